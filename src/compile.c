@@ -15,6 +15,7 @@ jvst_compile_schema(const struct ast_schema *schema)
 	cnodes = jvst_cnode_from_ast(schema);
 	ir = jvst_ir_from_cnode(cnodes);
 	opasm = jvst_op_assemble(ir);
+	opasm = jvst_op_optimize(opasm);
 	prog = jvst_op_encode(opasm);
 
 	return prog;
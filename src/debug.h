@@ -22,6 +22,8 @@ enum {
 	DEBUG_VMPROG           = 1 << 11,
         DEBUG_VMOP             = 1 << 12,
         DEBUG_VMTOK            = 1 << 13,
+	DEBUG_OPTIMIZE         = 1 << 14,
+	DEBUG_RECACHE          = 1 << 15,
 };
 
 extern unsigned debug;
@@ -52,6 +52,10 @@ hmap_create_pointer(size_t nbuckets, float maxload);
 void
 hmap_free(struct hmap *m);
 
+/* removes every item, keeping the buckets allocated */
+void
+hmap_clear(struct hmap *m);
+
 union hmap_value *
 hmap_get(const struct hmap *m, const void *k);
 
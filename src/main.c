@@ -6,10 +6,14 @@
 
 #define _XOPEN_SOURCE 500
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -31,6 +35,25 @@
 #include "validate_ir.h"
 #include "validate_op.h"
 #include "validate_vm.h"
+#include "validate_batch.h"
+#include "validate_cgen.h"
+#include "xxhash.h"
+
+/* Identifies the compiler in compile cache keys.  Bump it when the
+ * compiler changes the code it generates.  The build passes the source
+ * revision as JVST_BUILD_ID, which is mixed in too.
+ */
+#define JVST_COMPILER_VERSION "jvst-compiler-4"
+
+#ifndef JVST_BUILD_ID
+#define JVST_BUILD_ID ""
+#endif
+
+// debug flags that print the compiler's stages, which needs a compile
+#define DEBUG_COMPILE (DEBUG_PARSED_SCHEMA | DEBUG_INITIAL_CNODE | \
+	DEBUG_SIMPLIFIED_CNODE | DEBUG_CANONIFIED_CNODE | DEBUG_IR | \
+	DEBUG_LINEAR_IR | DEBUG_FLATTENED_IR | DEBUG_OPCODES | \
+	DEBUG_OPTIMIZE | DEBUG_VMPROG | DEBUG_RECACHE)
 
 unsigned debug;
 
@@ -78,6 +101,577 @@ readfile(FILE *f, size_t *np)
 	return p;
 }
 
+static int
+print_record(void *opaque, const struct jvst_vm_record_result *res)
+{
+	size_t *ninvalid = opaque;
+	const char *msg;
+
+	if (res->result == JVST_VALID) {
+		printf("%zu\t%zu\tVALID\n", res->index, res->offset);
+		return 0;
+	}
+
+	(*ninvalid)++;
+
+	// parser errors are negative SJP_RESULT codes
+	msg = (res->error < 0) ? ret2name(res->error) : jvst_invalid_msg(res->error);
+	printf("%zu\t%zu\tINVALID\t%d\t%s\n", res->index, res->offset, res->error, msg);
+
+	return 0;
+}
+
+/* Validates each record in the stream, printing one line per record:
+ * index, byte offset, verdict and, if invalid, the error.
+ */
+static int
+run_records(struct jvst_vm_program *prog, FILE *f, enum jvst_vm_record_format format)
+{
+	static char buf[65536];
+	struct jvst_vm_records rs;
+	size_t ninvalid;
+
+	ninvalid = 0;
+	jvst_vm_records_init(&rs, prog, format, print_record, &ninvalid);
+
+	for (;;) {
+		size_t r;
+
+		r = fread(buf, 1, sizeof buf, f);
+		if (r == 0) {
+			break;
+		}
+
+		jvst_vm_records_more(&rs, buf, r);
+	}
+
+	if (ferror(f)) {
+		perror("reading records");
+		exit(EXIT_FAILURE);
+	}
+
+	jvst_vm_records_close(&rs);
+	jvst_vm_records_finalize(&rs);
+
+	return (ninvalid == 0) ? 0 : -1;
+}
+
+/* Maps a regular file, or reads anything else.  *mapped is set if the
+ * data should be released with munmap(2) rather than free(3).
+ */
+static char *
+mapfile(FILE *f, size_t *np, int *mapped)
+{
+	struct stat st;
+	void *p;
+
+	*mapped = 0;
+
+	if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		return readfile(f, np);
+	}
+
+	// private and writable, the parser takes non-const buffers
+	p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+	if (p == MAP_FAILED) {
+		return readfile(f, np);
+	}
+
+	*mapped = 1;
+	*np = st.st_size;
+	return p;
+}
+
+struct batch_files {
+	char **paths;
+	size_t ninvalid;
+};
+
+static int
+print_file(void *opaque, const struct jvst_vm_record_result *res)
+{
+	struct batch_files *bf = opaque;
+	const char *msg;
+
+	if (res->result == JVST_VALID) {
+		printf("%s\tVALID\n", bf->paths[res->index]);
+		return 0;
+	}
+
+	bf->ninvalid++;
+
+	msg = (res->error < 0) ? ret2name(res->error) : jvst_invalid_msg(res->error);
+	printf("%s\tINVALID\t%d\t%s\n", bf->paths[res->index], res->error, msg);
+
+	return 0;
+}
+
+/* Validates a record stream, or a list of files, on a pool of threads.
+ * Results are printed in input order.
+ */
+static int
+run_batch(struct jvst_vm_program *prog, const struct jvst_batch_opts *opts,
+	int records, enum jvst_vm_record_format format, int argc, char *argv[])
+{
+	if (records) {
+		FILE *f;
+		char *p;
+		size_t n, ninvalid;
+		int mapped;
+
+		if (argc < 1) {
+			f = stdin;
+		} else {
+			f = fopen(argv[0], "r");
+			if (f == NULL) {
+				fprintf(stderr, "error opening json '%s': %s\n",
+					argv[0], strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		p = mapfile(f, &n, &mapped);
+		if (f != stdin) {
+			fclose(f);
+		}
+		if (p == NULL) {
+			perror("readfile");
+			exit(EXIT_FAILURE);
+		}
+
+		ninvalid = 0;
+		if (jvst_batch_records(prog, opts, format, p, n, print_record, &ninvalid) < 0) {
+			fprintf(stderr, "error starting batch validation\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (mapped) {
+			munmap(p, n);
+		} else {
+			free(p);
+		}
+
+		return (ninvalid == 0) ? 0 : -1;
+	} else {
+		struct batch_files bf;
+
+		if (argc < 1) {
+			fprintf(stderr, "-j without -s requires json files\n");
+			exit(EXIT_FAILURE);
+		}
+
+		bf.paths = argv;
+		bf.ninvalid = 0;
+		if (jvst_batch_files(prog, opts, (const char *const *)argv, argc, print_file, &bf) < 0) {
+			fprintf(stderr, "error starting batch validation\n");
+			exit(EXIT_FAILURE);
+		}
+
+		return (bf.ninvalid == 0) ? 0 : -1;
+	}
+}
+
+/* Writes the program as C to path, or to stdout if path is NULL. */
+static int
+run_cgen(struct jvst_vm_program *prog, const char *path)
+{
+	char err[256];
+	FILE *f;
+	int r;
+
+	f = stdout;
+	if (path != NULL) {
+		f = fopen(path, "w");
+		if (f == NULL) {
+			fprintf(stderr, "error opening '%s': %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	r = jvst_cgen_program(f, prog, "jvst_schema", err, sizeof err);
+	if (r != 0) {
+		fprintf(stderr, "error generating C: %s\n", err);
+	}
+
+	if (f != stdout && fclose(f) != 0 && r == 0) {
+		fprintf(stderr, "error writing '%s': %s\n", path, strerror(errno));
+		r = -1;
+	}
+
+	return r;
+}
+
+/* Writes the program's VM code to path, or to stdout if path is NULL. */
+static int
+run_write(struct jvst_vm_program *prog, const char *path)
+{
+	FILE *f;
+	int r;
+
+	f = stdout;
+	if (path != NULL) {
+		f = fopen(path, "wb");
+		if (f == NULL) {
+			fprintf(stderr, "error opening '%s': %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	r = jvst_vm_writefile(f, prog);
+	if (f != stdout && fclose(f) != 0) {
+		r = -1;
+	}
+
+	if (r != 0) {
+		fprintf(stderr, "error writing '%s': %s\n",
+			(path != NULL) ? path : "<stdout>", strerror(errno));
+	}
+
+	return r;
+}
+
+/* Loads VM code written by run_write().  Regular files are mapped, so
+ * processes running the same file share one copy of the program.
+ */
+static struct jvst_vm_program *
+run_read(const char *path)
+{
+	struct jvst_vm_program *prog;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "error opening compiled schema '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)) {
+		prog = jvst_vm_mapfile(fileno(f));
+	} else {
+		prog = jvst_vm_readfile(f);
+	}
+	fclose(f);
+
+	if (prog == NULL) {
+		fprintf(stderr, "error reading compiled schema '%s': not a jvst VM program, "
+			"or written by an incompatible version\n", path);
+	}
+
+	return prog;
+}
+
+/* A compile cache key.  Entries store the whole key and are only used
+ * if it matches; the hash just names the entry.
+ */
+struct cache_key {
+	char *s;
+	size_t len;
+	size_t cap;
+	uint64_t hash;
+};
+
+static void
+cache_key_add(struct cache_key *k, const void *p, size_t n)
+{
+	if (k->len + n > k->cap) {
+		k->s = xenlargevec(k->s, &k->cap, n, 1);
+	}
+
+	memcpy(k->s + k->len, p, n);
+	k->len += n;
+}
+
+/* Adds the schema's tokens to the key.  Strings are added as decoded
+ * and numbers as their values, so whitespace between tokens doesn't
+ * change the key but whitespace in strings does.  Returns -1 if the
+ * schema doesn't lex.
+ */
+static int
+cache_key_tokens(struct cache_key *k, const char *p, size_t n)
+{
+	struct sjp_lexer l;
+	struct sjp_token t;
+	char *buf;
+	int r, eos, ok;
+
+	// the lexer is given its own copy to work in; the schema is lexed
+	// again to parse it
+	buf = xmalloc(n > 0 ? n : 1);
+	memcpy(buf, p, n);
+
+	sjp_lexer_init(&l);
+	sjp_lexer_more(&l, buf, n);
+
+	eos = ok = 0;
+	for (;;) {
+		unsigned char type;
+		uint64_t len;
+
+		r = sjp_lexer_token(&l, &t);
+		if (r == SJP_MORE && t.type == SJP_TOK_NONE && !eos) {
+			sjp_lexer_eos(&l);
+			eos = 1;
+			continue;
+		}
+
+		if (r != SJP_OK) {
+			break;
+		}
+
+		if (t.type == SJP_TOK_NONE || t.type == SJP_TOK_EOS) {
+			ok = 1;
+			break;
+		}
+
+		type = (unsigned char)t.type;
+		cache_key_add(k, &type, 1);
+
+		switch (t.type) {
+		case SJP_TOK_STRING:
+			len = t.n;
+			cache_key_add(k, &len, sizeof len);
+			cache_key_add(k, t.value, t.n);
+			break;
+
+		case SJP_TOK_NUMBER:
+			cache_key_add(k, &t.extra.dbl, sizeof t.extra.dbl);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (SJP_ERROR(sjp_lexer_close(&l))) {
+		ok = 0;
+	}
+
+	free(buf);
+
+	return ok ? 0 : -1;
+}
+
+/* Builds the key for a schema: the compiler version and build, the
+ * base URI, the DFA budget and the schema's tokens.  Schemas that don't
+ * lex are keyed by their exact text.
+ */
+static void
+cache_key(struct cache_key *k, const char *p, size_t n, const struct json_string *base_uri)
+{
+	static const char version[] = JVST_COMPILER_VERSION "\n" JVST_BUILD_ID;
+	uint64_t len;
+	size_t mark;
+
+	memset(k, 0, sizeof *k);
+
+	cache_key_add(k, version, sizeof version);
+
+	len = base_uri->len;
+	cache_key_add(k, &len, sizeof len);
+	cache_key_add(k, base_uri->s, base_uri->len);
+	cache_key_add(k, &jvst_cnode_dfa_budget, sizeof jvst_cnode_dfa_budget);
+
+	mark = k->len;
+	cache_key_add(k, "T", 1);
+	if (cache_key_tokens(k, p, n) != 0) {
+		k->len = mark;
+		cache_key_add(k, "R", 1);
+		cache_key_add(k, p, n);
+	}
+
+	k->hash = XXH64(k->s, k->len, 0);
+}
+
+static char *
+cache_path(const char *dir, const struct cache_key *k)
+{
+	size_t n;
+	char *path;
+
+	n = strlen(dir) + 1 + 16 + sizeof ".jvst";
+	path = xmalloc(n);
+	snprintf(path, n, "%s/%016" PRIx64 ".jvst", dir, k->hash);
+
+	return path;
+}
+
+/* Cache entries start with a header:
+ *
+ *	offset	size
+ *	0	8	magic, "jvst-ck" and a NUL
+ *	8	8	length of the key
+ *	16	8	offset of the program, a multiple of the page size
+ *	24		the key
+ *
+ * followed by the program, as jvst_vm_writefile() writes it.  Entries
+ * are only written and read on the same host, so the header's integers
+ * are native.
+ */
+static const char cache_magic[8] = "jvst-ck";
+
+enum {
+	CACHE_HDRSIZE = 24,
+};
+
+static int
+cache_read(int fd, void *p, size_t n, size_t off)
+{
+	char *b = p;
+
+	while (n > 0) {
+		ssize_t r = pread(fd, b, n, (off_t)off);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		b += r;
+		off += r;
+		n -= r;
+	}
+
+	return 0;
+}
+
+/* Returns the cached program for key, or NULL if there isn't one.
+ * Entries with a different key, or that can't be read, are treated as
+ * missing and are replaced when the schema is compiled.
+ */
+static struct jvst_vm_program *
+cache_load(const char *dir, const struct cache_key *k)
+{
+	unsigned char hdr[CACHE_HDRSIZE];
+	struct jvst_vm_program *prog;
+	uint64_t klen, off;
+	long pagesize;
+	char *path, *key;
+	int fd;
+
+	path = cache_path(dir, k);
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	prog = NULL;
+	key = NULL;
+
+	if (cache_read(fd, hdr, sizeof hdr, 0) != 0 ||
+			memcmp(hdr, cache_magic, sizeof cache_magic) != 0) {
+		goto done;
+	}
+
+	memcpy(&klen, hdr+8, sizeof klen);
+	memcpy(&off, hdr+16, sizeof off);
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (klen != k->len || off < CACHE_HDRSIZE + klen ||
+			pagesize <= 0 || off % (uint64_t)pagesize != 0) {
+		goto done;
+	}
+
+	key = xmalloc(k->len > 0 ? k->len : 1);
+	if (cache_read(fd, key, k->len, CACHE_HDRSIZE) != 0 ||
+			memcmp(key, k->s, k->len) != 0) {
+		goto done;
+	}
+
+	prog = jvst_vm_mapfile_at(fd, off);
+
+done:
+	free(key);
+	close(fd);
+
+	return prog;
+}
+
+/* Adds a compiled program to the cache.  Entries are written to a
+ * temporary file and renamed into place, so concurrent jvst processes
+ * never see a partial entry and mapped entries are never changed.
+ * Failures only lose the entry.
+ */
+static void
+cache_store(const char *dir, const struct cache_key *k, const struct jvst_vm_program *prog)
+{
+	unsigned char hdr[CACHE_HDRSIZE];
+	char *path, *tmp;
+	uint64_t klen, off;
+	long pagesize;
+	size_t n, pad;
+	FILE *f;
+	int fd, r;
+
+	path = cache_path(dir, k);
+	n = strlen(path) + sizeof ".XXXXXX";
+	tmp = xmalloc(n);
+	snprintf(tmp, n, "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		fprintf(stderr, "warning: cannot cache compiled schema in '%s': %s\n", dir, strerror(errno));
+		goto done;
+	}
+
+	// mkstemp() creates the file private to the user, but the cache
+	// can be shared
+	(void)fchmod(fd, 0644);
+
+	f = fdopen(fd, "wb");
+	if (f == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+
+	// the program is mapped in place, so it starts on a page
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pagesize <= 0) {
+		pagesize = 4096;
+	}
+
+	klen = k->len;
+	off = CACHE_HDRSIZE + klen;
+	off += (uint64_t)pagesize - 1;
+	off -= off % (uint64_t)pagesize;
+
+	memcpy(hdr, cache_magic, sizeof cache_magic);
+	memcpy(hdr+8, &klen, sizeof klen);
+	memcpy(hdr+16, &off, sizeof off);
+
+	r = 0;
+	if (fwrite(hdr, 1, sizeof hdr, f) != sizeof hdr ||
+			fwrite(k->s, 1, k->len, f) != k->len) {
+		r = -1;
+	}
+
+	for (pad = off - (CACHE_HDRSIZE + k->len); r == 0 && pad > 0; pad--) {
+		if (putc('\0', f) == EOF) {
+			r = -1;
+		}
+	}
+
+	if (r == 0) {
+		r = jvst_vm_writefile(f, prog);
+	}
+	if (fclose(f) != 0) {
+		r = -1;
+	}
+
+	if (r != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "warning: cannot cache compiled schema as '%s': %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+
+done:
+	free(tmp);
+	free(path);
+}
+
 static int
 debug_flags(const char *s)
 {
@@ -106,9 +700,11 @@ debug_flags(const char *s)
 		case 'L': e = DEBUG_LINEAR_IR;        break;
 		case 'f': e = DEBUG_FLATTENED_IR;     break;
 		case 'o': e = DEBUG_OPCODES;          break;
+		case 'O': e = DEBUG_OPTIMIZE;         break;
 		case 'p': e = DEBUG_VMPROG;           break;
 		case 'v': e = DEBUG_VMOP;             break;
 		case 'T': e = DEBUG_VMTOK;            break;
+		case 'R': e = DEBUG_RECACHE;          break;
 
 		default:
 			fprintf(stderr, "-d: unrecognised flag '%c'\n", *s);
@@ -168,18 +764,23 @@ main(int argc, char *argv[])
 	static const struct json_string szero;
 	static const struct ast_schema ast_default;
 	int r;
-	int compile=0, runvm=0;
+	int compile=0, runvm=0, records=0, jit=0;
+	enum jvst_vm_record_format record_format = JVST_VM_RECORD_NDJSON;
+	int batch=0;
+	struct jvst_batch_opts batch_opts = { 0 };
 	struct jvst_vm_program *prog = NULL;
 	struct jvst_ir_forest *ir_forest;
 	enum jvst_lang lang = JVST_LANG_VM;
 	struct json_string base_uri;
+	const char *cachedir = NULL;
+	struct cache_key cachekey = { 0 };
 
 	base_uri = szero;
 
 	{
 		int c;
 
-		while (c = getopt(argc, argv, "b:l:rcd:"), c != -1) {
+		while (c = getopt(argc, argv, "b:C:l:m:rs:j:Jcd:"), c != -1) {
 			switch (c) {
 			case 'b':
 				base_uri.s = xstrdup(optarg);
@@ -190,6 +791,10 @@ main(int argc, char *argv[])
 				compile = 1;
 				break;
 
+			case 'C':
+				cachedir = optarg;
+				break;
+
 			case 'l':
 				if (strcmp(optarg,"c") == 0) {
 					lang = JVST_LANG_C;
@@ -201,6 +806,21 @@ main(int argc, char *argv[])
 				}
 				break;
 
+			case 'm':
+				{
+					char *end;
+					unsigned long budget;
+
+					budget = strtoul(optarg, &end, 10);
+					if (*optarg == '\0' || *end != '\0' || *optarg == '-') {
+						fprintf(stderr, "invalid number of DFA states: %s\n", optarg);
+						goto usage;
+					}
+
+					jvst_cnode_dfa_budget = budget;
+				}
+				break;
+
 			case 'd':
 				if (-1 == debug_flags(optarg)) {
 					goto usage;
@@ -211,6 +831,38 @@ main(int argc, char *argv[])
 				runvm = 1;
 				break;
 
+			case 'J':
+				jit = 1;
+				break;
+
+			case 's':
+				if (strcmp(optarg,"ndjson") == 0) {
+					record_format = JVST_VM_RECORD_NDJSON;
+				} else if (strcmp(optarg,"seq") == 0) {
+					record_format = JVST_VM_RECORD_SEQ;
+				} else {
+					fprintf(stderr, "unknown record format: %s\n", optarg);
+					goto usage;
+				}
+				records = 1;
+				break;
+
+			case 'j':
+				{
+					char *end;
+					long nthreads;
+
+					nthreads = strtol(optarg, &end, 10);
+					if (*optarg == '\0' || *end != '\0' || nthreads < 0) {
+						fprintf(stderr, "invalid number of threads: %s\n", optarg);
+						goto usage;
+					}
+
+					batch_opts.nthreads = nthreads;
+					batch = 1;
+				}
+				break;
+
 			default:
 				goto usage;
 			}
@@ -271,97 +923,148 @@ main(int argc, char *argv[])
 				base_uri = uri_from_filename(schema_filename);
 			}
 
-			sjp_lexer_init(&l);
-			sjp_lexer_more(&l, p, n);
-			parse(&l, &ast, base_uri);
-
-			if (debug & DEBUG_PARSED_SCHEMA) {
-				ast_dump(stdout, &ast);
+			if (cachedir != NULL) {
+				cache_key(&cachekey, p, n, &base_uri);
+				if (!(debug & DEBUG_COMPILE)) {
+					prog = cache_load(cachedir, &cachekey);
+				}
 			}
 
-			r = sjp_lexer_close(&l);
-			if (SJP_ERROR(r)) {
-				/* TODO: make this better */
-				fprintf(stderr, "sjp error B (%d): encountered %s\n", r, ret2name(r));
-				exit(EXIT_FAILURE);
+			if (prog == NULL) {
+				sjp_lexer_init(&l);
+				sjp_lexer_more(&l, p, n);
+				parse(&l, &ast, base_uri);
+
+				if (debug & DEBUG_PARSED_SCHEMA) {
+					ast_dump(stdout, &ast);
+				}
+
+				r = sjp_lexer_close(&l);
+				if (SJP_ERROR(r)) {
+					/* TODO: make this better */
+					fprintf(stderr, "sjp error B (%d): encountered %s\n", r, ret2name(r));
+					exit(EXIT_FAILURE);
+				}
 			}
 
 			free(p);
 		}
 
-		ctrees = jvst_cnode_translate_ast_with_ids(&ast);
-		if (debug & DEBUG_INITIAL_CNODE) {
-			printf("Initial cnode tree\n");
-			jvst_cnode_print_forest(stdout, ctrees);
-			printf("\n");
-		}
+		if (prog == NULL) {
+			ctrees = jvst_cnode_translate_ast_with_ids(&ast);
+			if (debug & DEBUG_INITIAL_CNODE) {
+				printf("Initial cnode tree\n");
+				jvst_cnode_print_forest(stdout, ctrees);
+				printf("\n");
+			}
 
-		jvst_cnode_simplify_forest(ctrees);
-		if (debug & DEBUG_SIMPLIFIED_CNODE) {
-			printf("Simplified cnode tree\n");
-			jvst_cnode_print_forest(stdout, ctrees);
-			printf("\n");
-		}
+			jvst_cnode_simplify_forest(ctrees);
+			if (debug & DEBUG_SIMPLIFIED_CNODE) {
+				printf("Simplified cnode tree\n");
+				jvst_cnode_print_forest(stdout, ctrees);
+				printf("\n");
+			}
 
-		jvst_cnode_canonify_forest(ctrees);
-		if (debug & DEBUG_CANONIFIED_CNODE) {
-			printf("Canonified cnode tree\n");
-			jvst_cnode_print_forest(stdout, ctrees);
-			printf("\n");
-		}
+			jvst_cnode_canonify_forest(ctrees);
+			if (debug & DEBUG_CANONIFIED_CNODE) {
+				printf("Canonified cnode tree\n");
+				jvst_cnode_print_forest(stdout, ctrees);
+				printf("\n");
+			}
 
-		ir_forest = jvst_ir_translate_forest(ctrees);
-		if (debug & DEBUG_IR) {
-			printf("Initial IR\n");
-			jvst_ir_print_forest(stdout, ir_forest);
-			printf("\n");
+			if (debug & DEBUG_RECACHE) {
+				size_t lookups, hits;
+
+				jvst_cnode_re_cache_stats(&lookups, &hits);
+				fprintf(stderr, "regexp cache: %zu lookups, %zu hits (%.1f%%)\n",
+					lookups, hits, (lookups > 0) ? 100.0 * hits / lookups : 0.0);
+			}
+
+			ir_forest = jvst_ir_translate_forest(ctrees);
+			if (debug & DEBUG_IR) {
+				printf("Initial IR\n");
+				jvst_ir_print_forest(stdout, ir_forest);
+				printf("\n");
+			}
 		}
 	}
 
-	/* compile IR into VM opcodes */
+	/* compile IR into VM opcodes (all output languages) */
 	if (compile) {
-		switch (lang) {
-		case JVST_LANG_VM:
-			{
-				struct jvst_ir_stmt *linearized, *flattened;
-				struct jvst_op_program *op_prog;
-
-				linearized = jvst_ir_linearize_forest(ir_forest);
-				if (debug & DEBUG_LINEAR_IR) {
-					printf("Linearized IR\n");
-					jvst_ir_print(stdout, linearized);
-					printf("\n");
-				}
+		if (prog == NULL) {
+			struct jvst_ir_stmt *linearized, *flattened;
+			struct jvst_op_program *op_prog;
+			size_t ninstr;
+
+			linearized = jvst_ir_linearize_forest(ir_forest);
+			if (debug & DEBUG_LINEAR_IR) {
+				printf("Linearized IR\n");
+				jvst_ir_print(stdout, linearized);
+				printf("\n");
+			}
 
-				flattened = jvst_ir_flatten(linearized);
-				if (debug & DEBUG_FLATTENED_IR) {
-					printf("Flattened IR\n");
-					jvst_ir_print(stdout, flattened);
-					printf("\n");
-				}
+			flattened = jvst_ir_flatten(linearized);
+			if (debug & DEBUG_FLATTENED_IR) {
+				printf("Flattened IR\n");
+				jvst_ir_print(stdout, flattened);
+				printf("\n");
+			}
 
-				op_prog = jvst_op_assemble(flattened);
-				if (debug & DEBUG_OPCODES) {
-					printf("Assembled OP codes\n");
-					jvst_op_print(stdout, op_prog);
-					printf("\n");
-				}
+			op_prog = jvst_op_assemble(flattened);
+			if (debug & (DEBUG_OPCODES | DEBUG_OPTIMIZE)) {
+				const struct jvst_op_pool_sizes *before = &op_prog->uninterned;
+				struct jvst_op_pool_sizes after;
+
+				printf("Assembled OP codes\n");
+				jvst_op_print(stdout, op_prog);
+				printf("\n");
+
+				jvst_op_pool_sizes(op_prog, &after);
+				printf("Pools: %zu floats, %zu constants, %zu DFAs (%zu bytes)\n",
+					after.nfloat, after.nconst, after.ndfa, after.dfa_bytes);
+				printf("       %zu floats, %zu constants, %zu DFAs (%zu bytes) before interning\n",
+					before->nfloat, before->nconst, before->ndfa, before->dfa_bytes);
+				printf("\n");
+			}
 
-				prog = jvst_op_encode(op_prog);
-				if (debug & DEBUG_VMPROG) {
-					printf("Final VM program:\n");
-					jvst_vm_program_print(stdout, prog);
-					printf("\n");
-				}
+			ninstr = jvst_op_count(op_prog);
+			jvst_op_optimize(op_prog);
+			if (debug & DEBUG_OPTIMIZE) {
+				printf("Optimized OP codes, %zu instructions (was %zu)\n",
+					jvst_op_count(op_prog), ninstr);
+				jvst_op_print(stdout, op_prog);
+				printf("\n");
+			}
 
-				// TODO: add bit where the vm program is saved, possibly
-				// if runvm is false
+			prog = jvst_op_encode(op_prog);
+			if (debug & DEBUG_VMPROG) {
+				printf("Final VM program:\n");
+				jvst_vm_program_print(stdout, prog);
+				printf("\n");
 			}
-			break;
+
+			if (cachedir != NULL) {
+				cache_store(cachedir, &cachekey, prog);
+			}
+		}
+
+		switch (lang) {
+		case JVST_LANG_VM:
+			if (runvm) {
+				break;
+			}
+
+			// with only debug dumps asked for, keep binary off stdout
+			if (argc == 0 && (debug & DEBUG_COMPILE)) {
+				return 0;
+			}
+
+			r = run_write(prog, (argc > 0) ? argv[0] : NULL);
+			return (r == 0) ? 0 : EXIT_FAILURE;
 
 		case JVST_LANG_C:
-			fprintf(stderr, "C output needs to be implemented\n");
-			exit(EXIT_FAILURE);
+			r = run_cgen(prog, (argc > 0) ? argv[0] : NULL);
+			return (r == 0) ? 0 : EXIT_FAILURE;
 
 		default:
 			fprintf(stderr, "internal error: unknown language %d\n", lang);
@@ -376,12 +1079,28 @@ main(int argc, char *argv[])
 		struct jvst_vm vm = { 0 };
 		enum jvst_result ret;
 
-		jvst_vm_init_defaults(&vm, prog);
-
 		if (prog == NULL) {
-			// TODO: add bit where we load the vm program
-			fprintf(stderr, "runvm currently requires compiling\n");
-			exit(EXIT_FAILURE);
+			if (argc < 1) {
+				fprintf(stderr, "running requires a schema or a compiled schema\n");
+				goto usage;
+			}
+
+			prog = run_read(argv[0]);
+			if (prog == NULL) {
+				exit(EXIT_FAILURE);
+			}
+
+			argc--;
+			argv++;
+		}
+
+		if (jit && jvst_vm_program_jit(prog) != 0) {
+			fprintf(stderr, "warning: cannot JIT the program, running on the interpreter\n");
+		}
+
+		if (batch) {
+			r = run_batch(prog, &batch_opts, records, record_format, argc, argv);
+			return (r == 0) ? 0 : EXIT_FAILURE;
 		}
 
 		if (argc < 1) {
@@ -395,6 +1114,17 @@ main(int argc, char *argv[])
 			}
 		}
 
+		if (records) {
+			r = run_records(prog, f_data, record_format);
+			if (f_data != stdin) {
+				fclose(f_data);
+			}
+
+			return (r == 0) ? 0 : EXIT_FAILURE;
+		}
+
+		jvst_vm_init_defaults(&vm, prog);
+
 		// FIXME: should stream this!
 		p = readfile(f_data, &n);
 		if (f_data != stdin) {
@@ -421,22 +1151,59 @@ main(int argc, char *argv[])
 
 usage:
 
-	fprintf(stderr, "usage: jvst [-d +-aslc] [-l <lang>] -c <schema> [<compiled>]\n"
-			"       jvst [-d +-aslc] -c -r <schema> [<json>]\n"
-			// "       jvst [-d +-aslc] -r <compiled> [<json>]\n"
+	fprintf(stderr, "usage: jvst [-d +-aslc] [-l <lang>] [-C <dir>] [-m <states>] -c <schema> [<compiled>]\n"
+			"       jvst [-d +-aslc] -c -r [-J] <schema> [<json>]\n"
+			"       jvst [-d +-aslc] -c -r -s <format> <schema> [<records>]\n"
+			"       jvst [-d +-aslc] -c -r -j <n> -s <format> <schema> [<records>]\n"
+			"       jvst [-d +-aslc] -c -r -j <n> <schema> <json>...\n"
+			"       jvst [-d +-aslc] -r [-J] <compiled> [<json>]\n"
+			"       jvst [-d +-aslc] -r -s <format> <compiled> [<records>]\n"
+			"       jvst [-d +-aslc] -r -j <n> <compiled> <json>...\n"
 			"\n"
 			"  -l <lang>\n"
 			"           specifies output language for compilation\n"
 			"           current options:\n"
-			"             jvst        generates jvst VM bytecode (default)\n"
-			"             c           generates C\n"
+			"             jvst        generates jvst VM bytecode (default),\n"
+			"                         written to <compiled> or stdout unless\n"
+			"                         running it with -r.  With -d flags that\n"
+			"                         print compiler stages, it is written\n"
+			"                         only to <compiled>\n"
+			"             c           generates C, written to <compiled> or\n"
+			"                         stdout.  See validate_cgen.h for its API\n"
 			"\n"
 			"  -b <uri>\n"
 			"           sets the base URI for the json schema\n"
 			"\n"
 			"  -c       compile schema to jvst VM code\n"
 			"\n"
-			"  -r       run jvst VM code on json\n"
+			"  -C <dir>\n"
+			"           with -c, caches compiled schemas in <dir>.  Entries\n"
+			"           are keyed by the schema's tokens, ignoring whitespace\n"
+			"           between them, the base URI, the DFA budget and the\n"
+			"           jvst build.\n"
+			"\n"
+			"  -m <states>\n"
+			"           with -c, the most states a pattern's DFA may have\n"
+			"           (default 4096, 0 for no limit).  Larger patterns are\n"
+			"           determinised as they run, caching the states used.\n"
+			"\n"
+			"  -r       run jvst VM code on json, compiled with -c or read\n"
+			"           from <compiled>\n"
+			"\n"
+			"  -J       with -r, translates the VM code to machine code before\n"
+			"           running it.  Falls back to the VM if it can't.\n"
+			"\n"
+			"  -s <format>\n"
+			"           with -r, validates each record of a stream and\n"
+			"           prints: index, byte offset, VALID or INVALID, error\n"
+			"           current formats:\n"
+			"             ndjson      newline delimited JSON\n"
+			"             seq         RFC 7464 JSON text sequences\n"
+			"\n"
+			"  -j <n>   with -r, validates on <n> threads, 0 for one per CPU.\n"
+			"           with -s, splits the records between threads, otherwise\n"
+			"           validates each <json> file as a document.  Results are\n"
+			"           printed in input order.\n"
 			"\n"
 			"  -d       debug flags\n"
 			"       +/- enables/disables\n"
@@ -452,9 +1219,11 @@ usage:
 			"           L   print linearized IR tree\n"
 			"           f   print flattened IR tree\n"
 			"           o   print opcodes\n"
+			"           O   print opcodes before and after optimizing\n"
 			"           p   print final VM program\n"
 			"           v   print VM instructions while executing\n"
 			"           T   print tokens as read (during VM run)\n"
+			"           R   print regexp cache hit rate\n"
 			"\n");
 
 	return 1;
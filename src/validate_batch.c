@@ -0,0 +1,380 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "validate_batch.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xalloc.h"
+#include "validate_ir.h"  // XXX - this is for INVALID codes, which should be moved!
+
+enum { BATCH_READBUF = 65536 };
+
+// results of a chunk, waiting to be passed to func in order
+struct batch_chunk {
+	int done;
+	size_t nres;
+	struct jvst_vm_record_result *res;
+};
+
+struct batch {
+	struct jvst_vm_program *prog;
+	int (*func)(void *opaque, const struct jvst_vm_record_result *res);
+	void *opaque;
+
+	pthread_mutex_t lock;
+
+	// record stream
+	enum jvst_vm_record_format format;
+	char *data;
+	size_t n;
+	size_t chunk;
+	size_t cursor;
+
+	// file list
+	const char *const *paths;
+	size_t npaths;
+
+	// chunks handed out, numbered in input order.  A file is one
+	// chunk.
+	size_t nchunks;
+	size_t maxchunks;
+	struct batch_chunk *chunks;
+
+	size_t next_emit;	// next chunk to pass to func
+	size_t nemitted;	// results passed to func
+	int stopped;
+};
+
+struct batch_worker {
+	struct batch *b;
+	pthread_t thread;
+	int started;
+
+	struct jvst_vm_records rs;
+	struct jvst_vm vm;
+
+	// results of the current chunk
+	size_t nres;
+	size_t maxres;
+	struct jvst_vm_record_result *res;
+
+	char buf[BATCH_READBUF];
+};
+
+static void
+batch_add_result(struct batch_worker *w, const struct jvst_vm_record_result *res)
+{
+	if (w->nres >= w->maxres) {
+		w->res = xenlargevec(w->res, &w->maxres, 1, sizeof w->res[0]);
+	}
+
+	w->res[w->nres++] = *res;
+}
+
+static int
+batch_collect(void *opaque, const struct jvst_vm_record_result *res)
+{
+	batch_add_result(opaque, res);
+	return 0;
+}
+
+/* Hands out the next chunk of the record stream.  Chunks end just
+ * after a record delimiter, or at the end of the stream.
+ */
+static int
+batch_next_records(struct batch *b, size_t *idp, size_t *startp, size_t *endp)
+{
+	size_t start, end;
+	char *q;
+
+	if (b->stopped || b->cursor >= b->n) {
+		return 0;
+	}
+
+	start = b->cursor;
+	end = start + b->chunk;
+	if (end >= b->n) {
+		end = b->n;
+	} else {
+		q = memchr(&b->data[end], (b->format == JVST_VM_RECORD_SEQ) ? '\x1e' : '\n', b->n - end);
+		end = (q != NULL) ? (size_t)(q - b->data) + 1 : b->n;
+	}
+
+	b->cursor = end;
+
+	*idp = b->nchunks;
+	*startp = start;
+	*endp = end;
+	return 1;
+}
+
+static int
+batch_next_file(struct batch *b, size_t *idp)
+{
+	if (b->stopped || b->nchunks >= b->npaths) {
+		return 0;
+	}
+
+	*idp = b->nchunks;
+	return 1;
+}
+
+/* Takes the next chunk to validate.  Returns zero when there's no work
+ * left.
+ */
+static int
+batch_take(struct batch *b, size_t *idp, size_t *startp, size_t *endp)
+{
+	int more;
+
+	pthread_mutex_lock(&b->lock);
+
+	if (b->paths != NULL) {
+		more = batch_next_file(b, idp);
+	} else {
+		more = batch_next_records(b, idp, startp, endp);
+	}
+
+	if (more) {
+		if (b->nchunks >= b->maxchunks) {
+			b->chunks = xenlargevec(b->chunks, &b->maxchunks, 1, sizeof b->chunks[0]);
+		}
+
+		b->chunks[b->nchunks].done = 0;
+		b->chunks[b->nchunks].nres = 0;
+		b->chunks[b->nchunks].res = NULL;
+		b->nchunks++;
+	}
+
+	pthread_mutex_unlock(&b->lock);
+
+	return more;
+}
+
+/* Stores the worker's results for a chunk, then passes the results of
+ * every completed chunk that's next in order to func.
+ */
+static void
+batch_complete(struct batch_worker *w, size_t id)
+{
+	struct batch *b = w->b;
+
+	pthread_mutex_lock(&b->lock);
+
+	b->chunks[id].done = 1;
+	b->chunks[id].nres = w->nres;
+	b->chunks[id].res = w->res;
+
+	w->nres = 0;
+	w->maxres = 0;
+	w->res = NULL;
+
+	while (b->next_emit < b->nchunks && b->chunks[b->next_emit].done) {
+		struct batch_chunk *c = &b->chunks[b->next_emit++];
+		size_t i;
+
+		for (i=0; i < c->nres && !b->stopped; i++) {
+			c->res[i].index = b->nemitted++;
+			b->stopped = b->func(b->opaque, &c->res[i]);
+		}
+
+		free(c->res);
+		c->res = NULL;
+	}
+
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void
+batch_file(struct batch_worker *w, const char *path)
+{
+	struct jvst_vm_record_result res = { 0 };
+	enum jvst_result ret;
+	FILE *f;
+
+	res.result = JVST_INVALID;
+	res.error = JVST_INVALID_IO;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		goto done;
+	}
+
+	jvst_vm_reset(&w->vm);
+
+	ret = JVST_MORE;
+	while (ret == JVST_MORE) {
+		size_t r;
+
+		r = fread(w->buf, 1, sizeof w->buf, f);
+		if (r == 0) {
+			break;
+		}
+
+		ret = jvst_vm_more(&w->vm, w->buf, r);
+	}
+
+	if (ferror(f)) {
+		fclose(f);
+		goto done;
+	}
+
+	fclose(f);
+
+	if (!JVST_IS_INVALID(ret)) {
+		ret = jvst_vm_close(&w->vm);
+	}
+
+	res.result = ret;
+	res.error = w->vm.ctx.error;
+
+done:
+	batch_add_result(w, &res);
+}
+
+static void *
+batch_run(void *arg)
+{
+	struct batch_worker *w = arg;
+	struct batch *b = w->b;
+	size_t id, start, end;
+
+	if (b->paths != NULL) {
+		jvst_vm_init_defaults(&w->vm, b->prog);
+
+		while (batch_take(b, &id, &start, &end)) {
+			batch_file(w, b->paths[id]);
+			batch_complete(w, id);
+		}
+
+		jvst_vm_finalize(&w->vm);
+		return NULL;
+	}
+
+	jvst_vm_records_init(&w->rs, b->prog, b->format, batch_collect, w);
+
+	while (batch_take(b, &id, &start, &end)) {
+		// offsets are relative to the whole stream
+		w->rs.off = start;
+		jvst_vm_records_more(&w->rs, &b->data[start], end - start);
+		jvst_vm_records_close(&w->rs);
+
+		batch_complete(w, id);
+	}
+
+	jvst_vm_records_finalize(&w->rs);
+	return NULL;
+}
+
+static int
+batch_start(struct batch *b, const struct jvst_batch_opts *opts)
+{
+	struct batch_worker *workers;
+	size_t i, nthreads;
+
+	nthreads = (opts != NULL) ? opts->nthreads : 0;
+	if (nthreads == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpu > 0) ? (size_t)ncpu : 1;
+	}
+
+	b->chunk = (opts != NULL && opts->chunk > 0) ? opts->chunk : JVST_BATCH_DEFAULT_CHUNK;
+
+	// VMs predecode the program if it hasn't been done, do it before
+	// the program is shared
+	jvst_vm_program_predecode(b->prog);
+
+	if (pthread_mutex_init(&b->lock, NULL) != 0) {
+		return -1;
+	}
+
+	workers = xcalloc(nthreads, sizeof workers[0]);
+	for (i=0; i < nthreads; i++) {
+		workers[i].b = b;
+	}
+
+	// the calling thread is worker 0.  If a thread can't be started,
+	// carry on with the ones that were.
+	for (i=1; i < nthreads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, batch_run, &workers[i]) != 0) {
+			break;
+		}
+		workers[i].started = 1;
+	}
+
+	batch_run(&workers[0]);
+
+	for (i=1; i < nthreads; i++) {
+		if (workers[i].started) {
+			pthread_join(workers[i].thread, NULL);
+		}
+	}
+
+	assert(b->stopped || b->next_emit == b->nchunks);
+
+	for (i=0; i < nthreads; i++) {
+		free(workers[i].res);
+	}
+	free(workers);
+
+	for (i=b->next_emit; i < b->nchunks; i++) {
+		free(b->chunks[i].res);
+	}
+	free(b->chunks);
+
+	pthread_mutex_destroy(&b->lock);
+
+	return b->stopped;
+}
+
+int
+jvst_batch_records(struct jvst_vm_program *prog, const struct jvst_batch_opts *opts,
+	enum jvst_vm_record_format format, char *data, size_t n,
+	int (*func)(void *opaque, const struct jvst_vm_record_result *res), void *opaque)
+{
+	static const struct batch zero;
+	struct batch b = zero;
+
+	assert(func != NULL);
+
+	b.prog = prog;
+	b.func = func;
+	b.opaque = opaque;
+
+	b.format = format;
+	b.data = data;
+	b.n = n;
+
+	return batch_start(&b, opts);
+}
+
+int
+jvst_batch_files(struct jvst_vm_program *prog, const struct jvst_batch_opts *opts,
+	const char *const *paths, size_t npaths,
+	int (*func)(void *opaque, const struct jvst_vm_record_result *res), void *opaque)
+{
+	static const struct batch zero;
+	struct batch b = zero;
+
+	assert(func != NULL);
+	assert(paths != NULL || npaths == 0);
+
+	b.prog = prog;
+	b.func = func;
+	b.opaque = opaque;
+
+	b.paths = paths;
+	b.npaths = npaths;
+
+	if (npaths == 0) {
+		return 0;
+	}
+
+	return batch_start(&b, opts);
+}
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
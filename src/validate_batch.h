@@ -0,0 +1,49 @@
+#ifndef VALIDATE_BATCH_H
+#define VALIDATE_BATCH_H
+
+#include <stdlib.h>
+
+#include "validate_vm.h"
+
+/* Batch validation runs one program over many documents on a pool of
+ * threads.  Each thread has its own struct jvst_vm, the program is
+ * shared and must not be changed while the batch runs.
+ *
+ * Work is handed out a chunk at a time: threads take the next chunk
+ * when they finish one, so a few large records don't leave the other
+ * threads idle.  Results are passed to func in input order, one call
+ * at a time, from whichever thread completes the next chunk in order.
+ * Returning non-zero from func stops the batch.
+ */
+
+enum { JVST_BATCH_DEFAULT_CHUNK = 256 * 1024 };
+
+struct jvst_batch_opts {
+	size_t nthreads;	// 0 uses one thread per online CPU
+	size_t chunk;		// bytes per record chunk, 0 for the default
+};
+
+/* Validates each record of a record stream held in memory.  Chunks are
+ * split at record delimiters.  Result indexes and offsets are
+ * relative to the whole stream.
+ *
+ * Returns zero, the non-zero value returned by func if it stopped the
+ * batch, or -1 if the batch couldn't be set up.
+ */
+int
+jvst_batch_records(struct jvst_vm_program *prog, const struct jvst_batch_opts *opts,
+	enum jvst_vm_record_format format, char *data, size_t n,
+	int (*func)(void *opaque, const struct jvst_vm_record_result *res), void *opaque);
+
+/* Validates each file as a single document.  The result index is the
+ * file's index in paths, and the offset is zero.  Files that can't be
+ * read are invalid with JVST_INVALID_IO.
+ */
+int
+jvst_batch_files(struct jvst_vm_program *prog, const struct jvst_batch_opts *opts,
+	const char *const *paths, size_t npaths,
+	int (*func)(void *opaque, const struct jvst_vm_record_result *res), void *opaque);
+
+#endif /* VALIDATE_BATCH_H */
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
@@ -0,0 +1,920 @@
+#include "validate_cgen.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "xalloc.h"
+
+/* The generated code mirrors the unchecked interpreter in
+ * validate_vm_run.h, instruction for instruction.  The VM state lives
+ * in the context: r_pc, r_fp and r_sp are kept up to date whenever a
+ * proc leaves, so a suspended proc resumes by jumping to the
+ * instruction at r_pc.
+ *
+ * A proc can be entered at its PROC instruction, at an instruction
+ * that can suspend, or after a CALL.  Those are its resume points.
+ * The verifier keeps jumps within their proc, so the only way into
+ * another proc other than a CALL is to fall through into the next
+ * one.  Calls are direct C calls; if the callee suspends, its caller
+ * leaves too and the run function resumes the innermost frame first,
+ * then its callers in turn.
+ */
+
+enum {
+	CG_LABEL  = 0x01,	// target of a jump within the proc
+	CG_RESUME = 0x02,	// the proc can be entered here
+};
+
+struct cgen {
+	FILE *f;
+	const struct jvst_vm_program *prog;
+	const struct jvst_vm_decoded *dec;
+	const char *prefix;
+
+	size_t ncode;
+
+	// procs are runs of instructions that start with a PROC.
+	// pstart has nproc+1 entries, the last is ncode.
+	size_t nproc;
+	uint32_t *pstart;
+	uint32_t *procof;	// ncode+1 entries
+
+	unsigned char *flags;	// ncode+1 entries
+};
+
+static int
+cgen_error(char *errbuf, size_t nb, const char *fmt, ...)
+{
+	va_list args;
+
+	if (errbuf != NULL && nb > 0) {
+		va_start(args, fmt);
+		vsnprintf(errbuf, nb, fmt, args);
+		va_end(args);
+	}
+
+	return -1;
+}
+
+static int
+cgen_isident(const char *s)
+{
+	if (s == NULL || !(isalpha((unsigned char)s[0]) || s[0] == '_')) {
+		return 0;
+	}
+
+	for (s++; *s != '\0'; s++) {
+		if (!isalnum((unsigned char)*s) && *s != '_') {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int
+cgen_suspends(const struct jvst_vm_decoded *ins)
+{
+	switch (ins->op) {
+	case JVST_OP_TOKEN:
+		return ins->a1slot || ins->a1 != -1;
+
+	case JVST_OP_RETURN:
+		return ins->a0 == 0;
+
+	case JVST_OP_UNIQUE:
+		return ins->a0 == JVST_VM_UNIQUE_EVAL;
+
+	case JVST_OP_CONSUME:
+	case JVST_OP_MATCH:
+	case JVST_OP_LMATCH:
+	case JVST_OP_ENUM:
+	case JVST_OP_DISPATCH:
+	case JVST_OP_SPLIT:
+	case JVST_OP_SPLITV:
+	case JVST_OP_SPLITANY:
+	case JVST_OP_SPLITALL:
+	case JVST_OP_SPLITONE:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+// marks the target of a jump from pc
+static void
+cgen_target(struct cgen *cg, uint32_t pc, uint32_t target)
+{
+	assert(target < cg->ncode && cg->procof[target] == cg->procof[pc]);
+	cg->flags[target] |= CG_LABEL;
+}
+
+static void
+cgen_layout(struct cgen *cg)
+{
+	const struct jvst_vm_decoded *dec = cg->dec;
+	size_t pc, n, np;
+
+	n = cg->ncode;
+
+	cg->pstart = xcalloc(n+1, sizeof cg->pstart[0]);
+	cg->procof = xcalloc(n+1, sizeof cg->procof[0]);
+	cg->flags  = xcalloc(n+1, sizeof cg->flags[0]);
+
+	np = 0;
+	for (pc=0; pc < n; pc++) {
+		if (pc == 0 || dec[pc].op == JVST_OP_PROC) {
+			cg->pstart[np++] = pc;
+			cg->flags[pc] |= CG_RESUME;
+		}
+
+		cg->procof[pc] = np-1;
+	}
+
+	cg->nproc = np;
+	cg->pstart[np] = n;
+	cg->procof[n] = np;
+
+	for (pc=0; pc < n; pc++) {
+		const struct jvst_vm_decoded *ins = &dec[pc];
+
+		if (cgen_suspends(ins)) {
+			cg->flags[pc] |= CG_RESUME;
+		}
+
+		switch (ins->op) {
+		case JVST_OP_CALL:
+			if (pc+1 < n) {
+				cg->flags[pc+1] |= CG_RESUME;
+			}
+			break;
+
+		case JVST_OP_JMP:
+			if (ins->cond != JVST_VM_BR_NEVER) {
+				cgen_target(cg, pc, ins->a0);
+			}
+			break;
+
+		case JVST_OP_SWITCH:
+			{
+				const int64_t *tbl = &cg->prog->cdata[ins->a1];
+				int64_t k;
+
+				for (k=0; k <= tbl[0]; k++) {
+					cgen_target(cg, pc, (uint32_t)tbl[1+k]);
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+static void
+cgen_free(struct cgen *cg)
+{
+	free(cg->pstart);
+	free(cg->procof);
+	free(cg->flags);
+}
+
+static void
+cgen_double(FILE *f, double v)
+{
+	if (isnan(v)) {
+		fprintf(f, "NAN");
+	} else if (isinf(v)) {
+		fprintf(f, "%sINFINITY", (v < 0) ? "-" : "");
+	} else {
+		fprintf(f, "%a", v);
+	}
+}
+
+static void
+cgen_int64(FILE *f, int64_t v)
+{
+	if (v == INT64_MIN) {
+		fprintf(f, "INT64_MIN");
+	} else {
+		fprintf(f, "INT64_C(%" PRId64 ")", v);
+	}
+}
+
+// integer value of an argument: a slot or a literal
+static void
+cgen_ival(FILE *f, int isslot, int32_t arg)
+{
+	if (isslot) {
+		fprintf(f, "sl[%" PRId32 "].i", arg);
+	} else {
+		fprintf(f, "%" PRId32, arg);
+	}
+}
+
+// writes n bytes as a string literal, with every byte escaped
+static void
+cgen_bytes(FILE *f, const char *s, size_t n)
+{
+	size_t i;
+
+	fprintf(f, "\"");
+	for (i=0; i < n; i++) {
+		fprintf(f, "\\%03o", (unsigned char)s[i]);
+	}
+	fprintf(f, "\"");
+}
+
+// writes the dense form of DFA i: its end data, byte classes and table
+static void
+cgen_dense(struct cgen *cg, size_t i, const struct jvst_vm_dfa *dfa)
+{
+	FILE *f = cg->f;
+	size_t j, nentries;
+
+	assert(dfa->ends != NULL);
+
+	fprintf(f, "static int dfa%zu_ends[%zu] = {", i, dfa->nstates);
+	for (j=0; j < dfa->nstates; j++) {
+		fprintf(f, "%s%d,", (j % 8 == 0) ? "\n\t" : " ", dfa->ends[j]);
+	}
+	fprintf(f, "\n};\n\n");
+
+	fprintf(f, "static uint8_t dfa%zu_classes[%d] = {", i, UCHAR_MAX+1);
+	for (j=0; j <= UCHAR_MAX; j++) {
+		fprintf(f, "%s%u,", (j % 16 == 0) ? "\n\t" : " ", dfa->classes[j]);
+	}
+	fprintf(f, "\n};\n\n");
+
+	if (dfa->nfa) {
+		return;
+	}
+
+	nentries = (dfa->nstates+1) * dfa->nclasses;
+	fprintf(f, "static uint%zu_t dfa%zu_table[%zu] = {", 8*dfa->width, i, nentries);
+	for (j=0; j < nentries; j++) {
+		unsigned long st;
+
+		switch (dfa->width) {
+		case 1:
+			st = ((const uint8_t *)dfa->table)[j];
+			break;
+
+		case 2:
+			st = ((const uint16_t *)dfa->table)[j];
+			break;
+
+		default:
+			st = ((const uint32_t *)dfa->table)[j];
+			break;
+		}
+
+		fprintf(f, "%s%lu,", (j % 12 == 0) ? "\n\t" : " ", st);
+	}
+	fprintf(f, "\n};\n\n");
+}
+
+static void
+cgen_data(struct cgen *cg)
+{
+	const struct jvst_vm_program *prog = cg->prog;
+	FILE *f = cg->f;
+	size_t i, nsdata;
+
+	fprintf(f, "static uint32_t code[%zu] = {", prog->ncode);
+	for (i=0; i < prog->ncode; i++) {
+		fprintf(f, "%s0x%08" PRIx32 ",", (i % 6 == 0) ? "\n\t" : " ", prog->code[i]);
+	}
+	fprintf(f, "\n};\n\n");
+
+	if (prog->nfloat > 0) {
+		fprintf(f, "static double fdata[%zu] = {\n", prog->nfloat);
+		for (i=0; i < prog->nfloat; i++) {
+			fprintf(f, "\t");
+			cgen_double(f, prog->fdata[i]);
+			fprintf(f, ",\n");
+		}
+		fprintf(f, "};\n\n");
+	}
+
+	if (prog->nconst > 0) {
+		fprintf(f, "static int64_t cdata[%zu] = {\n", prog->nconst);
+		for (i=0; i < prog->nconst; i++) {
+			fprintf(f, "\t");
+			cgen_int64(f, prog->cdata[i]);
+			fprintf(f, ",\n");
+		}
+		fprintf(f, "};\n\n");
+	}
+
+	if (prog->nsplit > 0) {
+		nsdata = prog->nsplit + 1 + prog->sdata[prog->nsplit];
+
+		fprintf(f, "static uint32_t sdata[%zu] = {", nsdata);
+		for (i=0; i < nsdata; i++) {
+			fprintf(f, "%s%" PRIu32 ",", (i % 8 == 0) ? "\n\t" : " ", prog->sdata[i]);
+		}
+		fprintf(f, "\n};\n\n");
+	}
+
+	// each DFA's arrays are one table, laid out as by
+	// jvst_vm_dfa_init().  Verifying the program built their dense
+	// forms, which are written out too, so loading the generated
+	// program doesn't build them again.
+	for (i=0; i < prog->ndfa; i++) {
+		const struct jvst_vm_dfa *dfa = &prog->dfas[i];
+		size_t j, k, nelts;
+
+		nelts = (dfa->nstates+1) + 2*dfa->nedges + 2*dfa->nends;
+
+		fprintf(f, "static int dfa%zu[%zu] = {\n\t/* offs */", i, nelts);
+		for (j=0, k=0; j < dfa->nstates+1; j++, k++) {
+			fprintf(f, "%s%d,", (k % 8 == 0) ? "\n\t" : " ", dfa->offs[j]);
+		}
+
+		fprintf(f, "\n\n\t/* transitions */");
+		for (j=0, k=0; j < 2*dfa->nedges; j++, k++) {
+			fprintf(f, "%s%d,", (k % 8 == 0) ? "\n\t" : " ", dfa->transitions[j]);
+		}
+
+		fprintf(f, "\n\n\t/* endstates */");
+		for (j=0, k=0; j < 2*dfa->nends; j++, k++) {
+			fprintf(f, "%s%d,", (k % 8 == 0) ? "\n\t" : " ", dfa->endstates[j]);
+		}
+
+		fprintf(f, "\n};\n\n");
+
+		cgen_dense(cg, i, dfa);
+	}
+
+	if (prog->ndfa > 0) {
+		fprintf(f, "static struct jvst_vm_dfa dfas[%zu] = {\n", prog->ndfa);
+		for (i=0; i < prog->ndfa; i++) {
+			const struct jvst_vm_dfa *dfa = &prog->dfas[i];
+
+			fprintf(f, "\t{ %zu, %zu, %zu, &dfa%zu[0], &dfa%zu[%zu], &dfa%zu[%zu],\n",
+				dfa->nstates, dfa->nedges, dfa->nends,
+				i, i, dfa->nstates+1, i, dfa->nstates+1 + 2*dfa->nedges);
+
+			fprintf(f, "\t  %zu, %zu, dfa%zu_ends, dfa%zu_classes, ", dfa->nclasses, dfa->width, i, i);
+			if (dfa->nfa) {
+				fprintf(f, "NULL, 1,\n");
+			} else {
+				fprintf(f, "dfa%zu_table, 0,\n", i);
+			}
+
+			fprintf(f, "\t  { %zu, %zu, %zu, ", dfa->pre.nprefix, dfa->pre.nsuffix, dfa->pre.nfactor);
+			cgen_bytes(f, dfa->pre.prefix, dfa->pre.nprefix);
+			fprintf(f, ", ");
+			cgen_bytes(f, dfa->pre.suffix, dfa->pre.nsuffix);
+			fprintf(f, ", ");
+			cgen_bytes(f, dfa->pre.factor, dfa->pre.nfactor);
+			fprintf(f, " } },\n");
+		}
+		fprintf(f, "};\n\n");
+	}
+
+	// the decoded stream and sizing are written out for the same
+	// reason.  The last entry is the BADPC sentinel.
+	fprintf(f, "static struct jvst_vm_decoded decoded[%zu] = {\n", prog->ncode+1);
+	for (i=0; i <= prog->ncode; i++) {
+		const struct jvst_vm_decoded *ins = &cg->dec[i];
+
+		fprintf(f, "\t{ %u, %u, %u, %u, %" PRId32 ", %" PRId32 " },\n",
+			ins->op, ins->cond, ins->a0slot, ins->a1slot, ins->a0, ins->a1);
+	}
+	fprintf(f, "};\n\n");
+}
+
+static const char *
+cgen_brcond(enum jvst_vm_br_cond cond)
+{
+	switch (cond) {
+	case JVST_VM_BR_LT: return "flag < 0";
+	case JVST_VM_BR_LE: return "flag <= 0";
+	case JVST_VM_BR_EQ: return "flag == 0";
+	case JVST_VM_BR_GE: return "flag >= 0";
+	case JVST_VM_BR_GT: return "flag > 0";
+	case JVST_VM_BR_NE: return "flag != 0";
+	default:            return NULL;
+	}
+}
+
+// jumps to pc, or leaves the proc for the run function to continue at
+// pc when it falls through into the next one
+static void
+cgen_goto(struct cgen *cg, uint32_t from, uint32_t pc, const char *indent)
+{
+	if (pc >= cg->ncode) {
+		fprintf(cg->f, "%sLEAVE(%zu, jvst_vm_rt_badpc(vm));\n", indent, cg->ncode);
+	} else if (cg->procof[pc] == cg->procof[from]) {
+		fprintf(cg->f, "%sgoto L%" PRIu32 ";\n", indent, pc);
+	} else {
+		fprintf(cg->f, "%sLEAVE(%" PRIu32 ", JVST_VM_RT_CONTINUE);\n", indent, pc);
+	}
+}
+
+static void
+cgen_ins(struct cgen *cg, uint32_t pc, int need_fp, int need_sl)
+{
+	const struct jvst_vm_decoded *ins = &cg->dec[pc];
+	FILE *f = cg->f;
+
+	switch (ins->op) {
+	case JVST_OP_NOP:
+		break;
+
+	case JVST_OP_PROC:
+		if (need_fp) {
+			fprintf(f, "\tfp = jvst_vm_rt_proc(vm, %" PRId32 ");\n", ins->a0);
+		} else {
+			fprintf(f, "\t(void) jvst_vm_rt_proc(vm, %" PRId32 ");\n", ins->a0);
+		}
+
+		if (need_sl) {
+			fprintf(f, "\tsl = &vm->stack[fp];\n");
+		}
+		break;
+
+	case JVST_OP_ICMP:
+		fprintf(f, "\tflag = CMP(");
+		cgen_ival(f, ins->a0slot, ins->a0);
+		fprintf(f, ", ");
+		cgen_ival(f, ins->a1slot, ins->a1);
+		fprintf(f, ");\n");
+		break;
+
+	case JVST_OP_FCMP:
+		fprintf(f, "\tflag = CMP(sl[%" PRId32 "].f, sl[%" PRId32 "].f);\n", ins->a0, ins->a1);
+		break;
+
+	case JVST_OP_FINT:
+		fprintf(f, "\t{\n\t\tdouble v = sl[%" PRId32 "].f;\n", ins->a0);
+		if (ins->a1slot) {
+			fprintf(f, "\t\tv /= sl[%" PRId32 "].f;\n", ins->a1);
+		} else if (ins->a1 != 0) {
+			fprintf(f, "\t\tv /= %" PRId32 ".0;\n", ins->a1);
+		}
+		fprintf(f, "\t\tflag = isfinite(v) && (v == ceil(v));\n\t}\n");
+		break;
+
+	case JVST_OP_JMP:
+		if (ins->cond == JVST_VM_BR_NEVER) {
+			break;
+		}
+
+		if (ins->cond == JVST_VM_BR_ALWAYS) {
+			cgen_goto(cg, pc, ins->a0, "\t");
+			break;
+		}
+
+		fprintf(f, "\tif (%s) {\n", cgen_brcond(ins->cond));
+		cgen_goto(cg, pc, ins->a0, "\t\t");
+		fprintf(f, "\t}\n");
+		break;
+
+	case JVST_OP_SWITCH:
+		{
+			const int64_t *tbl = &cg->prog->cdata[ins->a1];
+			int64_t k;
+
+			fprintf(f, "\tswitch (sl[%" PRId32 "].i) {\n", ins->a0);
+			for (k=0; k < tbl[0]; k++) {
+				if (tbl[2+k] == tbl[1]) {
+					continue;
+				}
+
+				fprintf(f, "\tcase %" PRId64 ":\n", k);
+				cgen_goto(cg, pc, (uint32_t)tbl[2+k], "\t\t");
+			}
+			fprintf(f, "\tdefault:\n");
+			cgen_goto(cg, pc, (uint32_t)tbl[1], "\t\t");
+			fprintf(f, "\t}\n");
+		}
+		break;
+
+	case JVST_OP_CALL:
+		if ((size_t)ins->a0 >= cg->ncode) {
+			cgen_goto(cg, pc, ins->a0, "\t");
+			break;
+		}
+
+		fprintf(f,
+			"\tjvst_vm_rt_call(vm, %" PRIu32 ");\n"
+			"\tvm->r_pc = %" PRId32 ";\n"
+			"\tvm->r_flag = flag;\n"
+			"\tret = proc%" PRIu32 "(vm, %" PRId32 ");\n"
+			"\tif (ret != JVST_VM_RT_CONTINUE || vm->r_pc != %" PRIu32 " || vm->r_fp != fp) {\n"
+			"\t\treturn ret;\n"
+			"\t}\n",
+			pc, ins->a0, cg->procof[ins->a0], ins->a0, pc+1);
+
+		if (need_sl) {
+			fprintf(f, "\tsl = &vm->stack[fp];\n");
+		}
+		fprintf(f, "\tflag = vm->r_flag;\n");
+		break;
+
+	case JVST_OP_SPLIT:
+	case JVST_OP_SPLITV:
+	case JVST_OP_SPLITANY:
+	case JVST_OP_SPLITALL:
+	case JVST_OP_SPLITONE:
+		fprintf(f, "\tret = jvst_vm_rt_split(vm, ");
+		cgen_ival(f, ins->a0slot, ins->a0);
+		fprintf(f, ", &sl[%" PRId32 "], JVST_OP_%s);\n", ins->a1, jvst_op_name(ins->op));
+		fprintf(f, "\tif (ret != JVST_VALID) {\n\t\tLEAVE(%" PRIu32 ", ret);\n\t}\n", pc);
+		break;
+
+	case JVST_OP_TOKEN:
+		if (!cgen_suspends(ins)) {
+			fprintf(f, "\tjvst_vm_rt_unget(vm);\n");
+			break;
+		}
+
+		fprintf(f, "\tret = jvst_vm_rt_token(vm);\n");
+		fprintf(f, "\tif (ret != JVST_VALID) {\n\t\tLEAVE(%" PRIu32 ", ret);\n\t}\n", pc);
+		break;
+
+	case JVST_OP_CONSUME:
+		fprintf(f, "\tret = jvst_vm_rt_consume(vm);\n");
+		fprintf(f, "\tif (ret != JVST_VALID) {\n\t\tLEAVE(%" PRIu32 ", ret);\n\t}\n", pc);
+		break;
+
+	case JVST_OP_MATCH:
+		if (ins->a0slot) {
+			fprintf(f, "\tret = jvst_vm_rt_match(vm, &dfas[sl[%" PRId32 "].i]);\n", ins->a0);
+		} else {
+			fprintf(f, "\tret = jvst_vm_rt_match(vm, &dfas[%" PRId32 "]);\n", ins->a0);
+		}
+		fprintf(f, "\tif (ret != JVST_VALID) {\n\t\tLEAVE(%" PRIu32 ", ret);\n\t}\n", pc);
+		break;
+
+	case JVST_OP_LMATCH:
+		if (ins->a0slot) {
+			fprintf(f, "\tret = jvst_vm_rt_lmatch(vm, &dfas[sl[%" PRId32 "].i], &cdata[%" PRId32 "]);\n",
+				ins->a0, ins->a1);
+		} else {
+			fprintf(f, "\tret = jvst_vm_rt_lmatch(vm, &dfas[%" PRId32 "], &cdata[%" PRId32 "]);\n",
+				ins->a0, ins->a1);
+		}
+		fprintf(f, "\tif (ret != JVST_VALID) {\n\t\tLEAVE(%" PRIu32 ", ret);\n\t}\n", pc);
+		break;
+
+	case JVST_OP_ENUM:
+		fprintf(f, "\tret = jvst_vm_rt_enum(vm, &cdata[%" PRId64 "]);\n", cg->prog->cdata[ins->a0]);
+		fprintf(f, "\tif (ret != JVST_VALID) {\n\t\tLEAVE(%" PRIu32 ", ret);\n\t}\n", pc);
+		break;
+
+	case JVST_OP_DISPATCH:
+		fprintf(f, "\tret = jvst_vm_rt_dispatch(vm, &cdata[%" PRId64 "], &sl[%" PRId32 "]);\n",
+			cg->prog->cdata[ins->a0], ins->a1);
+		fprintf(f, "\tif (ret != JVST_VALID) {\n\t\tLEAVE(%" PRIu32 ", ret);\n\t}\n", pc);
+		break;
+
+	case JVST_OP_FLOAD:
+		fprintf(f, "\tsl[%" PRId32 "].f = ", ins->a0);
+		cgen_double(f, cg->prog->fdata[ins->a1]);
+		fprintf(f, ";\n");
+		break;
+
+	case JVST_OP_ILOAD:
+		fprintf(f, "\tsl[%" PRId32 "].i = ", ins->a0);
+		cgen_int64(f, cg->prog->cdata[ins->a1]);
+		fprintf(f, ";\n");
+		break;
+
+	case JVST_OP_MOVE:
+		if (ins->a1slot) {
+			fprintf(f, "\tsl[%" PRId32 "] = sl[%" PRId32 "];\n", ins->a0, ins->a1);
+		} else {
+			fprintf(f, "\tsl[%" PRId32 "].i = %" PRId32 ";\n", ins->a0, ins->a1);
+		}
+		break;
+
+	case JVST_OP_INCR:
+		if (ins->a1slot) {
+			fprintf(f, "\tsl[%" PRId32 "].i += (int)sl[%" PRId32 "].i;\n", ins->a0, ins->a1);
+		} else {
+			fprintf(f, "\tsl[%" PRId32 "].i += %" PRId32 ";\n", ins->a0, ins->a1);
+		}
+		break;
+
+	case JVST_OP_BSET:
+		if (ins->a1slot) {
+			fprintf(f, "\tsl[%" PRId32 "].u |= (uint64_t)1 << (int)sl[%" PRId32 "].i;\n", ins->a0, ins->a1);
+		} else {
+			fprintf(f, "\tsl[%" PRId32 "].u |= UINT64_C(1) << %" PRId32 ";\n", ins->a0, ins->a1);
+		}
+		break;
+
+	case JVST_OP_BAND:
+		if (ins->a1slot) {
+			fprintf(f, "\tsl[%" PRId32 "].u &= sl[%" PRId32 "].u;\n", ins->a0, ins->a1);
+		} else {
+			fprintf(f, "\tsl[%" PRId32 "].u &= UINT64_C(0x%" PRIx64 ");\n",
+				ins->a0, (uint64_t)(int64_t)ins->a1);
+		}
+		break;
+
+	case JVST_OP_RETURN:
+		if (ins->a0 != 0) {
+			fprintf(f, "\tvm->error = %" PRId32 ";\n", ins->a0);
+			fprintf(f, "\tLEAVE(%" PRIu32 ", JVST_INVALID);\n", pc);
+			break;
+		}
+
+		fprintf(f, "\tLEAVE(%" PRIu32 ", jvst_vm_rt_return(vm));\n", pc);
+		break;
+
+	case JVST_OP_UNIQUE:
+		switch (ins->a0) {
+		case JVST_VM_UNIQUE_INIT:
+			fprintf(f, "\t(void) jvst_vm_rt_unique(vm, JVST_VM_UNIQUE_INIT);\n");
+			break;
+
+		case JVST_VM_UNIQUE_EVAL:
+			fprintf(f, "\tLEAVE(%" PRIu32 ", jvst_vm_rt_unique(vm, JVST_VM_UNIQUE_EVAL));\n", pc);
+			break;
+
+		case JVST_VM_UNIQUE_FINAL:
+			fprintf(f, "\t(void) jvst_vm_rt_unique(vm, JVST_VM_UNIQUE_FINAL);\n");
+			break;
+		}
+		break;
+
+	default:
+		// verified programs don't have these
+		fprintf(f, "\tLEAVE(%" PRIu32 ", jvst_vm_rt_badpc(vm));\n", pc);
+		break;
+	}
+}
+
+static void
+cgen_proc(struct cgen *cg, size_t p)
+{
+	const struct jvst_vm_decoded *dec = cg->dec, *last;
+	FILE *f = cg->f;
+	uint32_t pc, pc0, pc1;
+	int need_fp, need_sl, need_ret;
+
+	pc0 = cg->pstart[p];
+	pc1 = cg->pstart[p+1];
+
+	need_sl = 0;
+	need_ret = 0;
+	need_fp = 0;
+	for (pc=pc0; pc < pc1; pc++) {
+		const struct jvst_vm_decoded *ins = &dec[pc];
+
+		switch (ins->op) {
+		case JVST_OP_CALL:
+			need_ret = need_fp = 1;
+			break;
+
+		case JVST_OP_TOKEN:
+		case JVST_OP_CONSUME:
+			need_ret |= cgen_suspends(ins);
+			break;
+
+		case JVST_OP_MATCH:
+		case JVST_OP_LMATCH:
+			need_ret = 1;
+			need_sl |= ins->a0slot;
+			break;
+
+		case JVST_OP_ENUM:
+			need_ret = 1;
+			break;
+
+		case JVST_OP_ICMP:
+			need_sl |= ins->a0slot || ins->a1slot;
+			break;
+
+		case JVST_OP_SPLIT:
+		case JVST_OP_SPLITV:
+		case JVST_OP_SPLITANY:
+		case JVST_OP_SPLITALL:
+		case JVST_OP_SPLITONE:
+		case JVST_OP_DISPATCH:
+			need_ret = 1;
+			need_sl = 1;
+			break;
+
+		case JVST_OP_FCMP:
+		case JVST_OP_FINT:
+		case JVST_OP_SWITCH:
+		case JVST_OP_FLOAD:
+		case JVST_OP_ILOAD:
+		case JVST_OP_MOVE:
+		case JVST_OP_INCR:
+		case JVST_OP_BSET:
+		case JVST_OP_BAND:
+			need_sl = 1;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	need_fp |= need_sl;
+
+	fprintf(f, "static int\nproc%zu(struct jvst_vm_ctx *vm, uint32_t pc)\n{\n", p);
+	if (need_sl) {
+		fprintf(f, "\tunion jvst_vm_stackval *sl;\n");
+	}
+	if (need_fp) {
+		fprintf(f, "\tuint32_t fp;\n");
+	}
+	fprintf(f, "\tint64_t flag;\n");
+	if (need_ret) {
+		fprintf(f, "\tint ret;\n");
+	}
+	fprintf(f, "\n");
+
+	if (need_fp) {
+		fprintf(f, "\tfp = vm->r_fp;\n");
+	}
+	if (need_sl) {
+		fprintf(f, "\tsl = &vm->stack[fp];\n");
+	}
+	fprintf(f, "\tflag = vm->r_flag;\n\n");
+
+	fprintf(f, "\tswitch (pc) {\n");
+	for (pc=pc0; pc < pc1; pc++) {
+		if (cg->flags[pc] & CG_RESUME) {
+			fprintf(f, "\tcase %" PRIu32 ": goto L%" PRIu32 ";\n", pc, pc);
+		}
+	}
+	fprintf(f, "\tdefault: return jvst_vm_rt_badpc(vm);\n\t}\n\n");
+
+	for (pc=pc0; pc < pc1; pc++) {
+		if (cg->flags[pc] != 0) {
+			fprintf(f, "L%" PRIu32 ":\n", pc);
+		}
+
+		fprintf(f, "\t/* %" PRIu32 ": %s */\n", pc, jvst_op_name(dec[pc].op));
+		cgen_ins(cg, pc, need_fp, need_sl);
+	}
+
+	// falls through to the next proc or off the end of the program
+	last = &dec[pc1-1];
+	if (last->op != JVST_OP_RETURN && last->op != JVST_OP_SWITCH &&
+		!(last->op == JVST_OP_JMP && last->cond == JVST_VM_BR_ALWAYS)) {
+		fprintf(f, "\n");
+		cgen_goto(cg, pc1-1, pc1, "\t");
+	}
+	fprintf(f, "}\n\n");
+}
+
+int
+jvst_cgen_program(FILE *f, struct jvst_vm_program *prog, const char *prefix,
+	char *errbuf, size_t nb)
+{
+	static const struct cgen zero;
+	struct cgen cg = zero;
+	char verr[128];
+	size_t p, pc;
+
+	if (!cgen_isident(prefix)) {
+		return cgen_error(errbuf, nb, "prefix is not a C identifier");
+	}
+
+	if (jvst_vm_program_verify(prog, verr, sizeof verr) != 0) {
+		return cgen_error(errbuf, nb, "program does not verify: %s", verr);
+	}
+
+	cg.f = f;
+	cg.prog = prog;
+	cg.dec = prog->decoded;
+	cg.ncode = prog->ncode;
+	cg.prefix = prefix;
+
+	cgen_layout(&cg);
+
+	fprintf(f,
+		"/* Generated by jvst.  Do not edit.\n"
+		" *\n"
+		" * %s_init() sets up a struct jvst_vm to run this validator.\n"
+		" * See validate_cgen.h for the rest of the API.\n"
+		" */\n"
+		"\n"
+		"#include <math.h>\n"
+		"#include <stdint.h>\n"
+		"#include <stdlib.h>\n"
+		"\n"
+		"#include \"validate_vm.h\"\n"
+		"\n"
+		"#define CMP(a,b) (((a) > (b)) - ((a) < (b)))\n"
+		"\n"
+		"// leaves a proc with the VM at pc\n"
+		"#define LEAVE(pc_, ret_) do { vm->r_pc = (pc_); vm->r_flag = flag; return (ret_); } while (0)\n"
+		"\n",
+		prefix);
+
+	cgen_data(&cg);
+
+	for (p=0; p < cg.nproc; p++) {
+		fprintf(f, "static int proc%zu(struct jvst_vm_ctx *vm, uint32_t pc);\n", p);
+	}
+	fprintf(f, "\n");
+
+	for (p=0; p < cg.nproc; p++) {
+		cgen_proc(&cg, p);
+	}
+
+	// run function: dispatches to the proc that resumes at r_pc
+	fprintf(f, "static int (*const resume[%zu])(struct jvst_vm_ctx *vm, uint32_t pc) = {\n", cg.ncode);
+	for (pc=0; pc < cg.ncode; pc++) {
+		if (cg.flags[pc] & CG_RESUME) {
+			fprintf(f, "\t[%zu] = proc%" PRIu32 ",\n", pc, cg.procof[pc]);
+		}
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f,
+		"static enum jvst_result\n"
+		"run(struct jvst_vm_ctx *vm, enum SJP_RESULT pret, struct sjp_event *evt)\n"
+		"{\n"
+		"\tint ret;\n"
+		"\n"
+		"\tvm->evt = *evt;\n"
+		"\tvm->pret = pret;\n"
+		"\n"
+		"\tdo {\n"
+		"\t\tuint32_t pc = vm->r_pc;\n"
+		"\n"
+		"\t\tif (pc >= %zu || resume[pc] == NULL) {\n"
+		"\t\t\treturn jvst_vm_rt_badpc(vm);\n"
+		"\t\t}\n"
+		"\n"
+		"\t\tret = resume[pc](vm, pc);\n"
+		"\t} while (ret == JVST_VM_RT_CONTINUE);\n"
+		"\n"
+		"\treturn ret;\n"
+		"}\n"
+		"\n",
+		cg.ncode);
+
+	fprintf(f, "struct jvst_vm_program %s_program = {\n", prefix);
+	fprintf(f, "\t.ncode = %zu,\n", prog->ncode);
+	fprintf(f, "\t.nfloat = %zu,\n", prog->nfloat);
+	fprintf(f, "\t.nconst = %zu,\n", prog->nconst);
+	fprintf(f, "\t.nsplit = %zu,\n", prog->nsplit);
+	fprintf(f, "\t.ndfa = %zu,\n", prog->ndfa);
+	fprintf(f, "\t.fdata = %s,\n", (prog->nfloat > 0) ? "fdata" : "NULL");
+	fprintf(f, "\t.cdata = %s,\n", (prog->nconst > 0) ? "cdata" : "NULL");
+	fprintf(f, "\t.sdata = %s,\n", (prog->nsplit > 0) ? "sdata" : "NULL");
+	fprintf(f, "\t.dfas = %s,\n", (prog->ndfa > 0) ? "dfas" : "NULL");
+	fprintf(f, "\t.code = code,\n");
+	fprintf(f, "\t.decoded = decoded,\n");
+	fprintf(f, "\t.sizing = { %zu, %zu, %zu, %zu },\n",
+		prog->sizing.stack, prog->sizing.split_stack, prog->sizing.maxsplit, prog->sizing.nctx);
+	fprintf(f, "\t.verified = 1,\n");
+	fprintf(f, "\t.native = run,\n");
+	fprintf(f, "};\n\n");
+
+	fprintf(f,
+		"void\n%s_init(struct jvst_vm *vm)\n{\n"
+		"\tjvst_vm_init_defaults(vm, &%s_program);\n}\n\n",
+		prefix, prefix);
+
+	fprintf(f,
+		"enum jvst_result\n%s_more(struct jvst_vm *vm, char *data, size_t n)\n{\n"
+		"\treturn jvst_vm_more(vm, data, n);\n}\n\n",
+		prefix);
+
+	fprintf(f,
+		"enum jvst_result\n%s_close(struct jvst_vm *vm)\n{\n"
+		"\treturn jvst_vm_close(vm);\n}\n\n",
+		prefix);
+
+	fprintf(f,
+		"void\n%s_reset(struct jvst_vm *vm)\n{\n"
+		"\tjvst_vm_reset(vm);\n}\n\n",
+		prefix);
+
+	fprintf(f,
+		"void\n%s_finalize(struct jvst_vm *vm)\n{\n"
+		"\tjvst_vm_finalize(vm);\n}\n",
+		prefix);
+
+	cgen_free(&cg);
+
+	if (ferror(f)) {
+		return cgen_error(errbuf, nb, "error writing C output");
+	}
+
+	return 0;
+}
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
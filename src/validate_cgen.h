@@ -0,0 +1,40 @@
+#ifndef VALIDATE_CGEN_H
+#define VALIDATE_CGEN_H
+
+#include <stdio.h>
+
+#include "validate_vm.h"
+
+/* Compiles a VM program to a C translation unit.
+ *
+ * Each proc becomes a C function.  Branches become gotos, constants
+ * are folded into the code and DFAs become static tables.  Procs keep
+ * their slots in the VM stack frame, so they can suspend when they need
+ * another token and resume on the next call, and the generated code runs
+ * on the VM's runtime: struct jvst_vm, its parser, splits and unique
+ * sets.
+ *
+ * The translation unit defines, for the given prefix:
+ *
+ *	struct jvst_vm_program <prefix>_program;
+ *	void <prefix>_init(struct jvst_vm *vm);
+ *	enum jvst_result <prefix>_more(struct jvst_vm *vm, char *data, size_t n);
+ *	enum jvst_result <prefix>_close(struct jvst_vm *vm);
+ *	void <prefix>_reset(struct jvst_vm *vm);
+ *	void <prefix>_finalize(struct jvst_vm *vm);
+ *
+ * which behave like jvst_vm_init_defaults() with the program and the
+ * other jvst_vm functions.  <prefix>_program can also be given to
+ * jvst_vm_records_init() and the jvst_batch functions.
+ *
+ * The program must pass jvst_vm_program_verify().  Returns 0 on
+ * success.  Otherwise returns -1 and, if errbuf is not NULL, writes a
+ * description of the problem to errbuf.
+ */
+int
+jvst_cgen_program(FILE *f, struct jvst_vm_program *prog, const char *prefix,
+	char *errbuf, size_t nb);
+
+#endif /* VALIDATE_CGEN_H */
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
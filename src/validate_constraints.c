@@ -20,7 +20,9 @@
 #include "jvst_macros.h"
 #include "sjp_testing.h"
 #include "validate_sbuf.h"
+#include "validate_op.h"
 #include "hmap.h"
+#include "xxhash.h"
 
 #define WHEREFMT "%s:%d (%s) "
 #define WHEREARGS __FILE__, __LINE__, __func__
@@ -341,6 +343,7 @@ jvst_cnode_free_tree(struct jvst_cnode *root)
 		case JVST_CNODE_PROP_RANGE:
 		case JVST_CNODE_ITEM_RANGE:
 		case JVST_CNODE_ARR_UNIQUE:
+		case JVST_CNODE_VALUE_SET:
 			break;
 
 		case JVST_CNODE_STR_MATCH:
@@ -427,6 +430,8 @@ jvst_cnode_type_name(enum jvst_cnode_type type)
 		return "ARR_CONTAINS";
 	case JVST_CNODE_ARR_UNIQUE:
 		return "ARR_UNIQUE";
+	case JVST_CNODE_VALUE_SET:
+		return "VALUE_SET";
 	case JVST_CNODE_OBJ_REQMASK:
 		return "OBJ_REQMASK";
 	case JVST_CNODE_OBJ_REQBIT:
@@ -886,6 +891,20 @@ and_or_xor:
 			sbuf_snprintf(buf, "UNIQUE");
 		}
 		break;
+
+	case JVST_CNODE_VALUE_SET:
+		{
+			const struct ast_value_set *v;
+			size_t n = 0;
+
+			for (v = node->u.value_set.values; v != NULL; v = v->next) {
+				n++;
+			}
+
+			sbuf_snprintf(buf, "VALUE_SET(%s, %zu)",
+				evt2name(node->u.value_set.type), n);
+		}
+		break;
 	}
 }
 
@@ -1169,6 +1188,67 @@ cnode_enum_translate(struct json_value *v)
 	return jvst_cnode_alloc(JVST_CNODE_INVALID);
 }
 
+size_t jvst_cnode_enum_min = JVST_CNODE_ENUM_MIN;
+
+// Translates a large enum into a single SWITCH.  Strings, numbers,
+// objects and arrays are matched by a VALUE_SET for their token type,
+// which the VM looks up in a hash table instead of trying each member
+// in turn.
+static struct jvst_cnode *
+cnode_enum_value_set(const struct ast_value_set *values)
+{
+	const struct ast_value_set *v;
+	struct jvst_cnode *sw;
+
+	sw = cnode_new_switch(0);
+	for (v = values; v != NULL; v = v->next) {
+		enum SJP_EVENT evt;
+
+		switch (v->value.type) {
+		case JSON_VALUE_ARRAY:
+			evt = SJP_ARRAY_BEG;
+			break;
+
+		case JSON_VALUE_OBJECT:
+			evt = SJP_OBJECT_BEG;
+			break;
+
+		case JSON_VALUE_STRING:
+			evt = SJP_STRING;
+			break;
+
+		case JSON_VALUE_NUMBER:
+		case JSON_VALUE_INTEGER:
+			evt = SJP_NUMBER;
+			break;
+
+		case JSON_VALUE_BOOL:
+			evt = v->value.u.v ? SJP_TRUE : SJP_FALSE;
+			jvst_cnode_free(sw->u.sw[evt]);
+			sw->u.sw[evt] = jvst_cnode_alloc(JVST_CNODE_VALID);
+			continue;
+
+		case JSON_VALUE_NULL:
+			evt = SJP_NULL;
+			jvst_cnode_free(sw->u.sw[evt]);
+			sw->u.sw[evt] = jvst_cnode_alloc(JVST_CNODE_VALID);
+			continue;
+
+		default:
+			DIEF("unknown JSON type for enum/const: 0x%x\n", v->value.type);
+		}
+
+		if (sw->u.sw[evt]->type != JVST_CNODE_VALUE_SET) {
+			jvst_cnode_free(sw->u.sw[evt]);
+			sw->u.sw[evt] = jvst_cnode_alloc(JVST_CNODE_VALUE_SET);
+			sw->u.sw[evt]->u.value_set.values = values;
+			sw->u.sw[evt]->u.value_set.type = evt;
+		}
+	}
+
+	return sw;
+}
+
 static
 void add_cnode_ids(struct jvst_cnode_id_table *tbl, const struct ast_schema *ast, struct jvst_cnode *n)
 {
@@ -1686,13 +1766,23 @@ cnode_translate_ast_with_ids(const struct ast_schema *ast, struct ast_translator
 	if (ast->xenum != NULL) {
 		struct ast_value_set *v;
 		struct jvst_cnode *top_jxn, *cons, **jpp;
+		size_t n;
+
+		n = 0;
+		for (v=ast->xenum; v != NULL; v = v->next) {
+			n++;
+		}
 
 		cons = NULL;
 		jpp = &cons;
 
-		for (v=ast->xenum; v != NULL; v = v->next) {
-			*jpp = cnode_enum_translate(&v->value);
-			jpp = &(*jpp)->next;
+		if (jvst_cnode_enum_min > 0 && n >= jvst_cnode_enum_min) {
+			cons = cnode_enum_value_set(ast->xenum);
+		} else {
+			for (v=ast->xenum; v != NULL; v = v->next) {
+				*jpp = cnode_enum_translate(&v->value);
+				jpp = &(*jpp)->next;
+			}
 		}
 
 		top_jxn = jvst_cnode_alloc(JVST_CNODE_AND);
@@ -1986,6 +2076,11 @@ cnode_deep_copy(struct jvst_cnode *node)
 	case JVST_CNODE_ARR_UNIQUE:
 		return jvst_cnode_alloc(node->type);
 
+	case JVST_CNODE_VALUE_SET:
+		tree = jvst_cnode_alloc(node->type);
+		tree->u.value_set = node->u.value_set;
+		return tree;
+
 	case JVST_CNODE_NUM_MULTIPLE_OF:
 		tree = jvst_cnode_alloc(node->type);
 		tree->u.multiple_of = node->u.multiple_of;
@@ -4737,6 +4832,7 @@ jvst_cnode_simplify(struct jvst_cnode *tree)
 	case JVST_CNODE_NUM_INTEGER:
 	case JVST_CNODE_NUM_MULTIPLE_OF:
 	case JVST_CNODE_ARR_UNIQUE:
+	case JVST_CNODE_VALUE_SET:
 	case JVST_CNODE_REF:
 		return tree;
 
@@ -5151,8 +5247,11 @@ fsm_debug_printer(const struct fsm *dfa, const struct fsm_state *st, void *opaqu
 
 // static struct jvst_cnode **mcase_collector_head;
 
+size_t jvst_cnode_dfa_budget = JVST_CNODE_DFA_BUDGET;
+
+// compiles a regexp to an NFA
 static struct fsm *
-mcase_re_compile(struct ast_regexp *re, struct fsm_options *opts, struct jvst_cnode *mcase)
+re_compile_nfa(struct ast_regexp *re, struct fsm_options *opts)
 {
 	struct fsm *pat;
 	struct json_str_iter siter;
@@ -5169,17 +5268,10 @@ mcase_re_compile(struct ast_regexp *re, struct fsm_options *opts, struct jvst_cn
 			(enum re_flags)0,
 			&err);
 
-	if (!fsm_minimise(pat)) {
-		perror("minimizing regexp");
-		abort();
-	}
-
 	if (pat == NULL) {
 		goto error;
 	}
 
-	fsm_setendopaque(pat, mcase);
-
 	return pat;
 
 error:
@@ -5203,6 +5295,192 @@ error:
 	abort();
 }
 
+/* Regexp cache
+ *
+ * Large schemas repeat the same patterns many times, and compiling
+ * them is the largest cost of canonification.  While a forest or tree
+ * is canonified, each regexp is compiled once, keyed by its dialect and
+ * text, and the fsm handed back is a copy of the cached one.
+ *
+ * The cached fsm is minimised, unless it was compiled for a pattern
+ * whose DFA is over jvst_cnode_dfa_budget, in which case it's the NFA.
+ */
+struct re_cache_entry {
+	enum re_dialect dialect;
+	struct json_string str;
+	struct fsm *fsm;
+	int nfa;
+};
+
+struct re_cache {
+	struct hmap *entries;
+	size_t lookups;
+	size_t hits;
+};
+
+static struct re_cache *re_cache;
+static size_t re_cache_lookups;
+static size_t re_cache_hits;
+
+static uint64_t
+re_cache_hash(void *opaque, const void *key)
+{
+	const struct re_cache_entry *ent = key;
+
+	(void)opaque;
+	return XXH64(ent->str.s, ent->str.len, (unsigned long long)ent->dialect);
+}
+
+static int
+re_cache_equals(void *opaque, const void *k1, const void *k2)
+{
+	const struct re_cache_entry *e1 = k1, *e2 = k2;
+
+	(void)opaque;
+	return e1->dialect == e2->dialect && e1->str.len == e2->str.len &&
+		memcmp(e1->str.s, e2->str.s, e1->str.len) == 0;
+}
+
+// starts caching regexps, returning 0 if the cache was already started
+static int
+re_cache_begin(void)
+{
+	if (re_cache != NULL) {
+		return 0;
+	}
+
+	re_cache = xmalloc(sizeof *re_cache);
+	re_cache->entries = hmap_create(64, 0.7f, NULL, re_cache_hash, re_cache_equals);
+	re_cache->lookups = 0;
+	re_cache->hits = 0;
+
+	return 1;
+}
+
+static void
+re_cache_end(void)
+{
+	struct hmap_iter it;
+	struct re_cache_entry *ent;
+
+	assert(re_cache != NULL);
+
+	for (ent = hmap_iter_first(re_cache->entries, &it); ent != NULL; ent = hmap_iter_next(&it)) {
+		fsm_free(ent->fsm);
+		free((char *)ent->str.s);
+		free(ent);
+	}
+
+	re_cache_lookups = re_cache->lookups;
+	re_cache_hits = re_cache->hits;
+
+	hmap_free(re_cache->entries);
+	free(re_cache);
+	re_cache = NULL;
+}
+
+void
+jvst_cnode_re_cache_stats(size_t *lookupsp, size_t *hitsp)
+{
+	*lookupsp = re_cache_lookups;
+	*hitsp = re_cache_hits;
+}
+
+static struct fsm *
+re_clone(const struct fsm *fsm)
+{
+	struct fsm *pat;
+
+	pat = fsm_clone(fsm);
+	if (pat == NULL) {
+		perror("copying regexp");
+		abort();
+	}
+
+	return pat;
+}
+
+static void
+re_minimise(struct fsm *pat)
+{
+	if (!fsm_minimise(pat)) {
+		perror("minimizing regexp");
+		abort();
+	}
+}
+
+/* Compiles a regexp to a minimal DFA.  If lazy is non-zero, a regexp
+ * whose DFA would be over jvst_cnode_dfa_budget is left as an NFA,
+ * which the VM determinises as it runs.
+ */
+static struct fsm *
+re_compile(struct ast_regexp *re, struct fsm_options *opts, int lazy)
+{
+	struct re_cache_entry key, *ent;
+	size_t budget;
+	struct fsm *pat;
+	char *s;
+	int nfa;
+
+	ent = NULL;
+	if (re_cache != NULL) {
+		key.dialect = re->dialect;
+		key.str = re->str;
+
+		re_cache->lookups++;
+		ent = hmap_getptr(re_cache->entries, &key);
+	}
+
+	if (ent != NULL) {
+		pat = re_clone(ent->fsm);
+		if (ent->nfa && !lazy) {
+			re_minimise(pat);
+		} else {
+			re_cache->hits++;
+		}
+
+		return pat;
+	}
+
+	budget = jvst_cnode_dfa_budget;
+	pat = re_compile_nfa(re, opts);
+	nfa = lazy && budget > 0 && jvst_op_dfa_states(pat, budget) > budget;
+	if (!nfa) {
+		re_minimise(pat);
+	}
+
+	if (re_cache != NULL) {
+		ent = xmalloc(sizeof *ent);
+		s = xmalloc(re->str.len + 1);
+		memcpy(s, re->str.s, re->str.len);
+		s[re->str.len] = '\0';
+
+		ent->dialect = re->dialect;
+		ent->str.s = s;
+		ent->str.len = re->str.len;
+		ent->fsm = re_clone(pat);
+		ent->nfa = nfa;
+
+		if (!hmap_setptr(re_cache->entries, ent, ent)) {
+			fprintf(stderr, "could not add entry to regexp cache\n");
+			abort();
+		}
+	}
+
+	return pat;
+}
+
+static struct fsm *
+mcase_re_compile(struct ast_regexp *re, struct fsm_options *opts, struct jvst_cnode *mcase)
+{
+	struct fsm *pat;
+
+	pat = re_compile(re, opts, 0);
+	fsm_setendopaque(pat, mcase);
+
+	return pat;
+}
+
 static struct jvst_cnode *
 cnode_canonify_propset(struct jvst_cnode *top)
 {
@@ -5488,13 +5766,10 @@ cnode_canonify_strmatch(struct jvst_cnode *top)
 	mcase = cnode_new_mcase(mset, cons);
 	assert(mcase->next == NULL);
 
-	match = mcase_re_compile(&top->u.str_match, opts, NULL);
-
-	if (!fsm_determinise(match)) {
-		perror("cannot determinise fsm");
-		abort();
-	}
-
+	// A pattern whose DFA would be over budget is left as an NFA, and
+	// the VM builds the DFA states it needs as it runs.  With only
+	// one case, every end state has the same case.
+	match = re_compile(&top->u.str_match, opts, 1);
 	fsm_setendopaque(match, mcase);
 
 	// build the MATCH_SWITCH container to hold the case and the
@@ -5543,6 +5818,7 @@ cnode_canonify_pass1(struct jvst_cnode *tree, int namecons)
 	case JVST_CNODE_INVALID:
 	case JVST_CNODE_VALID:
 	case JVST_CNODE_ARR_UNIQUE:
+	case JVST_CNODE_VALUE_SET:
 	case JVST_CNODE_NUM_MULTIPLE_OF:
 	case JVST_CNODE_NUM_RANGE:
 	case JVST_CNODE_PROP_RANGE:
@@ -5718,6 +5994,7 @@ cnode_canonify_pass2(struct jvst_cnode *tree)
 	case JVST_CNODE_INVALID:
 	case JVST_CNODE_VALID:
 	case JVST_CNODE_ARR_UNIQUE:
+	case JVST_CNODE_VALUE_SET:
 	case JVST_CNODE_NUM_MULTIPLE_OF:
 	case JVST_CNODE_NUM_RANGE:
 	case JVST_CNODE_LENGTH_RANGE:
@@ -5877,10 +6154,19 @@ cnode_canonify_pass2(struct jvst_cnode *tree)
 struct jvst_cnode *
 jvst_cnode_canonify(struct jvst_cnode *tree)
 {
+	int cache;
+
+	cache = re_cache_begin();
+
 	tree = cnode_canonify_pass1(tree, 0);
 	tree = jvst_cnode_simplify(tree);
 	tree = cnode_canonify_pass2(tree);
 	tree = jvst_cnode_simplify(tree);
+
+	if (cache) {
+		re_cache_end();
+	}
+
 	return tree;
 }
 
@@ -5997,7 +6283,16 @@ jvst_cnode_simplify_forest(struct jvst_cnode_forest *forest)
 struct jvst_cnode_forest *
 jvst_cnode_canonify_forest(struct jvst_cnode_forest *forest)
 {
-	return cnode_update_forest(forest, jvst_cnode_canonify);
+	int cache;
+
+	// the trees share one regexp cache
+	cache = re_cache_begin();
+	forest = cnode_update_forest(forest, jvst_cnode_canonify);
+	if (cache) {
+		re_cache_end();
+	}
+
+	return forest;
 }
 
 /* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
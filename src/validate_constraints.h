@@ -72,6 +72,10 @@ enum jvst_cnode_type {
 	JVST_CNODE_ARR_UNIQUE,
 	JVST_CNODE_ARR_CONTAINS,
 
+	// members of a large enum that have one token type, matched
+	// as a set rather than one by one
+	JVST_CNODE_VALUE_SET,
+
 	JVST_CNODE_REF,
 
 	// The following node types are only present after
@@ -190,6 +194,13 @@ struct jvst_cnode {
 		// for array contains constraint
 		struct jvst_cnode *contains;
 
+		// for enum value sets.  values is the whole enum;
+		// only the members of the given type are in the set.
+		struct {
+			const struct ast_value_set *values;
+			enum SJP_EVENT type;
+		} value_set;
+
 		struct json_string ref;
 	} u;
 };
@@ -228,6 +239,25 @@ jvst_cnode_translate_ast(const struct ast_schema *ast);
 struct jvst_cnode *
 jvst_cnode_simplify(struct jvst_cnode *tree);
 
+#define JVST_CNODE_DFA_BUDGET 4096
+
+// Most states a pattern's DFA may have.  Larger patterns are kept as
+// NFAs, which the VM determinises as it runs.  Zero means no limit.
+extern size_t jvst_cnode_dfa_budget;
+
+#define JVST_CNODE_ENUM_MIN 8
+
+// Fewest members an enum must have to be matched as a set of values.
+// Smaller enums are translated member by member.  Zero means enums are
+// never matched as sets.
+extern size_t jvst_cnode_enum_min;
+
+// Sets *lookupsp and *hitsp to the lookups and hits of the regexp
+// cache of the last canonification, for debugging.  Each tree or
+// forest that's canonified has its own cache.
+void
+jvst_cnode_re_cache_stats(size_t *lookupsp, size_t *hitsp);
+
 // Canonifies the cnode tree.  Returns a new tree.
 struct jvst_cnode *
 jvst_cnode_canonify(struct jvst_cnode *tree);
@@ -106,9 +106,15 @@ jvst_invalid_msg(enum jvst_invalid_code code)
 	case JVST_INVALID_NOT_UNIQUE:
 		return "array elements are not unique";
 
+	case JVST_INVALID_NOT_IN_ENUM:
+		return "value is not in the enum";
+
 	case JVST_INVALID_JSON:
 		return "encountered invalid JSON";
 
+	case JVST_INVALID_IO:
+		return "error reading input";
+
 	case JVST_INVALID_VM_BAD_PC:
 		return "VM invalid PC";
 
@@ -599,6 +605,7 @@ ir_expr_tmp(struct jvst_ir_stmt *frame, struct jvst_ir_expr *expr)
 	case JVST_IR_EXPR_BCOUNT:
 	case JVST_IR_EXPR_SPLIT:
 	case JVST_IR_EXPR_MATCH:
+	case JVST_IR_EXPR_ENUM:
 		return ir_expr_itemp(frame);
 
 	case JVST_IR_EXPR_SEQ:
@@ -719,6 +726,7 @@ ir_expr_op(enum jvst_ir_expr_type op,
 	case JVST_IR_EXPR_FTEMP:
 	case JVST_IR_EXPR_SEQ:
 	case JVST_IR_EXPR_MATCH:
+	case JVST_IR_EXPR_ENUM:
 		fprintf(stderr, "invalid OP type: %s\n", jvst_ir_expr_type_name(op));
 		abort();
 	}
@@ -1003,6 +1011,9 @@ jvst_ir_expr_type_name(enum jvst_ir_expr_type type)
 	case JVST_IR_EXPR_MATCH:
 		return "EMATCH";
 
+	case JVST_IR_EXPR_ENUM:
+		return "ENUM";
+
 	}
 
 	fprintf(stderr, "%s:%d (%s) unknown IR expression node type %d\n",
@@ -1010,6 +1021,28 @@ jvst_ir_expr_type_name(enum jvst_ir_expr_type type)
 	abort();
 }
 
+const char *
+jvst_ir_split_mode_name(enum jvst_ir_split_mode mode)
+{
+	switch (mode) {
+	case JVST_IR_SPLIT_COUNT:
+		return "COUNT";
+
+	case JVST_IR_SPLIT_ANY:
+		return "ANY";
+
+	case JVST_IR_SPLIT_ALL:
+		return "ALL";
+
+	case JVST_IR_SPLIT_ONE:
+		return "ONE";
+	}
+
+	fprintf(stderr, "%s:%d (%s) unknown IR split mode %d\n",
+		__FILE__, __LINE__, __func__, mode);
+	abort();
+}
+
 void
 jvst_ir_dump_inner(struct sbuf *buf, struct jvst_ir_stmt *ir, int indent);
 
@@ -1140,8 +1173,20 @@ jvst_ir_dump_expr(struct sbuf *buf, const struct jvst_ir_expr *expr, int indent)
 				struct jvst_ir_stmt *split_list;
 				split_list = expr->u.split.split_list;
 				assert(split_list->type == JVST_IR_STMT_SPLITLIST);
-				sbuf_snprintf(buf, "SPLIT(list=%zu)",
-					split_list->u.split_list.ind);
+				if (expr->u.split.disc != NULL) {
+					sbuf_snprintf(buf, "SPLIT(%s, DISC(\"%.*s\"), list=%zu)",
+						jvst_ir_split_mode_name(expr->u.split.mode),
+						(int)expr->u.split.disc->key.len,
+						expr->u.split.disc->key.s,
+						split_list->u.split_list.ind);
+				} else if (expr->u.split.mode != JVST_IR_SPLIT_COUNT) {
+					sbuf_snprintf(buf, "SPLIT(%s, list=%zu)",
+						jvst_ir_split_mode_name(expr->u.split.mode),
+						split_list->u.split_list.ind);
+				} else {
+					sbuf_snprintf(buf, "SPLIT(list=%zu)",
+						split_list->u.split_list.ind);
+				}
 				return;
 			}
 
@@ -1149,7 +1194,17 @@ jvst_ir_dump_expr(struct sbuf *buf, const struct jvst_ir_expr *expr, int indent)
 			if (stmts == NULL) {
 				sbuf_snprintf(buf, "SPLIT()");
 			} else {
-				sbuf_snprintf(buf, "SPLIT(\n");
+				sbuf_snprintf(buf, "SPLIT(");
+				if (expr->u.split.mode != JVST_IR_SPLIT_COUNT) {
+					sbuf_snprintf(buf, "%s,",
+						jvst_ir_split_mode_name(expr->u.split.mode));
+				}
+				if (expr->u.split.disc != NULL) {
+					sbuf_snprintf(buf, " DISC(\"%.*s\"),",
+						(int)expr->u.split.disc->key.len,
+						expr->u.split.disc->key.s);
+				}
+				sbuf_snprintf(buf, "\n");
 				for (;stmts != NULL; stmts = stmts->next) {
 					jvst_ir_dump_inner(buf, stmts, indent+2);
 					if (stmts->next != NULL) {
@@ -1214,6 +1269,20 @@ jvst_ir_dump_expr(struct sbuf *buf, const struct jvst_ir_expr *expr, int indent)
 			expr->u.match.ind);
 		return;
 
+	case JVST_IR_EXPR_ENUM:
+		{
+			const struct ast_value_set *vs;
+			size_t n = 0;
+
+			for (vs = expr->u.enum_.values; vs != NULL; vs = vs->next) {
+				n++;
+			}
+
+			sbuf_snprintf(buf, "ENUM(%s, %zu)",
+				evt2name(expr->u.enum_.type), n);
+		}
+		return;
+
 	case JVST_IR_EXPR_SLOT:
 		sbuf_snprintf(buf, "%s(%zu)",
 			jvst_ir_expr_type_name(expr->type),
@@ -1629,6 +1698,55 @@ ir_translate_string(struct jvst_cnode *top, struct jvst_ir_stmt *frame);
 static void
 ir_translate_string_inner(struct jvst_cnode *top, struct ir_str_builder *builder);
 
+static struct jvst_ir_stmt *
+ir_translate_split(struct jvst_cnode *top, struct jvst_ir_stmt *frame,
+	struct jvst_ir_stmt *(*xlatefunc)(struct jvst_cnode *, struct jvst_ir_stmt *));
+
+// ENUM consumes the value, so a VALUE_SET is always translated on its
+// own.  Combined with other constraints, it gets its own split frame.
+static struct jvst_ir_stmt *
+ir_translate_value_set(struct jvst_cnode *top)
+{
+	struct jvst_ir_expr *e_enum, *cond;
+
+	assert(top->type == JVST_CNODE_VALUE_SET);
+
+	e_enum = ir_expr_new(JVST_IR_EXPR_ENUM);
+	e_enum->u.enum_.values = top->u.value_set.values;
+	e_enum->u.enum_.type = top->u.value_set.type;
+
+	cond = ir_expr_op(JVST_IR_EXPR_NE, e_enum, ir_expr_size(0));
+
+	return ir_stmt_if(cond,
+		ir_stmt_valid(),
+		ir_stmt_invalid(JVST_INVALID_NOT_IN_ENUM));
+}
+
+static bool
+cnode_has_value_set(struct jvst_cnode *top)
+{
+	struct jvst_cnode *n;
+
+	switch (top->type) {
+	case JVST_CNODE_VALUE_SET:
+		return true;
+
+	case JVST_CNODE_AND:
+	case JVST_CNODE_OR:
+	case JVST_CNODE_XOR:
+	case JVST_CNODE_NOT:
+		for (n = top->u.ctrl; n != NULL; n = n->next) {
+			if (cnode_has_value_set(n)) {
+				return true;
+			}
+		}
+		return false;
+
+	default:
+		return false;
+	}
+}
+
 static struct jvst_ir_expr *
 ir_translate_number_expr(struct jvst_cnode *top)
 {
@@ -1757,6 +1875,14 @@ ir_translate_number(struct jvst_cnode *top, struct jvst_ir_stmt *frame)
 	struct jvst_ir_stmt *stmt, **spp;
 	// struct jvst_ir_expr *expr, **epp;
 
+	if (top->type == JVST_CNODE_VALUE_SET) {
+		return ir_translate_value_set(top);
+	}
+
+	if (cnode_has_value_set(top)) {
+		return ir_translate_split(top, frame, ir_translate_number);
+	}
+
 	stmt = NULL;
 	spp = &stmt;
 
@@ -2349,6 +2475,7 @@ ir_translate_obj_inner(struct jvst_cnode *top, struct ir_object_builder *builder
 	case JVST_CNODE_NUM_RANGE:
 	case JVST_CNODE_NUM_INTEGER:
 	case JVST_CNODE_NUM_MULTIPLE_OF:
+	case JVST_CNODE_VALUE_SET:
 		fprintf(stderr, "[%s:%d] invalid cnode type %s for OBJECT\n",
 				__FILE__, __LINE__, 
 				jvst_cnode_type_name(top->type));
@@ -2368,7 +2495,7 @@ ir_translate_object_inner(struct jvst_cnode *top, struct jvst_ir_stmt *frame);
 
 // Checks if an AND node requires splitting the validator.  An AND node
 // will not require splitting the validator if none of its children are
-// control cnodes (OR, XOR, NOT).
+// control cnodes (OR, XOR, NOT) or value sets.
 static bool
 cnode_and_requires_split(struct jvst_cnode *and_node)
 {
@@ -2381,6 +2508,7 @@ cnode_and_requires_split(struct jvst_cnode *and_node)
 		case JVST_CNODE_OR:
 		case JVST_CNODE_XOR:
 		case JVST_CNODE_NOT:
+		case JVST_CNODE_VALUE_SET:
 			return true;
 
 		case JVST_CNODE_AND:
@@ -2493,6 +2621,7 @@ cnode_count_splits(struct jvst_cnode *top, size_t *np)
 	case JVST_CNODE_OBJ_REQBIT:
 	case JVST_CNODE_MATCH_SWITCH:
 	case JVST_CNODE_MATCH_CASE:
+	case JVST_CNODE_VALUE_SET:
 		/* nop */
 		goto finish;
 	}
@@ -2543,6 +2672,13 @@ separate_control_nodes(struct jvst_cnode *top, struct jvst_cnode **cpp, struct j
 			*cpp = NULL;
 			continue;
 
+		case JVST_CNODE_VALUE_SET:
+			// ENUM consumes the value, so it needs its own frame
+			*cpp = node;
+			cpp = &node->next;
+			*cpp = NULL;
+			continue;
+
 		case JVST_CNODE_INVALID:
 		case JVST_CNODE_VALID:
 		case JVST_CNODE_SWITCH:
@@ -2895,6 +3031,22 @@ split_gather(struct jvst_cnode *top, struct split_gather_data *data,
 	case JVST_CNODE_XOR:
 		return split_gather_xor(top,data,xlatefunc);
 
+	case JVST_CNODE_VALUE_SET:
+		{
+			struct jvst_ir_expr *e_btest;
+
+			// translate the node on its own in a frame, without
+			// the rest of the control list
+			node = top->next;
+			top->next = NULL;
+
+			data->nctrl++;
+			e_btest = split_gather_and_noncontrol_children(top, data, xlatefunc);
+
+			top->next = node;
+			return e_btest;
+		}
+
 	case JVST_CNODE_INVALID:
 	case JVST_CNODE_VALID:
 	case JVST_CNODE_SWITCH:
@@ -2987,14 +3139,18 @@ ir_translate_split(struct jvst_cnode *top, struct jvst_ir_stmt *frame,
 			abort();
 
 		case JVST_CNODE_OR:
+			split->u.split.mode = JVST_IR_SPLIT_ANY;
 			cmp = ir_expr_op(JVST_IR_EXPR_GE, split, ir_expr_size(1));
 			break;
 
 		case JVST_CNODE_NOT:
+			// NOT fails as soon as any frame is valid
+			split->u.split.mode = JVST_IR_SPLIT_ANY;
 			cmp = ir_expr_op(JVST_IR_EXPR_EQ, split, ir_expr_size(0));
 			break;
 
 		case JVST_CNODE_XOR:
+			split->u.split.mode = JVST_IR_SPLIT_ONE;
 			cmp = ir_expr_op(JVST_IR_EXPR_EQ, split, ir_expr_size(1));
 			break;
 
@@ -3044,6 +3200,10 @@ ir_translate_object_inner(struct jvst_cnode *top, struct jvst_ir_stmt *frame)
 	
 	struct ir_object_builder builder = { 0 };
 
+	if (top->type == JVST_CNODE_VALUE_SET) {
+		return ir_translate_value_set(top);
+	}
+
 	builder.frame = frame;
 
 	stmt = ir_stmt_new(JVST_IR_STMT_SEQ);
@@ -3119,14 +3279,330 @@ ir_translate_object_inner(struct jvst_cnode *top, struct jvst_ir_stmt *frame)
 	return stmt;
 }
 
+/* Tagged unions
+ *
+ * A oneOf or anyOf over objects is a tagged union if each branch
+ * requires the same property to be a string from a set of literals (the
+ * branch's tags), and no two branches share a tag.  The property's
+ * value then selects the only branch that can be valid, so the split
+ * carries a jvst_ir_disc and the VM can validate the object against the
+ * selected branch instead of every branch.
+ */
+
+static int
+disc_streq(const struct json_string *a, const struct json_string *b)
+{
+	return a->len == b->len && memcmp(a->s, b->s, a->len) == 0;
+}
+
+// Returns the property switch of an object branch, or NULL if the
+// branch doesn't have exactly one
+static struct jvst_cnode *
+disc_branch_mswitch(struct jvst_cnode *br)
+{
+	struct jvst_cnode *node, *msw;
+
+	if (br->type == JVST_CNODE_MATCH_SWITCH) {
+		return br;
+	}
+
+	if (br->type != JVST_CNODE_AND) {
+		return NULL;
+	}
+
+	msw = NULL;
+	for (node = br->u.ctrl; node != NULL; node = node->next) {
+		if (node->type != JVST_CNODE_MATCH_SWITCH) {
+			continue;
+		}
+
+		if (msw != NULL) {
+			return NULL;
+		}
+
+		msw = node;
+	}
+
+	return msw;
+}
+
+// Returns the literal name a property case matches, or NULL if the case
+// matches anything else
+static const struct json_string *
+disc_case_key(struct jvst_cnode *mcase)
+{
+	struct jvst_cnode_matchset *mset;
+
+	mset = mcase->u.mcase.matchset;
+	if (mset == NULL || mset->next != NULL || mset->match.dialect != RE_LITERAL) {
+		return NULL;
+	}
+
+	return &mset->match.str;
+}
+
+// Returns the constraint on a string value, if cons only allows strings,
+// and NULL otherwise
+static struct jvst_cnode *
+disc_string_constraint(struct jvst_cnode *cons)
+{
+	size_t i;
+
+	if (cons->type == JVST_CNODE_AND) {
+		struct jvst_cnode *node, *sw;
+
+		sw = NULL;
+		for (node = cons->u.ctrl; node != NULL; node = node->next) {
+			if (node->type == JVST_CNODE_SWITCH) {
+				if (sw != NULL) {
+					return NULL;
+				}
+				sw = node;
+			}
+		}
+
+		if (sw == NULL) {
+			return NULL;
+		}
+
+		cons = sw;
+	}
+
+	if (cons->type != JVST_CNODE_SWITCH) {
+		return NULL;
+	}
+
+	for (i=0; i < SJP_EVENT_MAX; i++) {
+		struct jvst_cnode *sw = cons->u.sw[i];
+
+		if (i != SJP_STRING && sw != NULL && sw->type != JVST_CNODE_INVALID) {
+			return NULL;
+		}
+	}
+
+	return cons->u.sw[SJP_STRING];
+}
+
+// Adds a tag for frame to disc.  Returns 0 if another frame has the tag.
+static int
+disc_add_tag(struct jvst_ir_disc *disc, size_t *maxtags,
+	const struct json_string *tag, size_t frame)
+{
+	size_t i;
+
+	for (i=0; i < disc->ntags; i++) {
+		if (disc_streq(&disc->tags[i].tag, tag)) {
+			return disc->tags[i].frame == frame;
+		}
+	}
+
+	if (disc->ntags >= *maxtags) {
+		disc->tags = xenlargevec(disc->tags, maxtags, 1, sizeof disc->tags[0]);
+	}
+
+	disc->tags[disc->ntags].tag = *tag;
+	disc->tags[disc->ntags].frame = frame;
+	disc->ntags++;
+
+	return 1;
+}
+
+// Adds the literals a string switch accepts as tags of frame.  Returns 0
+// if it accepts other strings, or one of them is the tag of another
+// frame.
+static int
+disc_add_mswitch_tags(struct jvst_ir_disc *disc, size_t *maxtags,
+	struct jvst_cnode *str, size_t frame)
+{
+	struct jvst_cnode *mcase;
+
+	if (str->type != JVST_CNODE_MATCH_SWITCH || str->u.mswitch.cases == NULL) {
+		return 0;
+	}
+
+	mcase = str->u.mswitch.dft_case;
+	if (mcase == NULL || mcase->u.mcase.constraint->type != JVST_CNODE_INVALID) {
+		return 0;
+	}
+
+	for (mcase = str->u.mswitch.cases; mcase != NULL; mcase = mcase->next) {
+		struct jvst_cnode_matchset *mset;
+
+		if (mcase->u.mcase.constraint->type != JVST_CNODE_VALID) {
+			return 0;
+		}
+
+		for (mset = mcase->u.mcase.matchset; mset != NULL; mset = mset->next) {
+			if (mset->match.dialect != RE_LITERAL) {
+				return 0;
+			}
+
+			if (!disc_add_tag(disc, maxtags, &mset->match.str, frame)) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// Adds the tags of a branch, given the constraint its property switch
+// puts on the discriminator: one string switch, or an OR of them for an
+// enum.
+static int
+disc_add_branch_tags(struct jvst_ir_disc *disc, size_t *maxtags,
+	struct jvst_cnode *cons, size_t frame)
+{
+	struct jvst_cnode *str, *node;
+
+	str = disc_string_constraint(cons);
+	if (str == NULL) {
+		return 0;
+	}
+
+	if (str->type != JVST_CNODE_OR) {
+		return disc_add_mswitch_tags(disc, maxtags, str, frame);
+	}
+
+	for (node = str->u.ctrl; node != NULL; node = node->next) {
+		if (!disc_add_mswitch_tags(disc, maxtags, node, frame)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Tries key as the discriminator of the branches of top.  Returns 0 if
+// it isn't one.
+static int
+disc_try_key(struct jvst_cnode *top, const struct json_string *key,
+	struct jvst_ir_disc *disc, size_t *maxtags)
+{
+	struct jvst_cnode *br;
+	size_t frame;
+
+	disc->key = *key;
+	disc->ntags = 0;
+
+	for (br = top->u.ctrl, frame = 0; br != NULL; br = br->next, frame++) {
+		struct jvst_cnode *msw, *mcase;
+		const struct json_string *k;
+
+		msw = disc_branch_mswitch(br);
+		if (msw == NULL) {
+			return 0;
+		}
+
+		for (mcase = msw->u.mswitch.cases; mcase != NULL; mcase = mcase->next) {
+			k = disc_case_key(mcase);
+			if (k != NULL && disc_streq(k, key)) {
+				break;
+			}
+		}
+
+		if (mcase == NULL) {
+			return 0;
+		}
+
+		if (!disc_add_branch_tags(disc, maxtags, mcase->u.mcase.constraint, frame)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Returns the discriminator of a oneOf or anyOf over objects, or NULL
+// if it isn't a tagged union
+static struct jvst_ir_disc *
+ir_object_disc(struct jvst_cnode *top)
+{
+	struct jvst_ir_disc *disc;
+	struct jvst_cnode *msw, *mcase;
+	size_t maxtags;
+
+	if (top->u.ctrl == NULL || top->u.ctrl->next == NULL) {
+		return NULL;
+	}
+
+	// candidates are the literal properties of the first branch
+	msw = disc_branch_mswitch(top->u.ctrl);
+	if (msw == NULL) {
+		return NULL;
+	}
+
+	disc = xcalloc(1, sizeof *disc);
+	maxtags = 0;
+
+	for (mcase = msw->u.mswitch.cases; mcase != NULL; mcase = mcase->next) {
+		const struct json_string *key;
+
+		key = disc_case_key(mcase);
+		if (key != NULL && disc_try_key(top, key, disc, &maxtags)) {
+			return disc;
+		}
+	}
+
+	free(disc->tags);
+	free(disc);
+
+	return NULL;
+}
+
+static struct jvst_ir_stmt *
+ir_translate_tagged_split(struct jvst_cnode *top, struct jvst_ir_disc *disc)
+{
+	struct jvst_cnode *node;
+	struct jvst_ir_stmt *frames, **fpp;
+	struct jvst_ir_expr *split, *cmp;
+
+	// one frame for each branch, in order, so the tags' frame
+	// indexes hold
+	frames = NULL;
+	fpp = &frames;
+	for (node = top->u.ctrl; node != NULL; node = node->next) {
+		struct jvst_ir_stmt *fr;
+
+		fr = ir_stmt_frame();
+		fr->u.frame.stmts = ir_translate_object_inner(node, fr);
+		*fpp = fr;
+		fpp = &fr->next;
+	}
+
+	split = ir_expr_new(JVST_IR_EXPR_SPLIT);
+	split->u.split.frames = frames;
+	split->u.split.disc = disc;
+
+	if (top->type == JVST_CNODE_XOR) {
+		split->u.split.mode = JVST_IR_SPLIT_ONE;
+		cmp = ir_expr_op(JVST_IR_EXPR_EQ, split, ir_expr_size(1));
+	} else {
+		split->u.split.mode = JVST_IR_SPLIT_ANY;
+		cmp = ir_expr_op(JVST_IR_EXPR_GE, split, ir_expr_size(1));
+	}
+
+	return ir_stmt_if(cmp,
+		ir_stmt_valid(),
+		ir_stmt_invalid(JVST_INVALID_SPLIT_CONDITION));
+}
+
 static struct jvst_ir_stmt *
 ir_translate_object(struct jvst_cnode *top, struct jvst_ir_stmt *frame)
 {
+	struct jvst_ir_disc *disc;
+
 	switch (top->type) {
-	case JVST_CNODE_AND:
 	case JVST_CNODE_OR:
-	case JVST_CNODE_NOT:
 	case JVST_CNODE_XOR:
+		disc = ir_object_disc(top);
+		if (disc != NULL) {
+			return ir_translate_tagged_split(top, disc);
+		}
+		return ir_translate_split(top, frame, ir_translate_object_inner);
+
+	case JVST_CNODE_AND:
+	case JVST_CNODE_NOT:
 		return ir_translate_split(top, frame, ir_translate_object_inner);
 
 	default:
@@ -3386,6 +3862,10 @@ ir_translate_string_inner(struct jvst_cnode *top, struct ir_str_builder *builder
 		*builder->ipp = ir_stmt_valid();
 		return;
 
+	case JVST_CNODE_VALUE_SET:
+		*builder->ipp = ir_translate_value_set(top);
+		return;
+
 	case JVST_CNODE_LENGTH_RANGE:
 		{
 			struct jvst_ir_stmt **spp;
@@ -3710,6 +4190,10 @@ ir_translate_array(struct jvst_cnode *top, struct jvst_ir_stmt *frame)
 	struct jvst_ir_stmt *stmt, **spp, *it, *next, *outer_loop, *ctmp, *cres;
 	size_t nc;
 
+	if (top->type == JVST_CNODE_VALUE_SET) {
+		return ir_translate_value_set(top);
+	}
+
 	if (nc = 0, cnode_count_splits(top, &nc) > 0) {
 		return ir_translate_split(top, frame, ir_translate_array);
 	}
@@ -4125,6 +4609,7 @@ ir_translate_array_inner(struct jvst_cnode *top, struct ir_arr_builder *builder)
 	case JVST_CNODE_NUM_MULTIPLE_OF:
 	case JVST_CNODE_OBJ_REQMASK:
 	case JVST_CNODE_OBJ_REQBIT:
+	case JVST_CNODE_VALUE_SET:
 		fprintf(stderr, "[%s:%d] unexpected cnode %s in array translation\n",
 				__FILE__, __LINE__, 
 				jvst_cnode_type_name(top->type));
@@ -4350,6 +4835,10 @@ jvst_ir_expr_copy(struct jvst_ir_expr *ir, struct addr_fixup_list *fixups, struc
 			return copy;
 		}
 
+	case JVST_IR_EXPR_ENUM:
+		copy->u.enum_ = ir->u.enum_;
+		return copy;
+
 	case JVST_IR_EXPR_SPLIT:
 		{
 			assert(ir->u.split.frames == NULL);
@@ -5488,6 +5977,8 @@ ir_linearize_split_expr(struct op_linearizer *oplin, struct jvst_ir_expr *expr)
 	spl = ir_expr_new(JVST_IR_EXPR_SPLIT);
 	spl->u.split.frames = NULL;
 	spl->u.split.split_list = ir_linearize_splitlist(oplin, expr->u.split.frames);
+	spl->u.split.mode = expr->u.split.mode;
+	spl->u.split.disc = expr->u.split.disc;
 
 	mv = ir_stmt_move(tmp, spl);
 	return ir_expr_seq(mv, tmp);
@@ -5577,6 +6068,14 @@ ir_linearize_operand(struct op_linearizer *oplin, struct jvst_ir_expr *expr)
 	case JVST_IR_EXPR_SPLIT:
 		return ir_linearize_split_expr(oplin, expr);
 
+	case JVST_IR_EXPR_ENUM:
+		{
+			struct jvst_ir_expr *tmp;
+
+			tmp = ir_expr_itemp(oplin->frame);
+			return ir_expr_seq(ir_stmt_move(tmp, expr), tmp);
+		}
+
 	case JVST_IR_EXPR_BCOUNT:
 		/* need to handle remapping things here ... */
 
@@ -5740,6 +6239,7 @@ ir_linearize_cond(struct op_linearizer *oplin, struct jvst_ir_expr *cond, struct
 	case JVST_IR_EXPR_COUNT:
 	case JVST_IR_EXPR_BCOUNT:
 	case JVST_IR_EXPR_SPLIT:
+	case JVST_IR_EXPR_ENUM:
 	case JVST_IR_EXPR_SLOT:
 	case JVST_IR_EXPR_ITEMP:
 	case JVST_IR_EXPR_FTEMP:
@@ -5859,6 +6359,7 @@ ir_linearize_rewrite_expr(struct jvst_ir_stmt *frame, struct jvst_ir_expr *expr)
 	case JVST_IR_EXPR_COUNT:
 	case JVST_IR_EXPR_BCOUNT:
 	case JVST_IR_EXPR_SPLIT:
+	case JVST_IR_EXPR_ENUM:
 		fprintf(stderr, "%s:%d (%s) condition %s not yet implemented\n",
 				__FILE__, __LINE__, __func__,
 				jvst_ir_expr_type_name(expr->type));
@@ -8,6 +8,8 @@
 #include "jdom.h"
 #include "sjp_parser.h"
 
+struct ast_value_set;
+
 // IR has two components: statements and expressions
 
 // Statements
@@ -121,10 +123,15 @@ enum jvst_ir_expr_type {
 
 	JVST_IR_EXPR_SPLIT,		// SPLITs the validator.  each sub-validator moves in lock-step.
 					// children must be FRAMEs.  result is the number of FRAMEs that
-					// return valid.
+					// return valid.  The split mode lets the VM stop once the
+					// comparison the result feeds is decided.
 
 	JVST_IR_EXPR_MATCH,
 
+	JVST_IR_EXPR_ENUM,		// ENUM(values, type) tests if the current value of the given
+					// type is in the value set.  consumes the value; result: int
+					// (1 if it's in the set, 0 if not)
+
 	JVST_IR_EXPR_SLOT,		// SLOT(n), value at slot n
 	JVST_IR_EXPR_ITEMP,		// ITEMP(n) integer temporary n
 	JVST_IR_EXPR_FTEMP,		// FTEMP(n) floating point temporary n
@@ -153,8 +160,10 @@ enum jvst_invalid_code {
 
 	JVST_INVALID_NOT_MULTIPLE     = 0x0011,
 	JVST_INVALID_NOT_UNIQUE       = 0x0012,
+	JVST_INVALID_NOT_IN_ENUM      = 0x0013,
 
 	JVST_INVALID_JSON             = 0x0020,
+	JVST_INVALID_IO               = 0x0021,
 
 	JVST_INVALID_VM_BAD_PC		= 0xD0,
 	JVST_INVALID_VM_STACK_OVERFLOW	= 0xD1,
@@ -165,6 +174,18 @@ enum jvst_invalid_code {
 const char *
 jvst_invalid_msg(enum jvst_invalid_code code);
 
+// How the result of a SPLIT is used.  With a mode other than COUNT,
+// the result is only exact as far as it decides the mode's outcome.
+enum jvst_ir_split_mode {
+	JVST_IR_SPLIT_COUNT = 0,	// result is compared arbitrarily, run every frame
+	JVST_IR_SPLIT_ANY,		// result >= 1
+	JVST_IR_SPLIT_ALL,		// result == number of frames
+	JVST_IR_SPLIT_ONE,		// result == 1
+};
+
+const char *
+jvst_ir_split_mode_name(enum jvst_ir_split_mode mode);
+
 struct jvst_ir_expr;
 struct jvst_ir_label;
 struct jvst_cnode_matchset;
@@ -176,6 +197,20 @@ struct jvst_ir_mcase {
 	struct jvst_ir_stmt *stmt;
 };
 
+// Discriminator of a SPLIT over objects.  Every frame requires the
+// object's property 'key' to be a string in a set of tags, and no two
+// frames share a tag, so the value of the property selects the only
+// frame that can be valid.
+struct jvst_ir_disc {
+	struct json_string key;
+
+	size_t ntags;
+	struct jvst_ir_tag {
+		struct json_string tag;
+		size_t frame;	// index of the frame the tag selects
+	} *tags;
+};
+
 struct jvst_ir_program {
 	struct jvst_ir_stmt *frames;
 };
@@ -388,6 +423,11 @@ struct jvst_ir_expr {
 		struct {
 			struct jvst_ir_stmt *frames;
 			struct jvst_ir_stmt *split_list;
+			enum jvst_ir_split_mode mode;
+
+			// set if the frames are selected by a
+			// discriminator, NULL otherwise
+			struct jvst_ir_disc *disc;
 		} split;
 
 		struct {
@@ -409,6 +449,11 @@ struct jvst_ir_expr {
 			size_t ind;
 		} match;
 
+		struct {
+			const struct ast_value_set *values;
+			enum SJP_EVENT type;
+		} enum_;
+
 	} u;
 };
 
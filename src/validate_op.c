@@ -19,8 +19,11 @@
 
 #include "xalloc.h"
 #include "jvst_macros.h"
+#include "hmap.h"
+#include "xxhash.h"
 
 #include "validate_sbuf.h"
+#include "validate_uniq.h"
 
 #define DEBUG_DFA 0
 
@@ -214,6 +217,30 @@ op_arg_dump(struct sbuf *buf, struct jvst_op_arg arg)
 			}
 		}
 		return;
+
+	case JVST_VM_ARG_JTAB:
+		{
+			size_t i;
+
+			sbuf_snprintf(buf, "JTAB(%zu)", arg.u.jtab->cind);
+			for (i=0; i <= arg.u.jtab->ncase; i++) {
+				sbuf_snprintf(buf, " ");
+				op_arg_dump(buf, arg.u.jtab->dests[i]);
+			}
+		}
+		return;
+
+	case JVST_VM_ARG_LITS:
+		sbuf_snprintf(buf, "LITS(%zu)", arg.u.lits->nkeys);
+		return;
+
+	case JVST_VM_ARG_VSET:
+		sbuf_snprintf(buf, "VSET(%zu)", arg.u.vset->nmembers);
+		return;
+
+	case JVST_VM_ARG_DISC:
+		sbuf_snprintf(buf, "DISC(%zu, %zu)", arg.u.disc->split, arg.u.disc->ntags);
+		return;
 	}
 
 	fprintf(stderr, "%s:%d (%s) Unknown OP arg type %02x\n",
@@ -300,6 +327,9 @@ op_instr_dump(struct sbuf *buf, struct jvst_op_instr *instr)
 
 	case JVST_OP_INCR:
 	case JVST_OP_SPLITV:
+	case JVST_OP_SPLITANY:
+	case JVST_OP_SPLITALL:
+	case JVST_OP_SPLITONE:
 	case JVST_OP_SPLIT:
 	case JVST_OP_FLOAD:
 	case JVST_OP_ILOAD:
@@ -337,12 +367,20 @@ op_instr_dump(struct sbuf *buf, struct jvst_op_instr *instr)
 		return;
 
 	case JVST_OP_UNIQUE:
+	case JVST_OP_SWITCH:
+	case JVST_OP_LMATCH:
+	case JVST_OP_DISPATCH:
 		sbuf_snprintf(buf, "%s ", jvst_op_name(instr->op));
 		op_arg_dump(buf, instr->args[0]);
 		sbuf_snprintf(buf, ", ", jvst_op_name(instr->op));
 		op_arg_dump(buf, instr->args[1]);
 		return;
 
+	case JVST_OP_ENUM:
+		sbuf_snprintf(buf, "%s ", jvst_op_name(instr->op));
+		op_arg_dump(buf, instr->args[0]);
+		return;
+
 	}
 
 	fprintf(stderr, "%s:%d (%s) Unknown OP arg type %02x\n",
@@ -575,6 +613,7 @@ asm_fixup_addr(struct asm_addr_fixup *fix)
 {
 	switch (fix->instr->op) {
 	case JVST_OP_JMP:
+	case JVST_OP_SWITCH:
 		assert(fix->ir != NULL);
 		assert(fix->ir->data != NULL);
 		assert(fix->type == FIXUP_ARG);
@@ -592,6 +631,10 @@ asm_fixup_addr(struct asm_addr_fixup *fix)
 
 	case JVST_OP_SPLIT:
 	case JVST_OP_SPLITV:
+	case JVST_OP_SPLITANY:
+	case JVST_OP_SPLITALL:
+	case JVST_OP_SPLITONE:
+	case JVST_OP_DISPATCH:
 		{
 			size_t ind, max;
 			struct jvst_op_program *prog;
@@ -637,6 +680,8 @@ asm_fixup_addr(struct asm_addr_fixup *fix)
 	case JVST_OP_RETURN:
 	case JVST_OP_MOVE:
 	case JVST_OP_UNIQUE:
+	case JVST_OP_LMATCH:
+	case JVST_OP_ENUM:
 		fprintf(stderr, "%s:%d (%s) invalid op %s for address lookup\n",
 			__FILE__, __LINE__, __func__, jvst_op_name(fix->instr->op));
 		abort();
@@ -698,6 +743,11 @@ struct op_assembler {
 	size_t maxdfa;
 	struct jvst_vm_dfa *dfas;
 
+	/* pool entries by value, so identical entries are stored once */
+	struct hmap *float_ids;
+	struct hmap *const_ids;
+	struct hmap *dfa_ids;
+
 	/* instruction list */
 	size_t maxinstr;
 	struct jvst_op_instr *ilist;
@@ -707,6 +757,13 @@ struct op_assembler {
 
 	struct jvst_ir_stmt *label_block;
 
+	/* statements of the frame being assembled */
+	struct jvst_ir_stmt *stmts;
+
+	/* default block of the last SWITCH; the tests it replaced are
+	 * skipped up to here */
+	struct jvst_ir_stmt *switch_end;
+
 	struct asm_addr_fixup_list *fixups;
 };
 
@@ -745,6 +802,10 @@ arg_special(enum jvst_op_arg_type type)
 	case JVST_VM_ARG_INSTR:
 	case JVST_VM_ARG_LABEL:
 	case JVST_VM_ARG_CALL:
+	case JVST_VM_ARG_JTAB:
+	case JVST_VM_ARG_LITS:
+	case JVST_VM_ARG_VSET:
+	case JVST_VM_ARG_DISC:
 		fprintf(stderr, "%s:%d (%s) arg type %d is not a special arg\n",
 			__FILE__, __LINE__, __func__, type);
 		abort();
@@ -813,6 +874,28 @@ arg_new_slot(struct op_assembler *opasm)
 	return arg;
 }
 
+static enum jvst_vm_op
+split_op(enum jvst_ir_split_mode mode)
+{
+	switch (mode) {
+	case JVST_IR_SPLIT_COUNT:
+		return JVST_OP_SPLIT;
+
+	case JVST_IR_SPLIT_ANY:
+		return JVST_OP_SPLITANY;
+
+	case JVST_IR_SPLIT_ALL:
+		return JVST_OP_SPLITALL;
+
+	case JVST_IR_SPLIT_ONE:
+		return JVST_OP_SPLITONE;
+	}
+
+	fprintf(stderr, "%s:%d (%s) unknown split mode %d\n",
+		__FILE__, __LINE__, __func__, mode);
+	abort();
+}
+
 static int64_t
 proc_add_split(struct op_assembler *opasm, struct jvst_op_instr *instr, struct jvst_ir_stmt *splitlist)
 {
@@ -891,11 +974,137 @@ proc_add_split(struct op_assembler *opasm, struct jvst_op_instr *instr, struct j
 	return (int64_t)ind;
 }
 
+/* Pool interning.  The maps are keyed by pool index + 1, and hash and
+ * compare the pool entries, so a new entry is added to the end of its
+ * pool and then looked up.  If there's an identical entry already, the
+ * new one is removed again.
+ */
+enum { POOL_HASH_SEED = 0x6a09e667 };
+
+static uint64_t
+pool_float_hash(void *opaque, const void *key)
+{
+	const struct jvst_op_program *prog = opaque;
+	size_t ind = (uintptr_t)key - 1;
+
+	// by representation: -0.0 and 0.0 are different constants
+	return XXH64(&prog->fdata[ind], sizeof prog->fdata[ind], POOL_HASH_SEED);
+}
+
+static int
+pool_float_equals(void *opaque, const void *k1, const void *k2)
+{
+	const struct jvst_op_program *prog = opaque;
+	size_t i1 = (uintptr_t)k1 - 1, i2 = (uintptr_t)k2 - 1;
+
+	return memcmp(&prog->fdata[i1], &prog->fdata[i2], sizeof prog->fdata[0]) == 0;
+}
+
+static uint64_t
+pool_const_hash(void *opaque, const void *key)
+{
+	const struct jvst_op_program *prog = opaque;
+	size_t ind = (uintptr_t)key - 1;
+
+	return XXH64(&prog->cdata[ind], sizeof prog->cdata[ind], POOL_HASH_SEED);
+}
+
+static int
+pool_const_equals(void *opaque, const void *k1, const void *k2)
+{
+	const struct jvst_op_program *prog = opaque;
+	size_t i1 = (uintptr_t)k1 - 1, i2 = (uintptr_t)k2 - 1;
+
+	return prog->cdata[i1] == prog->cdata[i2];
+}
+
+// the dense form is built from the sparse form, so only the sparse
+// form is hashed and compared
+static uint64_t
+pool_dfa_hash(void *opaque, const void *key)
+{
+	const struct jvst_op_program *prog = opaque;
+	const struct jvst_vm_dfa *dfa = &prog->dfas[(uintptr_t)key - 1];
+	uint64_t h;
+
+	h = XXH64(dfa->offs, (dfa->nstates+1) * sizeof dfa->offs[0], POOL_HASH_SEED);
+	h = XXH64(dfa->transitions, 2*dfa->nedges * sizeof dfa->transitions[0], h);
+	h = XXH64(dfa->endstates, 2*dfa->nends * sizeof dfa->endstates[0], h);
+
+	return h;
+}
+
+static int
+pool_dfa_equals(void *opaque, const void *k1, const void *k2)
+{
+	const struct jvst_op_program *prog = opaque;
+	const struct jvst_vm_dfa *a = &prog->dfas[(uintptr_t)k1 - 1];
+	const struct jvst_vm_dfa *b = &prog->dfas[(uintptr_t)k2 - 1];
+
+	return a->nstates == b->nstates && a->nedges == b->nedges && a->nends == b->nends &&
+		memcmp(a->offs, b->offs, (a->nstates+1) * sizeof a->offs[0]) == 0 &&
+		memcmp(a->transitions, b->transitions, 2*a->nedges * sizeof a->transitions[0]) == 0 &&
+		memcmp(a->endstates, b->endstates, 2*a->nends * sizeof a->endstates[0]) == 0;
+}
+
+// Returns the index of the first pool entry identical to entry ind
+static size_t
+pool_intern(struct hmap *ids, size_t ind)
+{
+	union hmap_value *v;
+	void *key = (void *)(uintptr_t)(ind+1);
+
+	v = hmap_get(ids, key);
+	if (v != NULL) {
+		return v->u;
+	}
+
+	if (!hmap_setuint(ids, key, ind)) {
+		fprintf(stderr, "%s:%d (%s) error adding pool entry %zu\n",
+			__FILE__, __LINE__, __func__, ind);
+		abort();
+	}
+
+	return ind;
+}
+
+static size_t
+dfa_bytes(const struct jvst_vm_dfa *dfa)
+{
+	size_t n;
+
+	n  = (dfa->nstates+1) * sizeof dfa->offs[0];
+	n += 2*dfa->nedges * sizeof dfa->transitions[0];
+	n += 2*dfa->nends * sizeof dfa->endstates[0];
+
+	if (dfa->table != NULL) {
+		n += dfa->nstates * sizeof dfa->ends[0] + (UCHAR_MAX+1);
+		n += (dfa->nstates+1) * dfa->nclasses * dfa->width;
+	}
+
+	return n;
+}
+
+void
+jvst_op_pool_sizes(const struct jvst_op_program *prog, struct jvst_op_pool_sizes *sizes)
+{
+	size_t i;
+
+	sizes->nfloat = prog->nfloat;
+	sizes->nconst = prog->nconst;
+	sizes->ndfa = prog->ndfa;
+
+	sizes->dfa_bytes = 0;
+	for (i=0; i < prog->ndfa; i++) {
+		sizes->dfa_bytes += dfa_bytes(&prog->dfas[i]);
+	}
+}
+
 static int64_t
 proc_add_float(struct op_assembler *opasm, double v)
 {
 	struct jvst_op_program *prog;
-	size_t ind;
+	size_t ind, found;
 
 	prog = opasm->prog;
 	assert(prog != NULL);
@@ -907,15 +1116,21 @@ proc_add_float(struct op_assembler *opasm, double v)
 	}
 
 	prog->fdata[ind] = v;
+	prog->uninterned.nfloat++;
 
-	return (int64_t)ind;
+	found = pool_intern(opasm->float_ids, ind);
+	if (found != ind) {
+		prog->nfloat--;
+	}
+
+	return (int64_t)found;
 }
 
 static int64_t
 proc_add_uconst(struct op_assembler *opasm, uint64_t v)
 {
 	struct jvst_op_program *prog;
-	size_t ind;
+	size_t ind, found;
 
 	prog = opasm->prog;
 	assert(prog != NULL);
@@ -927,6 +1142,38 @@ proc_add_uconst(struct op_assembler *opasm, uint64_t v)
 	}
 
 	prog->cdata[ind] = (int64_t)v;
+	prog->uninterned.nconst++;
+
+	found = pool_intern(opasm->const_ids, ind);
+	if (found != ind) {
+		prog->nconst--;
+	}
+
+	return (int64_t)found;
+}
+
+/* Reserves n zeroed entries at the end of the constant pool.  They're
+ * filled in later, so they aren't interned.
+ */
+static int64_t
+proc_reserve_uconst(struct op_assembler *opasm, size_t n)
+{
+	struct jvst_op_program *prog;
+	size_t ind;
+
+	prog = opasm->prog;
+	assert(prog != NULL);
+
+	ind = prog->nconst;
+	prog->nconst += n;
+	if (prog->nconst > opasm->maxconst) {
+		opasm->cdata = xenlargevec(opasm->cdata, &opasm->maxconst,
+			prog->nconst - opasm->maxconst, sizeof opasm->cdata[0]);
+		prog->cdata = opasm->cdata;
+	}
+
+	memset(&prog->cdata[ind], 0, n * sizeof prog->cdata[0]);
+	prog->uninterned.nconst += n;
 
 	return (int64_t)ind;
 }
@@ -935,7 +1182,7 @@ static int64_t
 proc_add_dfa(struct op_assembler *opasm, struct fsm *fsm)
 {
 	struct jvst_op_program *prog;
-	size_t ind;
+	size_t ind, found;
 
 	prog = opasm->prog;
 	assert(prog != NULL);
@@ -953,7 +1200,16 @@ proc_add_dfa(struct op_assembler *opasm, struct fsm *fsm)
 		jvst_vm_dfa_debug(&prog->dfas[ind]);
 	}
 
-	return (int64_t)ind;
+	prog->uninterned.ndfa++;
+	prog->uninterned.dfa_bytes += dfa_bytes(&prog->dfas[ind]);
+
+	found = pool_intern(opasm->dfa_ids, ind);
+	if (found != ind) {
+		jvst_vm_dfa_finalize(&prog->dfas[ind]);
+		prog->ndfa--;
+	}
+
+	return (int64_t)found;
 }
 
 static void
@@ -1006,6 +1262,9 @@ emit_cond(struct op_assembler *opasm, enum jvst_vm_op op,
 	case JVST_OP_CALL:
 	case JVST_OP_SPLIT:
 	case JVST_OP_SPLITV:
+	case JVST_OP_SPLITANY:
+	case JVST_OP_SPLITALL:
+	case JVST_OP_SPLITONE:
 	case JVST_OP_TOKEN:
 	case JVST_OP_CONSUME:
 	case JVST_OP_MATCH:
@@ -1017,6 +1276,10 @@ emit_cond(struct op_assembler *opasm, enum jvst_vm_op op,
 	case JVST_OP_RETURN:
 	case JVST_OP_MOVE:
 	case JVST_OP_UNIQUE:
+	case JVST_OP_SWITCH:
+	case JVST_OP_LMATCH:
+	case JVST_OP_ENUM:
+	case JVST_OP_DISPATCH:
 		fprintf(stderr, "op %s is not a conditional\n", jvst_op_name(op));
 		abort();
 	}
@@ -1044,6 +1307,13 @@ op_assemble_seq(struct op_assembler *opasm, struct jvst_ir_stmt *stmt_list)
 	struct jvst_ir_stmt *stmt;
 
 	for (stmt = stmt_list; stmt != NULL; stmt = stmt->next) {
+		if (opasm->switch_end != NULL) {
+			if (stmt != opasm->switch_end) {
+				continue;
+			}
+			opasm->switch_end = NULL;
+		}
+
 		op_assemble(opasm, stmt);
 	}
 }
@@ -1089,6 +1359,8 @@ op_assemble_frame(struct op_assembler *opasm, struct jvst_ir_stmt *top)
 
 	frame_opasm.currproc = proc;
 	frame_opasm.ipp = &proc->ilist;
+	frame_opasm.stmts = top->u.frame.stmts;
+	frame_opasm.switch_end = NULL;
 
 	// XXX - allocate storage for floats, dfas, splits
 	op_assemble_seq(&frame_opasm, top->u.frame.stmts);
@@ -1120,6 +1392,9 @@ op_arg_type(enum jvst_op_arg_type type)
 {
 	switch (type) {
 	case JVST_VM_ARG_NONE:
+	case JVST_VM_ARG_LITS:
+	case JVST_VM_ARG_VSET:
+	case JVST_VM_ARG_DISC:
 		return ARG_NONE;
 
 	case JVST_VM_ARG_TT:
@@ -1136,6 +1411,7 @@ op_arg_type(enum jvst_op_arg_type type)
 
 	case JVST_VM_ARG_INSTR:
 	case JVST_VM_ARG_LABEL:
+	case JVST_VM_ARG_JTAB:
 		return ARG_DEST;
 	case JVST_VM_ARG_CALL:
 		return ARG_PROC;
@@ -1170,6 +1446,7 @@ ir_expr_type(enum jvst_ir_expr_type type)
 	case JVST_IR_EXPR_INT:
 	case JVST_IR_EXPR_BCOUNT:
 	case JVST_IR_EXPR_MATCH:
+	case JVST_IR_EXPR_ENUM:
 		return ARG_INT;
 
 	case JVST_IR_EXPR_BOOL:
@@ -1205,6 +1482,9 @@ ir_expr_type(enum jvst_ir_expr_type type)
 static struct jvst_op_arg
 emit_match(struct op_assembler *opasm, struct jvst_ir_expr *expr);
 
+static struct jvst_op_arg
+emit_enum(struct op_assembler *opasm, struct jvst_ir_expr *expr);
+
 static struct jvst_op_arg
 emit_float_arg(struct op_assembler *opasm, double x)
 {
@@ -1287,7 +1567,7 @@ emit_op_arg(struct op_assembler *opasm, struct jvst_ir_expr *arg)
 			int64_t split_ind;
 
 			ireg = arg_new_slot(opasm);
-			instr = op_instr_new(JVST_OP_SPLIT);
+			instr = op_instr_new(split_op(arg->u.split.mode));
 
 			splitlist = arg->u.split.split_list;
 			assert(splitlist != NULL);
@@ -1298,6 +1578,21 @@ emit_op_arg(struct op_assembler *opasm, struct jvst_ir_expr *arg)
 			instr->args[0] = arg_const(split_ind);
 			instr->args[1] = ireg;
 
+			// a split over a tagged union only needs to run the
+			// branch its discriminator selects
+			if (arg->u.split.disc != NULL && opasm->prog->nconst <= JVST_VM_MAXLIT) {
+				struct jvst_op_disc *disc;
+
+				disc = jvst_op_build_disc(arg->u.split.disc, split_ind, instr->op);
+				if (disc != NULL) {
+					disc->cind = proc_reserve_uconst(opasm, 1);
+
+					instr->op = JVST_OP_DISPATCH;
+					instr->args[0].type = JVST_VM_ARG_DISC;
+					instr->args[0].u.disc = disc;
+				}
+			}
+
 			emit_instr(opasm, instr);
 
 			return ireg;
@@ -1313,6 +1608,9 @@ emit_op_arg(struct op_assembler *opasm, struct jvst_ir_expr *arg)
 	case JVST_IR_EXPR_MATCH:
 		return emit_match(opasm, arg);
 
+	case JVST_IR_EXPR_ENUM:
+		return emit_enum(opasm, arg);
+
 	case JVST_IR_EXPR_INT:
 	case JVST_IR_EXPR_BOOL:
 	case JVST_IR_EXPR_BCOUNT:
@@ -1391,6 +1689,7 @@ cmp_br_type(enum jvst_ir_expr_type type)
 	case JVST_IR_EXPR_FTEMP:
 	case JVST_IR_EXPR_SEQ:
 	case JVST_IR_EXPR_MATCH:
+	case JVST_IR_EXPR_ENUM:
 		fprintf(stderr, "%s:%d (%s) IR expression %s is not a comparison\n",
 			__FILE__, __LINE__, __func__, jvst_ir_expr_type_name(type));
 		abort();
@@ -1456,6 +1755,7 @@ cmp_type(enum jvst_ir_expr_type type, enum jvst_vm_op *iopp, enum jvst_vm_op *fo
 	case JVST_IR_EXPR_FTEMP:
 	case JVST_IR_EXPR_SEQ:
 	case JVST_IR_EXPR_MATCH:
+	case JVST_IR_EXPR_ENUM:
 		fprintf(stderr, "%s:%d (%s) IR expression %s is not a comparison\n",
 			__FILE__, __LINE__, __func__, jvst_ir_expr_type_name(type));
 		abort();
@@ -1696,6 +1996,7 @@ op_assemble_cond(struct op_assembler *opasm, struct jvst_ir_expr *cond)
 	case JVST_IR_EXPR_FTEMP:
 	case JVST_IR_EXPR_SEQ:
 	case JVST_IR_EXPR_MATCH:
+	case JVST_IR_EXPR_ENUM:
 		fprintf(stderr, "%s:%d (%s) expression %s is not a boolean condition\n",
 				__FILE__, __LINE__, __func__,
 				jvst_ir_expr_type_name(cond->type));
@@ -1731,6 +2032,38 @@ emit_match(struct op_assembler *opasm, struct jvst_ir_expr *expr)
 	return arg_special(JVST_VM_ARG_M);
 }
 
+static struct jvst_op_arg
+emit_enum(struct op_assembler *opasm, struct jvst_ir_expr *expr)
+{
+	struct jvst_op_instr *instr;
+	struct jvst_op_vset *vset;
+
+	assert(expr->type == JVST_IR_EXPR_ENUM);
+
+	// the ENUM's literal is the index of a constant that holds the
+	// table's offset, since the table goes at the end of the pool
+	if (opasm->prog->nconst > JVST_VM_MAXLIT) {
+		fprintf(stderr, "%s:%d (%s) too many constants (%zu > max %zu) for an ENUM\n",
+			__FILE__, __LINE__, __func__,
+			opasm->prog->nconst, (size_t)JVST_VM_MAXLIT);
+		abort();
+	}
+
+	vset = xmalloc(sizeof *vset);
+	vset->cind = proc_reserve_uconst(opasm, 1);
+	vset->words = jvst_vm_vset_build(expr->u.enum_.values, expr->u.enum_.type,
+		&vset->nmembers, &vset->nwords);
+
+	instr = op_instr_new(JVST_OP_ENUM);
+	instr->args[0].type = JVST_VM_ARG_VSET;
+	instr->args[0].u.vset = vset;
+	instr->args[1] = arg_none();
+
+	emit_instr(opasm, instr);
+
+	return arg_special(JVST_VM_ARG_M);
+}
+
 static enum jvst_vm_br_cond
 cmp_negate(enum jvst_vm_br_cond brc)
 {
@@ -1749,6 +2082,189 @@ cmp_negate(enum jvst_vm_br_cond brc)
 	}
 }
 
+/* Chains of CBRANCHes that test the same integer against different
+ * small constants, where each compare falls through to the next, are
+ * assembled as a single SWITCH:
+ *
+ * 	if (x == 0) goto A; else if (x == 3) goto B; ... else goto D;
+ *
+ * The IR builds these chains to dispatch on the token type (%TT) and
+ * on the case a MATCH found (%M, copied into a temporary).  Short
+ * chains are left as compares, and so are sparse ones, whose tables
+ * would be mostly defaults.
+ *
+ * The tests the SWITCH replaces aren't assembled.  A chain only
+ * continues through blocks that nothing else branches to, so none of
+ * them are needed.
+ */
+enum {
+	SWITCH_MIN_CASES = 4,
+	SWITCH_MAX_TABLE = 64,
+};
+
+// Returns 1 if a branch other than from targets blk.
+static int
+switch_block_used(struct jvst_ir_stmt *stmts, struct jvst_ir_stmt *blk,
+	struct jvst_ir_stmt *from)
+{
+	struct jvst_ir_stmt *stmt;
+
+	for (stmt = stmts; stmt != NULL; stmt = stmt->next) {
+		if (stmt == from) {
+			continue;
+		}
+
+		switch (stmt->type) {
+		case JVST_IR_STMT_BRANCH:
+			if (stmt->u.branch == blk) {
+				return 1;
+			}
+			break;
+
+		case JVST_IR_STMT_CBRANCH:
+			if (stmt->u.cbranch.br_true == blk || stmt->u.cbranch.br_false == blk) {
+				return 1;
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// If cond tests an integer for a constant, sets the integer and the
+// constant and returns 1.
+static int
+switch_case(struct op_assembler *opasm, struct jvst_ir_expr *cond,
+	struct jvst_op_arg *keyp, int64_t *valp)
+{
+	struct jvst_ir_expr *key, *val;
+
+	switch (cond->type) {
+	case JVST_IR_EXPR_ISTOK:
+		*keyp = arg_special(JVST_VM_ARG_TT);
+		*valp = cond->u.istok.tok_type;
+		return 1;
+
+	case JVST_IR_EXPR_EQ:
+		key = cond->u.cmp.left;
+		val = cond->u.cmp.right;
+		if (key->type == JVST_IR_EXPR_SIZE) {
+			key = cond->u.cmp.right;
+			val = cond->u.cmp.left;
+		}
+
+		if (val->type != JVST_IR_EXPR_SIZE || val->u.vsize >= SWITCH_MAX_TABLE) {
+			return 0;
+		}
+
+		// emits no code for either
+		if (key->type != JVST_IR_EXPR_ITEMP && key->type != JVST_IR_EXPR_SLOT) {
+			return 0;
+		}
+
+		*keyp = emit_op_arg(opasm, key);
+		*valp = (int64_t)val->u.vsize;
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static int
+op_assemble_switch(struct op_assembler *opasm, struct jvst_ir_stmt *stmt)
+{
+	struct jvst_ir_stmt *cases[SWITCH_MAX_TABLE] = { NULL };
+	struct jvst_ir_stmt *br, *next, *dflt;
+	struct jvst_op_arg key, k;
+	struct jvst_op_instr *instr;
+	struct jvst_op_jtab *jtab;
+	size_t i, nsteps, ncase, nuniq;
+	int64_t v, cind;
+
+	if (!switch_case(opasm, stmt->u.cbranch.cond, &key, &v)) {
+		return 0;
+	}
+
+	ncase = nuniq = 0;
+	dflt = NULL;
+	for (br = stmt, nsteps = 0; nsteps < SWITCH_MAX_TABLE; nsteps++) {
+		if (!switch_case(opasm, br->u.cbranch.cond, &k, &v)) {
+			break;
+		}
+
+		if (k.type != key.type || k.u.index != key.u.index) {
+			break;
+		}
+
+		if (v < 0 || v >= SWITCH_MAX_TABLE) {
+			break;
+		}
+
+		// an earlier test of the same value shadows this one
+		if (cases[v] == NULL) {
+			cases[v] = br->u.cbranch.br_true;
+			nuniq++;
+			if ((size_t)v >= ncase) {
+				ncase = v+1;
+			}
+		}
+
+		dflt = br->u.cbranch.br_false;
+		assert(dflt->type == JVST_IR_STMT_BLOCK);
+
+		// the chain continues if the block is only another test
+		// and nothing else branches to it
+		next = dflt->next;
+		if (next == NULL || next->type != JVST_IR_STMT_CBRANCH) {
+			break;
+		}
+
+		if (switch_block_used(opasm->stmts, dflt, br)) {
+			break;
+		}
+
+		br = next;
+	}
+
+	if (nuniq < SWITCH_MIN_CASES || ncase > 4*nuniq) {
+		return 0;
+	}
+
+	// the table index is a literal in the SWITCH
+	if (opasm->prog->nconst > JVST_VM_MAXLIT) {
+		return 0;
+	}
+
+	cind = proc_reserve_uconst(opasm, ncase+2);
+	opasm->prog->cdata[cind] = ncase;
+
+	jtab = xmalloc(sizeof *jtab);
+	jtab->cind = cind;
+	jtab->ncase = ncase;
+	jtab->dests = xcalloc(ncase+1, sizeof jtab->dests[0]);
+
+	instr = op_instr_new(JVST_OP_SWITCH);
+	instr->args[0] = key;
+	instr->args[1].type = JVST_VM_ARG_JTAB;
+	instr->args[1].u.jtab = jtab;
+
+	asm_addr_fixup_add_dest(opasm->fixups, instr, &jtab->dests[0], dflt);
+	for (i=0; i < ncase; i++) {
+		asm_addr_fixup_add_dest(opasm->fixups, instr, &jtab->dests[i+1],
+			(cases[i] != NULL) ? cases[i] : dflt);
+	}
+
+	emit_instr(opasm, instr);
+
+	opasm->switch_end = dflt;
+	return 1;
+}
+
 static void
 op_assemble_cbranch(struct op_assembler *opasm, struct jvst_ir_stmt *stmt)
 {
@@ -1756,6 +2272,10 @@ op_assemble_cbranch(struct op_assembler *opasm, struct jvst_ir_stmt *stmt)
 	enum jvst_vm_br_cond brc;
 	struct jvst_ir_stmt *dest;
 
+	if (op_assemble_switch(opasm, stmt)) {
+		return;
+	}
+
 	/* emit condition */
 	brc = op_assemble_cond(opasm, stmt->u.cbranch.cond);
 
@@ -2024,6 +2544,15 @@ jvst_op_assemble(struct jvst_ir_stmt *ir)
 	opasm.procpp = &opasm.prog->procs;
 	opasm.fixups = &fixups;
 
+	opasm.float_ids = hmap_create(64, 0.6f, opasm.prog, pool_float_hash, pool_float_equals);
+	opasm.const_ids = hmap_create(64, 0.6f, opasm.prog, pool_const_hash, pool_const_equals);
+	opasm.dfa_ids   = hmap_create(16, 0.6f, opasm.prog, pool_dfa_hash, pool_dfa_equals);
+	if (opasm.float_ids == NULL || opasm.const_ids == NULL || opasm.dfa_ids == NULL) {
+		fprintf(stderr, "%s:%d (%s) error allocating pool maps\n",
+			__FILE__, __LINE__, __func__);
+		abort();
+	}
+
 	for (i=0, fr=ir->u.program.frames; fr != NULL; i++, fr = fr->next) {
 		struct jvst_op_proc *proc;
 
@@ -2034,6 +2563,10 @@ jvst_op_assemble(struct jvst_ir_stmt *ir)
 	asm_fixup_addresses(&fixups);
 	asm_addr_fixup_list_free(&fixups);
 
+	hmap_free(opasm.float_ids);
+	hmap_free(opasm.const_ids);
+	hmap_free(opasm.dfa_ids);
+
 	return opasm.prog;
 }
 
@@ -2109,7 +2642,7 @@ collect_and_number_states(const struct fsm *fsm, const struct fsm_state *st, voi
 		endoff = b->end_off++;
 
 		b->dfa->endstates[2*endoff+0] = off;
-		b->dfa->endstates[2*endoff+1] = mc->which;
+		b->dfa->endstates[2*endoff+1] = (mc != NULL) ? mc->which : 0;
 	}
 
 	b->lookup[off].st  = st;
@@ -2183,6 +2716,337 @@ jvst_op_build_vm_dfa(struct fsm *fsm, struct jvst_vm_dfa *dfa)
 	}
 
 	free(tbl);
+
+	jvst_vm_dfa_compile(dfa);
+}
+
+size_t
+jvst_op_dfa_states(struct fsm *fsm, size_t limit)
+{
+	struct jvst_vm_dfa dfa;
+	size_t n;
+
+	jvst_op_build_vm_dfa(fsm, &dfa);
+	n = dfa.nfa ? jvst_vm_lazy_count(&dfa, limit) : dfa.nstates;
+	jvst_vm_dfa_finalize(&dfa);
+
+	return n;
+}
+
+enum {
+	LITS_MAXKEYS  = 1024,	// most strings in an LMATCH table
+	LITS_MAXLEN   = 256,	// longest string in an LMATCH table
+	LITS_MAXSEED  = 64,	// seeds tried for each table size
+	LITS_MAXLOAD  = 8,	// largest ratio of buckets to strings
+};
+
+struct lits_key {
+	size_t off;
+	size_t len;
+	int which;
+};
+
+struct lits_builder {
+	const struct jvst_vm_dfa *dfa;
+	unsigned char *live;	// state can reach an end state
+	unsigned char *onpath;	// state is on the current path
+
+	char path[LITS_MAXLEN];
+
+	size_t nkeys;
+	struct lits_key keys[LITS_MAXKEYS];
+
+	size_t ntext, maxtext;
+	char *text;
+};
+
+/* Marks the states that can reach an end state.  Strings that only
+ * reach the others aren't accepted, so those states are ignored.
+ */
+static void
+lits_mark_live(struct lits_builder *b)
+{
+	const struct jvst_vm_dfa *dfa = b->dfa;
+	size_t st;
+	int changed;
+
+	for (st=0; st < dfa->nstates; st++) {
+		b->live[st] = jvst_vm_dfa_endstate(dfa, st, NULL);
+	}
+
+	do {
+		changed = 0;
+		for (st=0; st < dfa->nstates; st++) {
+			int e;
+
+			if (b->live[st]) {
+				continue;
+			}
+
+			for (e = dfa->offs[st]; e < dfa->offs[st+1]; e++) {
+				int st1 = dfa->transitions[2*e+1];
+
+				if (st1 >= 0 && (size_t)st1 < dfa->nstates && b->live[st1]) {
+					b->live[st] = 1;
+					changed = 1;
+					break;
+				}
+			}
+		}
+	} while (changed);
+}
+
+/* Collects the strings accepted from state st, where path[0:len] is the
+ * string that reached st.  Returns 0 if a live state is on a cycle or
+ * there are too many strings.
+ */
+static int
+lits_collect(struct lits_builder *b, size_t st, size_t len)
+{
+	const struct jvst_vm_dfa *dfa = b->dfa;
+	int e, which;
+
+	if (jvst_vm_dfa_endstate(dfa, st, &which)) {
+		struct lits_key *k;
+
+		if (b->nkeys >= LITS_MAXKEYS) {
+			return 0;
+		}
+
+		if (b->ntext + len > b->maxtext) {
+			b->text = xenlargevec(b->text, &b->maxtext, len, 1);
+		}
+
+		k = &b->keys[b->nkeys++];
+		k->off = b->ntext;
+		k->len = len;
+		k->which = which;
+
+		memcpy(&b->text[b->ntext], b->path, len);
+		b->ntext += len;
+	}
+
+	b->onpath[st] = 1;
+	for (e = dfa->offs[st]; e < dfa->offs[st+1]; e++) {
+		int lbl = dfa->transitions[2*e+0];
+		int st1 = dfa->transitions[2*e+1];
+
+		if (st1 < 0 || (size_t)st1 >= dfa->nstates || !b->live[st1]) {
+			continue;
+		}
+
+		if (b->onpath[st1] || len >= LITS_MAXLEN) {
+			return 0;
+		}
+
+		b->path[len] = (char)lbl;
+		if (!lits_collect(b, st1, len+1)) {
+			return 0;
+		}
+	}
+	b->onpath[st] = 0;
+
+	return 1;
+}
+
+/* Packs s[0:n] into words, 8 bytes a word, low byte first.  Returns
+ * the number of words.
+ */
+static size_t
+lits_pack(int64_t *words, const char *s, size_t n)
+{
+	size_t i, j;
+
+	for (i=0, j=0; j < n; i++, j += 8) {
+		uint64_t w = 0;
+		size_t m;
+
+		for (m=0; m < 8 && j+m < n; m++) {
+			w |= (uint64_t)(unsigned char)s[j+m] << (8*m);
+		}
+
+		words[i] = (int64_t)w;
+	}
+
+	return i;
+}
+
+/* Places the keys in a table of nb buckets with the given seed.
+ * Returns 0 if two keys hash to the same bucket.
+ */
+static int
+lits_place(struct lits_builder *b, int64_t *words, size_t nb, uint64_t seed)
+{
+	size_t i, off;
+
+	words[0] = nb;
+	words[1] = seed;
+	memset(&words[2], 0, 2*nb * sizeof words[0]);
+
+	off = 2 + 2*nb;
+	for (i=0; i < b->nkeys; i++) {
+		const struct lits_key *k = &b->keys[i];
+		const char *s = &b->text[k->off];
+		uint64_t bkt;
+
+		bkt = jvst_vm_lits_hash(seed, s, k->len) & (nb-1);
+		if (words[3+2*bkt] != 0) {
+			return 0;
+		}
+
+		words[2+2*bkt] = (int64_t)(off | ((uint64_t)k->len << 32));
+		words[3+2*bkt] = k->which;
+
+		off += lits_pack(&words[off], s, k->len);
+	}
+
+	return 1;
+}
+
+/* Builds the smallest table of the keys that a seed places without
+ * collisions.  Returns NULL if there isn't one with at most
+ * LITS_MAXLOAD buckets a key.
+ */
+static int64_t *
+lits_table(struct lits_builder *b, size_t *nwordsp)
+{
+	size_t i, nb, nkw;
+	uint64_t seed;
+	int64_t *words = NULL;
+
+	// a case of zero marks an empty bucket
+	nkw = 0;
+	for (i=0; i < b->nkeys; i++) {
+		if (b->keys[i].which <= 0) {
+			return NULL;
+		}
+
+		nkw += (b->keys[i].len + 7) / 8;
+	}
+
+	// start with at most half of the buckets full
+	nb = 2;
+	while (nb < 2*b->nkeys) {
+		nb *= 2;
+	}
+
+	for (; nb <= LITS_MAXLOAD * b->nkeys; nb *= 2) {
+		words = xrealloc(words, (2 + 2*nb + nkw) * sizeof words[0]);
+		for (seed = 1; seed <= LITS_MAXSEED; seed++) {
+			if (lits_place(b, words, nb, seed)) {
+				*nwordsp = 2 + 2*nb + nkw;
+				return words;
+			}
+		}
+	}
+
+	free(words);
+	return NULL;
+}
+
+struct jvst_op_lits *
+jvst_op_build_lits(const struct jvst_vm_dfa *dfa)
+{
+	struct lits_builder *b;
+	struct jvst_op_lits *lits = NULL;
+	size_t nwords;
+	int64_t *words;
+
+	if (dfa->nstates == 0 || dfa->nfa) {
+		return NULL;
+	}
+
+	b = xcalloc(1, sizeof *b);
+	b->dfa = dfa;
+	b->live = xcalloc(2, dfa->nstates);
+	b->onpath = b->live + dfa->nstates;
+	b->maxtext = LITS_MAXLEN;
+	b->text = xmalloc(b->maxtext);
+
+	lits_mark_live(b);
+	if (!b->live[JVST_VM_DFA_START] || !lits_collect(b, JVST_VM_DFA_START, 0)) {
+		goto done;
+	}
+
+	words = lits_table(b, &nwords);
+	if (words != NULL) {
+		lits = xmalloc(sizeof *lits);
+		lits->cind = 0;
+		lits->nkeys = b->nkeys;
+		lits->nwords = nwords;
+		lits->words = words;
+	}
+
+done:
+	free(b->text);
+	free(b->live);
+	free(b);
+
+	return lits;
+}
+
+struct jvst_op_disc *
+jvst_op_build_disc(const struct jvst_ir_disc *ir, size_t split, enum jvst_vm_op op)
+{
+	struct lits_builder *b;
+	struct jvst_op_disc *disc = NULL;
+	size_t i, kw, ntw;
+	int64_t *tags;
+
+	if (ir->key.len > LITS_MAXLEN || ir->ntags == 0 || ir->ntags > LITS_MAXKEYS) {
+		return NULL;
+	}
+
+	// the tags are keyed by the frame they select, plus one
+	b = xcalloc(1, sizeof *b);
+	for (i=0; i < ir->ntags; i++) {
+		const struct jvst_ir_tag *tag = &ir->tags[i];
+		struct lits_key *k;
+
+		if (tag->tag.len > LITS_MAXLEN) {
+			goto done;
+		}
+
+		if (b->ntext + tag->tag.len > b->maxtext) {
+			b->text = xenlargevec(b->text, &b->maxtext, tag->tag.len, 1);
+		}
+
+		k = &b->keys[b->nkeys++];
+		k->off = b->ntext;
+		k->len = tag->tag.len;
+		k->which = (int)tag->frame + 1;
+
+		memcpy(&b->text[b->ntext], tag->tag.s, tag->tag.len);
+		b->ntext += tag->tag.len;
+	}
+
+	tags = lits_table(b, &ntw);
+	if (tags == NULL) {
+		goto done;
+	}
+
+	kw = (ir->key.len + 7) / 8;
+
+	disc = xmalloc(sizeof *disc);
+	disc->cind = 0;
+	disc->split = split;
+	disc->ntags = ir->ntags;
+	disc->nwords = 3 + kw + ntw;
+	disc->words = xmalloc(disc->nwords * sizeof disc->words[0]);
+
+	disc->words[0] = (int64_t)split;
+	disc->words[1] = op;
+	disc->words[2] = (int64_t)ir->key.len;
+	lits_pack(&disc->words[3], ir->key.s, ir->key.len);
+	memcpy(&disc->words[3+kw], tags, ntw * sizeof tags[0]);
+
+	free(tags);
+
+done:
+	free(b->text);
+	free(b);
+
+	return disc;
 }
 
 void
@@ -2216,6 +3080,20 @@ jvst_vm_dfa_debug(struct jvst_vm_dfa *dfa)
 	for (i=0; i < n; i++) {
 		fprintf(stderr, "%5d %5d\n", dfa->endstates[2*i+0], dfa->endstates[2*i+1]);
 	}
+
+	if (dfa->classes != NULL) {
+		fprintf(stderr, "\n%zu byte classes, %zu byte table entries\n",
+			dfa->nclasses, dfa->width);
+		for (i=0; i <= UCHAR_MAX; i++) {
+			fprintf(stderr, "%s%3d", (i % 16 == 0) ? "\n" : " ", dfa->classes[i]);
+		}
+		fprintf(stderr, "\n");
+
+		fprintf(stderr, "\nprefilter: prefix \"%.*s\", suffix \"%.*s\", factor \"%.*s\"\n",
+			(int)dfa->pre.nprefix, dfa->pre.prefix,
+			(int)dfa->pre.nsuffix, dfa->pre.suffix,
+			(int)dfa->pre.nfactor, dfa->pre.factor);
+	}
 }
 
 struct op_encoder {
@@ -2269,12 +3147,22 @@ encode_arg(struct jvst_op_arg arg)
 	case JVST_VM_ARG_CONST:
 		return VMLIT(arg.u.index);
 
+	case JVST_VM_ARG_JTAB:
+		return VMLIT(arg.u.jtab->cind);
+
+	case JVST_VM_ARG_VSET:
+		return VMLIT(arg.u.vset->cind);
+
+	case JVST_VM_ARG_DISC:
+		return VMLIT(arg.u.disc->cind);
+
 	case JVST_VM_ARG_NONE:
 		return 0;
 
 	case JVST_VM_ARG_INSTR:
 	case JVST_VM_ARG_LABEL:
 	case JVST_VM_ARG_CALL:
+	case JVST_VM_ARG_LITS:
 		fprintf(stderr, "%s:%d (%s) unexpected opcode argument type %d\n",
 				__FILE__, __LINE__, __func__, arg.type);
 		abort();
@@ -2286,8 +3174,67 @@ encode_arg(struct jvst_op_arg arg)
 	}
 }
 
+/* Adds an ENUM value set to the end of the constant pool, and stores
+ * its offset in the constant the ENUM refers to.  Unlike a literal
+ * table, the offset itself needn't fit in a literal argument.
+ */
+static void
+encode_vset(struct jvst_vm_program *vmprog, struct jvst_op_vset *vset)
+{
+	size_t off, n;
+
+	assert(vset->cind < vmprog->nconst);
+
+	off = vmprog->nconst;
+	n = off + vset->nwords;
+	vmprog->cdata = xrealloc(vmprog->cdata, n * sizeof vmprog->cdata[0]);
+	memcpy(&vmprog->cdata[off], vset->words, vset->nwords * sizeof vset->words[0]);
+	vmprog->cdata[vset->cind] = (int64_t)off;
+	vmprog->nconst = n;
+}
+
+/* Adds a DISPATCH table to the end of the constant pool, like a value
+ * set
+ */
+static void
+encode_disc(struct jvst_vm_program *vmprog, struct jvst_op_disc *disc)
+{
+	size_t off, n;
+
+	assert(disc->cind < vmprog->nconst);
+
+	off = vmprog->nconst;
+	n = off + disc->nwords;
+	vmprog->cdata = xrealloc(vmprog->cdata, n * sizeof vmprog->cdata[0]);
+	memcpy(&vmprog->cdata[off], disc->words, disc->nwords * sizeof disc->words[0]);
+	vmprog->cdata[disc->cind] = (int64_t)off;
+	vmprog->nconst = n;
+}
+
+/* Adds an LMATCH literal table to the end of the constant pool.  Returns
+ * 0 if the table would start past the largest literal argument.
+ */
+static int
+encode_lits(struct jvst_vm_program *vmprog, struct jvst_op_lits *lits)
+{
+	size_t n;
+
+	if (vmprog->nconst > JVST_VM_MAXLIT) {
+		return 0;
+	}
+
+	lits->cind = vmprog->nconst;
+
+	n = vmprog->nconst + lits->nwords;
+	vmprog->cdata = xrealloc(vmprog->cdata, n * sizeof vmprog->cdata[0]);
+	memcpy(&vmprog->cdata[lits->cind], lits->words, lits->nwords * sizeof lits->words[0]);
+	vmprog->nconst = n;
+
+	return 1;
+}
+
 static void
-encode_pass1(struct op_encoder *enc, struct jvst_op_instr *first)
+encode_pass1(struct op_encoder *enc, struct jvst_vm_program *vmprog, struct jvst_op_instr *first)
 {
 	struct jvst_op_instr *instr;
 
@@ -2317,6 +3264,36 @@ encode_pass1(struct op_encoder *enc, struct jvst_op_instr *first)
 			}
 			break;
 
+		case JVST_OP_LMATCH:
+			assert(instr->args[1].type == JVST_VM_ARG_LITS);
+
+			// tables go after the other constants, so the SWITCH
+			// tables and ILOAD constants keep their indexes
+			a = encode_arg(instr->args[0]);
+			if (encode_lits(vmprog, instr->args[1].u.lits)) {
+				cp = encoder_emit(enc, VMOP(instr->op, a, VMLIT(instr->args[1].u.lits->cind)));
+			} else {
+				cp = encoder_emit(enc, VMOP(JVST_OP_MATCH, a, 0));
+			}
+			instr->code_off = cp;
+			break;
+
+		case JVST_OP_ENUM:
+			assert(instr->args[0].type == JVST_VM_ARG_VSET);
+
+			encode_vset(vmprog, instr->args[0].u.vset);
+			cp = encoder_emit(enc, VMOP(instr->op, encode_arg(instr->args[0]), 0));
+			instr->code_off = cp;
+			break;
+
+		case JVST_OP_DISPATCH:
+			assert(instr->args[0].type == JVST_VM_ARG_DISC);
+
+			encode_disc(vmprog, instr->args[0].u.disc);
+			cp = encoder_emit(enc, VMOP(instr->op, encode_arg(instr->args[0]), encode_arg(instr->args[1])));
+			instr->code_off = cp;
+			break;
+
 		case JVST_OP_TOKEN:
 		case JVST_OP_CONSUME:
 
@@ -2327,6 +3304,9 @@ encode_pass1(struct op_encoder *enc, struct jvst_op_instr *first)
 		case JVST_OP_FINT:
 		case JVST_OP_SPLIT:
 		case JVST_OP_SPLITV:
+		case JVST_OP_SPLITANY:
+		case JVST_OP_SPLITALL:
+		case JVST_OP_SPLITONE:
 		case JVST_OP_MATCH:
 		case JVST_OP_FLOAD:
 		case JVST_OP_ILOAD:
@@ -2336,6 +3316,7 @@ encode_pass1(struct op_encoder *enc, struct jvst_op_instr *first)
 		case JVST_OP_BAND:
 		case JVST_OP_RETURN:
 		case JVST_OP_UNIQUE:
+		case JVST_OP_SWITCH:
 			a = encode_arg(instr->args[0]);
 			b = encode_arg(instr->args[1]);
 
@@ -2352,11 +3333,10 @@ encode_pass1(struct op_encoder *enc, struct jvst_op_instr *first)
 }
 
 static void
-encode_pass2(struct op_encoder *enc, struct jvst_op_instr *first)
+encode_pass2(struct op_encoder *enc, struct jvst_vm_program *vmprog, struct jvst_op_instr *first)
 {
 	struct jvst_op_instr *instr;
 
-	(void)enc;
 	for (instr = first; instr != NULL; instr = instr->next) {
 		uint32_t cp;
 		uint32_t br;
@@ -2407,6 +3387,23 @@ encode_pass2(struct op_encoder *enc, struct jvst_op_instr *first)
 			enc->code[cp] = VMBR(instr->op, brc, (long)delta);
 			break;
 
+		case JVST_OP_SWITCH:
+			{
+				struct jvst_op_jtab *jtab;
+				size_t i;
+
+				assert(instr->args[1].type == JVST_VM_ARG_JTAB);
+				jtab = instr->args[1].u.jtab;
+
+				assert(jtab->cind + 2 + jtab->ncase <= vmprog->nconst);
+				for (i=0; i <= jtab->ncase; i++) {
+					assert(jtab->dests[i].type == JVST_VM_ARG_INSTR);
+					assert(jtab->dests[i].u.dest != NULL);
+
+					vmprog->cdata[jtab->cind+1+i] = jtab->dests[i].u.dest->code_off;
+				}
+			}
+			break;
 
 		default:
 			/* nop */
@@ -2468,13 +3465,13 @@ jvst_op_encode(struct jvst_op_program *prog)
 			VMOP(JVST_OP_PROC, VMLIT(proc->nslots), VMLIT(0)));
 
 		assert(proc->ilist != NULL);
-		encode_pass1(&enc, proc->ilist);
+		encode_pass1(&enc, vmprog, proc->ilist);
 	}
 
 	// second pass, set branch dests and calls to real location
 	for (proc = prog->procs; proc != NULL; proc = proc->next) {
 		assert(proc->ilist != NULL);
-		encode_pass2(&enc, proc->ilist);
+		encode_pass2(&enc, vmprog, proc->ilist);
 	}
 
 	// encode splits last, after proc indexes have been generated
@@ -2505,6 +3502,10 @@ jvst_op_encode(struct jvst_op_program *prog)
 	vmprog->ncode = enc.len;
 	vmprog->code  = enc.code;
 
+	// programs that fail verification still run, but on the
+	// interpreter that checks each instruction's arguments
+	(void)jvst_vm_program_verify(vmprog, NULL, 0);
+
 	return vmprog;
 }
 
@@ -34,10 +34,26 @@ enum jvst_op_arg_type {
 
 	// Call and split destinations
 	JVST_VM_ARG_CALL,
+
+	// Jump table of a SWITCH
+	JVST_VM_ARG_JTAB,
+
+	// Literal table of an LMATCH
+	JVST_VM_ARG_LITS,
+
+	// Value set of an ENUM
+	JVST_VM_ARG_VSET,
+
+	// Discriminator table of a DISPATCH
+	JVST_VM_ARG_DISC,
 };
 
 struct jvst_op_proc;
 struct jvst_op_instr;
+struct jvst_op_jtab;
+struct jvst_op_lits;
+struct jvst_op_vset;
+struct jvst_op_disc;
 
 struct jvst_op_arg {
 	enum jvst_op_arg_type type;
@@ -46,9 +62,59 @@ struct jvst_op_arg {
 		struct jvst_op_instr *dest;
 		struct jvst_op_proc *proc;
 		const char *label;
+		struct jvst_op_jtab *jtab;
+		struct jvst_op_lits *lits;
+		struct jvst_op_vset *vset;
+		struct jvst_op_disc *disc;
 	} u;
 };
 
+// Jump table for a SWITCH.  The table is reserved in the constant pool
+// at cind (see JVST_OP_SWITCH), and its destinations are filled in
+// when the program is encoded.
+struct jvst_op_jtab {
+	size_t cind;
+	size_t ncase;
+
+	// ncase+1 destinations: the default, then one for each case
+	struct jvst_op_arg *dests;
+};
+
+// Literal table for an LMATCH, in the form the VM looks it up (see
+// jvst_vm_lits_find).  It's added to the end of the constant pool at
+// cind when the program is encoded.
+struct jvst_op_lits {
+	size_t cind;
+	size_t nkeys;
+
+	size_t nwords;
+	int64_t *words;
+};
+
+// Value set for an ENUM, in the form the VM looks it up (see
+// jvst_vm_vset_find).  Like a literal table, it's added to the end of
+// the constant pool when the program is encoded, and its offset is
+// stored in the constant at cind.
+struct jvst_op_vset {
+	size_t cind;
+	size_t nmembers;
+
+	size_t nwords;
+	int64_t *words;
+};
+
+// Discriminator table for a DISPATCH, in the form the VM reads it (see
+// JVST_OP_DISPATCH).  Like a value set, it's added to the end of the
+// constant pool, and its offset is stored in the constant at cind.
+struct jvst_op_disc {
+	size_t cind;
+	size_t split;
+	size_t ntags;
+
+	size_t nwords;
+	int64_t *words;
+};
+
 struct jvst_op_instr {
 	struct jvst_op_instr *next;
 	struct jvst_op_arg args[2];
@@ -76,6 +142,15 @@ struct jvst_op_proc {
 	char label[64];
 };
 
+// Sizes of a program's pools.  DFA bytes count both the sparse and
+// the dense forms of the tables.
+struct jvst_op_pool_sizes {
+	size_t nfloat;
+	size_t nconst;
+	size_t ndfa;
+	size_t dfa_bytes;
+};
+
 struct jvst_op_program {
 	struct jvst_op_proc *procs;
 
@@ -91,6 +166,10 @@ struct jvst_op_program {
 	size_t nsplit;
 	size_t *splitoff;
 	struct jvst_op_proc **splits;
+
+	// pool sizes the assembler would have produced without
+	// interning identical entries
+	struct jvst_op_pool_sizes uninterned;
 };
 
 struct jvst_ir_stmt;
@@ -101,6 +180,12 @@ jvst_op_assemble(struct jvst_ir_stmt *stmt);
 struct jvst_op_program *
 jvst_op_optimize(struct jvst_op_program *prog);
 
+size_t
+jvst_op_count(const struct jvst_op_program *prog);
+
+void
+jvst_op_pool_sizes(const struct jvst_op_program *prog, struct jvst_op_pool_sizes *sizes);
+
 int
 jvst_op_dump(struct jvst_op_program *prog, char *buf, size_t nb);
 
@@ -116,9 +201,37 @@ jvst_op_encode(struct jvst_op_program *prog);
 struct jvst_vm_program *
 jvst_ir_assemble(struct jvst_ir_stmt *prog);
 
+/* Builds the sparse form of a DFA from an fsm, and compiles it.  The
+ * fsm may be an NFA, in which case so is the DFA.  End states take the
+ * case of their jvst_ir_mcase, or zero if they have none.
+ */
 void
 jvst_op_build_vm_dfa(struct fsm *fsm, struct jvst_vm_dfa *dfa);
 
+/* Returns the number of states in the DFA of an fsm, or a number larger
+ * than limit if there are more than limit.  The cost is bounded by
+ * limit, not by the size of the DFA.
+ */
+size_t
+jvst_op_dfa_states(struct fsm *fsm, size_t limit);
+
+/* Builds the literal table for an LMATCH from a DFA that accepts a
+ * finite set of strings.  Returns NULL if the DFA accepts an infinite
+ * set, or too many or too long strings to tabulate, or is an NFA.
+ */
+struct jvst_op_lits *
+jvst_op_build_lits(const struct jvst_vm_dfa *dfa);
+
+struct jvst_ir_disc;
+
+/* Builds the table for a DISPATCH on a split whose frames are selected
+ * by disc.  op is the SPLIT the DISPATCH runs as when it can't find the
+ * discriminator.  Returns NULL if there are too many or too long tags
+ * to tabulate.
+ */
+struct jvst_op_disc *
+jvst_op_build_disc(const struct jvst_ir_disc *disc, size_t split, enum jvst_vm_op op);
+
 void
 jvst_vm_dfa_debug(struct jvst_vm_dfa *dfa);
 
@@ -0,0 +1,1100 @@
+#include "validate_op.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xalloc.h"
+#include "jvst_macros.h"
+
+/* Peephole and flow optimizations over assembled opcodes.
+ *
+ * The assembler translates the IR a statement at a time, so its output
+ * has jumps to jumps, branches around unconditional jumps, temporaries
+ * that are only copied into other temporaries, and a separate RETURN
+ * for every place that raises the same error.  jvst_op_optimize()
+ * cleans these up before the program is encoded:
+ *
+ *  - jumps to jumps are threaded to their final destination, and an
+ *    unconditional jump to a RETURN is replaced by the RETURN
+ *  - jumps to a RETURN are sent to the first identical RETURN in the
+ *    proc, so the copies become unreachable
+ *  - copies and constant loads are propagated forward within a basic
+ *    block, and loads of a value a slot already holds are removed
+ *  - comparisons of constants are folded, and branches on a flag
+ *    that's known are made unconditional or removed
+ *  - a conditional branch over an unconditional jump is inverted
+ *  - jumps to the next instruction, unreachable instructions,
+ *    comparisons whose flag is never tested, and loads into slots
+ *    that are never read are removed
+ *  - a MATCH whose DFA accepts a finite set of strings becomes an
+ *    LMATCH, which looks whole tokens up in a table of the strings
+ *
+ * Removed instructions are first turned into NOPs, so branch
+ * destinations stay valid while a pass runs, then swept out.  The
+ * passes repeat until the proc stops changing.
+ *
+ * The optimizer doesn't know what a proc's caller does with the flag
+ * after a CALL returns, so a valid RETURN counts as a use of the flag,
+ * and CALL and SPLIT don't count as setting it.
+ *
+ * A SWITCH is a branch to each destination in its jump table, and never
+ * falls through.
+ */
+
+enum {
+	OPT_MAX_ROUNDS  = 16,	// bound on optimization rounds per proc
+	OPT_MAX_THREAD  = 16,	// bound on jumps followed when threading
+};
+
+enum opt_val_kind {
+	OPT_VAL_UNKNOWN = 0,
+	OPT_VAL_COPY,		// holds the value of a slot, register or literal
+	OPT_VAL_FLOAT,		// holds a float pool constant
+	OPT_VAL_ICONST,		// holds an integer pool constant
+};
+
+struct opt_val {
+	enum opt_val_kind kind;
+	struct jvst_op_arg arg;
+};
+
+struct op_optimizer {
+	struct jvst_op_program *prog;
+	struct jvst_op_proc *proc;
+
+	// instructions in list order, numbered by code_off
+	size_t ninstr;
+	size_t cap;
+	struct jvst_op_instr **instrs;
+
+	unsigned char *target;	// instruction is a branch destination
+	unsigned char *mark;	// reachable, live flag, ...
+
+	// per-slot values for propagation, per-slot read marks
+	struct opt_val *vals;
+	unsigned char *read;
+
+	int changed;
+};
+
+static int
+opt_is_slot(struct jvst_op_arg arg)
+{
+	return arg.type == JVST_VM_ARG_SLOT || arg.type == JVST_VM_ARG_POOL;
+}
+
+static int
+opt_is_reg(struct jvst_op_arg arg)
+{
+	switch (arg.type) {
+	case JVST_VM_ARG_TT:
+	case JVST_VM_ARG_TNUM:
+	case JVST_VM_ARG_TLEN:
+	case JVST_VM_ARG_M:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static int
+opt_is_lit(struct jvst_op_arg arg)
+{
+	return arg.type == JVST_VM_ARG_CONST || arg.type == JVST_VM_ARG_TOKTYPE;
+}
+
+static int
+opt_args_equal(struct jvst_op_arg a, struct jvst_op_arg b)
+{
+	if (opt_is_slot(a) && opt_is_slot(b)) {
+		return a.u.index == b.u.index;
+	}
+
+	if (opt_is_lit(a) && opt_is_lit(b)) {
+		return a.u.index == b.u.index;
+	}
+
+	return opt_is_reg(a) && a.type == b.type;
+}
+
+static enum jvst_vm_br_cond
+opt_br_cond(const struct jvst_op_instr *instr)
+{
+	assert(instr->op == JVST_OP_JMP);
+	assert(instr->args[0].type == JVST_VM_ARG_CONST);
+
+	return instr->args[0].u.index;
+}
+
+static struct jvst_op_instr *
+opt_br_dest(const struct jvst_op_instr *instr)
+{
+	assert(instr->op == JVST_OP_JMP);
+	assert(instr->args[1].type == JVST_VM_ARG_INSTR);
+	assert(instr->args[1].u.dest != NULL);
+
+	return instr->args[1].u.dest;
+}
+
+static void
+opt_set_br(struct jvst_op_instr *instr, enum jvst_vm_br_cond brc, struct jvst_op_instr *dest)
+{
+	assert(instr->op == JVST_OP_JMP);
+
+	instr->args[0].u.index = brc;
+	instr->args[1].u.dest = dest;
+}
+
+static struct jvst_op_jtab *
+opt_jtab(const struct jvst_op_instr *instr)
+{
+	assert(instr->op == JVST_OP_SWITCH);
+	assert(instr->args[1].type == JVST_VM_ARG_JTAB);
+
+	return instr->args[1].u.jtab;
+}
+
+static int
+opt_br_taken(enum jvst_vm_br_cond brc, int64_t flag)
+{
+	int mask;
+
+	mask = (flag<0) | ((flag > 0) << 1) | ((flag == 0) << 2);
+	return (brc & mask) != 0;
+}
+
+static int
+opt_falls_through(const struct jvst_op_instr *instr)
+{
+	switch (instr->op) {
+	case JVST_OP_RETURN:
+	case JVST_OP_SWITCH:
+		return 0;
+
+	case JVST_OP_JMP:
+		return opt_br_cond(instr) != JVST_VM_BR_ALWAYS;
+
+	default:
+		return 1;
+	}
+}
+
+static int
+opt_is_return(const struct jvst_op_instr *instr)
+{
+	return instr->op == JVST_OP_RETURN &&
+		instr->args[0].type == JVST_VM_ARG_CONST;
+}
+
+static struct jvst_op_instr *
+opt_skip_nops(struct jvst_op_instr *instr)
+{
+	while (instr != NULL && instr->op == JVST_OP_NOP) {
+		instr = instr->next;
+	}
+
+	return instr;
+}
+
+/* Where a branch to instr lands once NOPs are swept: the next real
+ * instruction, or a NOP that ends the proc.
+ */
+static struct jvst_op_instr *
+opt_swept_dest(struct jvst_op_instr *instr)
+{
+	while (instr->op == JVST_OP_NOP && instr->next != NULL) {
+		instr = instr->next;
+	}
+
+	return instr;
+}
+
+static void
+opt_remove(struct op_optimizer *opt, struct jvst_op_instr *instr)
+{
+	instr->op = JVST_OP_NOP;
+	instr->args[0].type = JVST_VM_ARG_NONE;
+	instr->args[1].type = JVST_VM_ARG_NONE;
+	opt->changed = 1;
+}
+
+/* Unlinks NOPs from the proc, moving branches that land on them to the
+ * next real instruction, then numbers what's left.  code_off isn't set
+ * until the program is encoded, so it holds each instruction's index
+ * until then.
+ */
+static void
+opt_sweep(struct op_optimizer *opt)
+{
+	struct jvst_op_instr **ipp, *instr;
+	size_t n;
+
+	for (instr = opt->proc->ilist; instr != NULL; instr = instr->next) {
+		struct jvst_op_instr *dest;
+
+		if (instr->op == JVST_OP_NOP && instr->label != NULL) {
+			dest = opt_swept_dest(instr);
+			if (dest->label == NULL) {
+				dest->label = instr->label;
+			}
+		}
+
+		if (instr->op == JVST_OP_JMP) {
+			instr->args[1].u.dest = opt_swept_dest(opt_br_dest(instr));
+		}
+
+		if (instr->op == JVST_OP_SWITCH) {
+			struct jvst_op_jtab *jtab = opt_jtab(instr);
+			size_t k;
+
+			for (k=0; k <= jtab->ncase; k++) {
+				jtab->dests[k].u.dest = opt_swept_dest(jtab->dests[k].u.dest);
+			}
+		}
+	}
+
+	n = 0;
+	ipp = &opt->proc->ilist;
+	while (*ipp != NULL) {
+		instr = *ipp;
+		if (instr->op == JVST_OP_NOP && instr->next != NULL) {
+			*ipp = instr->next;
+			continue;
+		}
+
+		if (n >= opt->cap) {
+			opt->instrs = xenlargevec(opt->instrs, &opt->cap, 1, sizeof opt->instrs[0]);
+		}
+
+		instr->code_off = n;
+		opt->instrs[n++] = instr;
+		ipp = &instr->next;
+	}
+
+	opt->ninstr = n;
+
+	opt->target = xrealloc(opt->target, n + 1);
+	opt->mark = xrealloc(opt->mark, n + 1);
+	memset(opt->target, 0, n + 1);
+
+	for (n=0; n < opt->ninstr; n++) {
+		instr = opt->instrs[n];
+		if (instr->op == JVST_OP_JMP) {
+			opt->target[opt_br_dest(instr)->code_off] = 1;
+		}
+
+		if (instr->op == JVST_OP_SWITCH) {
+			struct jvst_op_jtab *jtab = opt_jtab(instr);
+			size_t k;
+
+			for (k=0; k <= jtab->ncase; k++) {
+				opt->target[jtab->dests[k].u.dest->code_off] = 1;
+			}
+		}
+	}
+}
+
+/* The flag isn't known at a SWITCH, so its destinations are only
+ * threaded through unconditional jumps.
+ */
+static void
+opt_thread_switch(struct op_optimizer *opt, struct jvst_op_instr *instr)
+{
+	struct jvst_op_jtab *jtab = opt_jtab(instr);
+	size_t k;
+
+	for (k=0; k <= jtab->ncase; k++) {
+		struct jvst_op_instr *dest, *orig;
+		int steps;
+
+		orig = dest = jtab->dests[k].u.dest;
+		for (steps=0; steps < OPT_MAX_THREAD; steps++) {
+			if (dest->op != JVST_OP_JMP || opt_br_cond(dest) != JVST_VM_BR_ALWAYS) {
+				break;
+			}
+
+			dest = opt_br_dest(dest);
+		}
+
+		if (dest != orig) {
+			jtab->dests[k].u.dest = dest;
+			opt->changed = 1;
+		}
+	}
+}
+
+/* Follows chains of jumps.  A jump can skip over a conditional jump
+ * on the same condition, since JMP doesn't change the flag, and
+ * straight past one on the opposite condition.
+ */
+static void
+opt_thread_jumps(struct op_optimizer *opt)
+{
+	size_t i;
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+		struct jvst_op_instr *dest, *orig;
+		enum jvst_vm_br_cond brc;
+		int steps;
+
+		if (instr->op == JVST_OP_SWITCH) {
+			opt_thread_switch(opt, instr);
+			continue;
+		}
+
+		if (instr->op != JVST_OP_JMP) {
+			continue;
+		}
+
+		brc = opt_br_cond(instr);
+		if (brc == JVST_VM_BR_NEVER) {
+			opt_remove(opt, instr);
+			continue;
+		}
+
+		orig = dest = opt_br_dest(instr);
+		for (steps=0; steps < OPT_MAX_THREAD; steps++) {
+			enum jvst_vm_br_cond dbrc;
+
+			if (dest->op != JVST_OP_JMP) {
+				break;
+			}
+
+			dbrc = opt_br_cond(dest);
+			if (dbrc == JVST_VM_BR_ALWAYS || dbrc == brc) {
+				dest = opt_br_dest(dest);
+			} else if (dbrc == (brc ^ JVST_VM_BR_ALWAYS) && dest->next != NULL) {
+				dest = opt_skip_nops(dest->next);
+			} else {
+				break;
+			}
+
+			if (dest == NULL || dest == instr) {
+				dest = orig;
+				break;
+			}
+		}
+
+		if (dest != orig) {
+			opt_set_br(instr, brc, dest);
+			opt->changed = 1;
+		}
+
+		if (brc == JVST_VM_BR_ALWAYS && opt_is_return(dest)) {
+			instr->op = JVST_OP_RETURN;
+			instr->args[0] = dest->args[0];
+			instr->args[1] = dest->args[1];
+			opt->changed = 1;
+		}
+	}
+}
+
+static struct jvst_op_instr *
+opt_first_return(struct op_optimizer *opt, const struct jvst_op_instr *ret)
+{
+	size_t i;
+
+	for (i=0; i < ret->code_off; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+
+		if (opt_is_return(instr) && instr->args[0].u.index == ret->args[0].u.index) {
+			return instr;
+		}
+	}
+
+	return NULL;
+}
+
+/* Sends branches to a RETURN to the first RETURN of the proc with the
+ * same result, so each error is raised in one place.  A RETURN that's
+ * only reached by falling through a branch goes too:
+ *
+ * 	JMP c :L1		JMP ~c :L0
+ * 	RETURN n	=>
+ * L1:			L1:
+ *
+ * where L0 is an earlier RETURN n.
+ */
+static void
+opt_merge_returns(struct op_optimizer *opt)
+{
+	size_t i;
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+		struct jvst_op_instr *dest, *first;
+
+		if (instr->op == JVST_OP_SWITCH) {
+			struct jvst_op_jtab *jtab = opt_jtab(instr);
+			size_t k;
+
+			for (k=0; k <= jtab->ncase; k++) {
+				dest = jtab->dests[k].u.dest;
+				first = opt_is_return(dest) ? opt_first_return(opt, dest) : NULL;
+				if (first != NULL) {
+					jtab->dests[k].u.dest = first;
+					opt->changed = 1;
+				}
+			}
+			continue;
+		}
+
+		if (instr->op != JVST_OP_JMP) {
+			continue;
+		}
+
+		dest = opt_br_dest(instr);
+		if (opt_is_return(dest)) {
+			first = opt_first_return(opt, dest);
+			if (first != NULL) {
+				opt_set_br(instr, opt_br_cond(instr), first);
+				opt->changed = 1;
+			}
+			continue;
+		}
+
+		if (i+1 >= opt->ninstr || opt_br_cond(instr) == JVST_VM_BR_ALWAYS) {
+			continue;
+		}
+
+		dest = opt->instrs[i+1];
+		if (!opt_is_return(dest) || opt->target[i+1] ||
+			opt_skip_nops(dest->next) != opt_br_dest(instr)) {
+			continue;
+		}
+
+		first = opt_first_return(opt, dest);
+		if (first != NULL) {
+			opt_set_br(instr, opt_br_cond(instr) ^ JVST_VM_BR_ALWAYS, first);
+			opt_remove(opt, dest);
+			i++;
+		}
+	}
+}
+
+/* Forgets what's known about slot ind, and about slots that copied it */
+static void
+opt_vals_kill(struct op_optimizer *opt, int64_t ind)
+{
+	size_t i, n = opt->proc->nslots;
+
+	if (ind >= 0 && (size_t)ind < n) {
+		opt->vals[ind].kind = OPT_VAL_UNKNOWN;
+	}
+
+	for (i=0; i < n; i++) {
+		if (opt->vals[i].kind == OPT_VAL_COPY &&
+				opt_is_slot(opt->vals[i].arg) &&
+				opt->vals[i].arg.u.index == ind) {
+			opt->vals[i].kind = OPT_VAL_UNKNOWN;
+		}
+	}
+}
+
+static void
+opt_vals_reset(struct op_optimizer *opt)
+{
+	memset(opt->vals, 0, opt->proc->nslots * sizeof opt->vals[0]);
+}
+
+static const struct opt_val *
+opt_val(struct op_optimizer *opt, struct jvst_op_arg arg)
+{
+	if (!opt_is_slot(arg) || arg.u.index < 0 || (size_t)arg.u.index >= opt->proc->nslots) {
+		return NULL;
+	}
+
+	return &opt->vals[arg.u.index];
+}
+
+/* Replaces a slot argument with the slot, register or literal it was
+ * copied from.  Literals are only substituted where the instruction
+ * reads the argument as an integer and the encoding allows one.
+ */
+static void
+opt_subst(struct op_optimizer *opt, struct jvst_op_arg *argp, int lit_ok)
+{
+	const struct opt_val *v;
+
+	v = opt_val(opt, *argp);
+	if (v == NULL || v->kind != OPT_VAL_COPY) {
+		return;
+	}
+
+	if (opt_is_lit(v->arg) && !lit_ok) {
+		return;
+	}
+
+	*argp = v->arg;
+	opt->changed = 1;
+}
+
+/* Value of an integer argument, if it's known */
+static int
+opt_ival(struct op_optimizer *opt, struct jvst_op_arg arg, int64_t *vp)
+{
+	const struct opt_val *v;
+
+	if (opt_is_lit(arg)) {
+		*vp = arg.u.index;
+		return 1;
+	}
+
+	v = opt_val(opt, arg);
+	if (v != NULL && v->kind == OPT_VAL_ICONST) {
+		*vp = opt->prog->cdata[v->arg.u.index];
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Value of a float argument, if it's known */
+static int
+opt_fval(struct op_optimizer *opt, struct jvst_op_arg arg, double *vp)
+{
+	const struct opt_val *v;
+
+	v = opt_val(opt, arg);
+	if (v != NULL && v->kind == OPT_VAL_FLOAT) {
+		*vp = opt->prog->fdata[v->arg.u.index];
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Forward pass over each basic block: propagates copies, removes
+ * redundant loads and folds comparisons and branches on known values.
+ */
+static void
+opt_propagate(struct op_optimizer *opt)
+{
+	size_t i;
+	int flag_known = 0;
+	int64_t flag = 0;
+
+	opt_vals_reset(opt);
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+		const struct opt_val *v;
+		struct opt_val nv;
+		int64_t a, b;
+		double fa, fb;
+
+		if (opt->target[i]) {
+			opt_vals_reset(opt);
+			flag_known = 0;
+		}
+
+		switch (instr->op) {
+		case JVST_OP_ICMP:
+			opt_subst(opt, &instr->args[0], 1);
+			opt_subst(opt, &instr->args[1], 1);
+
+			flag_known = opt_ival(opt, instr->args[0], &a) &&
+				opt_ival(opt, instr->args[1], &b);
+			if (flag_known) {
+				flag = (a > b) - (a < b);
+			}
+			break;
+
+		case JVST_OP_FCMP:
+			opt_subst(opt, &instr->args[0], 0);
+			opt_subst(opt, &instr->args[1], 0);
+
+			flag_known = opt_fval(opt, instr->args[0], &fa) &&
+				opt_fval(opt, instr->args[1], &fb);
+			if (flag_known) {
+				flag = (fa > fb) - (fa < fb);
+			}
+			break;
+
+		case JVST_OP_FINT:
+			opt_subst(opt, &instr->args[0], 0);
+			flag_known = 0;
+			break;
+
+		case JVST_OP_JMP:
+			if (flag_known && opt_br_cond(instr) != JVST_VM_BR_ALWAYS) {
+				if (opt_br_taken(opt_br_cond(instr), flag)) {
+					instr->args[0].u.index = JVST_VM_BR_ALWAYS;
+					opt->changed = 1;
+				} else {
+					opt_remove(opt, instr);
+				}
+			}
+			break;
+
+		case JVST_OP_MOVE:
+			opt_subst(opt, &instr->args[1], 1);
+
+			v = opt_val(opt, instr->args[0]);
+			if (v == NULL) {
+				opt_vals_kill(opt, instr->args[0].u.index);
+				break;
+			}
+
+			if (opt_args_equal(instr->args[0], instr->args[1]) ||
+					(v->kind == OPT_VAL_COPY && opt_args_equal(v->arg, instr->args[1]))) {
+				opt_remove(opt, instr);
+				break;
+			}
+
+			nv.kind = OPT_VAL_COPY;
+			nv.arg = instr->args[1];
+			opt_vals_kill(opt, instr->args[0].u.index);
+			if (opt_is_slot(nv.arg) || opt_is_reg(nv.arg) || opt_is_lit(nv.arg)) {
+				opt->vals[instr->args[0].u.index] = nv;
+			}
+			break;
+
+		case JVST_OP_FLOAD:
+		case JVST_OP_ILOAD:
+			nv.kind = (instr->op == JVST_OP_FLOAD) ? OPT_VAL_FLOAT : OPT_VAL_ICONST;
+			nv.arg = instr->args[1];
+
+			v = opt_val(opt, instr->args[0]);
+			if (v == NULL) {
+				opt_vals_kill(opt, instr->args[0].u.index);
+				break;
+			}
+
+			if (v->kind == nv.kind && v->arg.u.index == nv.arg.u.index) {
+				opt_remove(opt, instr);
+				break;
+			}
+
+			opt_vals_kill(opt, instr->args[0].u.index);
+			opt->vals[instr->args[0].u.index] = nv;
+			break;
+
+		case JVST_OP_INCR:
+		case JVST_OP_BAND:
+			opt_subst(opt, &instr->args[1], 1);
+			opt_vals_kill(opt, instr->args[0].u.index);
+			break;
+
+		case JVST_OP_BSET:
+			opt_vals_kill(opt, instr->args[0].u.index);
+			break;
+
+		case JVST_OP_SWITCH:
+			opt_subst(opt, &instr->args[0], 0);
+			break;
+
+		case JVST_OP_RETURN:
+		case JVST_OP_NOP:
+			break;
+
+		default:
+			// TOKEN and CONSUME change the registers, CALL and
+			// the SPLITs may change the flag, and the SPLITs
+			// write to a range of slots
+			opt_vals_reset(opt);
+			flag_known = 0;
+			break;
+		}
+
+		if (!opt_falls_through(instr)) {
+			opt_vals_reset(opt);
+			flag_known = 0;
+		}
+	}
+}
+
+/* Inverts a conditional branch over an unconditional jump:
+ *
+ * 	JMP c :L1		JMP ~c :L2
+ * 	JMP AL :L2	=>
+ * L1:			L1:
+ */
+static void
+opt_invert_branches(struct op_optimizer *opt)
+{
+	size_t i;
+
+	for (i=0; i+1 < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+		struct jvst_op_instr *jmp = opt->instrs[i+1];
+		enum jvst_vm_br_cond brc;
+
+		if (instr->op != JVST_OP_JMP || jmp->op != JVST_OP_JMP) {
+			continue;
+		}
+
+		brc = opt_br_cond(instr);
+		if (brc == JVST_VM_BR_ALWAYS || opt_br_cond(jmp) != JVST_VM_BR_ALWAYS) {
+			continue;
+		}
+
+		if (opt->target[i+1] || opt_skip_nops(jmp->next) != opt_br_dest(instr)) {
+			continue;
+		}
+
+		opt_set_br(instr, brc ^ JVST_VM_BR_ALWAYS, opt_br_dest(jmp));
+		opt_remove(opt, jmp);
+		i++;
+	}
+}
+
+static void
+opt_remove_fallthrough(struct op_optimizer *opt)
+{
+	size_t i;
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+
+		if (instr->op == JVST_OP_JMP &&
+			opt_skip_nops(instr->next) == opt_skip_nops(opt_br_dest(instr))) {
+			opt_remove(opt, instr);
+		}
+	}
+}
+
+static void
+opt_reach(struct op_optimizer *opt, size_t *stack, size_t *topp, const struct jvst_op_instr *instr)
+{
+	if (instr != NULL && !opt->mark[instr->code_off]) {
+		opt->mark[instr->code_off] = 1;
+		stack[(*topp)++] = instr->code_off;
+	}
+}
+
+static void
+opt_remove_unreachable(struct op_optimizer *opt)
+{
+	size_t i, *stack, top;
+
+	if (opt->ninstr == 0) {
+		return;
+	}
+
+	memset(opt->mark, 0, opt->ninstr);
+	stack = xmalloc(opt->ninstr * sizeof stack[0]);
+
+	top = 0;
+	stack[top++] = 0;
+	opt->mark[0] = 1;
+
+	while (top > 0) {
+		struct jvst_op_instr *instr = opt->instrs[stack[--top]];
+
+		if (opt_falls_through(instr)) {
+			opt_reach(opt, stack, &top, instr->next);
+		}
+
+		if (instr->op == JVST_OP_JMP) {
+			opt_reach(opt, stack, &top, opt_br_dest(instr));
+		}
+
+		if (instr->op == JVST_OP_SWITCH) {
+			struct jvst_op_jtab *jtab = opt_jtab(instr);
+			size_t k;
+
+			for (k=0; k <= jtab->ncase; k++) {
+				opt_reach(opt, stack, &top, jtab->dests[k].u.dest);
+			}
+		}
+	}
+
+	free(stack);
+
+	for (i=0; i < opt->ninstr; i++) {
+		if (!opt->mark[i] && opt->instrs[i]->op != JVST_OP_NOP) {
+			opt_remove(opt, opt->instrs[i]);
+		}
+	}
+}
+
+/* Removes comparisons whose flag is set again or discarded before any
+ * branch tests it.  mark[i] is set if the flag is live on entry to
+ * instruction i.
+ */
+static void
+opt_remove_dead_cmps(struct op_optimizer *opt)
+{
+	size_t i;
+	int changed;
+
+	memset(opt->mark, 0, opt->ninstr);
+
+	do {
+		changed = 0;
+
+		for (i=opt->ninstr; i-- > 0; ) {
+			struct jvst_op_instr *instr = opt->instrs[i];
+			int live = 0;
+
+			if (opt_falls_through(instr) && instr->next != NULL) {
+				live = opt->mark[instr->next->code_off];
+			}
+
+			switch (instr->op) {
+			case JVST_OP_JMP:
+				if (opt_br_cond(instr) != JVST_VM_BR_ALWAYS) {
+					live = 1;
+				}
+				live |= opt->mark[opt_br_dest(instr)->code_off];
+				break;
+
+			case JVST_OP_SWITCH:
+				{
+					struct jvst_op_jtab *jtab = opt_jtab(instr);
+					size_t k;
+
+					for (k=0; k <= jtab->ncase; k++) {
+						live |= opt->mark[jtab->dests[k].u.dest->code_off];
+					}
+				}
+				break;
+
+			case JVST_OP_RETURN:
+				live = (instr->args[0].u.index == 0);
+				break;
+
+			case JVST_OP_ICMP:
+			case JVST_OP_FCMP:
+			case JVST_OP_FINT:
+				live = 0;
+				break;
+
+			default:
+				break;
+			}
+
+			if (live != opt->mark[i]) {
+				opt->mark[i] = live;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+		int live_out;
+
+		switch (instr->op) {
+		case JVST_OP_ICMP:
+		case JVST_OP_FCMP:
+		case JVST_OP_FINT:
+			live_out = (instr->next != NULL) && opt->mark[instr->next->code_off];
+			if (!live_out) {
+				opt_remove(opt, instr);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/* Removes MOVEs and loads into slots that nothing reads */
+static void
+opt_remove_dead_stores(struct op_optimizer *opt)
+{
+	size_t i, n = opt->proc->nslots;
+
+	memset(opt->read, 0, n);
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+		int j, written;
+
+		// argument the instruction writes without reading it
+		switch (instr->op) {
+		case JVST_OP_MOVE:
+		case JVST_OP_FLOAD:
+		case JVST_OP_ILOAD:
+			written = 0;
+			break;
+
+		case JVST_OP_SPLIT:
+		case JVST_OP_SPLITV:
+		case JVST_OP_SPLITANY:
+		case JVST_OP_SPLITALL:
+		case JVST_OP_SPLITONE:
+		case JVST_OP_DISPATCH:
+			written = 1;
+			break;
+
+		default:
+			written = -1;
+			break;
+		}
+
+		for (j=0; j < 2; j++) {
+			struct jvst_op_arg arg = instr->args[j];
+
+			if (j == written || !opt_is_slot(arg)) {
+				continue;
+			}
+
+			if (arg.u.index >= 0 && (size_t)arg.u.index < n) {
+				opt->read[arg.u.index] = 1;
+			}
+		}
+	}
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+		struct jvst_op_arg dst;
+
+		switch (instr->op) {
+		case JVST_OP_MOVE:
+		case JVST_OP_FLOAD:
+		case JVST_OP_ILOAD:
+			dst = instr->args[0];
+			if (opt_is_slot(dst) && dst.u.index >= 0 &&
+				(size_t)dst.u.index < n && !opt->read[dst.u.index]) {
+				opt_remove(opt, instr);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/* Turns MATCHes of finite sets of strings into LMATCHes */
+static void
+opt_select_lmatch(struct op_optimizer *opt)
+{
+	size_t i;
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *instr = opt->instrs[i];
+		struct jvst_op_lits *lits;
+		int64_t dfa;
+
+		if (instr->op != JVST_OP_MATCH || instr->args[0].type != JVST_VM_ARG_CONST) {
+			continue;
+		}
+
+		dfa = instr->args[0].u.index;
+		if (dfa < 0 || (size_t)dfa >= opt->prog->ndfa) {
+			continue;
+		}
+
+		lits = jvst_op_build_lits(&opt->prog->dfas[dfa]);
+		if (lits == NULL) {
+			continue;
+		}
+
+		instr->op = JVST_OP_LMATCH;
+		instr->args[1].type = JVST_VM_ARG_LITS;
+		instr->args[1].u.lits = lits;
+	}
+}
+
+/* Names branch destinations that were in the middle of a block, so
+ * the listing stays readable
+ */
+static void
+opt_label_dests(struct op_optimizer *opt)
+{
+	size_t i, nlabel = 0;
+
+	for (i=0; i < opt->ninstr; i++) {
+		struct jvst_op_instr *dest;
+		char tmp[64];
+
+		if (!opt->target[i] || opt->instrs[i]->label != NULL) {
+			continue;
+		}
+
+		dest = opt->instrs[i];
+		snprintf(tmp, sizeof tmp, "opt_%zu", nlabel++);
+
+		// XXX - leaks, like the assembler's labels
+		dest->label = xstrdup(tmp);
+	}
+}
+
+static void
+opt_proc(struct op_optimizer *opt, struct jvst_op_proc *proc)
+{
+	int round;
+
+	opt->proc = proc;
+	opt->vals = xrealloc(opt->vals, (proc->nslots + 1) * sizeof opt->vals[0]);
+	opt->read = xrealloc(opt->read, proc->nslots + 1);
+
+	for (round=0; round < OPT_MAX_ROUNDS; round++) {
+		opt->changed = 0;
+
+		opt_sweep(opt);
+		opt_thread_jumps(opt);
+		opt_merge_returns(opt);
+
+		opt_sweep(opt);
+		opt_propagate(opt);
+		opt_invert_branches(opt);
+		opt_remove_fallthrough(opt);
+
+		opt_sweep(opt);
+		opt_remove_unreachable(opt);
+		opt_remove_dead_cmps(opt);
+		opt_remove_dead_stores(opt);
+
+		if (!opt->changed) {
+			break;
+		}
+	}
+
+	opt_sweep(opt);
+	opt_select_lmatch(opt);
+	opt_label_dests(opt);
+}
+
+struct jvst_op_program *
+jvst_op_optimize(struct jvst_op_program *prog)
+{
+	struct op_optimizer opt = { 0 };
+	struct jvst_op_proc *proc;
+
+	assert(prog != NULL);
+
+	opt.prog = prog;
+	for (proc = prog->procs; proc != NULL; proc = proc->next) {
+		if (proc->ilist != NULL) {
+			opt_proc(&opt, proc);
+		}
+	}
+
+	free(opt.instrs);
+	free(opt.target);
+	free(opt.mark);
+	free(opt.vals);
+	free(opt.read);
+
+	return prog;
+}
+
+size_t
+jvst_op_count(const struct jvst_op_program *prog)
+{
+	const struct jvst_op_proc *proc;
+	const struct jvst_op_instr *instr;
+	size_t n = 0;
+
+	for (proc = prog->procs; proc != NULL; proc = proc->next) {
+		for (instr = proc->ilist; instr != NULL; instr = instr->next) {
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
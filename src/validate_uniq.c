@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "ast.h"
 #include "xalloc.h"
 #include "hmap.h"
 #include "xxhash.h"
@@ -22,401 +23,888 @@
 		WHEREARGS);				\
 	abort(); } while (0)
 
+/* Numbers are compared by the bits of their canonical form: negative
+ * zero is zero, and every NaN is the same NaN.  UNIQ_NUM_EMPTY is a NaN
+ * that never comes out of number_bits, and marks empty number slots.
+ */
+#define UNIQ_NAN_BITS  0x7ff8000000000000ULL
+#define UNIQ_NUM_EMPTY 0xfff0000000000001ULL
+
 static uint64_t
-hash_entry(void *hopaque, const void *key)
+number_bits(double d)
 {
-	const struct jvst_vm_uniq_entry *entry = key;
+	uint64_t bits;
 
-	(void)hopaque;
+	if (d != d) {
+		return UNIQ_NAN_BITS;
+	}
 
-	switch (entry->type) {
-	default:
-	case SJP_NONE:
-	case SJP_OBJECT_END:
-	case SJP_ARRAY_END:
-		SHOULD_NOT_REACH();
+	if (d == 0.0) {
+		d = 0.0;
+	}
+
+	memcpy(&bits, &d, sizeof bits);
+	return bits;
+}
+
+/* Encoding
+ *
+ * Arrays and objects are written to a flat encoding as their tokens
+ * stream past, so an item is copied once however deeply it's nested.
+ * Each value is a type byte followed by:
+ *
+ *   null, true, false    nothing
+ *   number               the bits of the canonical double
+ *   string               the length (size_t), then the bytes
+ *   array, object        the length of the rest of the value (size_t),
+ *                        the number of items or members (size_t), then
+ *                        the items, or the key and value of each
+ *                        member, in document order
+ *
+ * Items are told apart by their hashes, which are computed as the
+ * tokens arrive.  The encodings are only compared when two items hash
+ * the same, so object members are matched up by key instead of being
+ * sorted.
+ */
+
+static void
+enc_put(struct jvst_vm_unique *uniq, const void *p, size_t n)
+{
+	if (uniq->enc.cap - uniq->enc.len < n) {
+		uniq->enc.ptr = xenlargevec(uniq->enc.ptr, &uniq->enc.cap,
+			n - (uniq->enc.cap - uniq->enc.len), 1);
+	}
+
+	if (n > 0) {
+		memcpy(uniq->enc.ptr + uniq->enc.len, p, n);
+		uniq->enc.len += n;
+	}
+}
+
+static void
+enc_type(struct jvst_vm_unique *uniq, enum SJP_EVENT type)
+{
+	char c = (char)type;
+	enc_put(uniq, &c, 1);
+}
+
+static void
+enc_size(struct jvst_vm_unique *uniq, size_t n)
+{
+	enc_put(uniq, &n, sizeof n);
+}
+
+static size_t
+enc_getsize(const char *p)
+{
+	size_t n;
+	memcpy(&n, p, sizeof n);
+	return n;
+}
 
+static const char *
+enc_skip(const char *p)
+{
+	switch ((enum SJP_EVENT)(unsigned char)*p++) {
 	case SJP_NULL:
 	case SJP_TRUE:
 	case SJP_FALSE:
+		return p;
+
 	case SJP_NUMBER:
-		return XXH64(entry, sizeof *entry, 0 /* XXX - SEED */);
+		return p + sizeof (double);
 
 	case SJP_STRING:
-	case SJP_OBJECT_BEG:
+		return p + sizeof (size_t) + enc_getsize(p);
+
 	case SJP_ARRAY_BEG:
-		// first byte of the data should indicate the type...
-		return XXH64(entry->u.b.data, entry->u.b.len, 0 /* XXX - SEED */);
+	case SJP_OBJECT_BEG:
+		return p + 2 * sizeof (size_t) + enc_getsize(p);
+
+	default:
+		SHOULD_NOT_REACH();
 	}
 }
 
 static int
-compare_entries(void *hopaque, const void *k1, const void *k2)
+enc_equal(const char *a, const char *b)
 {
-	const struct jvst_vm_uniq_entry *e1 = k1;
-	const struct jvst_vm_uniq_entry *e2 = k2;
+	enum SJP_EVENT type;
 
-	(void)hopaque;
-
-	if (e1->type != e2->type) {
+	type = (enum SJP_EVENT)(unsigned char)*a++;
+	if ((enum SJP_EVENT)(unsigned char)*b++ != type) {
 		return 0;
 	}
 
-	switch (e1->type) {
-	default:
-	case SJP_NONE:
-	case SJP_OBJECT_END:
-	case SJP_ARRAY_END:
-		SHOULD_NOT_REACH();
-
+	switch (type) {
 	case SJP_NULL:
 	case SJP_TRUE:
 	case SJP_FALSE:
 		return 1;
 
 	case SJP_NUMBER:
-		return e1->u.d == e2->u.d;
+		return memcmp(a, b, sizeof (uint64_t)) == 0;
 
 	case SJP_STRING:
-	case SJP_OBJECT_BEG:
+		{
+			size_t n = enc_getsize(a);
+			if (enc_getsize(b) != n) {
+				return 0;
+			}
+
+			return memcmp(a + sizeof n, b + sizeof n, n) == 0;
+		}
+
 	case SJP_ARRAY_BEG:
-		if (e1->u.b.len != e2->u.b.len) {
-			return 0;
+		{
+			size_t i, n;
+
+			n = enc_getsize(a + sizeof n);
+			if (enc_getsize(b + sizeof n) != n) {
+				return 0;
+			}
+
+			a += 2 * sizeof n;
+			b += 2 * sizeof n;
+			for (i=0; i < n; i++) {
+				if (!enc_equal(a,b)) {
+					return 0;
+				}
+
+				a = enc_skip(a);
+				b = enc_skip(b);
+			}
+
+			return 1;
+		}
+
+	case SJP_OBJECT_BEG:
+		{
+			const char *bmem, *bend, *mb;
+			size_t i, n;
+
+			n = enc_getsize(a + sizeof n);
+			if (enc_getsize(b + sizeof n) != n) {
+				return 0;
+			}
+
+			bmem = b + 2 * sizeof n;
+			bend = bmem + enc_getsize(b);
+
+			a += 2 * sizeof n;
+			for (i=0; i < n; i++) {
+				for (mb = bmem; mb < bend; mb = enc_skip(enc_skip(mb))) {
+					if (enc_equal(a, mb) && enc_equal(enc_skip(a), enc_skip(mb))) {
+						break;
+					}
+				}
+
+				if (mb >= bend) {
+					return 0;
+				}
+
+				a = enc_skip(enc_skip(a));
+			}
+
+			return 1;
 		}
 
-		return (memcmp(e1->u.b.data, e2->u.b.data, e1->u.b.len) == 0);
+	default:
+		SHOULD_NOT_REACH();
 	}
 }
 
+/* Words are hashed as their little-endian bytes, so a value hashes the
+ * same on every host.  Value sets are hashed when the schema is
+ * compiled, and the program may be run somewhere else.
+ */
 static void
-uniq_stack_init(struct jvst_vm_unique_stack *frame, enum jvst_vm_uniq_state state)
+put_le64(unsigned char *p, uint64_t v)
 {
-	frame->state = state;
-
-	frame->buf.ptr = NULL;
-	frame->buf.len = 0;
-	frame->buf.cap = 0;
+	int i;
 
-	frame->entries.items = NULL;
-	frame->entries.len = 0;
-	frame->entries.cap = 0;
+	for (i=0; i < 8; i++) {
+		p[i] = (unsigned char)(v >> (8*i));
+	}
 }
 
-static void
-finalize_entry(struct jvst_vm_uniq_entry *entry);
-
-static void
-uniq_stack_final(struct jvst_vm_unique_stack *frame)
+static uint64_t
+scalar_hash(enum SJP_EVENT type, const void *p, size_t n)
 {
-	size_t i,n;
+	return XXH64(p, n, (unsigned long long)type);
+}
 
-	frame->state = JVST_VM_UNIQ_BARE;
+static uint64_t
+number_hash(uint64_t bits)
+{
+	unsigned char b[8];
 
-	free(frame->buf.ptr);
-	frame->buf.ptr = NULL;
-	frame->buf.len = 0;
-	frame->buf.cap = 0;
+	put_le64(b, bits);
+	return scalar_hash(SJP_NUMBER, b, sizeof b);
+}
 
-	n = frame->entries.len;
-	for (i=0; i < n; i++) {
-		finalize_entry(&frame->entries.items[i]);
-	}
+static uint64_t
+member_hash(uint64_t key, uint64_t val)
+{
+	unsigned char kv[16];
 
-	free(frame->entries.items);
-	frame->entries.items = NULL;
-	frame->entries.len = 0;
-	frame->entries.cap = 0;
+	put_le64(&kv[0], key);
+	put_le64(&kv[8], val);
+	return XXH64(kv, sizeof kv, (unsigned long long)SJP_OBJECT_BEG);
 }
 
-struct jvst_vm_unique *
-jvst_vm_uniq_initialize(void)
+static uint64_t
+object_hash(uint64_t sum, size_t count)
 {
-	struct jvst_vm_unique *uniq;
-	uniq = malloc(sizeof *uniq);
-	// hmap_create_string(DEFAULT_UNIQ_BUCKETS, DEFAULT_UNIQ_LOAD);
-	uniq->entries = hmap_create(
-		DEFAULT_UNIQ_BUCKETS,
-		DEFAULT_UNIQ_LOAD,
-		NULL, 
-		hash_entry, 
-		compare_entries);
-
-	uniq->top = 0;
-	uniq_stack_init(&uniq->stack[uniq->top], JVST_VM_UNIQ_BARE);
+	unsigned char v[16];
 
-	return uniq;
+	put_le64(&v[0], sum);
+	put_le64(&v[8], (uint64_t)count);
+	return XXH64(v, sizeof v, (unsigned long long)SJP_OBJECT_BEG);
 }
 
-void
-jvst_vm_uniq_finalize(struct jvst_vm_unique *uniq)
+static void
+array_hash_item(struct XXH64_state_s *st, uint64_t h)
 {
-	hmap_free(uniq->entries);
-	free(uniq);
+	unsigned char b[8];
+
+	put_le64(b, h);
+	XXH64_update(st, b, sizeof b);
 }
 
-static struct jvst_vm_uniq_entry *
-number_entry(struct jvst_vm_unique *uniq, double d)
+static uint64_t
+hash_entry(void *hopaque, const void *key)
 {
-	struct jvst_vm_uniq_entry *entry;
-	(void)uniq;
-
-	entry = malloc(sizeof *entry);  // XXX - replace with pool allocator?
-	entry->type = SJP_NUMBER;
-	entry->u.d = d;
+	const struct jvst_vm_uniq_entry *entry = key;
 
-	return entry;
+	(void)hopaque;
+	return entry->hash;
 }
 
-static struct jvst_vm_uniq_entry *
-string_entry(struct jvst_vm_unique *uniq, const char *buf, size_t n)
+static int
+compare_entries(void *hopaque, const void *k1, const void *k2)
 {
-	struct jvst_vm_uniq_entry *entry;
-	struct jvst_vm_unique_stack *stack;
-	char *s, *sp;
-	size_t len;
+	const struct jvst_vm_uniq_entry *e1 = k1;
+	const struct jvst_vm_uniq_entry *e2 = k2;
 
-	stack = &uniq->stack[uniq->top];
+	(void)hopaque;
 
-	entry = malloc(sizeof *entry);  // XXX - replace with pool allocator?
-	entry->type = SJP_STRING;
+	if (e1->type != e2->type || e1->hash != e2->hash) {
+		return 0;
+	}
 
-	len = 1 + stack->buf.len + n;
-	s = xmalloc(len);
+	switch (e1->type) {
+	default:
+	case SJP_NONE:
+	case SJP_OBJECT_END:
+	case SJP_ARRAY_END:
+		SHOULD_NOT_REACH();
 
-	sp = s;
-	*sp++ = (char)SJP_STRING;
-	if (stack->buf.len > 0) {
-		memcpy(sp, stack->buf.ptr, stack->buf.len);
-		sp += stack->buf.len;
+	case SJP_NULL:
+	case SJP_TRUE:
+	case SJP_FALSE:
+		return 1;
 
-		stack->buf.len = 0;
-	}
+	case SJP_NUMBER:
+		return number_bits(e1->u.d) == number_bits(e2->u.d);
 
-	memcpy(sp, buf, n);
+	case SJP_STRING:
+		if (e1->u.b.len != e2->u.b.len) {
+			return 0;
+		}
 
-	entry->u.b.data = s;
-	entry->u.b.len = len;
+		return e1->u.b.len == 0 ||
+			memcmp(e1->u.b.data, e2->u.b.data, e1->u.b.len) == 0;
 
-	return entry;
+	case SJP_OBJECT_BEG:
+	case SJP_ARRAY_BEG:
+		return enc_equal(e1->u.b.data, e2->u.b.data);
+	}
 }
 
-static struct jvst_vm_uniq_entry *
-literal_entry(struct jvst_vm_unique *uniq, enum SJP_EVENT type)
+static struct jvst_vm_uniq_chunk *
+arena_newchunk(struct jvst_vm_uniq_chunk *next, size_t n)
 {
-	struct jvst_vm_uniq_entry *entry;
+	struct jvst_vm_uniq_chunk *c;
+	size_t cap;
 
-	(void)uniq;
+	cap = UNIQ_ARENA_CHUNK;
+	if (next != NULL && cap < 2*next->cap) {
+		cap = 2*next->cap;
+	}
+
+	if (cap < n) {
+		cap = n;
+	}
 
-	entry = malloc(sizeof *entry);  // XXX - replace with pool allocator?
-	entry->type = type;
-	entry->u.b.data = NULL;
-	entry->u.b.len = 0;
+	c = xmalloc(sizeof *c + cap);
+	c->next = next;
+	c->len = 0;
+	c->cap = cap;
 
-	return entry;
+	return c;
 }
 
-static struct jvst_vm_uniq_entry *
-composite_entry(struct jvst_vm_unique *uniq, enum SJP_EVENT composite_state)
+static void *
+arena_alloc(struct jvst_vm_uniq_arena *arena, size_t n)
 {
-	struct jvst_vm_uniq_entry *entry;
-	struct jvst_vm_unique_stack *stack;
-	char *buf, *p;
-	size_t i,n, len;
-
-	assert(uniq->top > 0);
-	stack = &uniq->stack[uniq->top];
-
-	len = 1;
-	n = stack->entries.len;
-	for (i=0; i < n; i++) {
-		len += 1;
-		switch (stack->entries.items[i].type) {
-		case SJP_TRUE:
-		case SJP_FALSE:
-		case SJP_NULL:
-			break;
+	struct jvst_vm_uniq_chunk *c;
+	size_t align;
+	void *p;
 
-		case SJP_NUMBER:
-			len += sizeof stack->entries.items[i].u.d;
-			break;
-
-		case SJP_STRING:
-		case SJP_ARRAY_BEG:
-		case SJP_OBJECT_BEG:
-			len += stack->entries.items[i].u.b.len;
-			break;
+	// keep every allocation aligned for entries
+	align = sizeof arena->chunks->data[0];
+	n = (n + align - 1) & ~(align - 1);
 
-		default:
-		case SJP_ARRAY_END:
-		case SJP_OBJECT_END:
-			SHOULD_NOT_REACH();
-		}
+	c = arena->chunks;
+	if (c == NULL || c->cap - c->len < n) {
+		c = arena->chunks = arena_newchunk(c, n);
 	}
 
-	buf = xmalloc(len);
-	p = buf;
-
-	*p++ = SJP_ARRAY_BEG;
-	for (i=0; i < n; i++) {
-		assert(p < buf+len);
-		*p++ = stack->entries.items[i].type;
-
-		switch (stack->entries.items[i].type) {
-		case SJP_TRUE:
-		case SJP_FALSE:
-		case SJP_NULL:
-			break;
+	p = (char *)&c->data[0] + c->len;
+	c->len += n;
 
-		case SJP_NUMBER:
-			{
-				size_t nb = sizeof stack->entries.items[i].u.d;
-				memcpy(p, &stack->entries.items[i].u.d, nb);
-				p += nb;
-			}
-			break;
+	return p;
+}
 
-		case SJP_STRING:
-		case SJP_ARRAY_BEG:
-		case SJP_OBJECT_BEG:
-			{
-				size_t nb = stack->entries.items[i].u.b.len;
-				memcpy(p, stack->entries.items[i].u.b.data, nb);
-				p += nb;
-			}
-			break;
+/* Frees every chunk but the oldest, and rewinds that one. */
+static void
+arena_release(struct jvst_vm_uniq_arena *arena)
+{
+	struct jvst_vm_uniq_chunk *c, *next;
 
-		default:
-		case SJP_ARRAY_END:
-		case SJP_OBJECT_END:
-			SHOULD_NOT_REACH();
-		}
+	c = arena->chunks;
+	if (c == NULL) {
+		return;
 	}
 
-	entry = malloc(sizeof *entry);  // XXX - replace with pool allocator?
-	entry->type = composite_state;
+	for (; c->next != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
 
-	entry->u.b.data = buf;
-	entry->u.b.len = len;
+	c->len = 0;
+	arena->chunks = c;
+}
 
-	return entry;
+static void
+arena_free(struct jvst_vm_uniq_arena *arena)
+{
+	arena_release(arena);
+	free(arena->chunks);
+	arena->chunks = NULL;
 }
 
-static struct jvst_vm_uniq_entry *
-array_entry(struct jvst_vm_unique *uniq)
+static void
+uniq_stack_init(struct jvst_vm_unique_stack *frame, enum jvst_vm_uniq_state state)
 {
-	assert(uniq->stack[uniq->top].state == JVST_VM_UNIQ_ARRAY);
-	return composite_entry(uniq, SJP_ARRAY_BEG);
+	frame->state = state;
+	frame->buf.len = 0;
+	frame->sum = 0;
+	frame->key = 0;
+	frame->count = 0;
+	frame->off = 0;
 }
 
-static int obj_pair_compare(const void *a, const void *b)
+static void
+uniq_stack_final(struct jvst_vm_unique_stack *frame)
 {
-	const struct jvst_vm_uniq_entry *ea = a;
-	const struct jvst_vm_uniq_entry *eb = b;
+	// the buffer and hash state are kept for the next frame pushed
+	// at this depth
+	frame->state = JVST_VM_UNIQ_BARE;
+	frame->buf.len = 0;
+}
 
-	assert(ea->type == SJP_STRING);
-	assert(eb->type == SJP_STRING);
+static void
+uniq_push(struct jvst_vm_unique *uniq, enum jvst_vm_uniq_state state)
+{
+	size_t top;
 
-	size_t na = ea->u.b.len;
-	size_t nb = eb->u.b.len;
+	top = uniq->top + 1;
+	if (top >= uniq->nstack) {
+		size_t n = uniq->nstack;
 
-	size_t nmin = na < nb ? na : nb;
-	int cmp = memcmp(ea->u.b.data, eb->u.b.data, nmin);
-	if (cmp != 0) {
-		return cmp;
+		uniq->stack = xenlargevec(uniq->stack, &uniq->nstack, 1, sizeof uniq->stack[0]);
+		memset(&uniq->stack[n], 0, (uniq->nstack - n) * sizeof uniq->stack[0]);
 	}
 
-	return (na > nb) - (na < nb);
+	uniq->top = top;
+	uniq_stack_init(&uniq->stack[top], state);
 }
 
+/* Starts a nested array or object: writes its header and pushes a
+ * frame to hash its contents.
+ */
 static void
-sort_pairs(struct jvst_vm_unique *uniq)
+uniq_begin(struct jvst_vm_unique *uniq, enum SJP_EVENT type, enum jvst_vm_uniq_state state)
 {
-	struct jvst_vm_unique_stack *stack;
+	struct jvst_vm_unique_stack *frame;
+	size_t off;
 
-	stack = &uniq->stack[uniq->top];
-	assert(stack->entries.len % 2 == 0); // even number
+	if (uniq->top == 0) {
+		uniq->enc.len = 0;
+	}
+
+	enc_type(uniq, type);
+	off = uniq->enc.len;
+	enc_size(uniq, 0);
+	enc_size(uniq, 0);
 
-	if (stack->entries.len < 4) {
-		return; // no need to sort...
+	uniq_push(uniq, state);
+	frame = &uniq->stack[uniq->top];
+	frame->off = off;
+
+	if (state != JVST_VM_UNIQ_ARRAY) {
+		return;
 	}
 
-	qsort(&stack->entries.items[0],
-		stack->entries.len/2,
-		2 * sizeof stack->entries.items[0],
-		obj_pair_compare);
-}
+	if (frame->hash == NULL) {
+		frame->hash = XXH64_createState();
+		if (frame->hash == NULL) {
+			fprintf(stderr, WHEREFMT "cannot allocate hash state\n", WHEREARGS);
+			abort();
+		}
+	}
 
-static struct jvst_vm_uniq_entry *
-object_entry(struct jvst_vm_unique *uniq)
-{
-	assert(uniq->stack[uniq->top].state == JVST_VM_UNIQ_OBJKEY);
-	sort_pairs(uniq);
-	return composite_entry(uniq, SJP_OBJECT_BEG);
+	XXH64_reset(frame->hash, (unsigned long long)SJP_ARRAY_BEG);
 }
 
+/* Finishes a nested array or object: fills in its header and pops its
+ * frame.
+ */
 static void
-finalize_entry(struct jvst_vm_uniq_entry *entry)
+uniq_end(struct jvst_vm_unique *uniq)
 {
-	if (!entry) {
-		return;
-	}
+	struct jvst_vm_unique_stack *frame;
+	size_t span;
 
-	switch (entry->type) {
-	default:
-	case SJP_NONE:
-	case SJP_OBJECT_END:
-	case SJP_ARRAY_END:
-		SHOULD_NOT_REACH();
+	assert(uniq->top > 0);
+	frame = &uniq->stack[uniq->top];
 
-	case SJP_NULL:
-	case SJP_TRUE:
-	case SJP_FALSE:
-	case SJP_NUMBER:
-		return;
+	span = uniq->enc.len - frame->off - 2 * sizeof span;
+	memcpy(uniq->enc.ptr + frame->off, &span, sizeof span);
+	memcpy(uniq->enc.ptr + frame->off + sizeof span, &frame->count, sizeof frame->count);
 
-	case SJP_STRING:
-	case SJP_OBJECT_BEG:
-	case SJP_ARRAY_BEG:
-		free(entry->u.b.data);
-		return;
-	}
+	uniq_stack_final(frame);
+	uniq->top--;
+}
+
+/* Scrambles the bits of a number for the number set. */
+static uint64_t
+mix_bits(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
 }
 
 static void
-free_entry(struct jvst_vm_uniq_entry *entry)
+numset_clear(struct jvst_vm_unique *uniq)
 {
-	if (!entry) {
-		return;
+	size_t i;
+
+	for (i=0; i < uniq->nums.cap; i++) {
+		uniq->nums.bits[i] = UNIQ_NUM_EMPTY;
 	}
 
-	finalize_entry(entry);
-	free(entry);
+	uniq->nums.len = 0;
 }
 
-
-static void uniq_add_entry(struct jvst_vm_unique *uniq, struct jvst_vm_uniq_entry *entry)
+static void
+numset_put(uint64_t *tbl, size_t cap, uint64_t bits)
 {
-	struct jvst_vm_unique_stack *stack;
-
-	stack = &uniq->stack[uniq->top];
-	assert(stack->state == JVST_VM_UNIQ_ARRAY   ||
-		stack->state == JVST_VM_UNIQ_OBJKEY ||
-		stack->state == JVST_VM_UNIQ_OBJVAL);
+	size_t i;
 
-	if (stack->entries.len >= stack->entries.cap) {
-		stack->entries.items = xenlargevec(stack->entries.items, &stack->entries.cap, 1, sizeof stack->entries.items[0]);
+	for (i = mix_bits(bits) & (cap-1); tbl[i] != UNIQ_NUM_EMPTY; i = (i+1) & (cap-1)) {
+		continue;
 	}
 
-	assert(stack->entries.len < stack->entries.cap);
+	tbl[i] = bits;
+}
+
+/* Sets are kept at most half full */
+static void
+numset_grow(struct jvst_vm_unique *uniq)
+{
+	uint64_t *old, *tbl;
+	size_t i, oldcap, cap;
+
+	old = uniq->nums.bits;
+	oldcap = uniq->nums.cap;
+
+	cap = (oldcap > 0) ? 2*oldcap : UNIQ_SET_INIT;
+	tbl = xmalloc(cap * sizeof tbl[0]);
+	for (i=0; i < cap; i++) {
+		tbl[i] = UNIQ_NUM_EMPTY;
+	}
+
+	for (i=0; i < oldcap; i++) {
+		if (old[i] != UNIQ_NUM_EMPTY) {
+			numset_put(tbl, cap, old[i]);
+		}
+	}
+
+	free(old);
+	uniq->nums.bits = tbl;
+	uniq->nums.cap = cap;
+}
+
+static int
+numset_add(struct jvst_vm_unique *uniq, uint64_t bits)
+{
+	size_t i, mask;
+
+	if (2*(uniq->nums.len+1) > uniq->nums.cap) {
+		numset_grow(uniq);
+	}
+
+	mask = uniq->nums.cap - 1;
+	for (i = mix_bits(bits) & mask; uniq->nums.bits[i] != UNIQ_NUM_EMPTY; i = (i+1) & mask) {
+		if (uniq->nums.bits[i] == bits) {
+			return 0;
+		}
+	}
+
+	uniq->nums.bits[i] = bits;
+	uniq->nums.len++;
+	return 1;
+}
+
+static void
+strset_clear(struct jvst_vm_unique *uniq)
+{
+	if (uniq->strs.cap > 0) {
+		memset(uniq->strs.slots, 0, uniq->strs.cap * sizeof uniq->strs.slots[0]);
+	}
+
+	uniq->strs.len = 0;
+}
+
+static void
+strset_grow(struct jvst_vm_unique *uniq)
+{
+	struct jvst_vm_uniq_str *old, *tbl;
+	size_t i, j, oldcap, cap;
+
+	old = uniq->strs.slots;
+	oldcap = uniq->strs.cap;
+
+	cap = (oldcap > 0) ? 2*oldcap : UNIQ_SET_INIT;
+	tbl = xcalloc(cap, sizeof tbl[0]);
+
+	for (i=0; i < oldcap; i++) {
+		if (old[i].s == NULL) {
+			continue;
+		}
+
+		for (j = old[i].hash & (cap-1); tbl[j].s != NULL; j = (j+1) & (cap-1)) {
+			continue;
+		}
+
+		tbl[j] = old[i];
+	}
+
+	free(old);
+	uniq->strs.slots = tbl;
+	uniq->strs.cap = cap;
+}
+
+static int
+strset_add(struct jvst_vm_unique *uniq, uint64_t h, const char *s, size_t n)
+{
+	struct jvst_vm_uniq_str *slot;
+	size_t i, mask;
+	char *p;
+
+	if (2*(uniq->strs.len+1) > uniq->strs.cap) {
+		strset_grow(uniq);
+	}
+
+	mask = uniq->strs.cap - 1;
+	for (i = h & mask; uniq->strs.slots[i].s != NULL; i = (i+1) & mask) {
+		slot = &uniq->strs.slots[i];
+		if (slot->hash == h && slot->n == n && (n == 0 || memcmp(slot->s, s, n) == 0)) {
+			return 0;
+		}
+	}
+
+	p = arena_alloc(&uniq->arena, n);
+	if (n > 0) {
+		memcpy(p, s, n);
+	}
+
+	slot = &uniq->strs.slots[i];
+	slot->hash = h;
+	slot->s = p;
+	slot->n = n;
+	uniq->strs.len++;
+
+	return 1;
+}
+
+struct jvst_vm_unique *
+jvst_vm_uniq_initialize(void)
+{
+	struct jvst_vm_unique *uniq;
+	uniq = xmalloc(sizeof *uniq);
+	// hmap_create_string(DEFAULT_UNIQ_BUCKETS, DEFAULT_UNIQ_LOAD);
+	uniq->entries = hmap_create(
+		DEFAULT_UNIQ_BUCKETS,
+		DEFAULT_UNIQ_LOAD,
+		NULL, 
+		hash_entry, 
+		compare_entries);
+
+	uniq->items = JVST_VM_UNIQ_ITEMS_NONE;
+	uniq->nums.bits = NULL;
+	uniq->nums.len = 0;
+	uniq->nums.cap = 0;
+	uniq->strs.slots = NULL;
+	uniq->strs.len = 0;
+	uniq->strs.cap = 0;
+
+	uniq->arena.chunks = NULL;
+
+	uniq->enc.ptr = NULL;
+	uniq->enc.len = 0;
+	uniq->enc.cap = 0;
+
+	uniq->nstack = UNIQ_STACK_INIT;
+	uniq->stack = xcalloc(uniq->nstack, sizeof uniq->stack[0]);
+	uniq->top = 0;
+	uniq_stack_init(&uniq->stack[uniq->top], JVST_VM_UNIQ_BARE);
+
+	uniq->next_free = NULL;
+
+	return uniq;
+}
+
+void
+jvst_vm_uniq_reset(struct jvst_vm_unique *uniq)
+{
+	if (uniq->nums.len > 0) {
+		numset_clear(uniq);
+	}
+
+	if (uniq->strs.len > 0) {
+		strset_clear(uniq);
+	}
+
+	uniq->items = JVST_VM_UNIQ_ITEMS_NONE;
+	hmap_clear(uniq->entries);
+
+	while (uniq->top > 0) {
+		uniq_stack_final(&uniq->stack[uniq->top--]);
+	}
+
+	uniq_stack_init(&uniq->stack[0], JVST_VM_UNIQ_BARE);
+	uniq->enc.len = 0;
+	arena_release(&uniq->arena);
+}
+
+void
+jvst_vm_uniq_finalize(struct jvst_vm_unique *uniq)
+{
+	size_t i;
+
+	jvst_vm_uniq_reset(uniq);
+	hmap_free(uniq->entries);
+	arena_free(&uniq->arena);
+
+	for (i=0; i < uniq->nstack; i++) {
+		free(uniq->stack[i].buf.ptr);
+		if (uniq->stack[i].hash != NULL) {
+			XXH64_freeState(uniq->stack[i].hash);
+		}
+	}
+	free(uniq->stack);
+	free(uniq->enc.ptr);
+	free(uniq->nums.bits);
+	free(uniq->strs.slots);
+
+	free(uniq);
+}
+
+/* Returns the text of a string token, prefixed by any partial text
+ * buffered in the frame.
+ */
+static const char *
+string_text(struct jvst_vm_unique_stack *frame, const struct sjp_event *evt, size_t *np)
+{
+	if (frame->buf.len == 0) {
+		*np = evt->n;
+		return evt->text;
+	}
+
+	if (frame->buf.cap - frame->buf.len < evt->n) {
+		frame->buf.ptr = xenlargevec(frame->buf.ptr, &frame->buf.cap,
+			evt->n - (frame->buf.cap - frame->buf.len), 1);
+	}
+
+	if (evt->n > 0) {
+		memcpy(frame->buf.ptr + frame->buf.len, evt->text, evt->n);
+	}
+
+	*np = frame->buf.len + evt->n;
+	frame->buf.len = 0;
+	return frame->buf.ptr;
+}
+
+/* Adds an item of the array to the generic set, returning 0 if it's
+ * already there.  The item is only copied into the arena if it's new.
+ */
+static int
+uniq_add_item(struct jvst_vm_unique *uniq, enum SJP_EVENT type, uint64_t h,
+	double d, const char *s, size_t n)
+{
+	struct jvst_vm_uniq_entry key, *entry;
+
+	key.type = type;
+	key.hash = h;
+	key.u.b.data = NULL;
+	key.u.b.len = 0;
+
+	switch (type) {
+	case SJP_NULL:
+	case SJP_TRUE:
+	case SJP_FALSE:
+		break;
+
+	case SJP_NUMBER:
+		key.u.d = d;
+		break;
+
+	case SJP_STRING:
+		key.u.b.data = (char *)s;
+		key.u.b.len = n;
+		break;
+
+	case SJP_ARRAY_BEG:
+	case SJP_OBJECT_BEG:
+		key.u.b.data = uniq->enc.ptr;
+		key.u.b.len = uniq->enc.len;
+		break;
+
+	default:
+		SHOULD_NOT_REACH();
+	}
+
+	if (hmap_get(uniq->entries, &key) != NULL) {
+		return 0;
+	}
+
+	entry = arena_alloc(&uniq->arena, sizeof *entry);
+	*entry = key;
+	if (type == SJP_STRING || type == SJP_ARRAY_BEG || type == SJP_OBJECT_BEG) {
+		entry->u.b.data = arena_alloc(&uniq->arena, key.u.b.len);
+		if (key.u.b.len > 0) {
+			memcpy(entry->u.b.data, key.u.b.data, key.u.b.len);
+		}
+	}
+
+	hmap_setptr(uniq->entries, entry, NULL);
+	return 1;
+}
+
+/* Moves the items of a specialised set into the generic set.  The
+ * strings are already in the arena, so the entries share their bytes.
+ */
+static void
+uniq_mixed(struct jvst_vm_unique *uniq)
+{
+	struct jvst_vm_uniq_entry *entry;
+	size_t i;
+
+	switch (uniq->items) {
+	case JVST_VM_UNIQ_ITEMS_MIXED:
+		return;
+
+	case JVST_VM_UNIQ_ITEMS_NONE:
+		break;
+
+	case JVST_VM_UNIQ_ITEMS_NUMBERS:
+		for (i=0; i < uniq->nums.cap; i++) {
+			uint64_t bits = uniq->nums.bits[i];
+
+			if (bits == UNIQ_NUM_EMPTY) {
+				continue;
+			}
+
+			entry = arena_alloc(&uniq->arena, sizeof *entry);
+			entry->type = SJP_NUMBER;
+			entry->hash = number_hash(bits);
+			memcpy(&entry->u.d, &bits, sizeof entry->u.d);
+			hmap_setptr(uniq->entries, entry, NULL);
+		}
+
+		numset_clear(uniq);
+		break;
+
+	case JVST_VM_UNIQ_ITEMS_STRINGS:
+		for (i=0; i < uniq->strs.cap; i++) {
+			struct jvst_vm_uniq_str *slot = &uniq->strs.slots[i];
+
+			if (slot->s == NULL) {
+				continue;
+			}
+
+			entry = arena_alloc(&uniq->arena, sizeof *entry);
+			entry->type = SJP_STRING;
+			entry->hash = slot->hash;
+			entry->u.b.data = (char *)slot->s;
+			entry->u.b.len = slot->n;
+			hmap_setptr(uniq->entries, entry, NULL);
+		}
+
+		strset_clear(uniq);
+		break;
+	}
+
+	uniq->items = JVST_VM_UNIQ_ITEMS_MIXED;
+}
+
+static int
+uniq_add_number(struct jvst_vm_unique *uniq, uint64_t bits)
+{
+	double d;
+
+	if (uniq->items == JVST_VM_UNIQ_ITEMS_NONE) {
+		uniq->items = JVST_VM_UNIQ_ITEMS_NUMBERS;
+	}
 
-	stack->entries.items[stack->entries.len++] = *entry;
+	if (uniq->items == JVST_VM_UNIQ_ITEMS_NUMBERS) {
+		return numset_add(uniq, bits);
+	}
+
+	uniq_mixed(uniq);
+	memcpy(&d, &bits, sizeof d);
+	return uniq_add_item(uniq, SJP_NUMBER, number_hash(bits), d, NULL, 0);
+}
+
+static int
+uniq_add_string(struct jvst_vm_unique *uniq, uint64_t h, const char *s, size_t n)
+{
+	if (uniq->items == JVST_VM_UNIQ_ITEMS_NONE) {
+		uniq->items = JVST_VM_UNIQ_ITEMS_STRINGS;
+	}
+
+	if (uniq->items == JVST_VM_UNIQ_ITEMS_STRINGS) {
+		return strset_add(uniq, h, s, n);
+	}
+
+	uniq_mixed(uniq);
+	return uniq_add_item(uniq, SJP_STRING, h, 0.0, s, n);
 }
 
 /* Unique evaluation machine (UEM)
  *
  * The UEM is a pushdown automaton.  There's a stack used for processing
  * nested structures.  Each level of the stack has an attached state,
- * and a pointer into a storage buffer.
+ * the running hash of its contents, and the offset of its header in the
+ * encoding of the current item.
  *
  * The stack state is:
  * 1) ARRAY                     array expecting item or ']'
@@ -467,100 +955,801 @@ static void uniq_add_entry(struct jvst_vm_unique *uniq, struct jvst_vm_uniq_entr
  */
 
 
-enum jvst_result
-jvst_vm_uniq_evaluate(struct jvst_vm_unique *uniq, enum SJP_RESULT pret, struct sjp_event *evt)
+
+
+/* A complete value, as uniq_scan() returns it.  Top level strings and
+ * numbers aren't encoded: a string is its text, and a number is the bits
+ * of its canonical form, without a hash.  Arrays and objects are in the
+ * encoding.
+ */
+struct uniq_value {
+	enum SJP_EVENT type;
+	uint64_t hash;
+	uint64_t bits;
+	const char *s;
+	size_t n;
+};
+
+/* Buffers the text of a partial string in the frame, where
+ * string_text() will find it when the string is complete.
+ */
+static void
+uniq_partial(struct jvst_vm_unique *uniq, const struct sjp_event *evt)
 {
-	struct jvst_vm_uniq_entry *entry;
+	struct jvst_vm_unique_stack *frame;
 
-	if (SJP_ERROR(pret)) {
-		return JVST_INVALID;
+	frame = &uniq->stack[uniq->top];
+	if (frame->buf.cap - frame->buf.len < evt->n) {
+		frame->buf.ptr = xenlargevec(frame->buf.ptr, &frame->buf.cap,
+			evt->n - (frame->buf.cap - frame->buf.len), 1);
 	}
 
-	if (pret == SJP_PARTIAL || pret == SJP_MORE) {
-		// FIXME: need to handle partial!
-		return JVST_MORE;
+	if (evt->n > 0) {
+		memcpy(frame->buf.ptr + frame->buf.len, evt->text, evt->n);
+		frame->buf.len += evt->n;
 	}
+}
 
-	if (uniq->top == 0 && uniq->stack[uniq->top].state == JVST_VM_UNIQ_DONE) {
-		return JVST_VALID;
-	}
+/* Takes the next token of a value.  Returns JVST_NEXT while the value
+ * is incomplete, and JVST_VALID once it's complete, with the value in
+ * *vp.
+ */
+static enum jvst_result
+uniq_scan(struct jvst_vm_unique *uniq, const struct sjp_event *evt, struct uniq_value *vp)
+{
+	struct jvst_vm_unique_stack *frame;
+	enum SJP_EVENT type;
+	const char *s = NULL;
+	size_t n = 0;
+	uint64_t h, bits;
 
-	assert(pret == SJP_OK);
+	frame = &uniq->stack[uniq->top];
+	type = evt->type;
 
 	switch (evt->type) {
 	case SJP_NULL:
 	case SJP_TRUE:
 	case SJP_FALSE:
-		entry = literal_entry(uniq,evt->type);
+		h = scalar_hash(type, "", 0);
+		if (uniq->top > 0) {
+			enc_type(uniq, type);
+		}
 		break;
 
 	case SJP_STRING:
-		entry = string_entry(uniq,evt->text, evt->n);
+		s = string_text(frame, evt, &n);
+		h = scalar_hash(type, s, n);
+		if (uniq->top == 0) {
+			vp->type = type;
+			vp->hash = h;
+			vp->s = s;
+			vp->n = n;
+			return JVST_VALID;
+		}
+
+		enc_type(uniq, type);
+		enc_size(uniq, n);
+		enc_put(uniq, s, n);
 		break;
 
 	case SJP_NUMBER:
-		entry = number_entry(uniq,evt->extra.d);
+		bits = number_bits(evt->extra.d);
+		if (uniq->top == 0) {
+			vp->type = type;
+			vp->bits = bits;
+			return JVST_VALID;
+		}
+
+		h = number_hash(bits);
+		enc_type(uniq, type);
+		enc_put(uniq, &bits, sizeof bits);
 		break;
 
 	case SJP_ARRAY_BEG:
-		uniq_stack_init(&uniq->stack[++uniq->top], JVST_VM_UNIQ_ARRAY);
+		uniq_begin(uniq, SJP_ARRAY_BEG, JVST_VM_UNIQ_ARRAY);
 		return JVST_NEXT;
 
 	case SJP_ARRAY_END:
-		if (uniq->top == 0) {
-			uniq->stack[uniq->top].state = JVST_VM_UNIQ_DONE;
-			return JVST_VALID;
-		}
-
-		assert(uniq->stack[uniq->top].state == JVST_VM_UNIQ_ARRAY);
-		entry = array_entry(uniq);
-		uniq_stack_final(&uniq->stack[uniq->top--]);
+		assert(uniq->top > 0);
+		assert(frame->state == JVST_VM_UNIQ_ARRAY);
+		type = SJP_ARRAY_BEG;
+		h = XXH64_digest(frame->hash);
+		uniq_end(uniq);
 		break;
 
 	case SJP_OBJECT_BEG:
-		uniq_stack_init(&uniq->stack[++uniq->top], JVST_VM_UNIQ_OBJKEY);
+		uniq_begin(uniq, SJP_OBJECT_BEG, JVST_VM_UNIQ_OBJKEY);
 		return JVST_NEXT;
 
 	case SJP_OBJECT_END:
-		assert(uniq->stack[uniq->top].state == JVST_VM_UNIQ_OBJKEY);
-		entry = object_entry(uniq);
-		uniq_stack_final(&uniq->stack[uniq->top--]);
+		assert(frame->state == JVST_VM_UNIQ_OBJKEY);
+		type = SJP_OBJECT_BEG;
+		h = object_hash(frame->sum, frame->count);
+		uniq_end(uniq);
 		break;
 
 	default:
 	case SJP_NONE: SHOULD_NOT_REACH();
 	}
 
-	switch (uniq->stack[uniq->top].state) {
+	frame = &uniq->stack[uniq->top];
+	switch (frame->state) {
 	case JVST_VM_UNIQ_BARE:
-		if (hmap_get(uniq->entries, entry) != NULL) {
-			free_entry(entry);
-			// XXX - set state to
-			// unique violation
-			return JVST_INVALID;
-		}
-
-		hmap_setptr(uniq->entries, entry, NULL);
+		vp->type = type;
+		vp->hash = h;
 		return JVST_VALID;
 
 	case JVST_VM_UNIQ_ARRAY:
-		uniq_add_entry(uniq, entry);
+		array_hash_item(frame->hash, h);
+		frame->count++;
 		return JVST_NEXT;
 
 	case JVST_VM_UNIQ_OBJKEY:
-		uniq_add_entry(uniq, entry);
-		uniq->stack[uniq->top].state = JVST_VM_UNIQ_OBJVAL;
+		frame->key = h;
+		frame->state = JVST_VM_UNIQ_OBJVAL;
 		return JVST_NEXT;
 
 	case JVST_VM_UNIQ_OBJVAL:
-		uniq_add_entry(uniq, entry);
-		uniq->stack[uniq->top].state = JVST_VM_UNIQ_OBJKEY;
+		frame->sum += member_hash(frame->key, h);
+		frame->count++;
+		frame->state = JVST_VM_UNIQ_OBJKEY;
 		return JVST_NEXT;
 
 	default:
 		SHOULD_NOT_REACH();
 	}
+}
+
+enum jvst_result
+jvst_vm_uniq_evaluate(struct jvst_vm_unique *uniq, enum SJP_RESULT pret, struct sjp_event *evt)
+{
+	struct uniq_value v;
+	enum jvst_result ret;
+	int added;
+
+	if (SJP_ERROR(pret)) {
+		return JVST_INVALID;
+	}
+
+	if (pret == SJP_PARTIAL || pret == SJP_MORE) {
+		if (pret == SJP_PARTIAL && evt->type == SJP_STRING) {
+			uniq_partial(uniq, evt);
+		}
+
+		return JVST_MORE;
+	}
+
+	if (uniq->top == 0 && uniq->stack[uniq->top].state == JVST_VM_UNIQ_DONE) {
+		return JVST_VALID;
+	}
+
+	assert(pret == SJP_OK);
+
+	if (uniq->top == 0 && evt->type == SJP_ARRAY_END) {
+		uniq->stack[uniq->top].state = JVST_VM_UNIQ_DONE;
+		return JVST_VALID;
+	}
+
+	ret = uniq_scan(uniq, evt, &v);
+	if (ret != JVST_VALID) {
+		return ret;
+	}
+
+	switch (v.type) {
+	case SJP_STRING:
+		added = uniq_add_string(uniq, v.hash, v.s, v.n);
+		break;
+
+	case SJP_NUMBER:
+		added = uniq_add_number(uniq, v.bits);
+		break;
+
+	default:
+		uniq_mixed(uniq);
+		added = uniq_add_item(uniq, v.type, v.hash, 0.0, NULL, 0);
+		break;
+	}
+
+	// XXX - set state to unique violation
+	return added ? JVST_VALID : JVST_INVALID;
+}
+
+/* Value sets
+ *
+ * The table format is described in validate_uniq.h.  Members are hashed
+ * the way the UEM hashes values, so a value from the document is looked
+ * up by the hash uniq_scan() computes as its tokens arrive, and compared
+ * with the members in its bucket chain.
+ */
+
+enum {
+	VSET_MAXDEPTH = 4096,	// deepest member jvst_vm_vset_verify() accepts
+};
+
+struct vset_words {
+	int64_t *words;
+	size_t len;
+	size_t cap;
+};
+
+static enum SJP_EVENT
+vset_type(const int64_t *w)
+{
+	return (enum SJP_EVENT)((uint64_t)w[0] & 0xff);
+}
+
+static uint64_t
+vset_size(const int64_t *w)
+{
+	return (uint64_t)w[0] >> 8;
+}
+
+static const int64_t *
+vset_skip(const int64_t *w)
+{
+	uint64_t i, n;
+
+	n = vset_size(w);
+	switch (vset_type(w)) {
+	case SJP_NULL:
+	case SJP_TRUE:
+	case SJP_FALSE:
+		return w+1;
+
+	case SJP_NUMBER:
+		return w+2;
+
+	case SJP_STRING:
+		return w + 1 + (n+7)/8;
+
+	case SJP_ARRAY_BEG:
+		for (w++, i=0; i < n; i++) {
+			w = vset_skip(w);
+		}
+		return w;
+
+	case SJP_OBJECT_BEG:
+		for (w++, i=0; i < 2*n; i++) {
+			w = vset_skip(w);
+		}
+		return w;
+
+	default:
+		SHOULD_NOT_REACH();
+	}
+}
+
+static int
+vset_bytes_equal(const int64_t *w, const char *s, size_t n)
+{
+	size_t i;
+
+	for (i=0; i < n; i++) {
+		unsigned char c = (unsigned char)((uint64_t)w[i/8] >> (8*(i%8)));
+		if (c != (unsigned char)s[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Compares a member with a value in the encoding */
+static int
+vset_equal_enc(const int64_t *w, const char *a)
+{
+	enum SJP_EVENT type;
+	size_t i, n;
+
+	type = (enum SJP_EVENT)(unsigned char)*a++;
+	if (vset_type(w) != type) {
+		return 0;
+	}
+
+	switch (type) {
+	case SJP_NULL:
+	case SJP_TRUE:
+	case SJP_FALSE:
+		return 1;
+
+	case SJP_NUMBER:
+		{
+			uint64_t bits;
+
+			memcpy(&bits, a, sizeof bits);
+			return (uint64_t)w[1] == bits;
+		}
+
+	case SJP_STRING:
+		n = enc_getsize(a);
+		return vset_size(w) == n && vset_bytes_equal(w+1, a + sizeof n, n);
+
+	case SJP_ARRAY_BEG:
+		n = enc_getsize(a + sizeof n);
+		if (vset_size(w) != n) {
+			return 0;
+		}
+
+		a += 2 * sizeof n;
+		for (w++, i=0; i < n; i++) {
+			if (!vset_equal_enc(w, a)) {
+				return 0;
+			}
+
+			w = vset_skip(w);
+			a = enc_skip(a);
+		}
+
+		return 1;
+
+	case SJP_OBJECT_BEG:
+		{
+			const int64_t *wmem, *mw;
+			size_t j;
+
+			n = enc_getsize(a + sizeof n);
+			if (vset_size(w) != n) {
+				return 0;
+			}
+
+			// members are matched up by key, in any order
+			wmem = w+1;
+			a += 2 * sizeof n;
+			for (i=0; i < n; i++) {
+				for (mw = wmem, j=0; j < n; j++) {
+					if (vset_equal_enc(mw, a) && vset_equal_enc(vset_skip(mw), enc_skip(a))) {
+						break;
+					}
+
+					mw = vset_skip(vset_skip(mw));
+				}
+
+				if (j == n) {
+					return 0;
+				}
+
+				a = enc_skip(enc_skip(a));
+			}
+
+			return 1;
+		}
+
+	default:
+		SHOULD_NOT_REACH();
+	}
+}
+
+static int
+vset_lookup(const int64_t *tbl, const struct uniq_value *v, const char *enc)
+{
+	uint64_t h, mask, b;
+
+	h = (v->type == SJP_NUMBER) ? number_hash(v->bits) : v->hash;
+
+	mask = (uint64_t)tbl[0] - 1;
+	for (b = h & mask; tbl[2+2*b] != 0; b = (b+1) & mask) {
+		const int64_t *w;
+
+		if ((uint64_t)tbl[1+2*b] != h) {
+			continue;
+		}
+
+		w = &tbl[tbl[2+2*b]];
+		if (vset_type(w) != v->type) {
+			continue;
+		}
+
+		switch (v->type) {
+		case SJP_NULL:
+		case SJP_TRUE:
+		case SJP_FALSE:
+			return 1;
+
+		case SJP_NUMBER:
+			if ((uint64_t)w[1] == v->bits) {
+				return 1;
+			}
+			break;
+
+		case SJP_STRING:
+			if (vset_size(w) == v->n && vset_bytes_equal(w+1, v->s, v->n)) {
+				return 1;
+			}
+			break;
+
+		case SJP_ARRAY_BEG:
+		case SJP_OBJECT_BEG:
+			if (vset_equal_enc(w, enc)) {
+				return 1;
+			}
+			break;
+
+		default:
+			SHOULD_NOT_REACH();
+		}
+	}
+
+	return 0;
+}
+
+int
+jvst_vm_vset_find(const int64_t *tbl, const struct sjp_event *evt)
+{
+	struct uniq_value v;
+
+	v.type = evt->type;
+	v.hash = 0;
+	v.bits = 0;
+	v.s = NULL;
+	v.n = 0;
+
+	switch (evt->type) {
+	case SJP_NULL:
+	case SJP_TRUE:
+	case SJP_FALSE:
+		v.hash = scalar_hash(v.type, "", 0);
+		break;
+
+	case SJP_STRING:
+		v.s = evt->text;
+		v.n = evt->n;
+		v.hash = scalar_hash(v.type, v.s, v.n);
+		break;
+
+	case SJP_NUMBER:
+		v.bits = number_bits(evt->extra.d);
+		break;
+
+	default:
+		SHOULD_NOT_REACH();
+	}
+
+	return vset_lookup(tbl, &v, NULL);
+}
+
+enum jvst_result
+jvst_vm_uniq_member(struct jvst_vm_unique *uniq, const int64_t *tbl,
+	enum SJP_RESULT pret, const struct sjp_event *evt)
+{
+	struct uniq_value v;
+	enum jvst_result ret;
+
+	if (SJP_ERROR(pret)) {
+		return JVST_INVALID;
+	}
+
+	if (pret == SJP_PARTIAL || pret == SJP_MORE) {
+		if (pret == SJP_PARTIAL && evt->type == SJP_STRING) {
+			uniq_partial(uniq, evt);
+		}
+
+		return JVST_MORE;
+	}
+
+	ret = uniq_scan(uniq, evt, &v);
+	if (ret != JVST_VALID) {
+		return ret;
+	}
+
+	return vset_lookup(tbl, &v, uniq->enc.ptr) ? JVST_VALID : JVST_INVALID;
+}
+
+static enum SJP_EVENT
+json_event_type(const struct json_value *v)
+{
+	switch (v->type) {
+	case JSON_VALUE_OBJECT:  return SJP_OBJECT_BEG;
+	case JSON_VALUE_ARRAY:   return SJP_ARRAY_BEG;
+	case JSON_VALUE_STRING:  return SJP_STRING;
+	case JSON_VALUE_NUMBER:
+	case JSON_VALUE_INTEGER: return SJP_NUMBER;
+	case JSON_VALUE_BOOL:    return v->u.v ? SJP_TRUE : SJP_FALSE;
+	case JSON_VALUE_NULL:    return SJP_NULL;
+	}
+
+	SHOULD_NOT_REACH();
+}
+
+static void
+vset_put(struct vset_words *vw, int64_t w)
+{
+	if (vw->len >= vw->cap) {
+		vw->words = xenlargevec(vw->words, &vw->cap, 1, sizeof vw->words[0]);
+	}
+
+	vw->words[vw->len++] = w;
+}
+
+static void
+vset_put_header(struct vset_words *vw, enum SJP_EVENT type, uint64_t n)
+{
+	vset_put(vw, (int64_t)((uint64_t)type | (n << 8)));
+}
+
+static void
+vset_put_string(struct vset_words *vw, const struct json_string *str)
+{
+	size_t i, off;
+
+	vset_put_header(vw, SJP_STRING, str->len);
+
+	off = vw->len;
+	for (i=0; i < (str->len+7)/8; i++) {
+		vset_put(vw, 0);
+	}
+
+	for (i=0; i < str->len; i++) {
+		uint64_t c = (unsigned char)str->s[i];
+		vw->words[off + i/8] = (int64_t)((uint64_t)vw->words[off + i/8] | (c << (8*(i%8))));
+	}
+}
+
+static void
+vset_encode(struct vset_words *vw, const struct json_value *v)
+{
+	enum SJP_EVENT type;
+
+	type = json_event_type(v);
+	switch (type) {
+	case SJP_NULL:
+	case SJP_TRUE:
+	case SJP_FALSE:
+		vset_put_header(vw, type, 0);
+		return;
+
+	case SJP_NUMBER:
+		vset_put_header(vw, type, 0);
+		vset_put(vw, (int64_t)number_bits(v->u.n));
+		return;
+
+	case SJP_STRING:
+		vset_put_string(vw, &v->u.str);
+		return;
+
+	case SJP_ARRAY_BEG:
+		{
+			const struct json_element *elt;
+			uint64_t n = 0;
+
+			for (elt = v->u.arr; elt != NULL; elt = elt->next) {
+				n++;
+			}
+
+			vset_put_header(vw, type, n);
+			for (elt = v->u.arr; elt != NULL; elt = elt->next) {
+				vset_encode(vw, &elt->value);
+			}
+		}
+		return;
+
+	case SJP_OBJECT_BEG:
+		{
+			const struct json_property *prop;
+			uint64_t n = 0;
+
+			for (prop = v->u.obj; prop != NULL; prop = prop->next) {
+				n++;
+			}
+
+			vset_put_header(vw, type, n);
+			for (prop = v->u.obj; prop != NULL; prop = prop->next) {
+				vset_put_string(vw, &prop->name);
+				vset_encode(vw, &prop->value);
+			}
+		}
+		return;
+
+	default:
+		SHOULD_NOT_REACH();
+	}
+}
+
+/* Hashes a value the way uniq_scan() hashes it */
+static uint64_t
+vset_hash(const struct json_value *v)
+{
+	enum SJP_EVENT type;
+
+	type = json_event_type(v);
+	switch (type) {
+	case SJP_NULL:
+	case SJP_TRUE:
+	case SJP_FALSE:
+		return scalar_hash(type, "", 0);
+
+	case SJP_NUMBER:
+		return number_hash(number_bits(v->u.n));
+
+	case SJP_STRING:
+		return scalar_hash(type, v->u.str.s, v->u.str.len);
+
+	case SJP_ARRAY_BEG:
+		{
+			const struct json_element *elt;
+			struct XXH64_state_s *st;
+			uint64_t h;
+
+			st = XXH64_createState();
+			if (st == NULL) {
+				fprintf(stderr, WHEREFMT "cannot allocate hash state\n", WHEREARGS);
+				abort();
+			}
+
+			XXH64_reset(st, (unsigned long long)SJP_ARRAY_BEG);
+			for (elt = v->u.arr; elt != NULL; elt = elt->next) {
+				array_hash_item(st, vset_hash(&elt->value));
+			}
+
+			h = XXH64_digest(st);
+			XXH64_freeState(st);
+			return h;
+		}
+
+	case SJP_OBJECT_BEG:
+		{
+			const struct json_property *prop;
+			uint64_t sum = 0;
+			size_t n = 0;
+
+			for (prop = v->u.obj; prop != NULL; prop = prop->next) {
+				uint64_t key = scalar_hash(SJP_STRING, prop->name.s, prop->name.len);
+				sum += member_hash(key, vset_hash(&prop->value));
+				n++;
+			}
+
+			return object_hash(sum, n);
+		}
+
+	default:
+		SHOULD_NOT_REACH();
+	}
+}
+
+int64_t *
+jvst_vm_vset_build(const struct ast_value_set *values, enum SJP_EVENT type,
+	size_t *nmembersp, size_t *nwordsp)
+{
+	const struct ast_value_set *vs;
+	struct vset_words vw = { 0 };
+	size_t i, n, nb, nmembers;
+
+	n = 0;
+	for (vs = values; vs != NULL; vs = vs->next) {
+		n += (json_event_type(&vs->value) == type);
+	}
+
+	// at most half full, so every chain ends in an empty bucket
+	for (nb = 1; nb < 2*n; nb *= 2) {
+		continue;
+	}
+
+	vset_put(&vw, (int64_t)nb);
+	for (i=0; i < 2*nb; i++) {
+		vset_put(&vw, 0);
+	}
+
+	nmembers = 0;
+	for (vs = values; vs != NULL; vs = vs->next) {
+		uint64_t h, b, mask;
+		size_t off, len;
+
+		if (json_event_type(&vs->value) != type) {
+			continue;
+		}
+
+		h = vset_hash(&vs->value);
+		off = vw.len;
+		vset_encode(&vw, &vs->value);
+		len = vw.len - off;
+
+		// an enum may list a value twice
+		mask = nb-1;
+		for (b = h & mask; vw.words[2+2*b] != 0; b = (b+1) & mask) {
+			const int64_t *w = &vw.words[vw.words[2+2*b]];
+
+			if ((uint64_t)vw.words[1+2*b] == h && (size_t)(vset_skip(w) - w) == len &&
+				memcmp(w, &vw.words[off], len * sizeof vw.words[0]) == 0) {
+				break;
+			}
+		}
+
+		if (vw.words[2+2*b] != 0) {
+			vw.len = off;
+			continue;
+		}
+
+		vw.words[1+2*b] = (int64_t)h;
+		vw.words[2+2*b] = (int64_t)off;
+		nmembers++;
+	}
+
+	*nmembersp = nmembers;
+	*nwordsp = vw.len;
+	return vw.words;
+}
+
+/* Returns the end of the member at w, or NULL if it runs past end or
+ * isn't well formed.
+ */
+static const int64_t *
+vset_check(const int64_t *w, const int64_t *end, int depth)
+{
+	uint64_t i, n;
+
+	if (w >= end || depth > VSET_MAXDEPTH) {
+		return NULL;
+	}
+
+	n = vset_size(w);
+	switch (vset_type(w)) {
+	case SJP_NULL:
+	case SJP_TRUE:
+	case SJP_FALSE:
+		return (n == 0) ? w+1 : NULL;
+
+	case SJP_NUMBER:
+		return (n == 0 && end - w >= 2) ? w+2 : NULL;
+
+	case SJP_STRING:
+		if ((n+7)/8 > (uint64_t)(end - w - 1)) {
+			return NULL;
+		}
+		return w + 1 + (n+7)/8;
+
+	case SJP_ARRAY_BEG:
+		for (w++, i=0; i < n && w != NULL; i++) {
+			w = vset_check(w, end, depth+1);
+		}
+		return w;
+
+	case SJP_OBJECT_BEG:
+		for (w++, i=0; i < n && w != NULL; i++) {
+			if (w >= end || vset_type(w) != SJP_STRING) {
+				return NULL;
+			}
+
+			w = vset_check(w, end, depth+1);
+			if (w != NULL) {
+				w = vset_check(w, end, depth+1);
+			}
+		}
+		return w;
+
+	default:
+		return NULL;
+	}
+}
+
+int
+jvst_vm_vset_verify(const int64_t *tbl, size_t n)
+{
+	int64_t nb, b;
+	int empty = 0;
+
+	if (n < 3) {
+		return 0;
+	}
+
+	nb = tbl[0];
+	if (nb <= 0 || (nb & (nb-1)) != 0 || (uint64_t)nb > (n-1)/2) {
+		return 0;
+	}
+
+	for (b=0; b < nb; b++) {
+		int64_t off = tbl[2+2*b];
+
+		if (off == 0) {
+			empty = 1;
+			continue;
+		}
+
+		if (off < 1+2*nb || (uint64_t)off >= n ||
+			vset_check(&tbl[off], &tbl[n], 0) == NULL) {
+			return 0;
+		}
+	}
 
+	return empty;
 }
 
 /* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
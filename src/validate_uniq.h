@@ -1,6 +1,8 @@
 #ifndef VALIDATE_UNIQ_H
 #define VALIDATE_UNIQ_H
 
+#include <stdint.h>
+
 #include "sjp_testing.h"
 #include "jdom.h"
 #include "validate.h"
@@ -9,8 +11,9 @@
 
 #define DEFAULT_UNIQ_BUCKETS 16
 #define DEFAULT_UNIQ_LOAD   0.6f
-#define UNIQ_BUFSIZE  4096
-#define UNIQ_STACK    4096
+#define UNIQ_STACK_INIT  8
+#define UNIQ_ARENA_CHUNK 4096
+#define UNIQ_SET_INIT    16
 
 // XXX - naming
 
@@ -32,11 +35,28 @@ enum jvst_vm_uniq_state {
   JVST_VM_UNIQ_DONE,
 };
 
+/* Which set holds the array's items.  Arrays of only numbers or only
+ * strings use a specialised set.  The first item of any other kind
+ * moves the items into the generic set.
+ */
+enum jvst_vm_uniq_items {
+  JVST_VM_UNIQ_ITEMS_NONE = 0,
+  JVST_VM_UNIQ_ITEMS_NUMBERS,
+  JVST_VM_UNIQ_ITEMS_STRINGS,
+  JVST_VM_UNIQ_ITEMS_MIXED,
+};
+
 struct hmap;
 struct jvst_vm;
+struct XXH64_state_s;
 
+/* An item of the array.  Strings keep their bytes, and arrays and
+ * objects keep their encoding (see validate_uniq.c), which is only
+ * examined when two items hash the same.
+ */
 struct jvst_vm_uniq_entry {
 	enum SJP_EVENT type;
+	uint64_t hash;
 	union {
 		struct {
 			char *data;
@@ -47,40 +67,166 @@ struct jvst_vm_uniq_entry {
 	} u;
 };
 
+/* Entries and their encodings are carved out of a bump arena that is
+ * released all at once when the set is reset.  The arena is a list of
+ * chunks, newest first.  The oldest chunk is kept across resets so a
+ * pooled set doesn't go back to malloc for small arrays.
+ */
+struct jvst_vm_uniq_chunk {
+	struct jvst_vm_uniq_chunk *next;
+	size_t len;
+	size_t cap;
+
+	union {
+		double d;
+		void *p;
+		size_t n;
+	} data[];
+};
+
+struct jvst_vm_uniq_arena {
+	struct jvst_vm_uniq_chunk *chunks;
+};
+
+/* A slot in the string set.  The bytes are kept in the arena, and an
+ * empty slot has a NULL pointer.
+ */
+struct jvst_vm_uniq_str {
+	uint64_t hash;
+	const char *s;
+	size_t n;
+};
+
+/* A nested array or object being hashed.  Arrays feed the hashes of
+ * their items to a streaming hash in order.  Objects sum the hashes of
+ * their members, so the order of the members doesn't matter.
+ */
 struct jvst_vm_unique_stack {
 	enum jvst_vm_uniq_state state;
-	char buf0[UNIQ_BUFSIZE];
 	struct {
 		char *ptr;
 		size_t len;
 		size_t cap;
 	} buf;
 
-	struct {
-		struct jvst_vm_uniq_entry *items;
-		size_t len;
-		size_t cap;
-	} entries;
+	struct XXH64_state_s *hash;
+	uint64_t sum;
+	uint64_t key;
+	size_t count;
+
+	// offset of the array or object header in the encoding
+	size_t off;
 };
 
 struct jvst_vm_unique
 {
+	enum jvst_vm_uniq_items items;
+
+	// open addressed sets for arrays of numbers or strings.  Numbers
+	// are stored as the bits of their canonical form.
+	struct {
+		uint64_t *bits;
+		size_t len;
+		size_t cap;
+	} nums;
+
+	struct {
+		struct jvst_vm_uniq_str *slots;
+		size_t len;
+		size_t cap;
+	} strs;
+
 	struct hmap *entries;
 
-	struct jvst_vm_unique_stack stack[UNIQ_STACK];
+	struct jvst_vm_uniq_arena arena;
+
+	// encoding of the current item, copied into the arena when the
+	// item is complete
+	struct {
+		char *ptr;
+		size_t len;
+		size_t cap;
+	} enc;
+
+	// frames are grown on demand and keep their buffers when popped,
+	// so nstack is the number of frames that have been initialized
+	struct jvst_vm_unique_stack *stack;
 	size_t top;
+	size_t nstack;
 	// need stack to store state of objects so we can sort them...
+
+	// link in a VM's pool of free unique sets
+	struct jvst_vm_unique *next_free;
 };
 
 struct jvst_vm_unique *
 jvst_vm_uniq_initialize(void);
 
+/* Empties the set so it can be reused, keeping its hash table, stack
+ * and the first chunk of its arena allocated.
+ */
+void
+jvst_vm_uniq_reset(struct jvst_vm_unique *uniq);
+
 void
 jvst_vm_uniq_finalize(struct jvst_vm_unique *uniq);
 
 enum jvst_result
 jvst_vm_uniq_evaluate(struct jvst_vm_unique *uniq, enum SJP_RESULT pret, struct sjp_event *evt);
 
+/* Value sets for ENUM.  The members of an enum of one type are hashed
+ * into a table of B buckets, B a power of two, that's at most half full.
+ * The table takes these words of the constant pool, starting at t:
+ *
+ * 	cdata[t]		number of buckets B
+ * 	cdata[t+1+2b]		hash of the member in bucket b
+ * 	cdata[t+2+2b]		offset from t of the member, or zero if
+ * 				the bucket is empty
+ *
+ * followed by the members.  A member is a header word, the type of its
+ * SJP event with a count shifted left by 8, followed by:
+ *
+ * 	null, true, false	nothing
+ * 	number			the bits of the canonical double
+ * 	string			the bytes, eight to a word with the first
+ * 				byte in the low bits; the count is the length
+ * 	array			the count items
+ * 	object			the key (a string) and value of the count
+ * 				members
+ *
+ * Members are hashed like the items of a uniqueItems array, as little
+ * endian words, so the table is the same on every host.  Collisions are
+ * resolved by linear probing.
+ */
+struct ast_value_set;
+
+/* Builds the value set of the values of the given type.  Duplicate
+ * values are dropped.  Returns the table, which the caller frees, with
+ * the number of members in *nmembersp and of words in *nwordsp.
+ */
+int64_t *
+jvst_vm_vset_build(const struct ast_value_set *values, enum SJP_EVENT type,
+	size_t *nmembersp, size_t *nwordsp);
+
+/* Returns non-zero if the n words at tbl are a well formed value set */
+int
+jvst_vm_vset_verify(const int64_t *tbl, size_t n);
+
+/* Returns non-zero if a complete null, true, false, string or number
+ * token is in the value set.
+ */
+int
+jvst_vm_vset_find(const int64_t *tbl, const struct sjp_event *evt);
+
+/* Tests if a value of any type is in the value set, a token at a time.
+ * Returns JVST_NEXT or JVST_MORE until the value is complete, then
+ * JVST_VALID if it's a member and JVST_INVALID if not.  The unique set
+ * is only used for its stack and encoding buffer.
+ */
+enum jvst_result
+jvst_vm_uniq_member(struct jvst_vm_unique *uniq, const int64_t *tbl,
+	enum SJP_RESULT pret, const struct sjp_event *evt);
+
 #undef MODULE_NAME
 
 #endif /* VALIDATE_UNIQ_H */
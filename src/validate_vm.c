@@ -1,7 +1,6 @@
 #include "validate_vm.h"
 
 #include <assert.h>
-#include <ctype.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <math.h>
@@ -20,15 +19,40 @@
 #define DEBUG_OPCODES (debug & DEBUG_VMOP)	// displays opcodes and the current frame's stack
 #define DEBUG_STEP    0				// instruction-by-instruction execution of the VM
 #define DEBUG_TOKENS  (debug & DEBUG_VMTOK)	// displays tokens as they're read
-#define DEBUG_BSEARCH 0				// debugs DFA binary search
 #define DEBUG_SPLITV  0				// debugs how SPLITV sets its result masks
 
+/* Selects the interpreter's dispatch.  When non-zero, vm_run_next uses
+ * direct threading through a table of label addresses (a GNU C
+ * extension).  Otherwise it falls back to a plain switch.  Build with
+ * -DJVST_VM_THREADED=0 to force the switch.
+ */
+#ifndef JVST_VM_THREADED
+#  if defined(__GNUC__) || defined(__clang__)
+#    define JVST_VM_THREADED 1
+#  else
+#    define JVST_VM_THREADED 0
+#  endif
+#endif
+
+// pseudo-ops that only appear in the decoded instruction stream
+enum {
+	JVST_OP_BADPC = 0x20,	// pc has left the program
+	JVST_OP_BADOP,		// opcode does not decode to a valid instruction
+
+	JVST_OP_NDECODED,
+};
+
 // XXX - replace with something better at some point
 //       (maybe a longjmp to an error handler?)
 #define PANIC(vm, ecode, errmsg) \
 	do { fprintf(stderr, "%s:%d (%s) PANIC (code=%d): %s\n",  \
 		__FILE__, __LINE__, __func__, (ecode), (errmsg)); \
-		jvst_vm_dumpstate(vm); abort(); } while(0)
+		vm_dumpctx(vm); abort(); } while(0)
+
+struct jvst_vm_ctx;
+
+static void
+vm_dumpctx(struct jvst_vm_ctx *vm);
 
 #define NOT_YET_IMPLEMENTED(op) do { \
 	fprintf(stderr, "%s:%d (%s) op %s not yet implemented\n", \
@@ -48,6 +72,9 @@ jvst_op_name(enum jvst_vm_op op)
 	case JVST_OP_CALL:      return "CALL";
 	case JVST_OP_SPLIT:     return "SPLIT";
 	case JVST_OP_SPLITV:    return "SPLITV";
+	case JVST_OP_SPLITANY:  return "SPLITANY";
+	case JVST_OP_SPLITALL:  return "SPLITALL";
+	case JVST_OP_SPLITONE:  return "SPLITONE";
 	case JVST_OP_TOKEN:     return "TOKEN";
 	case JVST_OP_CONSUME:   return "CONSUME";
 	case JVST_OP_MATCH:     return "MATCH";
@@ -59,6 +86,10 @@ jvst_op_name(enum jvst_vm_op op)
 	case JVST_OP_BAND:      return "BAND";
 	case JVST_OP_RETURN:    return "RETURN";
 	case JVST_OP_UNIQUE:	return "UNIQUE";
+	case JVST_OP_SWITCH:	return "SWITCH";
+	case JVST_OP_LMATCH:	return "LMATCH";
+	case JVST_OP_ENUM:	return "ENUM";
+	case JVST_OP_DISPATCH:	return "DISPATCH";
 	}
 
 	fprintf(stderr, "Unknown OP %d\n", op);
@@ -290,12 +321,14 @@ jvst_vm_program_debug(const struct jvst_vm_program *prog)
 size_t
 jvst_vm_dfa_init(struct jvst_vm_dfa *dfa, size_t nstates, size_t nedges, size_t nends)
 {
+	static const struct jvst_vm_dfa zero = { 0 };
 	size_t nelts;
 	int *elts;
 
 	nelts = (nstates+1) + 2*nedges + 2*nends;
 	elts = xmalloc(nelts * sizeof *elts);
 
+	*dfa = zero;
 	dfa->nstates = nstates;
 	dfa->nedges  = nedges;
 	dfa->nends   = nends;
@@ -315,72 +348,186 @@ jvst_vm_dfa_copy(struct jvst_vm_dfa *dst, const struct jvst_vm_dfa *src)
 	memcpy(dst->offs, src->offs, (src->nstates+1)*sizeof src->offs[0]);
 	memcpy(dst->transitions, src->transitions, 2*src->nedges * sizeof src->transitions[0]);
 	memcpy(dst->endstates, src->endstates, 2*src->nends * sizeof src->endstates[0]);
+
+	if (src->ends != NULL) {
+		jvst_vm_dfa_compile(dst);
+	}
 }
 
-void
-jvst_vm_dfa_finalize(struct jvst_vm_dfa *dfa)
+// returns the edges of state st, clamped to the edge array
+static void
+dfa_state_edges(const struct jvst_vm_dfa *dfa, size_t st, size_t *e0p, size_t *e1p)
 {
-	static struct jvst_vm_dfa zero = { 0 };
-	// arrays within the dfa were allocated as a single chunk, so
-	// this frees them
-	free(dfa->offs);
-	*dfa = zero;
+	int e0, e1;
+
+	e0 = dfa->offs[st];
+	e1 = dfa->offs[st+1];
+
+	if (e0 < 0 || (size_t)e0 > dfa->nedges) {
+		e0 = 0;
+	}
+
+	if (e1 < e0 || (size_t)e1 > dfa->nedges) {
+		e1 = e0;
+	}
+
+	*e0p = e0;
+	*e1p = e1;
 }
 
-static int
-twoint_binary_search(const int *restrict list, int i0, int i1, int key)
+static void
+dfa_table_set(struct jvst_vm_dfa *dfa, size_t ind, size_t st)
 {
-#if DEBUG_BSEARCH
-	fprintf(stderr, "binary search in range [%d,%d] for %d (%c)\n",
-		i0,i1,key,isprint(key) ? key : ' ');
-#endif
-	while (i0 <= i1) {
-		int mid,mkey;
-		mid = (i0 + i1)/2;
-		mkey = list[2*mid];
-#if DEBUG_BSEARCH
-		fprintf(stderr, "  i0 = %d, i1 = %d, mid = %d, mkey = %d (%c)\n",
-			i0,i1,mid,mkey, isprint(mkey) ? mkey : ' ');
-#endif
-		if (mkey == key) {
-			return mid;
+	switch (dfa->width) {
+	case 1:
+		((uint8_t *)dfa->table)[ind] = (uint8_t)st;
+		break;
+
+	case 2:
+		((uint16_t *)dfa->table)[ind] = (uint16_t)st;
+		break;
+
+	default:
+		((uint32_t *)dfa->table)[ind] = (uint32_t)st;
+		break;
+	}
+}
+
+void
+jvst_vm_dfa_compile(struct jvst_vm_dfa *dfa)
+{
+	uint8_t bounds[UCHAR_MAX+2] = { 0 };
+	size_t n, st, i, e, e0, e1, nc, nentries;
+	const int *tr;
+	char *mem;
+	int nfa;
+
+	n  = dfa->nstates;
+	tr = dfa->transitions;
+	free(dfa->ends);
+
+	// epsilon edges, or two edges on a byte, make it an NFA
+	nfa = 0;
+	for (st=0; st < n && !nfa; st++) {
+		dfa_state_edges(dfa, st, &e0, &e1);
+		for (e=e0; e < e1; e++) {
+			if (tr[2*e+0] == JVST_VM_DFA_EPSILON || (e > e0 && tr[2*(e-1)+0] == tr[2*e+0])) {
+				nfa = 1;
+				break;
+			}
 		}
+	}
 
-		if (mkey < key) {
-			i0 = mid+1;
-		} else {
-			i1 = mid-1;
+	// A byte starts a new class if some state has a different
+	// transition on it than on the byte before.  Edges are sorted, so
+	// that's where a run of edges to the same state starts or ends.
+	// Classes are ranges of bytes, which keeps this linear in the
+	// number of edges.  An NFA gives each byte with an edge a class of
+	// its own, so a class has one byte to follow.
+	for (st=0; st < n; st++) {
+		dfa_state_edges(dfa, st, &e0, &e1);
+		for (e=e0; e < e1; e++) {
+			int lbl = tr[2*e+0], dst = tr[2*e+1];
+
+			if (lbl < 0 || lbl > UCHAR_MAX) {
+				continue;
+			}
+
+			if (nfa || e == e0 || tr[2*(e-1)+0] != lbl-1 || tr[2*(e-1)+1] != dst) {
+				bounds[lbl] = 1;
+			}
+
+			if (nfa || e+1 == e1 || tr[2*(e+1)+0] != lbl+1 || tr[2*(e+1)+1] != dst) {
+				bounds[lbl+1] = 1;
+			}
 		}
-#if DEBUG_BSEARCH
-		fprintf(stderr, "  new: i0 = %d, i1 = %d\n", i0,i1);
-#endif
 	}
 
-	return -1;
-}
+	if (n <= UINT8_MAX) {
+		dfa->width = 1;
+	} else if (n <= UINT16_MAX) {
+		dfa->width = 2;
+	} else {
+		assert((uint64_t)n <= UINT32_MAX);
+		dfa->width = 4;
+	}
 
-static int
-dfa_find_edge(const struct jvst_vm_dfa *dfa, int i0, int i1, int edge)
-{
-	int ind;
+	// one chunk: end data, byte classes, then the table
+	nc = 1;
+	for (i=1; i <= UCHAR_MAX; i++) {
+		nc += bounds[i];
+	}
+
+	nentries = nfa ? 0 : (n+1) * nc;
+	mem = xmalloc(n * sizeof dfa->ends[0] + (UCHAR_MAX+1) + nentries * dfa->width);
+
+	dfa->nfa = nfa;
+	dfa->nclasses = nc;
+	dfa->ends = (int *)mem;
+	dfa->classes = (uint8_t *)(mem + n * sizeof dfa->ends[0]);
+	dfa->table = nfa ? NULL : dfa->classes + (UCHAR_MAX+1);
+
+	dfa->classes[0] = 0;
+	for (i=1; i <= UCHAR_MAX; i++) {
+		dfa->classes[i] = dfa->classes[i-1] + bounds[i];
+	}
+
+	for (i=0; i < nentries; i++) {
+		dfa_table_set(dfa, i, n);
+	}
+
+	for (st=0; st < n && !nfa; st++) {
+		dfa_state_edges(dfa, st, &e0, &e1);
+		for (e=e0; e < e1; e++) {
+			int lbl = tr[2*e+0], dst = tr[2*e+1];
+
+			if (lbl >= 0 && lbl <= UCHAR_MAX && dst >= 0 && (size_t)dst < n) {
+				dfa_table_set(dfa, st*nc + dfa->classes[lbl], dst);
+			}
+		}
+	}
+
+	for (st=0; st < n; st++) {
+		dfa->ends[st] = -1;
+	}
+
+	for (i=0; i < dfa->nends; i++) {
+		int est = dfa->endstates[2*i+0];
 
-	// currently a binary search.  would an interpolating search
-	// make sense?
-	ind = twoint_binary_search(dfa->transitions, i0,i1, edge);
+		if (est >= 0 && (size_t)est < n) {
+			dfa->ends[est] = dfa->endstates[2*i+1];
+		}
+	}
 
-	if (ind < 0) {
-		return JVST_VM_DFA_NOMATCH;
+	memset(&dfa->pre, 0, sizeof dfa->pre);
+	if (!nfa) {
+		jvst_vm_dfa_prefilter_build(dfa, &dfa->pre);
 	}
+}
 
-	assert(ind >= i0 && ind <= i1);
-	return dfa->transitions[2*ind+1];
+void
+jvst_vm_dfa_finalize(struct jvst_vm_dfa *dfa)
+{
+	static struct jvst_vm_dfa zero = { 0 };
+	// arrays within each form were allocated as a single chunk, so
+	// this frees them
+	free(dfa->offs);
+	free(dfa->ends);
+	*dfa = zero;
 }
 
+// one load from the class map and one from the table per byte
+#define DFA_RUN_DENSE(type) do {					\
+	const type *tbl = dfa->table;					\
+	for (i=0; i < n; i++) {						\
+		st = tbl[st*nc + dfa->classes[(unsigned char)buf[i]]];	\
+	}								\
+} while (0)
+
 int
 jvst_vm_dfa_run(const struct jvst_vm_dfa *dfa, int st0, const char *buf, size_t n)
 {
-	size_t i;
-	int st;
+	size_t i, st, nc;
 
 	if (st0 < 0) {
 		return st0;
@@ -390,38 +537,43 @@ jvst_vm_dfa_run(const struct jvst_vm_dfa *dfa, int st0, const char *buf, size_t
 		return JVST_VM_DFA_BADSTATE;
 	}
 
+	assert(dfa->table != NULL);
+
 	st = st0;
-	for (i=0; i < n; i++) {
-		int i0,i1,edge;
-		edge = (unsigned char)buf[i];
-		i0 = dfa->offs[st];
-		i1 = dfa->offs[st+1]-1;
-		st = dfa_find_edge(dfa, i0,i1, edge);
-		if (st < 0) {
-			break;
-		}
+	nc = dfa->nclasses;
+	switch (dfa->width) {
+	case 1:
+		DFA_RUN_DENSE(uint8_t);
+		break;
+
+	case 2:
+		DFA_RUN_DENSE(uint16_t);
+		break;
+
+	default:
+		DFA_RUN_DENSE(uint32_t);
+		break;
 	}
 
-	return st;
+	return (st < dfa->nstates) ? (int)st : JVST_VM_DFA_NOMATCH;
 }
 
+#undef DFA_RUN_DENSE
+
 bool
 jvst_vm_dfa_endstate(const struct jvst_vm_dfa *dfa, int st1, int *datap)
 {
-	int ind;
-
 	if (st1 < 0 || (size_t)st1 >= dfa->nstates) {
-		return st1;
+		return false;
 	}
 
-	ind = twoint_binary_search(dfa->endstates, 0, dfa->nends-1, st1);
-	if (ind < 0) {
+	assert(dfa->ends != NULL);
+	if (dfa->ends[st1] < 0) {
 		return false;
 	}
 
-	assert(ind >= 0 && (size_t)ind < dfa->nends);
 	if (datap != NULL) {
-		*datap = dfa->endstates[2*ind+1];
+		*datap = dfa->ends[st1];
 	}
 
 	return true;
@@ -432,6 +584,9 @@ jvst_vm_program_free(struct jvst_vm_program *prog)
 {
 	size_t i;
 	assert(prog != NULL);
+	jvst_vm_program_unjit(prog);
+	jvst_vm_program_unmap(prog);
+
 	free(prog->fdata);
 	free(prog->cdata);
 	free(prog->sdata);
@@ -442,226 +597,1317 @@ jvst_vm_program_free(struct jvst_vm_program *prog)
 	free(prog->dfas);
 
 	free(prog->code);
+	free(prog->decoded);
 	free(prog);
 }
 
-enum { VM_DEFAULT_STACK = 1024  };   // 8 bytes per stack element, so default to 16K stack
-enum { VM_STACK_BUFFER = 64     };   // in resize, minimum amount of extra space
-enum { VM_DEFAULT_MAXSPLIT = 16 };
+struct vm_sizing_proc {
+	int state;	// 0 = not visited, 1 = being visited, 2 = done
+	size_t depth;	// stack slots used by the proc and its callees
+	size_t nctx;	// split contexts used by the proc and its callees
+};
 
-void
-jvst_vm_init_defaults(struct jvst_vm *vm, struct jvst_vm_program *prog)
+static size_t
+size_max(size_t a, size_t b)
 {
-	static struct jvst_vm zero = { 0 };
+	return (a > b) ? a : b;
+}
 
-	*vm = zero;
+static int
+vm_sizing_isproc(const struct jvst_vm_program *prog, long pc)
+{
+	return pc >= 0 && (size_t)pc < prog->ncode && prog->decoded[pc].op == JVST_OP_PROC;
+}
+
+/* Returns the split a SPLIT or DISPATCH runs, or -1 if it's out of
+ * range.
+ */
+static int64_t
+vm_sizing_split(const struct jvst_vm_program *prog, const struct jvst_vm_decoded *ins)
+{
+	int64_t split, tbl;
+
+	if (ins->a0slot || ins->a0 < 0) {
+		return -1;
+	}
 
-	vm->prog = prog;
+	split = ins->a0;
+	if (ins->op == JVST_OP_DISPATCH) {
+		if ((size_t)ins->a0 >= prog->nconst) {
+			return -1;
+		}
 
-	vm->maxstack = VM_DEFAULT_STACK;
-	vm->stack = xmalloc(vm->maxstack * sizeof vm->stack[0]);
+		tbl = prog->cdata[ins->a0];
+		if (tbl < 0 || (uint64_t)tbl >= prog->nconst) {
+			return -1;
+		}
 
-	vm->nsplit = 0;
-	vm->maxsplit = VM_DEFAULT_MAXSPLIT;
-	vm->splits = xmalloc(vm->maxsplit * sizeof vm->splits[0]);
+		split = prog->cdata[tbl];
+	}
 
-	vm->r_flag = 0;
-	vm->r_pc = 0;
-	vm->r_fp = 0;
-	vm->r_sp = 0;
+	if (split < 0 || (uint64_t)split >= prog->nsplit) {
+		return -1;
+	}
 
-	(void)sjp_parser_init(&vm->parser, &vm->pstack[0], ARRAYLEN(vm->pstack), &vm->pbuf[0],
-			      ARRAYLEN(vm->pbuf));
+	return split;
 }
 
-void
-jvst_vm_finalize(struct jvst_vm *vm)
+/* Walks the proc at pc0, and every proc it calls or splits to.
+ * Returns -1 if it finds a cycle.  Out of range targets are skipped;
+ * jvst_vm_program_verify() reports them.
+ */
+static int
+vm_sizing_visit(const struct jvst_vm_program *prog, struct vm_sizing_proc *procs,
+	size_t pc0, struct jvst_vm_sizing *sz)
 {
-	static struct jvst_vm zero = { 0 };
+	const struct jvst_vm_decoded *dec = prog->decoded;
+	struct vm_sizing_proc *proc = &procs[pc0];
+	size_t pc, depth, nctx;
 
-	size_t i;
+	if (proc->state == 2) {
+		return 0;
+	}
 
-	if (vm->uniq) {
-		jvst_vm_uniq_finalize(vm->uniq);
+	if (proc->state == 1) {
+		return -1;
 	}
 
-	free(vm->stack);
+	proc->state = 1;
+	depth = 0;
+	nctx = 0;
 
-	for (i=0; i < vm->nsplit; i++) {
-		jvst_vm_finalize(&vm->splits[i]);
-	}
-	free(vm->splits);
+	for (pc = pc0+1; pc < prog->ncode && dec[pc].op != JVST_OP_PROC; pc++) {
+		const struct jvst_vm_decoded *ins = &dec[pc];
 
-	*vm = zero;
-}
+		switch (ins->op) {
+		case JVST_OP_CALL:
+			if (!vm_sizing_isproc(prog, ins->a0)) {
+				break;
+			}
 
-static void
-vm_dumpregs(struct sbuf *buf, const struct jvst_vm *vm)
-{
-	sbuf_snprintf(buf, "PC=%" PRIu32 " FP=%" PRIu32 " SP=%" PRIu32 " FLAG=%" PRId64 "\n",
-		vm->r_pc, vm->r_fp, vm->r_sp, vm->r_flag);
-}
+			if (vm_sizing_visit(prog, procs, ins->a0, sz) < 0) {
+				return -1;
+			}
 
-static void
-vm_dumpstack(FILE *f, const struct jvst_vm *vm)
-{
-	uint32_t fp,sp,i,n;
+			// CALL pushes the return pc and frame pointer
+			depth = size_max(depth, 2 + procs[ins->a0].depth);
+			nctx = size_max(nctx, procs[ins->a0].nctx);
+			break;
 
-	fp = vm->r_fp;
-	sp = vm->r_sp;
-	if (fp > 0) {
-		fprintf(f, "[%5d] %" PRId64 "\t(PPC)\n", fp-2, vm->stack[fp-2].i);
-		fprintf(f, "[%5d] %" PRId64 "\t(PFP)\n", fp-1, vm->stack[fp-1].i);
-		fprintf(f, "---\n");
-	}
+		case JVST_OP_SPLIT:
+		case JVST_OP_SPLITV:
+		case JVST_OP_SPLITANY:
+		case JVST_OP_SPLITALL:
+		case JVST_OP_SPLITONE:
+		case JVST_OP_DISPATCH:
+			{
+				uint32_t proc0, proc1, off, i;
+				int64_t split;
+				size_t total;
+
+				// DISPATCH runs one branch of its split, but
+				// falls back to running all of them
+				split = vm_sizing_split(prog, ins);
+				if (split < 0) {
+					break;
+				}
 
-	assert(sp >= fp);
-	n = sp - fp;
-	for (i=0; i < n; i++) {
-		char rname[16];
-		fprintf(f, "[%5d] %-3s ", fp+i, stackname(i,rname));
-		if (i == JVST_VM_TNUM) {
-			fprintf(f, "%f\n", vm->stack[i].f);
-		} else {
-			fprintf(f, "%" PRId64 "\n", vm->stack[i].i);
+				proc0 = prog->sdata[split+0];
+				proc1 = prog->sdata[split+1];
+				if (proc0 > proc1 || proc1 > prog->sdata[prog->nsplit]) {
+					break;
+				}
+
+				sz->maxsplit = size_max(sz->maxsplit, proc1-proc0);
+
+				// the branches run at the same time, each in its
+				// own context
+				total = proc1-proc0;
+				off = prog->nsplit + 1;
+				for (i=proc0; i < proc1; i++) {
+					uint32_t bpc = prog->sdata[off+i];
+
+					if (!vm_sizing_isproc(prog, bpc)) {
+						continue;
+					}
+
+					if (vm_sizing_visit(prog, procs, bpc, sz) < 0) {
+						return -1;
+					}
+
+					total += procs[bpc].nctx;
+					sz->split_stack = size_max(sz->split_stack, procs[bpc].depth);
+				}
+
+				nctx = size_max(nctx, total);
+			}
+			break;
+
+		default:
+			break;
 		}
 	}
-	fprintf(f, "\n");
+
+	proc->depth = depth + JVST_VM_NUMREG;
+	if (!dec[pc0].a0slot && dec[pc0].a0 > 0) {
+		proc->depth += dec[pc0].a0;
+	}
+
+	proc->nctx = nctx;
+	proc->state = 2;
+	return 0;
 }
 
 void
-jvst_vm_dumpstate(struct jvst_vm *vm)
+jvst_vm_program_sizing(struct jvst_vm_program *prog)
 {
-	uint32_t i, fp,sp;
-	char cbuf[128];
-	struct sbuf buf = { .buf = cbuf, .cap = sizeof cbuf, .len = 0, .np = 0 };
+	static const struct jvst_vm_sizing zero = { 0 };
+	struct vm_sizing_proc *procs;
+	struct jvst_vm_sizing sz = zero;
 
-	fprintf(stderr, "--- VM state ---\n");
-	jvst_vm_program_debug(vm->prog);
-	vm_dumpregs(&buf, vm);
-	fprintf(stderr, "\n%s\n", buf.buf);
-	
-	fprintf(stderr, "stack frame:\n");
+	if (!vm_sizing_isproc(prog, 0)) {
+		prog->sizing = zero;
+		return;
+	}
 
-	vm_dumpstack(stderr,vm);
+	procs = xcalloc(prog->ncode, sizeof procs[0]);
+	if (vm_sizing_visit(prog, procs, 0, &sz) == 0) {
+		sz.stack = procs[0].depth;
+		sz.nctx = procs[0].nctx;
+	} else {
+		sz.stack = 0;
+		sz.split_stack = 0;
+		sz.nctx = 0;
+	}
+
+	free(procs);
+	prog->sizing = sz;
 }
 
+// decodes the instruction at pc
 static void
-resize_stack(struct jvst_vm *vm, size_t newlen)
+vm_decode_ins(const struct jvst_vm_program *prog, size_t pc, struct jvst_vm_decoded *dec)
 {
-	size_t newmax;
+	static const struct jvst_vm_decoded zero;
+	uint32_t opcode, a0, a1;
+	enum jvst_vm_op op;
+	long target;
 
-	if (newlen < vm->maxstack) {
+	*dec = zero;
+
+	opcode = prog->code[pc];
+	op = jvst_vm_decode_op(opcode);
+
+	if (op > JVST_OP_MAX) {
+		dec->op = JVST_OP_BADOP;
 		return;
 	}
 
-	newmax = vm->maxstack;
-	if (newmax < VM_DEFAULT_STACK) {
-		newmax = VM_DEFAULT_STACK;
-	} else if (newmax < 16384) {
-		newmax *= 2;
-	} else {
-		newmax += newmax/4;
-	}
+	dec->op = op;
 
-	if (newmax < newlen) {
-		newmax = newlen + VM_STACK_BUFFER;
-	}
+	switch (op) {
+	case JVST_OP_JMP:
+	case JVST_OP_CALL:
+		target = (long)pc + jvst_vm_tobarg(jvst_vm_decode_barg(opcode));
+		if (target < 0 || (size_t)target >= prog->ncode) {
+			// branches out of the program land on the sentinel
+			target = prog->ncode;
+		}
 
-	vm->stack = xrealloc(vm->stack, newmax * sizeof vm->stack[0]);
-	vm->maxstack = newmax;
-}
+		dec->cond = jvst_vm_decode_bcond(opcode);
+		dec->a0 = target;
+		break;
 
-static inline union jvst_vm_stackval *
-vm_slotptr(struct jvst_vm *vm, uint32_t fp, uint32_t arg)
-{
-	int slot;
+	default:
+		a0 = jvst_vm_decode_arg0(opcode);
+		a1 = jvst_vm_decode_arg1(opcode);
 
-	assert(jvst_vm_arg_isslot(arg));
-	slot = jvst_vm_arg_toslot(arg);
-	if (fp+slot > vm->r_sp) {
-		// XXX - better error code!
-		PANIC(vm, -1, "slot exceeded stack");
-	}
+		dec->a0slot = jvst_vm_arg_isslot(a0);
+		dec->a0 = dec->a0slot ? jvst_vm_arg_toslot(a0) : jvst_vm_arg_tolit(a0);
 
-	return &vm->stack[fp+slot];
+		dec->a1slot = jvst_vm_arg_isslot(a1);
+		dec->a1 = dec->a1slot ? jvst_vm_arg_toslot(a1) : jvst_vm_arg_tolit(a1);
+		break;
+	}
 }
 
-static inline uint64_t
-vm_uval(struct jvst_vm *vm, uint32_t fp, uint32_t arg)
+// builds the dense form of each DFA that doesn't have one
+static void
+vm_compile_dfas(struct jvst_vm_program *prog)
 {
-	int slot;
+	size_t i;
 
-	if (jvst_vm_arg_islit(arg)) {
-		return jvst_vm_arg_tolit(arg);
+	for (i=0; i < prog->ndfa; i++) {
+		if (prog->dfas[i].ends == NULL) {
+			jvst_vm_dfa_compile(&prog->dfas[i]);
+		}
 	}
-
-	return vm_slotptr(vm,fp,arg)->u;
 }
 
-static inline int64_t
-vm_ival(struct jvst_vm *vm, uint32_t fp, uint32_t arg)
+// decodes the code and sizes the program, if it hasn't been done
+static void
+vm_decode_code(struct jvst_vm_program *prog)
 {
-	int slot;
+	struct jvst_vm_decoded *dec;
+	size_t pc, n;
 
-	if (jvst_vm_arg_islit(arg)) {
-		return jvst_vm_arg_tolit(arg);
+	if (prog->decoded != NULL) {
+		return;
 	}
 
-	return vm_slotptr(vm,fp,arg)->i;
-}
-
-static inline double *
-vm_fvalptr(struct jvst_vm *vm, uint32_t fp, uint32_t arg)
-{
-	int slot;
+	n = prog->ncode;
+	dec = xcalloc(n+1, sizeof dec[0]);
 
-	if (jvst_vm_arg_islit(arg)) {
-		// XXX - better error code!
-		PANIC(vm, -1, "literal arg to float compare");
+	for (pc=0; pc < n; pc++) {
+		vm_decode_ins(prog, pc, &dec[pc]);
 	}
 
-	return &vm_slotptr(vm,fp,arg)->f;
+	dec[n].op = JVST_OP_BADPC;
+	prog->decoded = dec;
+
+	jvst_vm_program_sizing(prog);
 }
 
-static inline int
-iopcmp(struct jvst_vm *vm, uint32_t fp, uint32_t opcode)
+void
+jvst_vm_program_predecode(struct jvst_vm_program *prog)
 {
-	uint32_t a,b;
-	int64_t va,vb;
+	vm_compile_dfas(prog);
+	vm_decode_code(prog);
+}
 
-	a = jvst_vm_decode_arg0(opcode);
-	b = jvst_vm_decode_arg1(opcode);
+static int
+verify_error(char *errbuf, size_t nb, const char *fmt, ...)
+{
+	va_list args;
 
-	va = vm_ival(vm, fp, a);
-	vb = vm_ival(vm, fp, b);
+	if (errbuf != NULL && nb > 0) {
+		va_start(args, fmt);
+		vsnprintf(errbuf, nb, fmt, args);
+		va_end(args);
+	}
 
-	return (va > vb) - (va < vb);
+	return -1;
 }
 
-static inline int
-fopcmp(struct jvst_vm *vm, uint32_t fp, uint32_t opcode)
+static int
+verify_dfa(const struct jvst_vm_dfa *dfa)
 {
-	uint32_t a,b;
-	double va,vb;
+	size_t st, i;
+
+	if (dfa->nstates == 0 || dfa->offs[0] != 0 || (size_t)dfa->offs[dfa->nstates] != dfa->nedges) {
+		return -1;
+	}
+
+	for (st=0; st < dfa->nstates; st++) {
+		int e0, e1, e;
+
+		e0 = dfa->offs[st];
+		e1 = dfa->offs[st+1];
+		if (e1 < e0) {
+			return -1;
+		}
+
+		// edges must be sorted by label to find the byte classes.
+		// Repeated labels and epsilon edges make it an NFA.
+		for (e=e0; e < e1; e++) {
+			int label = dfa->transitions[2*e+0];
+			int dest  = dfa->transitions[2*e+1];
+
+			if (label < 0 || label > JVST_VM_DFA_EPSILON) {
+				return -1;
+			}
+
+			if (e > e0 && dfa->transitions[2*(e-1)] > label) {
+				return -1;
+			}
+
+			if (dest < 0 || (size_t)dest >= dfa->nstates) {
+				return -1;
+			}
+		}
+	}
+
+	for (i=0; i < dfa->nends; i++) {
+		int est = dfa->endstates[2*i];
+
+		if (est < 0 || (size_t)est >= dfa->nstates) {
+			return -1;
+		}
+
+		if (i > 0 && dfa->endstates[2*(i-1)] >= est) {
+			return -1;
+		}
+
+		// negative data marks states that aren't end states
+		if (dfa->endstates[2*i+1] < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// the widest argument field holds 13 bits of slot or literal
+static inline int
+verify_arg(int isslot, int32_t arg)
+{
+	if (isslot) {
+		return arg >= 0 && arg < (1 << 13);
+	}
+
+	return arg >= JVST_VM_MINLIT && arg <= JVST_VM_MAXLIT;
+}
+
+/* Checks a DFA's dense form, which can come from a file.  Like the
+ * decoded stream, it isn't checked against the sparse form, only for
+ * what running it relies on: byte classes and table entries in range,
+ * with the dead state as the only entry past the last state, and end
+ * data of -1 or more.
+ */
+static int
+verify_dfa_dense(const struct jvst_vm_dfa *dfa)
+{
+	size_t n, i, nentries;
+
+	n = dfa->nstates;
+	if (dfa->classes == NULL || dfa->nclasses == 0 || dfa->nclasses > UCHAR_MAX+1) {
+		return -1;
+	}
+
+	for (i=0; i <= UCHAR_MAX; i++) {
+		if (dfa->classes[i] >= dfa->nclasses) {
+			return -1;
+		}
+	}
+
+	for (i=0; i < n; i++) {
+		if (dfa->ends[i] < -1) {
+			return -1;
+		}
+	}
+
+	if (dfa->pre.nprefix > JVST_VM_DFA_MAXLIT || dfa->pre.nsuffix > JVST_VM_DFA_MAXLIT ||
+			dfa->pre.nfactor > JVST_VM_DFA_MAXLIT) {
+		return -1;
+	}
+
+	// an NFA is determinised as it runs, it has no table
+	if (dfa->nfa) {
+		return (dfa->table == NULL) ? 0 : -1;
+	}
+
+	if (dfa->table == NULL) {
+		return -1;
+	}
+
+	nentries = (n+1) * dfa->nclasses;
+	switch (dfa->width) {
+	case 1:
+		for (i=0; i < nentries; i++) {
+			if (((const uint8_t *)dfa->table)[i] > n) {
+				return -1;
+			}
+		}
+		break;
+
+	case 2:
+		for (i=0; i < nentries; i++) {
+			if (((const uint16_t *)dfa->table)[i] > n) {
+				return -1;
+			}
+		}
+		break;
+
+	case 4:
+		for (i=0; i < nentries; i++) {
+			if (((const uint32_t *)dfa->table)[i] > n) {
+				return -1;
+			}
+		}
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+jvst_vm_dfa_verify(const struct jvst_vm_dfa *dfa)
+{
+	if (verify_dfa(dfa) != 0) {
+		return -1;
+	}
+
+	return (dfa->ends != NULL) ? verify_dfa_dense(dfa) : 0;
+}
+
+static inline int
+verify_slot(int isslot, int32_t arg, size_t nframe)
+{
+	return isslot && arg >= 0 && (size_t)arg < nframe;
+}
+
+static inline int
+verify_slot_or_lit(int isslot, int32_t arg, size_t nframe)
+{
+	return !isslot || verify_slot(isslot, arg, nframe);
+}
+
+static inline int
+verify_lit(int isslot, int32_t arg, size_t max)
+{
+	return !isslot && arg >= 0 && (size_t)arg < max;
+}
+
+/* Checks that a decoded instruction has fields vm_decode_ins() could
+ * have given it: branches have an absolute target in the program or
+ * on the sentinel, other instructions have slot flags and arguments in
+ * the range of the encoding.
+ */
+static int
+verify_decoded(const struct jvst_vm_decoded *ins, size_t n)
+{
+	switch (ins->op) {
+	case JVST_OP_JMP:
+	case JVST_OP_CALL:
+		return ins->cond <= JVST_VM_BR_ALWAYS && !ins->a0slot && !ins->a1slot &&
+			ins->a0 >= 0 && (size_t)ins->a0 <= n && ins->a1 == 0;
+
+	default:
+		return ins->cond == 0 && ins->a0slot <= 1 && ins->a1slot <= 1 &&
+			verify_arg(ins->a0slot, ins->a0) && verify_arg(ins->a1slot, ins->a1);
+	}
+}
+
+/* A jump table has to fit in the constant pool, and each of its
+ * destinations has to be in the body of the proc, between lo and hi.
+ */
+static int
+verify_jtab(const struct jvst_vm_program *prog, int isslot, int32_t tbl,
+	size_t lo, size_t hi)
+{
+	int64_t ncase, k;
+
+	if (!verify_lit(isslot, tbl, prog->nconst) || (size_t)tbl + 2 > prog->nconst) {
+		return 0;
+	}
+
+	ncase = prog->cdata[tbl];
+	if (ncase < 0 || (uint64_t)ncase > prog->nconst - (size_t)tbl - 2) {
+		return 0;
+	}
+
+	for (k=0; k <= ncase; k++) {
+		int64_t dest = prog->cdata[tbl+1+k];
+
+		if (dest < 0 || (uint64_t)dest < lo || (uint64_t)dest >= hi) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Checks a literal table of avail words, whose cases are at most
+ * maxcase.
+ */
+static int
+verify_lits_table(const int64_t *t, size_t avail, int64_t maxcase)
+{
+	int64_t nb, b;
+
+	if (avail < 2) {
+		return 0;
+	}
+
+	nb = t[0];
+	if (nb <= 0 || (nb & (nb-1)) != 0 || (uint64_t)nb > (avail - 2)/2) {
+		return 0;
+	}
+
+	for (b=0; b < nb; b++) {
+		uint64_t key = (uint64_t)t[2+2*b];
+		uint64_t off = key & 0xffffffff, len = key >> 32;
+		int64_t which = t[3+2*b];
+
+		if (which == 0) {
+			continue;
+		}
+
+		if (which < 0 || which > maxcase) {
+			return 0;
+		}
+
+		if (off < (uint64_t)(2+2*nb) || off > avail || (len+7)/8 > avail - off) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int
+verify_lits(const struct jvst_vm_program *prog, int isslot, int32_t tbl)
+{
+	if (!verify_lit(isslot, tbl, prog->nconst)) {
+		return 0;
+	}
+
+	return verify_lits_table(&prog->cdata[tbl], prog->nconst - (size_t)tbl, INT_MAX);
+}
+
+static int
+verify_vset(const struct jvst_vm_program *prog, int isslot, int32_t dir)
+{
+	int64_t tbl;
+
+	if (!verify_lit(isslot, dir, prog->nconst)) {
+		return 0;
+	}
+
+	tbl = prog->cdata[dir];
+	if (tbl < 0 || (uint64_t)tbl >= prog->nconst) {
+		return 0;
+	}
+
+	return jvst_vm_vset_verify(&prog->cdata[tbl], prog->nconst - (size_t)tbl);
+}
+
+/* Checks a DISPATCH table.  Its split must be in range, and its tags
+ * must select branches of the split.
+ */
+static int
+verify_disc(const struct jvst_vm_program *prog, int isslot, int32_t dir)
+{
+	const int64_t *t;
+	int64_t tbl, nproc;
+	size_t avail, kw;
+
+	if (!verify_lit(isslot, dir, prog->nconst)) {
+		return 0;
+	}
+
+	tbl = prog->cdata[dir];
+	if (tbl < 0 || (uint64_t)tbl >= prog->nconst || prog->nconst - (size_t)tbl < 3) {
+		return 0;
+	}
+
+	t = &prog->cdata[tbl];
+	avail = prog->nconst - (size_t)tbl;
+
+	if (t[0] < 0 || (uint64_t)t[0] >= prog->nsplit) {
+		return 0;
+	}
+
+	if (t[1] != JVST_OP_SPLITANY && t[1] != JVST_OP_SPLITONE) {
+		return 0;
+	}
+
+	if (t[2] < 0 || (uint64_t)t[2] > 8*(avail - 3)) {
+		return 0;
+	}
+
+	kw = ((size_t)t[2] + 7) / 8;
+	nproc = prog->sdata[t[0]+1] - prog->sdata[t[0]];
+
+	return verify_lits_table(&t[3+kw], avail - 3 - kw, nproc);
+}
+
+int
+jvst_vm_program_verify(struct jvst_vm_program *prog, char *errbuf, size_t nb)
+{
+	const struct jvst_vm_decoded *dec;
+	size_t pc, n, i, nframe, pbody, pend;
+
+	prog->verified = 0;
+
+	// DFAs can come from a file too, so their dense forms are only
+	// built once they've been checked, below
+	vm_decode_code(prog);
+	dec = prog->decoded;
+	n = prog->ncode;
+
+	if (n == 0 || dec[0].op != JVST_OP_PROC) {
+		return verify_error(errbuf, nb, "program does not start with PROC");
+	}
+
+	// the decoded stream can come from a file.  What's checked below
+	// only relies on it being a stream the decoder could produce, so
+	// that's what it's checked for, rather than decoding it again.
+	for (pc=0; pc < n; pc++) {
+		if (!verify_decoded(&dec[pc], n)) {
+			return verify_error(errbuf, nb, "decoded instruction %zu is malformed", pc);
+		}
+	}
+
+	if (dec[n].op != JVST_OP_BADPC) {
+		return verify_error(errbuf, nb, "decoded stream does not end with BADPC");
+	}
+
+	if (prog->ndfa > 0 && prog->dfas == NULL) {
+		return verify_error(errbuf, nb, "program has no DFA tables");
+	}
+
+	for (i=0; i < prog->ndfa; i++) {
+		if (jvst_vm_dfa_verify(&prog->dfas[i]) != 0) {
+			return verify_error(errbuf, nb, "DFA %zu is malformed", i);
+		}
+	}
+
+	vm_compile_dfas(prog);
+
+	if (prog->nsplit > 0) {
+		size_t soff, nentries;
+
+		if (prog->sdata[0] != 0) {
+			return verify_error(errbuf, nb, "split table does not start at zero");
+		}
+
+		for (i=0; i < prog->nsplit; i++) {
+			if (prog->sdata[i+1] < prog->sdata[i]) {
+				return verify_error(errbuf, nb, "split %zu has a negative length", i);
+			}
+		}
+
+		soff = prog->nsplit + 1;
+		nentries = prog->sdata[prog->nsplit];
+		for (i=0; i < nentries; i++) {
+			uint32_t target = prog->sdata[soff+i];
+
+			// vm_split looks at the instruction after the PROC
+			if (target+1 >= n || dec[target].op != JVST_OP_PROC) {
+				return verify_error(errbuf, nb,
+					"split entry %zu does not point to a PROC", i);
+			}
+		}
+	}
+
+	// slots are checked against the frame of the enclosing proc, so
+	// jumps have to stay in its body, [pbody,pend)
+	nframe = 0;
+	pbody = pend = 0;
+	for (pc=0; pc < n; pc++) {
+		const struct jvst_vm_decoded *ins = &dec[pc];
+		int ok;
+
+		switch (ins->op) {
+		case JVST_OP_NOP:
+		case JVST_OP_TOKEN:
+		case JVST_OP_CONSUME:
+			ok = 1;
+			break;
+
+		case JVST_OP_PROC:
+			ok = !ins->a0slot && ins->a0 >= 0;
+			nframe = ins->a0 + JVST_VM_NUMREG;
+			pbody = pc+1;
+			for (pend = pbody; pend < n && dec[pend].op != JVST_OP_PROC; pend++) {
+				continue;
+			}
+			break;
+
+		case JVST_OP_ICMP:
+			ok = verify_slot_or_lit(ins->a0slot, ins->a0, nframe) &&
+				verify_slot_or_lit(ins->a1slot, ins->a1, nframe);
+			break;
+
+		case JVST_OP_FCMP:
+			ok = verify_slot(ins->a0slot, ins->a0, nframe) &&
+				verify_slot(ins->a1slot, ins->a1, nframe);
+			break;
+
+		case JVST_OP_FINT:
+		case JVST_OP_MOVE:
+		case JVST_OP_INCR:
+		case JVST_OP_BAND:
+			ok = verify_slot(ins->a0slot, ins->a0, nframe) &&
+				verify_slot_or_lit(ins->a1slot, ins->a1, nframe);
+			break;
+
+		case JVST_OP_JMP:
+			ok = ins->a0 >= 0 && (size_t)ins->a0 >= pbody && (size_t)ins->a0 < pend;
+			break;
+
+		case JVST_OP_CALL:
+			ok = ins->a0 >= 0 && (size_t)ins->a0 < n && dec[ins->a0].op == JVST_OP_PROC;
+			break;
+
+		case JVST_OP_SWITCH:
+			ok = verify_slot(ins->a0slot, ins->a0, nframe) &&
+				verify_jtab(prog, ins->a1slot, ins->a1, pbody, pend);
+			break;
+
+		case JVST_OP_MATCH:
+			ok = verify_lit(ins->a0slot, ins->a0, prog->ndfa);
+			break;
+
+		case JVST_OP_LMATCH:
+			ok = verify_lit(ins->a0slot, ins->a0, prog->ndfa) &&
+				verify_lits(prog, ins->a1slot, ins->a1);
+			break;
+
+		case JVST_OP_ENUM:
+			ok = verify_vset(prog, ins->a0slot, ins->a0);
+			break;
+
+		case JVST_OP_DISPATCH:
+			ok = verify_disc(prog, ins->a0slot, ins->a0) &&
+				verify_slot(ins->a1slot, ins->a1, nframe);
+			break;
+
+		case JVST_OP_FLOAD:
+			ok = verify_slot(ins->a0slot, ins->a0, nframe) &&
+				verify_lit(ins->a1slot, ins->a1, prog->nfloat);
+			break;
+
+		case JVST_OP_ILOAD:
+			ok = verify_slot(ins->a0slot, ins->a0, nframe) &&
+				verify_lit(ins->a1slot, ins->a1, prog->nconst);
+			break;
+
+		case JVST_OP_BSET:
+			ok = verify_slot(ins->a0slot, ins->a0, nframe) &&
+				verify_lit(ins->a1slot, ins->a1, 64);
+			break;
+
+		case JVST_OP_SPLIT:
+		case JVST_OP_SPLITV:
+		case JVST_OP_SPLITANY:
+		case JVST_OP_SPLITALL:
+		case JVST_OP_SPLITONE:
+			ok = verify_lit(ins->a0slot, ins->a0, prog->nsplit) &&
+				verify_slot(ins->a1slot, ins->a1, nframe);
+			if (ok && ins->op == JVST_OP_SPLITV) {
+				size_t nproc, nwords;
+
+				// SPLITV writes a bitvector, one bit per split proc
+				nproc = prog->sdata[ins->a0+1] - prog->sdata[ins->a0];
+				nwords = nproc / 64 + ((nproc % 64) > 0);
+				ok = (size_t)ins->a1 + nwords <= nframe;
+			}
+			break;
+
+		case JVST_OP_RETURN:
+			ok = !ins->a0slot;
+			break;
+
+		case JVST_OP_UNIQUE:
+			ok = !ins->a0slot &&
+				(ins->a0 == JVST_VM_UNIQUE_INIT ||
+				 ins->a0 == JVST_VM_UNIQUE_EVAL ||
+				 ins->a0 == JVST_VM_UNIQUE_FINAL);
+			break;
+
+		case JVST_OP_BADOP:
+		default:
+			return verify_error(errbuf, nb, "invalid opcode 0x%08" PRIx32 " at %zu",
+				prog->code[pc], pc);
+		}
+
+		if (!ok) {
+			return verify_error(errbuf, nb, "invalid arguments to %s at %zu",
+				jvst_op_name(ins->op), pc);
+		}
+	}
+
+	prog->verified = 1;
+	return 0;
+}
+
+enum { VM_DEFAULT_STACK = 1024  };   // 8 bytes per stack element, so default to 16K stack
+enum { VM_STACK_BUFFER = 64     };   // in resize, minimum amount of extra space
+enum { VM_DEFAULT_MAXSPLIT = 16 };
+enum { VM_SPLIT_STACK = 64      };   // initial stack of a split context, grows as needed
+enum { VM_SIZING_MAXSTACK = 65536 };   // largest stack preallocated from a sizing hint
+enum { VM_SIZING_MAXCTX = 64   };   // most split contexts preallocated from a sizing hint
+enum { VM_COMMIT_MAXSTEPS = 16 };   // jumps and returns followed to find a committed split branch
+
+/* DISPATCH state.  Until it finds the discriminator, a DISPATCH keeps
+ * the object's events, and their text, so it can replay them into the
+ * branch the discriminator selects, or into the split if there isn't
+ * one.
+ */
+enum vm_disc_state {
+	VM_DISC_IDLE = 0,
+	VM_DISC_SCAN,		// buffering events, looking for the discriminator
+	VM_DISC_BRANCH,		// running the selected branch in splits[0]
+	VM_DISC_SPLIT,		// running the split
+};
+
+struct vm_disc_event {
+	enum SJP_RESULT pret;
+	enum SJP_EVENT type;
+	size_t off, n;		// text, in the state's buffer
+	double d;
+	size_t ncp;
+};
+
+struct jvst_vm_disc {
+	enum vm_disc_state state;
+	enum jvst_vm_tokstate tokstate;	// the context's, at the DISPATCH
+
+	size_t depth;	// nesting depth in the object
+	int inval;	// at depth 1, the next token is a member's value
+	int iskey;	// ... and the member is the discriminator
+	size_t tok;	// first event of the current token
+
+	size_t nevt, maxevt;
+	struct vm_disc_event *evts;
+
+	size_t ntext, maxtext;
+	char *text;
+};
+
+static void
+vm_disc_reset(struct jvst_vm_disc *d)
+{
+	d->state = VM_DISC_IDLE;
+	d->nevt = 0;
+	d->ntext = 0;
+}
+
+static void
+vm_disc_free(struct jvst_vm_disc *d)
+{
+	free(d->evts);
+	free(d->text);
+	free(d);
+}
+
+static size_t
+vm_sizing_clamp(size_t hint, size_t min, size_t max)
+{
+	if (hint < min) {
+		return min;
+	}
+
+	return (hint > max) ? max : hint;
+}
+
+static void
+vm_ctx_init(struct jvst_vm_ctx *ctx, struct jvst_vm *owner, struct jvst_vm_program *prog, size_t nstack)
+{
+	static struct jvst_vm_ctx zero = { 0 };
+
+	*ctx = zero;
+
+	ctx->prog = prog;
+	ctx->owner = owner;
+
+	ctx->maxstack = nstack;
+	ctx->stack = xmalloc(ctx->maxstack * sizeof ctx->stack[0]);
+
+	ctx->nsplit = 0;
+	ctx->maxsplit = size_max(VM_DEFAULT_MAXSPLIT, prog->sizing.maxsplit);
+	ctx->splits = xmalloc(ctx->maxsplit * sizeof ctx->splits[0]);
+}
+
+static struct jvst_vm_ctx *
+vm_ctx_new(struct jvst_vm *owner, struct jvst_vm_program *prog)
+{
+	struct jvst_vm_ctx *ctx;
+
+	ctx = xmalloc(sizeof *ctx);
+	vm_ctx_init(ctx, owner, prog,
+		vm_sizing_clamp(prog->sizing.split_stack, VM_SPLIT_STACK, VM_SIZING_MAXSTACK));
+
+	return ctx;
+}
+
+/* Resets a context to start running at pc, keeping its stack and split
+ * array.
+ */
+static void
+vm_ctx_reset(struct jvst_vm_ctx *ctx, struct jvst_vm_program *prog, uint32_t pc)
+{
+	static const struct sjp_event evt_zero = { 0 };
+
+	assert(ctx->nsplit == 0);
+
+	ctx->prog = prog;
+
+	ctx->nobj = 0;
+	ctx->narr = 0;
+	ctx->evt  = evt_zero;
+
+	ctx->r_flag = 0;
+	ctx->r_pc = pc;
+	ctx->r_fp = 0;
+	ctx->r_sp = 0;
+
+	ctx->pret = SJP_OK;
+	ctx->error = 0;
+	ctx->dfa_st = 0;
+	ctx->tokstate = JVST_VM_TOKEN_CONSUMED;
+
+	ctx->uniq = NULL;
+	ctx->vset = NULL;
+	ctx->next_free = NULL;
+
+	if (ctx->disc != NULL) {
+		vm_disc_reset(ctx->disc);
+	}
+}
+
+/* Takes a split context from the owner's pool, allocating one only if
+ * the pool is empty.
+ */
+static struct jvst_vm_ctx *
+vm_ctx_get(struct jvst_vm *owner, struct jvst_vm_program *prog, uint32_t pc)
+{
+	struct jvst_vm_ctx *ctx;
+
+	ctx = owner->free_ctx;
+	if (ctx != NULL) {
+		owner->free_ctx = ctx->next_free;
+	} else {
+		ctx = vm_ctx_new(owner, prog);
+	}
+
+	vm_ctx_reset(ctx, prog, pc);
+	return ctx;
+}
+
+static void
+vm_ctx_release_splits(struct jvst_vm_ctx *ctx);
+
+/* Takes a unique set from the owner's pool, allocating one only if the
+ * pool is empty.
+ */
+static struct jvst_vm_unique *
+vm_uniq_get(struct jvst_vm *owner)
+{
+	struct jvst_vm_unique *uniq;
+
+	uniq = owner->free_uniq;
+	if (uniq == NULL) {
+		return jvst_vm_uniq_initialize();
+	}
+
+	owner->free_uniq = uniq->next_free;
+	uniq->next_free = NULL;
+	return uniq;
+}
+
+static void
+vm_uniq_put(struct jvst_vm *owner, struct jvst_vm_unique *uniq)
+{
+	jvst_vm_uniq_reset(uniq);
+	uniq->next_free = owner->free_uniq;
+	owner->free_uniq = uniq;
+}
+
+/* Returns a split context, and any splits it has running, to the
+ * owner's pool.  The caller is responsible for clearing ctx->uniq if
+ * the context shares it with its parent.
+ */
+static void
+vm_ctx_put(struct jvst_vm *owner, struct jvst_vm_ctx *ctx)
+{
+	vm_ctx_release_splits(ctx);
+
+	if (ctx->uniq != NULL) {
+		vm_uniq_put(owner, ctx->uniq);
+		ctx->uniq = NULL;
+	}
+
+	if (ctx->vset != NULL) {
+		vm_uniq_put(owner, ctx->vset);
+		ctx->vset = NULL;
+	}
+
+	ctx->prog = NULL;
+	ctx->next_free = owner->free_ctx;
+	owner->free_ctx = ctx;
+}
+
+static void
+vm_ctx_release_splits(struct jvst_vm_ctx *ctx)
+{
+	size_t i;
+
+	for (i=0; i < ctx->nsplit; i++) {
+		struct jvst_vm_ctx *sub = ctx->splits[i];
+
+		// XXX - kludge
+		if (sub->uniq == ctx->uniq) {
+			sub->uniq = NULL;
+		}
+
+		vm_ctx_put(ctx->owner, sub);
+	}
+
+	ctx->nsplit = 0;
+}
+
+static void
+vm_ctx_final(struct jvst_vm_ctx *ctx)
+{
+	static struct jvst_vm_ctx zero = { 0 };
+	size_t i;
+
+	free(ctx->stack);
+	free(ctx->splits);
+
+	if (ctx->disc != NULL) {
+		vm_disc_free(ctx->disc);
+	}
+
+	for (i=0; i < ctx->nlazy; i++) {
+		jvst_vm_lazy_free(ctx->lazy[i]);
+	}
+	free(ctx->lazy);
+
+	*ctx = zero;
+}
+
+void
+jvst_vm_init_defaults(struct jvst_vm *vm, struct jvst_vm_program *prog)
+{
+	static struct jvst_vm zero = { 0 };
+
+	const struct jvst_vm_sizing *sz;
+	size_t i, nctx;
+
+	*vm = zero;
+
+	jvst_vm_program_predecode(prog);
+	sz = &prog->sizing;
+
+	vm_ctx_init(&vm->ctx, vm, prog,
+		vm_sizing_clamp(sz->stack, VM_DEFAULT_STACK, VM_SIZING_MAXSTACK));
+
+	// preallocate the split contexts, so validating a document
+	// doesn't have to allocate them
+	vm->free_ctx = NULL;
+	nctx = vm_sizing_clamp(sz->nctx, 0, VM_SIZING_MAXCTX);
+	for (i=0; i < nctx; i++) {
+		struct jvst_vm_ctx *ctx = vm_ctx_new(vm, prog);
+		ctx->prog = NULL;
+		ctx->next_free = vm->free_ctx;
+		vm->free_ctx = ctx;
+	}
+
+	vm->free_uniq = NULL;
+
+	(void)sjp_parser_init(&vm->parser, &vm->pstack[0], ARRAYLEN(vm->pstack), &vm->pbuf[0],
+			      ARRAYLEN(vm->pbuf));
+}
+
+void
+jvst_vm_reset(struct jvst_vm *vm)
+{
+	vm_ctx_release_splits(&vm->ctx);
+
+	if (vm->ctx.uniq != NULL) {
+		vm_uniq_put(vm, vm->ctx.uniq);
+	}
+
+	if (vm->ctx.vset != NULL) {
+		vm_uniq_put(vm, vm->ctx.vset);
+	}
+
+	vm_ctx_reset(&vm->ctx, vm->ctx.prog, 0);
+	vm->needtok = 0;
+
+	(void)sjp_parser_init(&vm->parser, &vm->pstack[0], ARRAYLEN(vm->pstack), &vm->pbuf[0],
+			      ARRAYLEN(vm->pbuf));
+}
+
+void
+jvst_vm_finalize(struct jvst_vm *vm)
+{
+	static struct jvst_vm zero = { 0 };
+
+	struct jvst_vm_ctx *ctx, *next;
+	struct jvst_vm_unique *uniq, *unext;
+
+	vm_ctx_release_splits(&vm->ctx);
+
+	if (vm->ctx.uniq) {
+		jvst_vm_uniq_finalize(vm->ctx.uniq);
+	}
+
+	if (vm->ctx.vset) {
+		jvst_vm_uniq_finalize(vm->ctx.vset);
+	}
+
+	vm_ctx_final(&vm->ctx);
+
+	for (ctx = vm->free_ctx; ctx != NULL; ctx = next) {
+		next = ctx->next_free;
+		vm_ctx_final(ctx);
+		free(ctx);
+	}
+
+	for (uniq = vm->free_uniq; uniq != NULL; uniq = unext) {
+		unext = uniq->next_free;
+		jvst_vm_uniq_finalize(uniq);
+	}
+
+	*vm = zero;
+}
+
+static void
+vm_dumpregs(struct sbuf *buf, const struct jvst_vm_ctx *vm)
+{
+	sbuf_snprintf(buf, "PC=%" PRIu32 " FP=%" PRIu32 " SP=%" PRIu32 " FLAG=%" PRId64 "\n",
+		vm->r_pc, vm->r_fp, vm->r_sp, vm->r_flag);
+}
+
+static void
+vm_dumpstack(FILE *f, const struct jvst_vm_ctx *vm)
+{
+	uint32_t fp,sp,i,n;
+
+	fp = vm->r_fp;
+	sp = vm->r_sp;
+	if (fp > 0) {
+		fprintf(f, "[%5d] %" PRId64 "\t(PPC)\n", fp-2, vm->stack[fp-2].i);
+		fprintf(f, "[%5d] %" PRId64 "\t(PFP)\n", fp-1, vm->stack[fp-1].i);
+		fprintf(f, "---\n");
+	}
+
+	assert(sp >= fp);
+	n = sp - fp;
+	for (i=0; i < n; i++) {
+		char rname[16];
+		fprintf(f, "[%5d] %-3s ", fp+i, stackname(i,rname));
+		if (i == JVST_VM_TNUM) {
+			fprintf(f, "%f\n", vm->stack[i].f);
+		} else {
+			fprintf(f, "%" PRId64 "\n", vm->stack[i].i);
+		}
+	}
+	fprintf(f, "\n");
+}
+
+static void
+vm_dumpctx(struct jvst_vm_ctx *vm)
+{
+	char cbuf[128];
+	struct sbuf buf = { .buf = cbuf, .cap = sizeof cbuf, .len = 0, .np = 0 };
+
+	fprintf(stderr, "--- VM state ---\n");
+	jvst_vm_program_debug(vm->prog);
+	vm_dumpregs(&buf, vm);
+	fprintf(stderr, "\n%s\n", buf.buf);
+	
+	fprintf(stderr, "stack frame:\n");
+
+	vm_dumpstack(stderr,vm);
+}
+
+void
+jvst_vm_dumpstate(struct jvst_vm *vm)
+{
+	vm_dumpctx(&vm->ctx);
+}
+
+static void
+resize_stack(struct jvst_vm_ctx *vm, size_t newlen)
+{
+	size_t newmax;
+
+	if (newlen < vm->maxstack) {
+		return;
+	}
+
+	newmax = vm->maxstack;
+	if (newmax < VM_DEFAULT_STACK) {
+		newmax = VM_DEFAULT_STACK;
+	} else if (newmax < 16384) {
+		newmax *= 2;
+	} else {
+		newmax += newmax/4;
+	}
+
+	if (newmax < newlen) {
+		newmax = newlen + VM_STACK_BUFFER;
+	}
+
+	vm->stack = xrealloc(vm->stack, newmax * sizeof vm->stack[0]);
+	vm->maxstack = newmax;
+}
+
+/* Slot and argument accessors.  When checked is zero the arguments are
+ * assumed to have been proven valid by jvst_vm_program_verify().
+ * checked is always a constant, so the tests compile away.
+ */
+static inline union jvst_vm_stackval *
+vm_slotptr(struct jvst_vm_ctx *vm, uint32_t fp, int32_t slot, const int checked)
+{
+	if (checked && fp+slot > vm->r_sp) {
+		// XXX - better error code!
+		PANIC(vm, -1, "slot exceeded stack");
+	}
+
+	return &vm->stack[fp+slot];
+}
+
+static inline uint64_t
+vm_uval(struct jvst_vm_ctx *vm, uint32_t fp, int isslot, int32_t arg, const int checked)
+{
+	if (!isslot) {
+		return arg;
+	}
+
+	return vm_slotptr(vm,fp,arg,checked)->u;
+}
+
+static inline int64_t
+vm_ival(struct jvst_vm_ctx *vm, uint32_t fp, int isslot, int32_t arg, const int checked)
+{
+	if (!isslot) {
+		return arg;
+	}
 
-	a = jvst_vm_decode_arg0(opcode);
-	b = jvst_vm_decode_arg1(opcode);
+	return vm_slotptr(vm,fp,arg,checked)->i;
+}
+
+static inline double *
+vm_fvalptr(struct jvst_vm_ctx *vm, uint32_t fp, int isslot, int32_t arg, const int checked)
+{
+	if (checked && !isslot) {
+		// XXX - better error code!
+		PANIC(vm, -1, "literal arg to float compare");
+	}
+
+	return &vm_slotptr(vm,fp,arg,checked)->f;
+}
+
+static inline int
+iopcmp(struct jvst_vm_ctx *vm, uint32_t fp, const struct jvst_vm_decoded *ins, const int checked)
+{
+	int64_t va,vb;
+
+	va = vm_ival(vm, fp, ins->a0slot, ins->a0, checked);
+	vb = vm_ival(vm, fp, ins->a1slot, ins->a1, checked);
+
+	return (va > vb) - (va < vb);
+}
+
+static inline int
+fopcmp(struct jvst_vm_ctx *vm, uint32_t fp, const struct jvst_vm_decoded *ins, const int checked)
+{
+	double va,vb;
 
-	va = vm_fvalptr(vm, fp, a)[0];
-	vb = vm_fvalptr(vm, fp, b)[0];
+	va = vm_fvalptr(vm, fp, ins->a0slot, ins->a0, checked)[0];
+	vb = vm_fvalptr(vm, fp, ins->a1slot, ins->a1, checked)[0];
 
 	return (va > vb) - (va < vb);
 }
 
 static inline int
-has_partial_token(struct jvst_vm *vm)
+has_partial_token(struct jvst_vm_ctx *vm)
 {
 	return (vm->pret != SJP_OK);
 }
 
 static void
-setup_next_token(struct jvst_vm *vm, uint32_t fp)
+setup_next_token(struct jvst_vm_ctx *vm, uint32_t fp)
 {
 	int ret;
 
@@ -674,7 +1920,7 @@ setup_next_token(struct jvst_vm *vm, uint32_t fp)
 }
 
 static void
-load_slots_from_token(struct jvst_vm *vm, uint32_t fp)
+load_slots_from_token(struct jvst_vm_ctx *vm, uint32_t fp)
 {
 	vm->stack[fp+JVST_VM_TT  ].i = 0;
 	vm->stack[fp+JVST_VM_TNUM].f = 0.0;
@@ -692,7 +1938,7 @@ load_slots_from_token(struct jvst_vm *vm, uint32_t fp)
 }
 
 static void
-unget_token(struct jvst_vm *vm)
+unget_token(struct jvst_vm_ctx *vm)
 {
 	if (vm->tokstate == JVST_VM_TOKEN_BUFFERED) {
 		PANIC(vm, -1, "unget TOKEN while token already buffered");
@@ -702,7 +1948,7 @@ unget_token(struct jvst_vm *vm)
 }
 
 static int
-next_token(struct jvst_vm *vm, uint32_t fp)
+next_token(struct jvst_vm_ctx *vm, uint32_t fp)
 {
 	switch (vm->tokstate) {
 	case JVST_VM_TOKEN_BUFFERED:
@@ -723,7 +1969,7 @@ next_token(struct jvst_vm *vm, uint32_t fp)
 }
 
 static int
-consume_current_value(struct jvst_vm *vm)
+consume_current_value(struct jvst_vm_ctx *vm)
 {
 	int ret;
 
@@ -819,7 +2065,7 @@ eating_object_or_array:
 }
 
 static void
-vm_dumpevt(struct sbuf *buf, const struct jvst_vm *vm)
+vm_dumpevt(struct sbuf *buf, const struct jvst_vm_ctx *vm)
 {
 	size_t n;
 	sbuf_snprintf(buf, "type=%s n=%zu text=\"",
@@ -863,7 +2109,7 @@ tokstate_name(enum jvst_vm_tokstate st)
 }
 
 static void
-debug_state(struct jvst_vm *vm)
+debug_state(struct jvst_vm_ctx *vm)
 {
 	char cbuf[128];
 	struct sbuf buf = { .buf = cbuf, .cap = sizeof(cbuf), .len = 0, .np = 0 };
@@ -881,7 +2127,7 @@ debug_state(struct jvst_vm *vm)
 }
 
 static void
-debug_op(struct jvst_vm *vm, uint32_t pc, uint32_t opcode)
+debug_op(struct jvst_vm_ctx *vm, uint32_t pc, uint32_t opcode)
 {
 	char cbuf[128];
 	struct sbuf buf = { .buf = cbuf, .cap = sizeof(cbuf), .len = 0, .np = 0 };
@@ -903,10 +2149,35 @@ debug_op(struct jvst_vm *vm, uint32_t pc, uint32_t opcode)
  * partial token and has subsequently been completed, then the initial
  * data is lost and MATCH will start halfway in.
  */
+static struct jvst_vm_lazy *
+vm_lazy_get(struct jvst_vm_ctx *vm, const struct jvst_vm_dfa *dfa)
+{
+	const struct jvst_vm_program *prog = vm->prog;
+	size_t i;
+
+	if (dfa < prog->dfas || dfa >= prog->dfas + prog->ndfa) {
+		PANIC(vm, -1, "MATCH op on an NFA that isn't in the program");
+	}
+
+	i = dfa - prog->dfas;
+	if (vm->lazy == NULL) {
+		vm->nlazy = prog->ndfa;
+		vm->lazy = xcalloc(vm->nlazy, sizeof vm->lazy[0]);
+	}
+
+	if (vm->lazy[i] == NULL) {
+		vm->lazy[i] = jvst_vm_lazy_new(dfa, JVST_VM_LAZY_MAXSTATES);
+	}
+
+	return vm->lazy[i];
+}
+
 static int
-vm_match(struct jvst_vm *vm, const struct jvst_vm_dfa *dfa)
+vm_match(struct jvst_vm_ctx *vm, const struct jvst_vm_dfa *dfa)
 {
+	struct jvst_vm_lazy *lz;
 	int ret, st, result;
+	bool isend;
 
 	if (vm->tokstate != JVST_VM_TOKEN_READY) {
 		PANIC(vm, -1, "MATCH op, but token is not READY");
@@ -917,8 +2188,19 @@ vm_match(struct jvst_vm *vm, const struct jvst_vm_dfa *dfa)
 	}
 
 	ret = SJP_OK;
-	st = jvst_vm_dfa_run(dfa, vm->dfa_st, vm->evt.text, vm->evt.n);
+	lz = NULL;
+	if (dfa->nfa) {
+		lz = vm_lazy_get(vm, dfa);
+		st = jvst_vm_lazy_run(lz, vm->dfa_st, vm->evt.text, vm->evt.n);
+	} else if (vm->dfa_st == JVST_VM_DFA_START && !has_partial_token(vm) &&
+		!jvst_vm_dfa_maymatch(dfa, vm->evt.text, vm->evt.n)) {
+		// the whole string is here, and the prefilter rules it out
+		st = JVST_VM_DFA_NOMATCH;
+	} else {
+		st = jvst_vm_dfa_run(dfa, vm->dfa_st, vm->evt.text, vm->evt.n);
+	}
 	if (has_partial_token(vm)) {
+		vm->dfa_st = st;
 		return JVST_MORE;
 	}
 
@@ -928,7 +2210,9 @@ vm_match(struct jvst_vm *vm, const struct jvst_vm_dfa *dfa)
 	}
 
 	result = -1;
-	if (st == JVST_VM_DFA_NOMATCH || !jvst_vm_dfa_endstate(dfa, st, &result)) {
+	isend = (lz != NULL) ? jvst_vm_lazy_endstate(lz, st, &result)
+		: jvst_vm_dfa_endstate(dfa, st, &result);
+	if (st == JVST_VM_DFA_NOMATCH || !isend) {
 		result = 0;
 	}
 	assert(result >= 0);
@@ -941,47 +2225,319 @@ vm_match(struct jvst_vm *vm, const struct jvst_vm_dfa *dfa)
 	return SJP_OK;
 }
 
+/* Compares s[0:n] with a string packed 8 bytes a word, low byte first */
+static int
+vm_packed_equal(const int64_t *kw, const char *s, size_t n)
+{
+	size_t i;
+
+	for (i=0; i < n; i++) {
+		if ((unsigned char)((uint64_t)kw[i/8] >> (8*(i%8))) != (unsigned char)s[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int
+jvst_vm_lits_find(const int64_t *tbl, const char *s, size_t n)
+{
+	uint64_t key, b;
+	size_t off;
+
+	b = jvst_vm_lits_hash((uint64_t)tbl[1], s, n) & (uint64_t)(tbl[0]-1);
+	if (tbl[3+2*b] == 0) {
+		return 0;
+	}
+
+	key = (uint64_t)tbl[2+2*b];
+	off = key & 0xffffffff;
+	if (key >> 32 != n) {
+		return 0;
+	}
+
+	if (!vm_packed_equal(&tbl[off], s, n)) {
+		return 0;
+	}
+
+	return (int)tbl[3+2*b];
+}
+
+/* LMATCH semantics:
+ *
+ * Like MATCH, but a token that's complete and hasn't been partly
+ * matched is looked up in the literal table.  Otherwise it's matched
+ * with the DFA, which accepts the same strings.  The DFA of a finite
+ * set of strings never returns to its start state, so if it's in the
+ * start state, no part of the token has been matched.
+ */
+static int
+vm_lmatch(struct jvst_vm_ctx *vm, const struct jvst_vm_dfa *dfa, const int64_t *tbl)
+{
+	if (vm->tokstate != JVST_VM_TOKEN_READY || vm->evt.type != SJP_STRING ||
+		has_partial_token(vm) || vm->dfa_st != JVST_VM_DFA_START) {
+		return vm_match(vm, dfa);
+	}
+
+	vm->tokstate = JVST_VM_TOKEN_CONSUMED;
+	vm->stack[vm->r_fp + JVST_VM_M].i = jvst_vm_lits_find(tbl, vm->evt.text, vm->evt.n);
+	return SJP_OK;
+}
+
+/* ENUM semantics:
+ *
+ * A complete null, true, false, string or number token is looked up in
+ * the value set directly.  Partial strings, arrays and objects are
+ * hashed a token at a time by a unique set from the owner's pool, and
+ * ENUM returns JVST_MORE or JVST_NEXT to be run again with the rest of
+ * the value.  Once the value is complete, %M is 1 if it's in the set and
+ * 0 if not, and the value is consumed.
+ */
+static int
+vm_enum(struct jvst_vm_ctx *vm, const int64_t *tbl)
+{
+	int ret, found;
+
+	if (vm->vset == NULL) {
+		if (vm->tokstate != JVST_VM_TOKEN_READY) {
+			PANIC(vm, -1, "ENUM op, but token is not READY");
+		}
+
+		switch (vm->evt.type) {
+		case SJP_NULL:
+		case SJP_TRUE:
+		case SJP_FALSE:
+		case SJP_STRING:
+		case SJP_NUMBER:
+			if (!has_partial_token(vm)) {
+				found = jvst_vm_vset_find(tbl, &vm->evt);
+				goto done;
+			}
+			break;
+
+		case SJP_ARRAY_BEG:
+		case SJP_OBJECT_BEG:
+			break;
+
+		default:
+			PANIC(vm, -1, "ENUM op on a token that doesn't start a value");
+		}
+
+		vm->vset = vm_uniq_get(vm->owner);
+	}
+
+	ret = jvst_vm_uniq_member(vm->vset, tbl, vm->pret, &vm->evt);
+	switch (ret) {
+	case JVST_NEXT:
+	case JVST_MORE:
+		return ret;
+
+	case JVST_VALID:
+	case JVST_INVALID:
+		break;
+
+	default:
+		PANIC(vm, -1, "unexpected return from jvst_vm_uniq_member");
+	}
+
+	found = (ret == JVST_VALID);
+	vm_uniq_put(vm->owner, vm->vset);
+	vm->vset = NULL;
+
+done:
+	vm->tokstate = JVST_VM_TOKEN_CONSUMED;
+	vm->stack[vm->r_fp + JVST_VM_M].i = found;
+	return SJP_OK;
+}
+
 static enum jvst_result
-vm_run_next(struct jvst_vm *vm, enum SJP_RESULT pret, struct sjp_event *evt);
+vm_run_next(struct jvst_vm_ctx *vm, enum SJP_RESULT pret, struct sjp_event *evt);
+
+/* A split branch is committed when it is consuming the rest of a value
+ * and every frame on its stack returns VALID once that's done.  Its
+ * result is known even though it hasn't finished.
+ */
+static int
+vm_ctx_committed(const struct jvst_vm_ctx *ctx)
+{
+	const struct jvst_vm_decoded *dec;
+	uint32_t pc, fp;
+	int steps;
+
+	if (ctx->prog == NULL || ctx->r_pc >= ctx->prog->ncode) {
+		return 0;
+	}
+
+	dec = ctx->prog->decoded;
+	pc = ctx->r_pc;
+	fp = ctx->r_fp;
+
+	if (dec[pc].op != JVST_OP_CONSUME) {
+		return 0;
+	}
+
+	// follow unconditional jumps and VALID returns out to the top
+	// frame
+	pc++;
+	for (steps=0; steps < VM_COMMIT_MAXSTEPS; steps++) {
+		const struct jvst_vm_decoded *ins = &dec[pc];
+
+		if (ins->op == JVST_OP_JMP && ins->cond == JVST_VM_BR_ALWAYS) {
+			pc = ins->a0;
+			continue;
+		}
+
+		if (ins->op != JVST_OP_RETURN || ins->a0slot || ins->a0 != 0) {
+			return 0;
+		}
+
+		if (fp == 0) {
+			return 1;
+		}
+
+		// continue after the CALL in the caller's frame
+		pc = ctx->stack[fp-2].u + 1;
+		fp = ctx->stack[fp-1].u;
+	}
+
+	return 0;
+}
+
+/* Decides the outcome of a split from the branches run so far.  nvalid
+ * is the number of branches that have returned VALID or are committed,
+ * nrun is the number of branches that are still running and not
+ * committed.
+ *
+ * Returns 1 if the outcome holds, 0 if it fails, and -1 if it's not
+ * yet decided.  SPLIT and SPLITV need every result, so they are only
+ * decided when all running branches are committed.
+ */
+static int
+split_outcome(enum jvst_vm_op op, uint32_t nproc, uint32_t nvalid, uint32_t nrun)
+{
+	switch (op) {
+	case JVST_OP_SPLITANY:
+		if (nvalid > 0) {
+			return 1;
+		}
+		break;
+
+	case JVST_OP_SPLITALL:
+		if (nvalid + nrun < nproc) {
+			return 0;
+		}
+		break;
+
+	case JVST_OP_SPLITONE:
+		if (nvalid > 1) {
+			return 0;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	if (nrun > 0) {
+		return -1;
+	}
+
+	switch (op) {
+	case JVST_OP_SPLITANY: return nvalid > 0;
+	case JVST_OP_SPLITALL: return nvalid == nproc;
+	case JVST_OP_SPLITONE: return nvalid == 1;
+	default:               return 1;
+	}
+}
+
+/* Stops running split branches once the outcome of the split is
+ * decided.  If the outcome fails, every branch is stopped and the
+ * caller fails without consuming the rest of the value.  Otherwise
+ * branches that aren't committed are stopped and one committed branch
+ * is left to consume the rest of the value, if it's not already
+ * consumed.
+ *
+ * Stopped branches are marked finished with the result they would have
+ * had: committed branches as VALID, others as INVALID.  Returns the
+ * number of branches left running.
+ */
+static int
+vm_split_retire(struct jvst_vm_ctx *vm, int outcome)
+{
+	uint32_t i;
+	int keep;
+
+	keep = (outcome != 0);
+	for (i=0; i < vm->nsplit; i++) {
+		struct jvst_vm_ctx *sub = vm->splits[i];
+
+		if (sub->prog == NULL) {
+			continue;
+		}
+
+		if (!vm_ctx_committed(sub)) {
+			sub->error = JVST_INVALID_SPLIT_CONDITION;
+		} else if (keep) {
+			// this branch consumes the rest of the value
+			keep = 0;
+			continue;
+		}
+
+		sub->prog = NULL;
+	}
+
+	// number of branches left running
+	return (outcome != 0) && !keep;
+}
+
+/* Starts a context for a split proc, which inherits the current token
+ * state.
+ */
+static struct jvst_vm_ctx *
+vm_split_branch(struct jvst_vm_ctx *vm, uint32_t proc)
+{
+	struct jvst_vm_ctx *sub;
+	uint32_t pc0;
+
+	pc0 = vm->prog->sdata[vm->prog->nsplit + 1 + proc];
+	sub = vm_ctx_get(vm->owner, vm->prog, pc0);
+
+	// XXX - kludge to support unique constraints.
+	// This needs to be fixed!
+	{
+		const struct jvst_vm_decoded *ins = &vm->prog->decoded[pc0+1];
+		if (ins->op == JVST_OP_UNIQUE && ins->a0 == JVST_VM_UNIQUE_EVAL) {
+			sub->uniq = vm->uniq;
+		}
+	}
+
+	// split vms inherit the current token state
+	sub->tokstate = vm->tokstate;
+
+	return sub;
+}
 
 static int
-vm_split(struct jvst_vm *vm, int split, union jvst_vm_stackval *slot, int splitv)
+vm_split(struct jvst_vm_ctx *vm, int split, union jvst_vm_stackval *slot, enum jvst_vm_op op)
 {
-	uint32_t proc0, proc1, nproc, i, ndone;
-	int endstate;
+	uint32_t proc0, proc1, nproc, i, ndone, nvalid, nrun;
+	int endstate, outcome;
 
 	proc0 = vm->prog->sdata[split+0];
 	proc1 = vm->prog->sdata[split+1];
 	nproc = proc1-proc0;
 
 	if (vm->nsplit == 0) {
-		uint32_t i, off, fp0;
+		uint32_t i;
 
 		if (nproc > vm->maxsplit) {
-			size_t incr = vm->maxsplit - nproc;
+			size_t incr = nproc - vm->maxsplit;
 			vm->splits = xenlargevec(vm->splits, &vm->maxsplit, incr, sizeof vm->splits[0]);
 		}
 
-		fp0 = vm->r_fp;
-		off = vm->prog->nsplit + 1 + proc0;
 		for (i=0; i < nproc; i++) {
-			jvst_vm_init_defaults(&vm->splits[i], vm->prog);
-			vm->splits[i].r_pc = vm->prog->sdata[off + i];
-
-			// XXX - kludge to support unique constraints.
-			// This needs to be fixed!
-			{
-				uint32_t opcode = vm->prog->code[vm->splits[i].r_pc+1];
-				uint32_t op = jvst_vm_decode_op(opcode);
-				uint32_t a0 = jvst_vm_decode_arg0(opcode);
-				int wh = jvst_vm_arg_tolit(a0);
-				if (op == JVST_OP_UNIQUE && wh == JVST_VM_UNIQUE_EVAL) {
-					vm->splits[i].uniq = vm->uniq;
-				}
-			}
-
-			// split vms inherit the current token state
-			vm->splits[i].tokstate = vm->tokstate;
+			vm->splits[i] = vm_split_branch(vm, proc0 + i);
 		}
 
 		// SPLIT should leave the current token, if any, consumed
@@ -996,21 +2552,24 @@ vm_split(struct jvst_vm *vm, int split, union jvst_vm_stackval *slot, int splitv
 
 	endstate = JVST_INDETERMINATE;
 	ndone = 0;
+	nvalid = 0;
+	nrun = 0;
 	for (i=0; i < nproc; i++) {
 		enum jvst_result ret;
 
-		if (vm->splits[i].prog == NULL) {
+		if (vm->splits[i]->prog == NULL) {
 			ndone++;
+			nvalid += (vm->splits[i]->error == 0);
 			continue;
 		}
 
 		// run vm code
-		ret = vm_run_next(&vm->splits[i], vm->pret, &vm->evt);
+		ret = vm_run_next(vm->splits[i], vm->pret, &vm->evt);
 
 		switch (ret) {
 		case JVST_VALID:
-			assert(vm->splits[i].error == 0);
-			vm->splits[i].prog = NULL;
+			assert(vm->splits[i]->error == 0);
+			vm->splits[i]->prog = NULL;
 
 			/* fallthrough */
 
@@ -1039,13 +2598,27 @@ vm_split(struct jvst_vm *vm, int split, union jvst_vm_stackval *slot, int splitv
 			 * string/object/array) or done with a dummy
 			 * split whose result we ignore.
 			 */
-			assert(vm->splits[i].error != 0);
-			vm->splits[i].prog = NULL;
+			assert(vm->splits[i]->error != 0);
+			vm->splits[i]->prog = NULL;
 			break;
 		}
 
-		if (vm->splits[i].prog == NULL) {
+		if (vm->splits[i]->prog == NULL) {
 			ndone++;
+			nvalid += (vm->splits[i]->error == 0);
+		} else if (vm_ctx_committed(vm->splits[i])) {
+			nvalid++;
+		} else {
+			nrun++;
+		}
+	}
+
+	if (ndone < nproc) {
+		outcome = split_outcome(op, nproc, nvalid, nrun);
+		if (outcome >= 0 && vm_split_retire(vm, outcome) == 0) {
+			// the remaining branches were stopped part way
+			// through the value
+			goto finished;
 		}
 	}
 
@@ -1067,14 +2640,15 @@ vm_split(struct jvst_vm *vm, int split, union jvst_vm_stackval *slot, int splitv
 			PANIC(vm, -1, "internal error: split finished, endstate is not INDETERMINATE or VALID");
 	}
 
+finished:
 	// all splits have finished.  record valid splits
-	if (splitv == 0) {
+	if (op != JVST_OP_SPLITV) {
 		// count number of valid splits
 		slot->i = 0;
 		for (i=0; i < nproc; i++) {
-			assert(vm->splits[i].prog == NULL);
+			assert(vm->splits[i]->prog == NULL);
 
-			if (vm->splits[i].error == 0) {
+			if (vm->splits[i]->error == 0) {
 				slot->i++;
 			}
 		}
@@ -1106,7 +2680,7 @@ vm_split(struct jvst_vm *vm, int split, union jvst_vm_stackval *slot, int splitv
 			}
 #endif /* DEBUG_SPLITV */
 
-			if (vm->splits[i].error == 0) {
+			if (vm->splits[i]->error == 0) {
 				slot[sl].u |= mask;
 			}
 			mask = mask << 1;
@@ -1114,485 +2688,490 @@ vm_split(struct jvst_vm *vm, int split, union jvst_vm_stackval *slot, int splitv
 		}
 	}
 
-	// clean up split resources and reset vm->nsplit
-	for (i=0; i < nproc; i++) {
-		assert(vm->splits[i].prog == NULL);
-
-		// XXX - kludge
-		if (vm->splits[i].uniq == vm->uniq) {
-			vm->splits[i].uniq = NULL;
-		}
-
-		jvst_vm_finalize(&vm->splits[i]);
-	}
-	vm->nsplit = 0;
+	// return split contexts to the pool and reset vm->nsplit
+	vm_ctx_release_splits(vm);
 	return JVST_VALID;
 }
 
-#define DEBUG_OP(vm,pc,opcode) do{ if (DEBUG_OPCODES) { debug_op((vm),(pc),(opcode)); } } while(0)
+/* DISPATCH semantics:
+ *
+ * The DISPATCH is reached with the object's OBJECT_BEG as the current
+ * token.  It buffers the object's events until it reads the value of
+ * the discriminator.  If the value is one of the tags, the branch it
+ * selects is started on the buffered events and run on the rest of the
+ * object, and the slot gets 1 if the branch is valid and 0 if not.  No
+ * other branch can be valid, so no other branch is run.  If the value
+ * isn't a tag, the slot gets 0 at once.
+ *
+ * If the object ends without the discriminator, the buffered events
+ * are replayed through the split.  So is everything if the DISPATCH is
+ * reached in any other state, which the assembler doesn't generate.
+ */
 
-#define NEXT do{ vm->r_pc = ++pc; goto loop; } while(0)
-#define BRANCH(newpc) do { pc += (newpc); vm->r_pc = pc; goto loop; } while(0)
-static enum jvst_result
-vm_run_next(struct jvst_vm *vm, enum SJP_RESULT pret, struct sjp_event *evt)
+static void
+vm_disc_push(struct jvst_vm_disc *d, enum SJP_RESULT pret, const struct sjp_event *evt)
 {
-	uint32_t opcode, pc, fp, sp;
-	int64_t flag;
-	uint32_t *code;
-	size_t ncode;
-
-	enum jvst_vm_op op;
-	int ret;
-
-	vm->evt = *evt;
-	vm->pret = pret;
-
-	code  = vm->prog->code;
-	ncode = vm->prog->ncode;
-
-	pc = vm->r_pc;
-	fp = vm->r_fp;
-	sp = vm->r_sp;
-	flag = vm->r_flag;
-
-	ret = JVST_INVALID;
-
-loop:
-	assert(pc >= 0);  // safety in case type is changed
+	struct vm_disc_event *e;
 
-	// bounds check pc
-	if (pc > ncode) {
-		vm->error = JVST_INVALID_VM_BAD_PC;
-		ret = JVST_INVALID;
-		goto finish;
+	if (d->nevt >= d->maxevt) {
+		d->evts = xenlargevec(d->evts, &d->maxevt, 1, sizeof d->evts[0]);
 	}
 
-	opcode = code[pc];
-	op = jvst_vm_decode_op(opcode);
-	DEBUG_OP(vm, pc, opcode);
-#if DEBUG_STEP
-	{
-		static char buf[256];
-		fgets(buf, sizeof buf, stdin);
+	if (d->ntext + evt->n > d->maxtext) {
+		d->text = xenlargevec(d->text, &d->maxtext, d->ntext + evt->n - d->maxtext, 1);
 	}
-#endif
 
-	switch (op) {
-	case JVST_OP_NOP:
-		NEXT;
+	e = &d->evts[d->nevt++];
+	e->pret = pret;
+	e->type = evt->type;
+	e->off  = d->ntext;
+	e->n    = evt->n;
+	e->d    = evt->extra.d;
+	e->ncp  = evt->extra.ncp;
+
+	if (evt->n > 0) {
+		memcpy(&d->text[d->ntext], evt->text, evt->n);
+		d->ntext += evt->n;
+	}
+}
 
-	case JVST_OP_PROC:
-		{
-			uint32_t a, fp0;
-			int i,n,nsl;
-			a = jvst_vm_decode_arg0(opcode);
-			assert(jvst_vm_arg_islit(a));
-
-			nsl = jvst_vm_arg_tolit(a);
-			if (nsl < 0) {
-				// XXX - better error messages
-				vm->error = JVST_INVALID_VM_INVALID_ARG;
-				ret = JVST_INVALID;
-				goto finish;
-			}
+static void
+vm_disc_event(const struct jvst_vm_disc *d, size_t i, struct sjp_event *evt)
+{
+	static const struct sjp_event evt_zero = { 0 };
+	const struct vm_disc_event *e = &d->evts[i];
+
+	*evt = evt_zero;
+	evt->type = e->type;
+	evt->text = &d->text[e->off];
+	evt->n = e->n;
+	evt->extra.d = e->d;
+	evt->extra.ncp = e->ncp;
+}
 
-			// allocate extra slots for "registers"
-			n = nsl + JVST_VM_NUMREG;
+/* Runs the selected branch on an event.  Returns JVST_VALID once the
+ * branch has finished.
+ */
+static int
+vm_disc_branch(struct jvst_vm_ctx *vm, union jvst_vm_stackval *slot,
+	enum SJP_RESULT pret, struct sjp_event *evt)
+{
+	struct jvst_vm_ctx *sub = vm->splits[0];
+	int ret;
 
-			// setup frame
-			fp0 = fp;
-			fp = sp;
+	ret = vm_run_next(sub, pret, evt);
+	if (ret == JVST_NEXT || ret == JVST_MORE) {
+		return ret;
+	}
 
-			// allocate stack slots
-			resize_stack(vm, sp+n);
-			for (i=0; i < n; i++) {
-				vm->stack[sp++].u = 0;
-			}
+	slot->i = (sub->error == 0);
 
-			if (fp0 != fp) {
-				// copy registers
-				vm->stack[fp+JVST_VM_TT  ].i = vm->stack[fp0+JVST_VM_TT  ].i;
-				vm->stack[fp+JVST_VM_TNUM].f = vm->stack[fp0+JVST_VM_TNUM].f;
-				vm->stack[fp+JVST_VM_TLEN].i = vm->stack[fp0+JVST_VM_TLEN].i;
-				vm->stack[fp+JVST_VM_M   ].i = vm->stack[fp0+JVST_VM_M   ].i;
-			} else {
-				// load TT / TNUM / TLEN from current token
-				load_slots_from_token(vm,fp);
-			}
+	vm_ctx_release_splits(vm);
+	vm_disc_reset(vm->disc);
+	return JVST_VALID;
+}
 
-			vm->r_fp = fp;
-			vm->r_sp = sp;
-		}
-		NEXT;
+/* Starts the branch a tag selects, and catches it up on the buffered
+ * events
+ */
+static int
+vm_disc_select(struct jvst_vm_ctx *vm, const int64_t *tbl, union jvst_vm_stackval *slot, int which)
+{
+	struct jvst_vm_disc *d = vm->disc;
+	uint32_t proc0;
+	size_t i;
+	int ret;
 
-	/* integer comparisons */
-	case JVST_OP_ICMP:
-		vm->r_flag = flag = iopcmp(vm, fp, opcode);
-		NEXT;
+	proc0 = vm->prog->sdata[tbl[0]];
 
-	/* floating point comparisons */
-	case JVST_OP_FCMP:
-		vm->r_flag = flag = fopcmp(vm, fp, opcode);
-		NEXT;
+	vm->tokstate = d->tokstate;
+	vm->splits[0] = vm_split_branch(vm, proc0 + (uint32_t)(which-1));
+	vm->nsplit = 1;
 
-	case JVST_OP_FINT:
-		{
-			double v;
-			uint32_t arg0, arg1;
-			int slot;
-
-			arg0 = jvst_vm_decode_arg0(opcode);
-			arg1 = jvst_vm_decode_arg1(opcode);
-			assert(jvst_vm_arg_isslot(arg0));
-
-			v = vm_fvalptr(vm, fp, arg0)[0];
-			if (arg1 != 0) {
-				double div;
-
-				if (jvst_vm_arg_isslot(arg1)) {
-					div = vm_fvalptr(vm, fp, arg1)[0];
-				} else {
-					div = jvst_vm_arg_tolit(arg1);
-				}
+	// like SPLIT, leave the current token consumed
+	vm->tokstate = JVST_VM_TOKEN_CONSUMED;
+	d->state = VM_DISC_BRANCH;
 
-				v /= div;
-			}
+	ret = JVST_NEXT;
+	for (i=0; i < d->nevt; i++) {
+		struct sjp_event evt;
 
-			vm->r_flag = flag = isfinite(v) && (v == ceil(v));
+		vm_disc_event(d, i, &evt);
+		ret = vm_disc_branch(vm, slot, d->evts[i].pret, &evt);
+		if (ret != JVST_NEXT && ret != JVST_MORE) {
+			break;
 		}
-		NEXT;
-
-	case JVST_OP_JMP:
-		{
-			enum jvst_vm_br_cond brc;
-			uint32_t barg;
-			int fmask;
-
-			brc = jvst_vm_decode_bcond(opcode);
-			if (brc != JVST_VM_BR_ALWAYS) {
-				int mask;
-
-				// XXX - can we simplify / eliminate
-				// branches?
-				mask = (flag<0) | ((flag > 0) << 1) | ((flag == 0) << 2);
+	}
 
-				if ((brc & mask) == 0) {
-					NEXT;
-				}
-			}
+	return ret;
+}
 
-			barg = jvst_vm_decode_barg(opcode);
-			BRANCH(jvst_vm_tobarg(barg));
-		}
+/* Replays the buffered events through the split */
+static int
+vm_disc_fallback(struct jvst_vm_ctx *vm, const int64_t *tbl, union jvst_vm_stackval *slot)
+{
+	struct jvst_vm_disc *d = vm->disc;
+	struct sjp_event live;
+	enum SJP_RESULT live_pret;
+	size_t i;
+	int ret;
 
-	case JVST_OP_TOKEN:
-		{
-			uint32_t arg1;
-			int i1;
+	live = vm->evt;
+	live_pret = vm->pret;
 
-			arg1 = jvst_vm_decode_arg1(opcode);
-			i1 = jvst_vm_arg_tolit(arg1);
+	vm->tokstate = d->tokstate;
+	d->state = VM_DISC_SPLIT;
 
-			// read next token, set the various token values
-			if (i1 == -1) {
-				unget_token(vm);
-				NEXT;
-			}
+	ret = JVST_NEXT;
+	for (i=0; i < d->nevt; i++) {
+		vm_disc_event(d, i, &vm->evt);
+		vm->pret = d->evts[i].pret;
 
-			if (next_token(vm,fp)) {
-				return JVST_NEXT;
-			}
-			NEXT;
+		ret = vm_split(vm, (int)tbl[0], slot, (enum jvst_vm_op)tbl[1]);
+		if (ret != JVST_NEXT && ret != JVST_MORE) {
+			break;
 		}
+	}
 
-	case JVST_OP_CONSUME:
-		{
-			int ret;
+	vm->evt = live;
+	vm->pret = live_pret;
 
-			ret = consume_current_value(vm);
-			if (ret != JVST_VALID) {
-				return ret;
-			}
-		}
-		NEXT;
+	if (ret != JVST_NEXT && ret != JVST_MORE) {
+		vm_disc_reset(d);
+	}
 
-	case JVST_OP_RETURN:
-		{
-			uint32_t arg0;
+	return ret;
+}
 
-			arg0 = jvst_vm_decode_arg0(opcode);
-			assert(jvst_vm_arg_islit(arg0));
+/* Buffers the current event and follows the object's members.  Partial
+ * tokens are buffered until they're complete.
+ */
+static int
+vm_disc_scan(struct jvst_vm_ctx *vm, const int64_t *tbl, union jvst_vm_stackval *slot)
+{
+	struct jvst_vm_disc *d = vm->disc;
+	const int64_t *tags;
+	const char *s;
+	size_t tok, n, kw;
+	int which;
+
+	// resuming after more input was asked for
+	if (vm->evt.type == SJP_NONE) {
+		return JVST_NEXT;
+	}
 
-			if (arg0 != 0) {
-				vm->error = vm_ival(vm, fp, arg0);
-				assert(vm->error != 0);
-				ret = JVST_INVALID;
-				goto finish;
-			}
+	vm_disc_push(d, vm->pret, &vm->evt);
+	if (has_partial_token(vm)) {
+		return JVST_MORE;
+	}
 
-			// otherwise VALID return
+	// the whole token, over the events it took
+	tok = d->tok;
+	d->tok = d->nevt;
+	s = &d->text[d->evts[tok].off];
+	n = d->ntext - d->evts[tok].off;
+
+	if (d->depth > 1) {
+		switch (vm->evt.type) {
+		case SJP_OBJECT_BEG:
+		case SJP_ARRAY_BEG:
+			d->depth++;
+			break;
 
-			// consume token, then return to previous frame or, if top of
-			// stack, return JVST_VALID
-			ret = consume_current_value(vm);
-			if (ret != JVST_VALID && ret != JVST_NEXT) {
-				return ret;
+		case SJP_OBJECT_END:
+		case SJP_ARRAY_END:
+			if (--d->depth == 1) {
+				d->inval = 0;
 			}
+			break;
 
-			// value consumed... return to previous frame or finish
-			// if we're at the top of the stack
-			if (fp == 0) {
-				vm->r_pc = pc = 0;
-				ret = JVST_VALID;
-				goto finish;
-			}
+		default:
+			break;
+		}
+
+		return JVST_NEXT;
+	}
 
-			vm->r_sp = sp = fp-2;
-			vm->r_pc = pc = vm->stack[fp-2].u;
-			vm->r_fp = fp = vm->stack[fp-1].u;
-			NEXT; // pc points to CALL, continue with next instruction
+	if (!d->inval) {
+		if (vm->evt.type != SJP_STRING) {
+			// the end of the object, without the discriminator
+			return vm_disc_fallback(vm, tbl, slot);
 		}
 
-	case JVST_OP_MOVE:
-		{
-			double v;
-			uint32_t a0,a1;
+		d->iskey = ((uint64_t)tbl[2] == n) && vm_packed_equal(&tbl[3], s, n);
+		d->inval = 1;
+		return JVST_NEXT;
+	}
 
-			a0 = jvst_vm_decode_arg0(opcode);
-			a1 = jvst_vm_decode_arg1(opcode);
+	if (d->iskey) {
+		kw = ((size_t)tbl[2] + 7) / 8;
+		tags = &tbl[3+kw];
 
-			assert(jvst_vm_arg_isslot(a0));
+		which = 0;
+		if (vm->evt.type == SJP_STRING) {
+			which = jvst_vm_lits_find(tags, s, n);
+		}
 
-			if (jvst_vm_arg_islit(a1)) {
-				int lit = jvst_vm_arg_tolit(a1);
-				vm_slotptr(vm,fp,a0)->i = lit;
-			} else {
-				union jvst_vm_stackval *s0, *s1;
-				s0 = vm_slotptr(vm,fp,a0);
-				s1 = vm_slotptr(vm,fp,a1);
-				memcpy(s0,s1,sizeof(*s0));
-			}
+		if (which == 0) {
+			// no branch allows the value, so none is valid
+			slot->i = 0;
+			vm->tokstate = JVST_VM_TOKEN_CONSUMED;
+			vm_disc_reset(d);
+			return JVST_VALID;
 		}
-		NEXT;
 
-	case JVST_OP_FLOAD:
-	case JVST_OP_ILOAD:
-		{
-			uint32_t a0,a1;
-			union jvst_vm_stackval *slot;
-			int ind;
+		return vm_disc_select(vm, tbl, slot, which);
+	}
 
-			a0 = jvst_vm_decode_arg0(opcode);
-			a1 = jvst_vm_decode_arg1(opcode);
+	if (vm->evt.type == SJP_OBJECT_BEG || vm->evt.type == SJP_ARRAY_BEG) {
+		d->depth++;
+	} else {
+		d->inval = 0;
+	}
 
-			assert(jvst_vm_arg_isslot(a0));
-			assert(jvst_vm_arg_islit(a1));
-			slot = vm_slotptr(vm, fp, a0);
-			ind = jvst_vm_arg_tolit(a1);
+	return JVST_NEXT;
+}
 
-			if (op == JVST_OP_FLOAD) {
-				if (ind < 0 || (size_t)ind > vm->prog->nfloat) {
-					PANIC(vm, -1, "invalid float pool index");
-				}
+static int
+vm_dispatch(struct jvst_vm_ctx *vm, const int64_t *tbl, union jvst_vm_stackval *slot)
+{
+	struct jvst_vm_disc *d;
 
-				slot->f = vm->prog->fdata[ind];
-			} else {
-				if (ind < 0 || (size_t)ind > vm->prog->nconst) {
-					PANIC(vm, -1, "invalid const pool index");
-				}
+	if (vm->disc == NULL) {
+		vm->disc = xcalloc(1, sizeof *vm->disc);
+	}
 
-				slot->i = vm->prog->cdata[ind];
-			}
+	d = vm->disc;
+	switch (d->state) {
+	case VM_DISC_IDLE:
+		if (vm->tokstate != JVST_VM_TOKEN_READY || vm->evt.type != SJP_OBJECT_BEG ||
+			has_partial_token(vm) || vm->nsplit != 0) {
+			d->state = VM_DISC_SPLIT;
+			goto split;
 		}
-		NEXT;
 
-	case JVST_OP_INCR:
-		{
-			uint32_t a0,a1;
-			union jvst_vm_stackval *slot;
-			int delta;
+		d->state = VM_DISC_SCAN;
+		d->tokstate = vm->tokstate;
+		d->depth = 1;
+		d->inval = 0;
+		d->iskey = 0;
+		d->tok = 0;
+		d->nevt = 0;
+		d->ntext = 0;
+
+		vm_disc_push(d, vm->pret, &vm->evt);
+		d->tok = d->nevt;
+		vm->tokstate = JVST_VM_TOKEN_CONSUMED;
+		return JVST_NEXT;
 
-			a0 = jvst_vm_decode_arg0(opcode);
-			a1 = jvst_vm_decode_arg1(opcode);
+	case VM_DISC_SCAN:
+		return vm_disc_scan(vm, tbl, slot);
 
-			assert(jvst_vm_arg_isslot(a0));
+	case VM_DISC_BRANCH:
+		return vm_disc_branch(vm, slot, vm->pret, &vm->evt);
 
-			slot = vm_slotptr(vm, fp, a0);
-			delta = vm_ival(vm, fp, a1);
-			slot->i += delta;
-		}
-		NEXT;
+	case VM_DISC_SPLIT:
+		goto split;
+	}
 
-	case JVST_OP_MATCH:
-		{
-			uint32_t a0;
-			int dfa_ind;
-			const struct jvst_vm_dfa *dfa;
+	PANIC(vm, -1, "invalid DISPATCH state");
 
-			a0 = jvst_vm_decode_arg0(opcode);
-			dfa_ind = vm_ival(vm, fp, a0);
+split:
+	{
+		int ret;
 
-			if (dfa_ind < 0 || (size_t)dfa_ind >= vm->prog->ndfa) {
-				PANIC(vm, -1, "MATCH op with invalid DFA");
-			}
+		ret = vm_split(vm, (int)tbl[0], slot, (enum jvst_vm_op)tbl[1]);
+		if (ret != JVST_NEXT && ret != JVST_MORE) {
+			vm_disc_reset(d);
+		}
 
-			dfa = &vm->prog->dfas[dfa_ind];
-			assert(dfa != NULL);
+		return ret;
+	}
+}
 
-			ret = vm_match(vm, dfa);
-			if (ret != JVST_VALID) {
-				goto finish;
-			}
-		}
-		NEXT;
+#define VM_RUN_FN  vm_run_checked
+#define VM_CHECKED 1
+#include "validate_vm_run.h"
+#undef VM_RUN_FN
+#undef VM_CHECKED
 
-	case JVST_OP_CALL:
-		{
-			uint32_t barg;
-			long br;
-			barg = jvst_vm_decode_barg(opcode);
-			br = jvst_vm_tobarg(barg);
+#define VM_RUN_FN  vm_run_unchecked
+#define VM_CHECKED 0
+#include "validate_vm_run.h"
+#undef VM_RUN_FN
+#undef VM_CHECKED
 
-			assert(pc+br >= 0 && (size_t)(pc+br) < vm->prog->ncode);
-			assert(jvst_vm_decode_op(vm->prog->code[pc+br]) == JVST_OP_PROC);
+uint32_t
+jvst_vm_rt_proc(struct jvst_vm_ctx *vm, int nslots)
+{
+	uint32_t fp0, fp, sp;
+	int i,n;
 
-			resize_stack(vm, sp+2);
-			vm->stack[sp+0].u = pc;
-			vm->stack[sp+1].u = fp;
+	n = nslots + JVST_VM_NUMREG;
 
-			sp += 2;
-			vm->r_fp = fp;
-			vm->r_sp = sp;
+	fp0 = vm->r_fp;
+	fp = sp = vm->r_sp;
 
-			BRANCH(br);
-		}
+	resize_stack(vm, sp+n);
+	for (i=0; i < n; i++) {
+		vm->stack[sp++].u = 0;
+	}
 
-	case JVST_OP_BSET:
-		{
-			uint32_t a0,a1;
-			union jvst_vm_stackval *slot;
-			int bit;
+	if (fp0 != fp) {
+		vm->stack[fp+JVST_VM_TT  ].i = vm->stack[fp0+JVST_VM_TT  ].i;
+		vm->stack[fp+JVST_VM_TNUM].f = vm->stack[fp0+JVST_VM_TNUM].f;
+		vm->stack[fp+JVST_VM_TLEN].i = vm->stack[fp0+JVST_VM_TLEN].i;
+		vm->stack[fp+JVST_VM_M   ].i = vm->stack[fp0+JVST_VM_M   ].i;
+	} else {
+		load_slots_from_token(vm,fp);
+	}
 
-			a0 = jvst_vm_decode_arg0(opcode);
-			a1 = jvst_vm_decode_arg1(opcode);
+	vm->r_fp = fp;
+	vm->r_sp = sp;
 
-			assert(jvst_vm_arg_isslot(a0));
+	return fp;
+}
 
-			slot = vm_slotptr(vm, fp, a0);
-			bit = vm_ival(vm, fp, a1);
+void
+jvst_vm_rt_call(struct jvst_vm_ctx *vm, uint32_t pc)
+{
+	uint32_t sp = vm->r_sp;
 
-			if (bit < 0 || bit >= 64) {
-				PANIC(vm, -1, "BSET op with invalid bit");
-			}
+	resize_stack(vm, sp+2);
+	vm->stack[sp+0].u = pc;
+	vm->stack[sp+1].u = vm->r_fp;
 
-			slot->u |= (1<<bit);
-		}
-		NEXT;
+	vm->r_sp = sp+2;
+}
 
-	case JVST_OP_BAND:
-		{
-			uint32_t a0,a1;
-			union jvst_vm_stackval *slot;
-			uint64_t mask;
+int
+jvst_vm_rt_return(struct jvst_vm_ctx *vm)
+{
+	uint32_t fp;
+	int ret;
 
-			a0 = jvst_vm_decode_arg0(opcode);
-			a1 = jvst_vm_decode_arg1(opcode);
+	ret = consume_current_value(vm);
+	if (ret != JVST_VALID && ret != JVST_NEXT) {
+		return ret;
+	}
 
-			assert(jvst_vm_arg_isslot(a0));
+	fp = vm->r_fp;
+	if (fp == 0) {
+		vm->r_pc = 0;
+		return JVST_VALID;
+	}
 
-			slot = vm_slotptr(vm, fp, a0);
-			mask = vm_uval(vm, fp, a1);
+	vm->r_sp = fp-2;
+	vm->r_pc = vm->stack[fp-2].u + 1;
+	vm->r_fp = vm->stack[fp-1].u;
 
-			slot->u &= mask;
-		}
-		NEXT;
+	return JVST_VM_RT_CONTINUE;
+}
 
-	case JVST_OP_SPLITV:
-	case JVST_OP_SPLIT:
-		{
-			uint32_t a0,a1;
-			int split;
-			union jvst_vm_stackval *slot;
+int
+jvst_vm_rt_token(struct jvst_vm_ctx *vm)
+{
+	return next_token(vm, vm->r_fp) ? JVST_NEXT : JVST_VALID;
+}
 
-			a0 = jvst_vm_decode_arg0(opcode);
-			a1 = jvst_vm_decode_arg1(opcode);
+void
+jvst_vm_rt_unget(struct jvst_vm_ctx *vm)
+{
+	unget_token(vm);
+}
 
-			if (!jvst_vm_arg_isslot(a1)) {
-				PANIC(vm, -1, "SPLIT op with non-slot second argument");
-			}
+int
+jvst_vm_rt_consume(struct jvst_vm_ctx *vm)
+{
+	return consume_current_value(vm);
+}
 
-			split = vm_ival(vm, fp, a0);
-			slot = vm_slotptr(vm, fp, a1);
-			if (split < 0 || (size_t)split >= vm->prog->nsplit) {
-				PANIC(vm, -1, "SPLIT op with bad split index");
-			}
+int
+jvst_vm_rt_match(struct jvst_vm_ctx *vm, const struct jvst_vm_dfa *dfa)
+{
+	return vm_match(vm, dfa);
+}
 
-			ret = vm_split(vm,split,slot, (op == JVST_OP_SPLITV));
-			if (ret != JVST_VALID) {
-				goto finish;
-			}
-		}
-		NEXT;
+int
+jvst_vm_rt_lmatch(struct jvst_vm_ctx *vm, const struct jvst_vm_dfa *dfa, const int64_t *tbl)
+{
+	return vm_lmatch(vm, dfa, tbl);
+}
 
-	case JVST_OP_UNIQUE:
-		{
-			uint32_t a0,a1;
-			a0 = jvst_vm_decode_arg0(opcode);
-			a1 = jvst_vm_decode_arg1(opcode);
+int
+jvst_vm_rt_enum(struct jvst_vm_ctx *vm, const int64_t *tbl)
+{
+	return vm_enum(vm, tbl);
+}
 
-			int wh = jvst_vm_arg_tolit(a0);
+int
+jvst_vm_rt_split(struct jvst_vm_ctx *vm, int split, union jvst_vm_stackval *slot, enum jvst_vm_op op)
+{
+	return vm_split(vm, split, slot, op);
+}
 
-			switch (wh) {
-			case JVST_VM_UNIQUE_INIT:
-				vm->uniq = jvst_vm_uniq_initialize();
-				break;
+int
+jvst_vm_rt_dispatch(struct jvst_vm_ctx *vm, const int64_t *tbl, union jvst_vm_stackval *slot)
+{
+	return vm_dispatch(vm, tbl, slot);
+}
 
-			case JVST_VM_UNIQUE_EVAL:
-				{
-					int ret = jvst_vm_uniq_evaluate(vm->uniq, vm->pret, &vm->evt);
-					switch (ret) {
-					case JVST_VALID:
-					case JVST_NEXT:
-					case JVST_MORE:
-						return ret;
-
-					case JVST_INVALID:
-						vm->error = JVST_INVALID_NOT_UNIQUE;
-						ret = JVST_INVALID;
-						goto finish;
-
-					default:
-						PANIC(vm, -1, "unexpected return from jvst_vm_uniq_evaluate");
-					}
-				}
-				break;
+int
+jvst_vm_rt_unique(struct jvst_vm_ctx *vm, enum jvst_vm_unique_arg arg)
+{
+	int ret;
 
-			case JVST_VM_UNIQUE_FINAL:
-				jvst_vm_uniq_finalize(vm->uniq);
-				vm->uniq = NULL;
-				break;
+	switch (arg) {
+	case JVST_VM_UNIQUE_INIT:
+		vm->uniq = vm_uniq_get(vm->owner);
+		return JVST_VALID;
 
-			default:
-				PANIC(vm, -1, "invalid arg0 for UNIQUE op");
-			}
+	case JVST_VM_UNIQUE_EVAL:
+		ret = jvst_vm_uniq_evaluate(vm->uniq, vm->pret, &vm->evt);
+		switch (ret) {
+		case JVST_VALID:
+		case JVST_NEXT:
+		case JVST_MORE:
+			return ret;
+
+		case JVST_INVALID:
+			vm->error = JVST_INVALID_NOT_UNIQUE;
+			return JVST_INVALID;
+
+		default:
+			PANIC(vm, -1, "unexpected return from jvst_vm_uniq_evaluate");
 		}
-		NEXT;
 
+	case JVST_VM_UNIQUE_FINAL:
+		vm_uniq_put(vm->owner, vm->uniq);
+		vm->uniq = NULL;
+		return JVST_VALID;
+
+	default:
+		PANIC(vm, -1, "invalid arg0 for UNIQUE op");
 	}
+}
 
-	vm->error = JVST_INVALID_VM_INVALID_OP;
+int
+jvst_vm_rt_badpc(struct jvst_vm_ctx *vm)
+{
+	vm->error = JVST_INVALID_VM_BAD_PC;
 	return JVST_INVALID;
+}
 
-finish:
-	vm->r_pc = pc;
-	vm->r_fp = fp;
-	vm->r_sp = sp;
-	vm->r_flag = flag;
-	return ret;
+static enum jvst_result
+vm_run_next(struct jvst_vm_ctx *vm, enum SJP_RESULT pret, struct sjp_event *evt)
+{
+	if (vm->prog->native != NULL) {
+		return vm->prog->native(vm, pret, evt);
+	}
+
+	if (vm->prog->verified) {
+		return vm_run_unchecked(vm, pret, evt);
+	}
+
+	return vm_run_checked(vm, pret, evt);
 }
-#undef NEXT
-#undef BRANCH
-#undef DEBUG_OP
 
 enum jvst_result
 jvst_vm_more(struct jvst_vm *vm, char *data, size_t n)
@@ -1602,7 +3181,7 @@ jvst_vm_more(struct jvst_vm *vm, char *data, size_t n)
 	enum SJP_RESULT pret;
 	int first;
 
-	if (vm->error) {
+	if (vm->ctx.error) {
 		return JVST_INVALID;
 	}
 
@@ -1614,7 +3193,7 @@ jvst_vm_more(struct jvst_vm *vm, char *data, size_t n)
 	if (!vm->needtok) {
 		enum jvst_result ret;
 
-		ret = vm_run_next(vm, pret, &evt);
+		ret = vm_run_next(&vm->ctx, pret, &evt);
 		if (ret != JVST_NEXT) {
 			return ret;
 		}
@@ -1642,7 +3221,7 @@ jvst_vm_more(struct jvst_vm *vm, char *data, size_t n)
 		}
 
 		if (SJP_ERROR(pret)) {
-			vm->error = pret;
+			vm->ctx.error = pret;
 			if (DEBUG_OPCODES) {
 				const char *lbeg, *lend, *err, *end;
 				size_t i,n,width = 60, padding = 12;
@@ -1701,7 +3280,7 @@ jvst_vm_more(struct jvst_vm *vm, char *data, size_t n)
 				fprintf(stderr,"%s\n",buf);
 				fprintf(stderr, "\n");
 
-				debug_state(vm);
+				debug_state(&vm->ctx);
 			}
 
 			return JVST_INVALID;
@@ -1717,14 +3296,14 @@ jvst_vm_more(struct jvst_vm *vm, char *data, size_t n)
 
 		if (pret == SJP_OK && evt.type == SJP_TOK_NONE) {
 			// stream has closed
-			if (vm->r_pc == 0 && vm->r_fp == 0) {
+			if (vm->ctx.r_pc == 0 && vm->ctx.r_fp == 0) {
 				return JVST_VALID;
 			}
 			return JVST_INVALID;
 		}
 
 		vm->needtok = 0;
-		ret = vm_run_next(vm, pret, &evt);
+		ret = vm_run_next(&vm->ctx, pret, &evt);
 		if (ret != JVST_NEXT) {
 			return ret;
 		}
@@ -1737,7 +3316,7 @@ jvst_vm_close(struct jvst_vm *vm)
 {
 	int st,ret;
 
-	if (vm->r_pc != 0) {
+	if (vm->ctx.r_pc != 0) {
 		char buf[2] = " ";
 		// FIXME: this is a dumb hack to deal with numbers The problem is
 		// this: if the number is adjacent to the end of the stream, the lexer
@@ -1754,11 +3333,203 @@ jvst_vm_close(struct jvst_vm *vm)
 	ret = sjp_parser_close(&vm->parser);
 
 	if (SJP_ERROR(ret)) {
-		vm->error = JVST_INVALID_JSON;
+		vm->ctx.error = JVST_INVALID_JSON;
+		return JVST_INVALID;
+	}
+
+	return (vm->ctx.error == 0) ? JVST_VALID : JVST_INVALID;
+}
+
+static int
+vm_json_isspace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* The VM stops at the end of the top level value.  Anything the parser
+ * finds after it, other than whitespace, makes the record invalid.
+ */
+static enum jvst_result
+vm_records_trailing(struct jvst_vm *vm, char *data, size_t n)
+{
+	struct sjp_event evt = { 0 };
+	enum SJP_RESULT pret;
+
+	if (n > 0) {
+		sjp_parser_more(&vm->parser, data, n);
+	}
+
+	pret = sjp_parser_next(&vm->parser, &evt);
+	if (SJP_ERROR(pret) || (pret == SJP_OK && evt.type != SJP_NONE)) {
+		vm->ctx.error = JVST_INVALID_JSON;
 		return JVST_INVALID;
 	}
 
-	return (vm->error == 0) ? JVST_VALID : JVST_INVALID;
+	return JVST_VALID;
+}
+
+/* Feeds part of the current record, data doesn't contain a record
+ * delimiter.
+ */
+static void
+vm_records_feed(struct jvst_vm_records *rs, char *data, size_t n)
+{
+	size_t i;
+
+	i = 0;
+	if (!rs->inrec) {
+		while (i < n && vm_json_isspace(data[i])) {
+			i++;
+		}
+
+		if (i == n) {
+			return;
+		}
+
+		rs->inrec = 1;
+		rs->rec_off = rs->off + i;
+	}
+
+	switch (rs->result) {
+	case JVST_MORE:
+		rs->result = jvst_vm_more(&rs->vm, &data[i], n-i);
+		if (rs->result == JVST_VALID) {
+			// the parser may hold the rest of this chunk
+			rs->result = vm_records_trailing(&rs->vm, NULL, 0);
+		}
+		break;
+
+	case JVST_VALID:
+		rs->result = vm_records_trailing(&rs->vm, &data[i], n-i);
+		break;
+
+	default:
+		// the record is invalid, skip the rest of it
+		break;
+	}
+}
+
+/* Reports the verdict for the current record, if it has started, and
+ * resets the VM for the next one.
+ */
+static int
+vm_records_end(struct jvst_vm_records *rs)
+{
+	struct jvst_vm_record_result res;
+	int ret;
+
+	if (!rs->inrec) {
+		return 0;
+	}
+
+	if (rs->result == JVST_MORE) {
+		rs->result = jvst_vm_close(&rs->vm);
+	}
+
+	res.index  = rs->index;
+	res.offset = rs->rec_off;
+	res.result = rs->result;
+	res.error  = rs->vm.ctx.error;
+
+	ret = rs->func(rs->opaque, &res);
+
+	jvst_vm_reset(&rs->vm);
+	rs->index++;
+	rs->inrec = 0;
+	rs->result = JVST_MORE;
+
+	rs->stopped = ret;
+	return ret;
+}
+
+void
+jvst_vm_records_init(struct jvst_vm_records *rs, struct jvst_vm_program *prog,
+	enum jvst_vm_record_format format,
+	int (*func)(void *opaque, const struct jvst_vm_record_result *res), void *opaque)
+{
+	static const struct jvst_vm_records zero;
+
+	assert(func != NULL);
+
+	*rs = zero;
+	jvst_vm_init_defaults(&rs->vm, prog);
+
+	rs->format = format;
+	rs->func = func;
+	rs->opaque = opaque;
+
+	rs->result = JVST_MORE;
+}
+
+int
+jvst_vm_records_more(struct jvst_vm_records *rs, char *data, size_t n)
+{
+	char *p, *end;
+	int delim;
+
+	if (rs->stopped) {
+		return rs->stopped;
+	}
+
+	switch (rs->format) {
+	case JVST_VM_RECORD_NDJSON:
+		delim = '\n';
+		break;
+
+	case JVST_VM_RECORD_SEQ:
+		delim = '\x1e';
+		break;
+
+	default:
+		fprintf(stderr, "%s:%d (%s) unknown record format %d\n",
+			__FILE__, __LINE__, __func__, rs->format);
+		abort();
+	}
+
+	p = data;
+	end = data + n;
+	while (p < end) {
+		char *q;
+		size_t len;
+
+		q = memchr(p, delim, end-p);
+		len = ((q != NULL) ? q : end) - p;
+
+		vm_records_feed(rs, p, len);
+		rs->off += len;
+
+		if (q == NULL) {
+			break;
+		}
+
+		p = q+1;
+		rs->off++;
+
+		if (vm_records_end(rs) != 0) {
+			return rs->stopped;
+		}
+	}
+
+	return 0;
+}
+
+int
+jvst_vm_records_close(struct jvst_vm_records *rs)
+{
+	if (rs->stopped) {
+		return rs->stopped;
+	}
+
+	return vm_records_end(rs);
+}
+
+void
+jvst_vm_records_finalize(struct jvst_vm_records *rs)
+{
+	static const struct jvst_vm_records zero;
+
+	jvst_vm_finalize(&rs->vm);
+	*rs = zero;
 }
 
 
@@ -60,6 +60,21 @@ enum jvst_vm_op {
 	JVST_OP_SPLIT,		// SPLIT(split_ind, slot)
 	JVST_OP_SPLITV,		// SPLITV(split_ind, slot0)
 
+	// Short-circuiting SPLITs.  These store the number of valid
+	// branches in the slot, like SPLIT, but stop running branches
+	// once the count can no longer change the outcome:
+	//
+	// 	ANY	outcome is count >= 1
+	// 	ALL	outcome is count == number of branches
+	// 	ONE	outcome is count == 1
+	//
+	// When the outcome is decided, the count is only exact as far
+	// as it decides the outcome.  If the outcome is a failure, the
+	// rest of the value is not consumed.
+	JVST_OP_SPLITANY,	// SPLITANY(split_ind, slot)
+	JVST_OP_SPLITALL,	// SPLITALL(split_ind, slot)
+	JVST_OP_SPLITONE,	// SPLITONE(split_ind, slot)
+
 	JVST_OP_TOKEN,		// Loads the next token
 	JVST_OP_CONSUME,	// Consumes the next value, including objects and arrays
 
@@ -80,9 +95,60 @@ enum jvst_vm_op {
 	JVST_OP_RETURN,		// Returns VALID or raises an INVALID result.  INVALID results have an error code.
 
 	JVST_OP_UNIQUE,		// Initializes UNIQUE data, finalizes UNIQUE data, or evaluates for UNIQUE
+
+	JVST_OP_SWITCH,		// Multiway branch through a jump table: SWITCH(slot, table)
+				//
+				// The table is in the constant pool:
+				//
+				// 	cdata[table]		number of cases N
+				// 	cdata[table+1]		default destination
+				// 	cdata[table+2+k]	destination of case k
+				//
+				// Jumps to case k if the slot holds k, 0 <= k < N, and
+				// to the default otherwise.  Destinations are absolute
+				// code offsets.
+
+	JVST_OP_LMATCH,		// MATCH with a table of literals: LMATCH(dfa_index, table)
+				//
+				// Sets %M like MATCH, but looks a complete token up in
+				// a perfect hash table of literal strings in the
+				// constant pool (see jvst_vm_lits_find).  The DFA must
+				// accept exactly the strings in the table; it's run
+				// instead if the token is partial.
+
+	JVST_OP_ENUM,		// Tests if the current value is in a value set: ENUM(dir)
+				//
+				// cdata[dir] is the offset of the value set in the
+				// constant pool (see validate_uniq.h).  Sets %M to 1
+				// if the value is a member, and to 0 if not, and
+				// consumes the value.  Arrays and objects are taken
+				// a token at a time.
+
+	JVST_OP_DISPATCH,	// SPLIT selected by a discriminator: DISPATCH(dir, slot)
+				//
+				// Splits an object between branches that each require
+				// a string property to hold one of their own tags.
+				// cdata[dir] is the offset of the table t in the
+				// constant pool:
+				//
+				// 	t[0]		split index
+				// 	t[1]		SPLITANY or SPLITONE, run without the property
+				// 	t[2]		length n of the property's name
+				// 	t[3]		the name, 8 bytes a word, low byte first
+				// 	t[3+(n+7)/8]	literal table of the tags (see
+				// 			jvst_vm_lits_find), whose cases are
+				// 			the branch plus one
+				//
+				// Members are buffered until the property's value is
+				// read, then only the branch it selects is run on the
+				// object, and the slot gets 1 if the branch is valid
+				// and 0 if not.  If the value isn't a tag, the slot gets
+				// 0 and the rest of the object isn't consumed.  If the
+				// object doesn't have the property, the buffered
+				// members are replayed through the split.
 };
 
-#define JVST_OP_MAX JVST_OP_RETURN
+#define JVST_OP_MAX JVST_OP_DISPATCH
 
 enum jvst_vm_br_cond {
 	JVST_VM_BR_NEVER  = 0,           // bits: 000
@@ -116,7 +182,7 @@ enum jvst_vm_unique_arg {
  * constant pool
  *
  * For FLOAD and ILOAD, A must be a slot and B must be an index into the constant
- * pool.
+ * pool.  For SWITCH, B is the index of the jump table in the constant pool.
  *
  * For all other non-branching instructions, A and B can be either a slot or a constant
  *
@@ -286,6 +352,44 @@ jvst_vm_encode2(enum jvst_vm_op op, uint16_t a, uint16_t b)
 	return (uint32_t)op | ((uint32_t)a << 5) | ((uint32_t)b << 18);
 }
 
+/* A DFA has two forms.  The sparse form is what the compiler builds:
+ * offs[st] is the index of state st's first edge, edges are (byte,
+ * state) pairs sorted by byte, and endstates are (state, data) pairs
+ * sorted by state.
+ *
+ * The dense form is what's run, and files and generated C carry it
+ * alongside the sparse form, so it's only built when a program is
+ * compiled or loaded from an older file.  classes maps each byte to one of
+ * nclasses byte classes, so that no transition tells apart two bytes in
+ * the same class, and table has a row of nclasses next states for each
+ * state.  The row for state nstates is the dead state, where bytes
+ * without a transition go.  Entries are width bytes: 1, 2 or 4, the
+ * narrowest that can hold nstates.  ends[st] is the data of end state
+ * st, or -1 if st isn't an end state.
+ *
+ * The sparse form may also hold an NFA: a state may have epsilon edges,
+ * labelled JVST_VM_DFA_EPSILON and sorted after the bytes, or more than
+ * one edge on a byte.  An NFA has classes and ends but no table, and the
+ * VM determinises it as it runs (see jvst_vm_lazy_new()).  The compiler
+ * leaves patterns as NFAs when their DFAs would be too large.
+ *
+ * The dense form of a DFA also has a prefilter: literals that every
+ * string it matches has, which the VM checks before running the DFA
+ * on a string it has whole.  Each literal may be empty, and an NFA's
+ * are.
+ */
+#define JVST_VM_DFA_MAXLIT 32
+
+struct jvst_vm_dfa_prefilter {
+	size_t nprefix;
+	size_t nsuffix;
+	size_t nfactor;		// found anywhere in the string
+
+	char prefix[JVST_VM_DFA_MAXLIT];
+	char suffix[JVST_VM_DFA_MAXLIT];
+	char factor[JVST_VM_DFA_MAXLIT];
+};
+
 struct jvst_vm_dfa {
 	size_t nstates;
 	size_t nedges;
@@ -294,6 +398,16 @@ struct jvst_vm_dfa {
 	int *offs;
 	int *transitions;
 	int *endstates;
+
+	size_t nclasses;
+	size_t width;
+
+	int *ends;
+	uint8_t *classes;
+	void *table;
+
+	int nfa;
+	struct jvst_vm_dfa_prefilter pre;
 };
 
 size_t
@@ -302,15 +416,31 @@ jvst_vm_dfa_init(struct jvst_vm_dfa *dfa, size_t nstates, size_t nedges, size_t
 void
 jvst_vm_dfa_copy(struct jvst_vm_dfa *dst, const struct jvst_vm_dfa *src);
 
+/* Builds the dense form of the DFA from its sparse form.  Edges and end
+ * states that are out of range are ignored.
+ */
+void
+jvst_vm_dfa_compile(struct jvst_vm_dfa *dfa);
+
+/* Checks that the DFA's sparse form, and its dense form if it has one,
+ * are safe to run.  Returns 0 if they are, -1 otherwise.
+ */
+int
+jvst_vm_dfa_verify(const struct jvst_vm_dfa *dfa);
+
 enum {
 	JVST_VM_DFA_START    =  0,
 	JVST_VM_DFA_NOMATCH  = -1,
 	JVST_VM_DFA_BADSTATE = -2,
+
+	// label of an epsilon edge, one past the last byte
+	JVST_VM_DFA_EPSILON  = 256,
 };
 
 /* Runs the DFA on the input in buf, starting with state st0.  Returns
  * the DFA state after consuming all input in buf, or
- * JVST_VM_DFA_NOMATCH if the DFA cannot match the input.
+ * JVST_VM_DFA_NOMATCH if the DFA cannot match the input.  The DFA must
+ * have its dense form.
  *
  * The starting state is always zero.  st0 can be passed a value of
  * JVST_VM_DFA_NOMATCH as well, in which case the function will just
@@ -331,6 +461,123 @@ jvst_vm_dfa_endstate(const struct jvst_vm_dfa *dfa, int st1, int *datap);
 void
 jvst_vm_dfa_finalize(struct jvst_vm_dfa *dfa);
 
+/* Finds the literals of the DFA's prefilter from its sparse form.
+ * jvst_vm_dfa_compile() calls this.
+ */
+void
+jvst_vm_dfa_prefilter_build(const struct jvst_vm_dfa *dfa, struct jvst_vm_dfa_prefilter *pf);
+
+/* Returns false if the DFA can't match the n bytes of s, by its
+ * prefilter.  True doesn't mean that it matches.
+ */
+bool
+jvst_vm_dfa_maymatch(const struct jvst_vm_dfa *dfa, const char *s, size_t n);
+
+/* Lazily determinised NFAs.  The cache holds at most maxstates DFA
+ * states, and no fewer than three; when it's full it's flushed, even
+ * partway through a string.  States are numbered as in a DFA, with
+ * JVST_VM_DFA_START the start state, so jvst_vm_lazy_run() and
+ * jvst_vm_lazy_endstate() behave like jvst_vm_dfa_run() and
+ * jvst_vm_dfa_endstate().  If a set of NFA states has more than one end
+ * state, its data is that of the lowest numbered.
+ *
+ * A flush renumbers the states, so the state jvst_vm_lazy_run()
+ * returns is only good for the next call with the same cache, and a
+ * cache can only serve one match at a time.
+ *
+ * The NFA must have been compiled with jvst_vm_dfa_compile(), and must
+ * outlive the cache.
+ */
+#define JVST_VM_LAZY_MAXSTATES 4096
+
+struct jvst_vm_lazy;
+
+struct jvst_vm_lazy *
+jvst_vm_lazy_new(const struct jvst_vm_dfa *nfa, size_t maxstates);
+
+void
+jvst_vm_lazy_free(struct jvst_vm_lazy *lz);
+
+int
+jvst_vm_lazy_run(struct jvst_vm_lazy *lz, int st0, const char *buf, size_t n);
+
+bool
+jvst_vm_lazy_endstate(const struct jvst_vm_lazy *lz, int st1, int *datap);
+
+// Returns the number of states in the cache
+size_t
+jvst_vm_lazy_size(const struct jvst_vm_lazy *lz);
+
+/* Returns the number of states of the NFA's DFA, or a number larger
+ * than limit if it has more than limit states.  Stops building states
+ * once it passes limit, so the cost is bounded by limit.
+ */
+size_t
+jvst_vm_lazy_count(const struct jvst_vm_dfa *nfa, size_t limit);
+
+/* Literal tables for LMATCH.  A table of B buckets, B a power of two,
+ * takes these words of the constant pool, starting at t:
+ *
+ * 	cdata[t]		number of buckets B
+ * 	cdata[t+1]		hash seed
+ * 	cdata[t+2+2b]		key of bucket b: offset from t | length << 32
+ * 	cdata[t+3+2b]		case of bucket b, or zero if the bucket is empty
+ *
+ * followed by the key bytes, eight to a word with the first byte in the
+ * low bits.  The hash is perfect: each key is in the bucket its hash
+ * selects, so a lookup is one hash and one comparison.
+ */
+static inline uint64_t
+jvst_vm_lits_hash(uint64_t seed, const char *s, size_t n)
+{
+	uint64_t h;
+	size_t i;
+
+	// FNV-1a, with the seed folded into the offset basis
+	h = UINT64_C(0xcbf29ce484222325) ^ (seed * UINT64_C(0x9e3779b97f4a7c15));
+	for (i=0; i < n; i++) {
+		h ^= (unsigned char)s[i];
+		h *= UINT64_C(0x100000001b3);
+	}
+
+	return h ^ (h >> 32);
+}
+
+/* Returns the case of the string in the literal table tbl, or zero if
+ * the string isn't in the table.
+ */
+int
+jvst_vm_lits_find(const int64_t *tbl, const char *s, size_t n);
+
+/* Pre-decoded form of a single instruction.  The interpreter runs from
+ * an array of these, built once per program by
+ * jvst_vm_program_predecode(), so that argument and branch decoding is
+ * paid for once per program rather than once per executed instruction.
+ */
+struct jvst_vm_decoded {
+	uint8_t op;
+	uint8_t cond;		// JMP: branch condition
+	uint8_t a0slot;		// non-zero if a0 is a slot index
+	uint8_t a1slot;		// non-zero if a1 is a slot index
+	int32_t a0;		// slot index or literal value; JMP/CALL: absolute target pc
+	int32_t a1;		// slot index or literal value
+};
+
+/* Buffer sizes a VM needs to run a program without growing them,
+ * estimated from the program's static call and split graph by
+ * jvst_vm_program_predecode().  If the call graph is recursive the
+ * stack depth isn't bounded and the stack sizes and nctx are zero.
+ */
+struct jvst_vm_sizing {
+	size_t stack;		// stack slots for the top level context
+	size_t split_stack;	// stack slots for a split context
+	size_t maxsplit;	// largest number of branches in one split
+	size_t nctx;		// split contexts that can be live at once
+};
+
+struct jvst_vm_ctx;
+struct jvst_vm_jit;
+
 struct jvst_vm_program {
 	size_t ncode;
 
@@ -345,17 +592,83 @@ struct jvst_vm_program {
 	struct jvst_vm_dfa *dfas;
 
 	uint32_t *code;
+
+	// ncode+1 entries, the last is a sentinel that traps running off
+	// the end of the program.  Built by jvst_vm_program_predecode().
+	struct jvst_vm_decoded *decoded;
+
+	// also set by jvst_vm_program_predecode()
+	struct jvst_vm_sizing sizing;
+
+	// set by jvst_vm_program_verify() if the program passes
+	int verified;
+
+	// Programs compiled to C by jvst_cgen_program() or to machine
+	// code by jvst_vm_program_jit() run their contexts with this
+	// function in place of the interpreter.
+	enum jvst_result (*native)(struct jvst_vm_ctx *vm, enum SJP_RESULT pret, struct sjp_event *evt);
+
+	// set by jvst_vm_program_jit()
+	struct jvst_vm_jit *jit;
+
+	// Programs loaded by jvst_vm_mapfile() use the arrays in place in
+	// a read-only mapping of the file
+	const void *image;
+	size_t image_len;
 };
 
+/* Reads a program written by jvst_vm_writefile() or
+ * jvst_vm_program_writebuf().  The file is versioned and checksummed;
+ * returns NULL if it can't be read, isn't a program file, or is
+ * truncated or corrupt.  The program is verified as it's read, as
+ * jvst_op_encode() does, and is freed with jvst_vm_program_free().
+ */
 struct jvst_vm_program *
 jvst_vm_readfile(FILE *f);
 
 struct jvst_vm_program *
 jvst_vm_readbuf(const unsigned char *buf, size_t n);
 
+/* Loads a program from a file written by jvst_vm_writefile() by
+ * mapping the file read-only.  On little-endian hosts the program's
+ * code, pools, split table, DFA tables and decoded instructions are
+ * used in place, so loading doesn't copy the program and processes
+ * that map the same file share its pages.  Elsewhere, the program is
+ * copied out of the mapping as jvst_vm_readbuf() does.
+ *
+ * The file must not be changed while the program is loaded; write a
+ * new file and rename it over the old one instead.
+ *
+ * fd can be closed once the program is loaded.  Returns NULL if fd
+ * isn't a regular file that can be mapped, or on the same errors as
+ * jvst_vm_readbuf().  The mapping is released by
+ * jvst_vm_program_free().
+ */
+struct jvst_vm_program *
+jvst_vm_mapfile(int fd);
+
+/* Like jvst_vm_mapfile(), for a program that starts at offset off in
+ * the file, so callers can keep their own header in front of it.  off
+ * must be a multiple of the page size.
+ */
+struct jvst_vm_program *
+jvst_vm_mapfile_at(int fd, size_t off);
+
+/* Releases the mapping of a program loaded by jvst_vm_mapfile(). */
+void
+jvst_vm_program_unmap(struct jvst_vm_program *prog);
+
+/* Writes the program's code, constant pools, split table and DFAs in a
+ * portable binary format.  Returns 0 on success, -1 on a write error.
+ */
 int
 jvst_vm_writefile(FILE *f, const struct jvst_vm_program *prog);
 
+/* Like jvst_vm_writefile(), but appends to buf.  As with
+ * sbuf_snprintf(), the output is truncated if buf is too small and
+ * buf->np counts the whole file.  Returns 0 if the whole file fit,
+ * otherwise -1.
+ */
 int
 jvst_vm_program_writebuf(struct sbuf *buf, const struct jvst_vm_program *prog);
 
@@ -371,6 +684,53 @@ jvst_vm_program_debug(const struct jvst_vm_program *prog);
 void
 jvst_vm_program_free(struct jvst_vm_program *prog);
 
+/* Builds the decoded instruction stream used by the interpreter and the
+ * dense form of any DFAs without one, and estimates the program's buffer
+ * sizes.  This is called by jvst_vm_init_defaults() if it hasn't already
+ * been done.
+ * Programs that are shared between threads should be predecoded before
+ * they are shared.
+ */
+void
+jvst_vm_program_predecode(struct jvst_vm_program *prog);
+
+/* Estimates the program's buffer sizes from its decoded instructions.
+ * jvst_vm_program_predecode() calls this, it's only needed for
+ * programs that are given their decoded instructions some other way.
+ */
+void
+jvst_vm_program_sizing(struct jvst_vm_program *prog);
+
+/* Checks that every branch target, slot index, constant pool index,
+ * DFA index and split index in the program is in range, that split
+ * and call targets are PROCs, and that the DFA tables are well formed.
+ *
+ * Verified programs run on an interpreter that skips these checks for
+ * each executed instruction.  Returns 0 if the program is valid.
+ * Otherwise returns -1 and, if errbuf is not NULL, writes a
+ * description of the first problem found to errbuf.
+ */
+int
+jvst_vm_program_verify(struct jvst_vm_program *prog, char *errbuf, size_t nb);
+
+/* Translates the program to x86-64 machine code, which then runs the
+ * program's contexts in place of the interpreter.  The machine code
+ * keeps the interpreter's stack frames and token state, so results are
+ * the same either way.  The program is verified first if it hasn't
+ * been.
+ *
+ * Returns 0 on success.  Returns -1, leaving the program on the
+ * interpreter, if the host isn't x86-64, the program doesn't verify or
+ * has an instruction the JIT can't translate, or opcode tracing is on.
+ * Like predecoding, this should be done before the program is shared
+ * between threads.
+ */
+int
+jvst_vm_program_jit(struct jvst_vm_program *prog);
+
+/* Frees the program's machine code and returns it to the interpreter. */
+void
+jvst_vm_program_unjit(struct jvst_vm_program *prog);
 
 enum {
 	JVST_VM_PARSER_STKSIZE = 4096,
@@ -391,22 +751,29 @@ union jvst_vm_stackval {
 };
 
 struct jvst_vm_unique;
+struct jvst_vm_disc;
+struct jvst_vm;
 
-struct jvst_vm {
+/* Execution state: registers, stack and per-value state.  The top-level
+ * VM has one, and so does each branch of a SPLIT.  Split branches share
+ * the top-level VM's token stream, so they don't carry a parser, and
+ * their contexts are recycled through a pool owned by the top-level VM.
+ */
+struct jvst_vm_ctx {
 	struct jvst_vm_program *prog;
+	struct jvst_vm *owner;
 
 	size_t maxstack;
 	union jvst_vm_stackval *stack;
 
 	size_t nsplit;
 	size_t maxsplit;
-	struct jvst_vm *splits;
+	struct jvst_vm_ctx **splits;
 
 	// for consuming nested structures
 	size_t nobj;
 	size_t narr;
 
-	struct sjp_parser parser;
 	struct sjp_event evt;
 
 	// machine state registers, when active they aren't stored on
@@ -420,12 +787,38 @@ struct jvst_vm {
 	int error;
 	int dfa_st;
 	enum jvst_vm_tokstate tokstate;
+
+	struct jvst_vm_unique *uniq;
+
+	// hashes the array or object an ENUM is testing
+	struct jvst_vm_unique *vset;
+
+	// members a DISPATCH buffers while it looks for the
+	// discriminator, kept for reuse
+	struct jvst_vm_disc *disc;
+
+	// state caches of the program's NFAs, indexed like its DFAs and
+	// built when first matched.  A partly matched string holds a
+	// state of its cache, so each context has its own.
+	struct jvst_vm_lazy **lazy;
+	size_t nlazy;
+
+	// link in the owner's pool of free split contexts
+	struct jvst_vm_ctx *next_free;
+};
+
+struct jvst_vm {
+	struct jvst_vm_ctx ctx;
+
+	struct sjp_parser parser;
 	int needtok;  // flag if the next call to vm_run_next should have a token
 
+	// split contexts and unique sets that are not currently in use
+	struct jvst_vm_ctx *free_ctx;
+	struct jvst_vm_unique *free_uniq;
+
 	char pstack[JVST_VM_PARSER_STKSIZE];
 	char pbuf[JVST_VM_PARSER_BUFSIZE];
-
-	struct jvst_vm_unique *uniq;
 };
 
 void
@@ -437,12 +830,133 @@ jvst_vm_more(struct jvst_vm *vm, char *data, size_t n);
 enum jvst_result
 jvst_vm_close(struct jvst_vm *vm);
 
+/* Returns the VM to the state jvst_vm_init_defaults() left it in, so
+ * it can validate another document with the same program.  The stacks,
+ * split contexts, unique sets and NFA state caches the VM has allocated
+ * are kept for reuse.
+ */
+void
+jvst_vm_reset(struct jvst_vm *vm);
+
 void
 jvst_vm_finalize(struct jvst_vm *vm);
 
 void
 jvst_vm_dumpstate(struct jvst_vm *vm);
 
+/* Runtime support for programs compiled to C by jvst_cgen_program().
+ * Each function carries out the VM instruction of the same name on the
+ * context's registers and stack, so compiled code and the interpreter
+ * keep the same state and can't be told apart by splits, records or
+ * jvst_vm_reset().
+ *
+ * Functions that can suspend return the same values as the
+ * interpreter: JVST_VALID to carry on with the next instruction,
+ * otherwise the result to return from the context.  The exceptions are
+ * jvst_vm_rt_return(), which returns JVST_VM_RT_CONTINUE once it has
+ * returned to the calling frame, and UNIQUE EVAL, whose result is
+ * always returned from the context.
+ */
+enum {
+	// returned by compiled procs: continue at r_pc in frame r_fp
+	JVST_VM_RT_CONTINUE = JVST_NEXT + 1,
+};
+
+uint32_t
+jvst_vm_rt_proc(struct jvst_vm_ctx *vm, int nslots);
+
+void
+jvst_vm_rt_call(struct jvst_vm_ctx *vm, uint32_t pc);
+
+int
+jvst_vm_rt_return(struct jvst_vm_ctx *vm);
+
+int
+jvst_vm_rt_token(struct jvst_vm_ctx *vm);
+
+void
+jvst_vm_rt_unget(struct jvst_vm_ctx *vm);
+
+int
+jvst_vm_rt_consume(struct jvst_vm_ctx *vm);
+
+int
+jvst_vm_rt_match(struct jvst_vm_ctx *vm, const struct jvst_vm_dfa *dfa);
+
+int
+jvst_vm_rt_lmatch(struct jvst_vm_ctx *vm, const struct jvst_vm_dfa *dfa, const int64_t *tbl);
+
+int
+jvst_vm_rt_enum(struct jvst_vm_ctx *vm, const int64_t *tbl);
+
+int
+jvst_vm_rt_split(struct jvst_vm_ctx *vm, int split, union jvst_vm_stackval *slot, enum jvst_vm_op op);
+
+int
+jvst_vm_rt_dispatch(struct jvst_vm_ctx *vm, const int64_t *tbl, union jvst_vm_stackval *slot);
+
+int
+jvst_vm_rt_unique(struct jvst_vm_ctx *vm, enum jvst_vm_unique_arg arg);
+
+// pc has left the program
+int
+jvst_vm_rt_badpc(struct jvst_vm_ctx *vm);
+
+/* Record streams: a sequence of JSON texts, each validated as its own
+ * document.  The stream can be fed in chunks of any size, records may
+ * span chunks.  Records that are empty or only whitespace are skipped.
+ */
+enum jvst_vm_record_format {
+	JVST_VM_RECORD_NDJSON = 0,	// newline delimited JSON, texts end with LF
+	JVST_VM_RECORD_SEQ,		// RFC 7464 JSON text sequences, texts begin with RS
+};
+
+struct jvst_vm_record_result {
+	size_t index;		// number of the record in the stream, from 0
+	size_t offset;		// stream offset of the first byte of the JSON text
+	enum jvst_result result;
+	int error;		// vm.ctx.error: jvst_invalid_code or SJP_RESULT
+};
+
+struct jvst_vm_records {
+	struct jvst_vm vm;
+
+	enum jvst_vm_record_format format;
+
+	// called with the verdict for each record, returning non-zero
+	// stops the stream
+	int (*func)(void *opaque, const struct jvst_vm_record_result *res);
+	void *opaque;
+
+	size_t off;		// stream offset of the next byte
+	size_t index;		// number of the current record
+
+	// current record
+	size_t rec_off;
+	int inrec;		// seen the start of its JSON text
+	enum jvst_result result;	// JVST_MORE until the VM decides
+
+	int stopped;		// value returned by func if it stopped the stream
+};
+
+void
+jvst_vm_records_init(struct jvst_vm_records *rs, struct jvst_vm_program *prog,
+	enum jvst_vm_record_format format,
+	int (*func)(void *opaque, const struct jvst_vm_record_result *res), void *opaque);
+
+/* Feeds the next chunk of the stream.  Returns zero, or the non-zero
+ * value returned by func if it stopped the stream.
+ */
+int
+jvst_vm_records_more(struct jvst_vm_records *rs, char *data, size_t n);
+
+/* Ends the stream, reporting the last record if it wasn't terminated. */
+int
+jvst_vm_records_close(struct jvst_vm_records *rs);
+
+void
+jvst_vm_records_finalize(struct jvst_vm_records *rs);
+
 #endif /* VALIDATE_VM_H */
 
 /* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
@@ -0,0 +1,1019 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "validate_vm.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xalloc.h"
+#include "xxhash.h"
+
+/* File format for VM programs.
+ *
+ * All integers are little-endian, floats are IEEE 754 doubles stored
+ * as their 64-bit patterns.  The file starts with a header:
+ *
+ *	offset	size
+ *	0	8	magic, "jvst-vm" and a NUL
+ *	8	4	format version
+ *	12	4	flags, zero
+ *	16	8	size of the file
+ *	24	8	XXH64 of the rest of the file, from offset 32
+ *	32	8	number of splits
+ *	40	160	section table
+ *
+ * The section table has an entry for each section, in the order of
+ * enum vm_file_section, giving the section's offset in the file and
+ * its number of elements, both 64-bit.  Sections start at 8-byte
+ * aligned offsets after the header.
+ *
+ * DFAs are stored as a table of headers and a pool of int32 elements.
+ * Each header has four 64-bit fields: the number of states, edges and
+ * end states, and the index of the DFA's first element in the pool.
+ * The elements are laid out as jvst_vm_dfa_init() lays them out.
+ *
+ * The decoded section holds the decoded instruction stream, ncode+1
+ * entries of 12 bytes: op, cond, a0slot and a1slot bytes, then a0 and
+ * a1 as int32.  It's empty if the program wasn't predecoded when it
+ * was written.  Loading doesn't decode the code again to compare: once
+ * the checksum matches, the stream is taken as the code's decoding,
+ * and verifying checks that it's well formed, as it checks the other
+ * sections.  If it isn't, the code is decoded again.
+ *
+ * The dense forms of the DFAs, which are what the VM runs, are stored
+ * too, so loading a program doesn't build them.  They're in three
+ * sections: a table of headers, a pool of int32 end data, nstates for
+ * each DFA, and a pool of bytes holding each DFA's 256 byte classes
+ * followed by its (nstates+1) x nclasses table of width byte entries,
+ * aligned to the width.  Each header is:
+ *
+ *	offset	size
+ *	0	8	number of byte classes
+ *	8	8	width of a table entry, 1, 2 or 4
+ *	16	8	1 if it's an NFA, which has no table, otherwise 0
+ *	24	8	index of the end data in their pool
+ *	32	8	offset of the byte classes in the byte pool
+ *	40	8	offset of the table in the byte pool
+ *	48	24	prefilter prefix, suffix and factor lengths
+ *	72	96	prefilter prefix, suffix and factor
+ *
+ * The sections are empty if any DFA has no dense form, in which case
+ * it's built once the program is verified.  Like the decoded stream,
+ * verifying checks that they're well formed, and a DFA's dense form
+ * that isn't is built again from its sparse form.
+ *
+ * On little-endian hosts the sections have the same layout as the
+ * arrays of struct jvst_vm_program, so jvst_vm_mapfile() can run a
+ * program from a read-only mapping of the file without copying it.
+ * Version 1 files have no decoded section, and their section table
+ * ends after the DFA elements.  Version 2 files have no dense DFA
+ * sections, and their section table ends after the decoded stream.
+ */
+
+enum vm_file_section {
+	VM_FILE_CODE,		// uint32 instructions
+	VM_FILE_FLOATS,		// float pool
+	VM_FILE_CONSTS,		// int64 pool
+	VM_FILE_SPLITS,		// uint32 split table, see jvst_op_encode()
+	VM_FILE_DFAS,		// DFA headers
+	VM_FILE_DFADATA,	// int32 DFA elements
+	VM_FILE_DECODED,	// decoded instruction stream
+	VM_FILE_DENSE,		// dense DFA headers
+	VM_FILE_DENSEENDS,	// int32 dense DFA end data
+	VM_FILE_DENSEDATA,	// dense DFA byte classes and tables
+
+	VM_FILE_NSECTIONS,
+};
+
+enum {
+	VM_FILE_VERSION  = 3,
+
+	VM_FILE_HDR_SUM  = 24,
+	VM_FILE_HDR_SECT = 40,
+	VM_FILE_HDRSIZE  = VM_FILE_HDR_SECT + 16*VM_FILE_NSECTIONS,
+
+	VM_FILE_DFAHDR   = 32,
+	VM_FILE_DECSIZE  = 12,
+	VM_FILE_DENSEHDR = 72 + 3*JVST_VM_DFA_MAXLIT,
+};
+
+static const char vm_file_magic[8] = "jvst-vm";
+
+static const size_t vm_file_eltsize[VM_FILE_NSECTIONS] = {
+	[VM_FILE_CODE]    = 4,
+	[VM_FILE_FLOATS]  = 8,
+	[VM_FILE_CONSTS]  = 8,
+	[VM_FILE_SPLITS]  = 4,
+	[VM_FILE_DFAS]    = VM_FILE_DFAHDR,
+	[VM_FILE_DFADATA] = 4,
+	[VM_FILE_DECODED] = VM_FILE_DECSIZE,
+	[VM_FILE_DENSE]   = VM_FILE_DENSEHDR,
+	[VM_FILE_DENSEENDS] = 4,
+	[VM_FILE_DENSEDATA] = 1,
+};
+
+static void
+put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >>  8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static void
+put_u64(unsigned char *p, uint64_t v)
+{
+	put_u32(p, (uint32_t)v);
+	put_u32(p+4, (uint32_t)(v >> 32));
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+get_u64(const unsigned char *p)
+{
+	return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p+4) << 32);
+}
+
+static size_t
+align8(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+// dense DFA tables are stored if every DFA has one
+static int
+vm_file_hasdense(const struct jvst_vm_program *prog)
+{
+	size_t i;
+
+	for (i=0; i < prog->ndfa; i++) {
+		if (prog->dfas[i].ends == NULL) {
+			return 0;
+		}
+	}
+
+	return prog->ndfa > 0;
+}
+
+// size of a dense DFA table in the byte pool
+static size_t
+vm_file_tablesize(const struct jvst_vm_dfa *dfa)
+{
+	return dfa->nfa ? 0 : (dfa->nstates+1) * dfa->nclasses * dfa->width;
+}
+
+static size_t
+vm_file_nelts(const struct jvst_vm_program *prog, enum vm_file_section s)
+{
+	size_t i, n;
+
+	switch (s) {
+	case VM_FILE_CODE:
+		return prog->ncode;
+
+	case VM_FILE_FLOATS:
+		return prog->nfloat;
+
+	case VM_FILE_CONSTS:
+		return prog->nconst;
+
+	case VM_FILE_SPLITS:
+		return (prog->nsplit > 0) ? prog->nsplit + 1 + prog->sdata[prog->nsplit] : 0;
+
+	case VM_FILE_DFAS:
+		return prog->ndfa;
+
+	case VM_FILE_DFADATA:
+		n = 0;
+		for (i=0; i < prog->ndfa; i++) {
+			const struct jvst_vm_dfa *dfa = &prog->dfas[i];
+			n += (dfa->nstates+1) + 2*dfa->nedges + 2*dfa->nends;
+		}
+		return n;
+
+	case VM_FILE_DECODED:
+		return (prog->decoded != NULL) ? prog->ncode + 1 : 0;
+
+	case VM_FILE_DENSE:
+		return vm_file_hasdense(prog) ? prog->ndfa : 0;
+
+	case VM_FILE_DENSEENDS:
+		n = 0;
+		for (i=0; vm_file_hasdense(prog) && i < prog->ndfa; i++) {
+			n += prog->dfas[i].nstates;
+		}
+		return n;
+
+	case VM_FILE_DENSEDATA:
+		n = 0;
+		for (i=0; vm_file_hasdense(prog) && i < prog->ndfa; i++) {
+			const struct jvst_vm_dfa *dfa = &prog->dfas[i];
+
+			n = (n + 3) & ~(size_t)3;
+			n += (UCHAR_MAX+1) + vm_file_tablesize(dfa);
+		}
+		return n;
+
+	default:
+		assert(!"unknown section");
+		return 0;
+	}
+}
+
+static void
+put_ints(unsigned char *p, const int *v, size_t n)
+{
+	size_t i;
+
+	for (i=0; i < n; i++) {
+		put_u32(p + 4*i, (uint32_t)v[i]);
+	}
+}
+
+static void
+vm_file_encode_dense(const struct jvst_vm_program *prog, unsigned char *buf,
+	const size_t off[VM_FILE_NSECTIONS], const size_t nelts[VM_FILE_NSECTIONS])
+{
+	unsigned char *p;
+	size_t i, j, end, data;
+
+	if (nelts[VM_FILE_DENSE] == 0) {
+		return;
+	}
+
+	end = data = 0;
+	for (i=0; i < prog->ndfa; i++) {
+		const struct jvst_vm_dfa *dfa = &prog->dfas[i];
+		const struct jvst_vm_dfa_prefilter *pf = &dfa->pre;
+		size_t nentries;
+
+		data = (data + 3) & ~(size_t)3;
+
+		p = buf + off[VM_FILE_DENSE] + VM_FILE_DENSEHDR*i;
+		put_u64(p+ 0, dfa->nclasses);
+		put_u64(p+ 8, dfa->width);
+		put_u64(p+16, dfa->nfa ? 1 : 0);
+		put_u64(p+24, end);
+		put_u64(p+32, data);
+		put_u64(p+40, data + (UCHAR_MAX+1));
+		put_u64(p+48, pf->nprefix);
+		put_u64(p+56, pf->nsuffix);
+		put_u64(p+64, pf->nfactor);
+		memcpy(p+72, pf->prefix, JVST_VM_DFA_MAXLIT);
+		memcpy(p+72 + JVST_VM_DFA_MAXLIT, pf->suffix, JVST_VM_DFA_MAXLIT);
+		memcpy(p+72 + 2*JVST_VM_DFA_MAXLIT, pf->factor, JVST_VM_DFA_MAXLIT);
+
+		put_ints(buf + off[VM_FILE_DENSEENDS] + 4*end, dfa->ends, dfa->nstates);
+		end += dfa->nstates;
+
+		p = buf + off[VM_FILE_DENSEDATA] + data;
+		memcpy(p, dfa->classes, UCHAR_MAX+1);
+		p += UCHAR_MAX+1;
+
+		nentries = dfa->nfa ? 0 : (dfa->nstates+1) * dfa->nclasses;
+		for (j=0; j < nentries; j++) {
+			switch (dfa->width) {
+			case 1:
+				p[j] = ((const uint8_t *)dfa->table)[j];
+				break;
+
+			case 2:
+				p[2*j+0] = ((const uint16_t *)dfa->table)[j] & 0xff;
+				p[2*j+1] = ((const uint16_t *)dfa->table)[j] >> 8;
+				break;
+
+			default:
+				put_u32(p + 4*j, ((const uint32_t *)dfa->table)[j]);
+				break;
+			}
+		}
+
+		data += (UCHAR_MAX+1) + vm_file_tablesize(dfa);
+	}
+}
+
+/* Encodes the program into buf, which has room for the whole file. */
+static void
+vm_file_encode(const struct jvst_vm_program *prog, unsigned char *buf, size_t size,
+	const size_t off[VM_FILE_NSECTIONS], const size_t nelts[VM_FILE_NSECTIONS])
+{
+	unsigned char *p;
+	size_t i, s, elt;
+
+	memset(buf, 0, size);
+
+	memcpy(buf, vm_file_magic, sizeof vm_file_magic);
+	put_u32(buf+8, VM_FILE_VERSION);
+	put_u32(buf+12, 0);
+	put_u64(buf+16, size);
+	put_u64(buf+32, prog->nsplit);
+
+	for (s=0; s < VM_FILE_NSECTIONS; s++) {
+		put_u64(buf + VM_FILE_HDR_SECT + 16*s, off[s]);
+		put_u64(buf + VM_FILE_HDR_SECT + 16*s + 8, nelts[s]);
+	}
+
+	p = buf + off[VM_FILE_CODE];
+	for (i=0; i < prog->ncode; i++) {
+		put_u32(p + 4*i, prog->code[i]);
+	}
+
+	p = buf + off[VM_FILE_FLOATS];
+	for (i=0; i < prog->nfloat; i++) {
+		uint64_t bits;
+
+		memcpy(&bits, &prog->fdata[i], sizeof bits);
+		put_u64(p + 8*i, bits);
+	}
+
+	p = buf + off[VM_FILE_CONSTS];
+	for (i=0; i < prog->nconst; i++) {
+		put_u64(p + 8*i, (uint64_t)prog->cdata[i]);
+	}
+
+	p = buf + off[VM_FILE_SPLITS];
+	for (i=0; i < nelts[VM_FILE_SPLITS]; i++) {
+		put_u32(p + 4*i, prog->sdata[i]);
+	}
+
+	elt = 0;
+	for (i=0; i < prog->ndfa; i++) {
+		const struct jvst_vm_dfa *dfa = &prog->dfas[i];
+
+		p = buf + off[VM_FILE_DFAS] + VM_FILE_DFAHDR*i;
+		put_u64(p+ 0, dfa->nstates);
+		put_u64(p+ 8, dfa->nedges);
+		put_u64(p+16, dfa->nends);
+		put_u64(p+24, elt);
+
+		p = buf + off[VM_FILE_DFADATA] + 4*elt;
+		put_ints(p, dfa->offs, dfa->nstates+1);
+		p += 4*(dfa->nstates+1);
+		put_ints(p, dfa->transitions, 2*dfa->nedges);
+		p += 4*(2*dfa->nedges);
+		put_ints(p, dfa->endstates, 2*dfa->nends);
+
+		elt += (dfa->nstates+1) + 2*dfa->nedges + 2*dfa->nends;
+	}
+
+	p = buf + off[VM_FILE_DECODED];
+	for (i=0; i < nelts[VM_FILE_DECODED]; i++) {
+		const struct jvst_vm_decoded *dec = &prog->decoded[i];
+
+		p[0] = dec->op;
+		p[1] = dec->cond;
+		p[2] = dec->a0slot;
+		p[3] = dec->a1slot;
+		put_u32(p+4, (uint32_t)dec->a0);
+		put_u32(p+8, (uint32_t)dec->a1);
+		p += VM_FILE_DECSIZE;
+	}
+
+	vm_file_encode_dense(prog, buf, off, nelts);
+
+	put_u64(buf + VM_FILE_HDR_SUM, XXH64(buf + 32, size - 32, 0));
+}
+
+/* Lays out the sections and returns the size of the file. */
+static size_t
+vm_file_layout(const struct jvst_vm_program *prog,
+	size_t off[VM_FILE_NSECTIONS], size_t nelts[VM_FILE_NSECTIONS])
+{
+	size_t s, size;
+
+	size = VM_FILE_HDRSIZE;
+	for (s=0; s < VM_FILE_NSECTIONS; s++) {
+		nelts[s] = vm_file_nelts(prog, s);
+		off[s] = size;
+		size = align8(size + nelts[s] * vm_file_eltsize[s]);
+	}
+
+	return size;
+}
+
+int
+jvst_vm_program_writebuf(struct sbuf *buf, const struct jvst_vm_program *prog)
+{
+	size_t off[VM_FILE_NSECTIONS], nelts[VM_FILE_NSECTIONS];
+	unsigned char *enc;
+	size_t size, nb;
+
+	assert(buf->len <= buf->cap);
+
+	size = vm_file_layout(prog, off, nelts);
+	enc = xmalloc(size);
+	vm_file_encode(prog, enc, size, off, nelts);
+
+	// like sbuf_snprintf, np counts the whole file even if it's
+	// truncated
+	nb = buf->cap - buf->len;
+	if (nb > size) {
+		nb = size;
+	}
+
+	if (nb > 0) {
+		memcpy(buf->buf + buf->len, enc, nb);
+		buf->len += nb;
+	}
+	buf->np += size;
+
+	free(enc);
+
+	return (nb == size) ? 0 : -1;
+}
+
+int
+jvst_vm_writefile(FILE *f, const struct jvst_vm_program *prog)
+{
+	size_t off[VM_FILE_NSECTIONS], nelts[VM_FILE_NSECTIONS];
+	unsigned char *enc;
+	size_t size;
+	int ret;
+
+	size = vm_file_layout(prog, off, nelts);
+	enc = xmalloc(size);
+	vm_file_encode(prog, enc, size, off, nelts);
+
+	ret = (fwrite(enc, 1, size, f) == size) ? 0 : -1;
+
+	free(enc);
+	return ret;
+}
+
+static void
+get_ints(int *v, const unsigned char *p, size_t n)
+{
+	size_t i;
+
+	for (i=0; i < n; i++) {
+		v[i] = (int)(int32_t)get_u32(p + 4*i);
+	}
+}
+
+struct vm_file {
+	size_t off[VM_FILE_NSECTIONS];
+	size_t nelts[VM_FILE_NSECTIONS];
+	size_t nsplit;
+};
+
+/* Checks the header, checksum and section table of a file in buf and
+ * fills in vf.  Returns 0 if the file is well formed.
+ */
+static int
+vm_file_check(const unsigned char *buf, size_t n, struct vm_file *vf)
+{
+	const unsigned char *p;
+	uint32_t version;
+	uint64_t nsplit;
+	size_t i, s, nsect, hdrsize, ndfadata, nends, ndata;
+
+	if (n < VM_FILE_HDR_SECT || memcmp(buf, vm_file_magic, sizeof vm_file_magic) != 0) {
+		return -1;
+	}
+
+	// version 1 files don't have the decoded stream, version 2 files
+	// don't have dense DFAs
+	version = get_u32(buf+8);
+	switch (version) {
+	case 1:
+		nsect = VM_FILE_DECODED;
+		break;
+
+	case 2:
+		nsect = VM_FILE_DENSE;
+		break;
+
+	case VM_FILE_VERSION:
+		nsect = VM_FILE_NSECTIONS;
+		break;
+
+	default:
+		return -1;
+	}
+
+	hdrsize = VM_FILE_HDR_SECT + 16*nsect;
+	if (n < hdrsize || get_u32(buf+12) != 0) {
+		return -1;
+	}
+
+	if (get_u64(buf+16) != n || get_u64(buf + VM_FILE_HDR_SUM) != XXH64(buf + 32, n - 32, 0)) {
+		return -1;
+	}
+
+	for (s=0; s < VM_FILE_NSECTIONS; s++) {
+		uint64_t o, ne;
+
+		if (s >= nsect) {
+			vf->off[s] = hdrsize;
+			vf->nelts[s] = 0;
+			continue;
+		}
+
+		o  = get_u64(buf + VM_FILE_HDR_SECT + 16*s);
+		ne = get_u64(buf + VM_FILE_HDR_SECT + 16*s + 8);
+
+		if (o < hdrsize || o > n || (o & 7) != 0 ||
+				ne > (n - o) / vm_file_eltsize[s]) {
+			return -1;
+		}
+
+		vf->off[s] = o;
+		vf->nelts[s] = ne;
+	}
+
+	if (vf->nelts[VM_FILE_DECODED] != 0 && vf->nelts[VM_FILE_DECODED] != vf->nelts[VM_FILE_CODE]+1) {
+		return -1;
+	}
+
+	nsplit = get_u64(buf+32);
+	if (nsplit == 0) {
+		if (vf->nelts[VM_FILE_SPLITS] != 0) {
+			return -1;
+		}
+	} else {
+		if (nsplit >= vf->nelts[VM_FILE_SPLITS]) {
+			return -1;
+		}
+
+		p = buf + vf->off[VM_FILE_SPLITS];
+		if (vf->nelts[VM_FILE_SPLITS] - (nsplit+1) != get_u32(p + 4*nsplit)) {
+			return -1;
+		}
+	}
+	vf->nsplit = nsplit;
+
+	// check the DFA headers against the element pool
+	ndfadata = vf->nelts[VM_FILE_DFADATA];
+	for (i=0; i < vf->nelts[VM_FILE_DFAS]; i++) {
+		uint64_t nstates, nedges, nends, first;
+
+		p = buf + vf->off[VM_FILE_DFAS] + VM_FILE_DFAHDR*i;
+		nstates = get_u64(p+ 0);
+		nedges  = get_u64(p+ 8);
+		nends   = get_u64(p+16);
+		first   = get_u64(p+24);
+
+		if (nstates >= ndfadata || nedges > ndfadata || nends > ndfadata || first > ndfadata) {
+			return -1;
+		}
+
+		if ((nstates+1) + 2*nedges + 2*nends > ndfadata - first) {
+			return -1;
+		}
+	}
+
+	// and the dense DFA headers against their pools
+	if (vf->nelts[VM_FILE_DENSE] != 0 && vf->nelts[VM_FILE_DENSE] != vf->nelts[VM_FILE_DFAS]) {
+		return -1;
+	}
+
+	nends = vf->nelts[VM_FILE_DENSEENDS];
+	ndata = vf->nelts[VM_FILE_DENSEDATA];
+	for (i=0; i < vf->nelts[VM_FILE_DENSE]; i++) {
+		uint64_t nstates, nclasses, width, nfa, end, classes, table, tblsize;
+
+		nstates = get_u64(buf + vf->off[VM_FILE_DFAS] + VM_FILE_DFAHDR*i);
+
+		p = buf + vf->off[VM_FILE_DENSE] + VM_FILE_DENSEHDR*i;
+		nclasses = get_u64(p+ 0);
+		width    = get_u64(p+ 8);
+		nfa      = get_u64(p+16);
+		end      = get_u64(p+24);
+		classes  = get_u64(p+32);
+		table    = get_u64(p+40);
+
+		if (nclasses == 0 || nclasses > UCHAR_MAX+1 || nfa > 1 ||
+				(width != 1 && width != 2 && width != 4)) {
+			return -1;
+		}
+
+		if (end > nends || nstates > nends - end) {
+			return -1;
+		}
+
+		if (classes > ndata || UCHAR_MAX+1 > ndata - classes) {
+			return -1;
+		}
+
+		// tables are used in place, so they're aligned
+		tblsize = nfa ? 0 : (nstates+1) * nclasses * width;
+		if (table > ndata || table % width != 0 || tblsize > ndata - table) {
+			return -1;
+		}
+
+		if (get_u64(p+48) > JVST_VM_DFA_MAXLIT || get_u64(p+56) > JVST_VM_DFA_MAXLIT ||
+				get_u64(p+64) > JVST_VM_DFA_MAXLIT) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Sets up the dense form of DFA i from the file.  If inplace, it uses
+ * the file's arrays, otherwise it copies them into one allocation, as
+ * jvst_vm_dfa_compile() lays them out.
+ */
+static void
+vm_file_dense(const unsigned char *buf, const struct vm_file *vf, size_t i,
+	struct jvst_vm_dfa *dfa, int inplace)
+{
+	const unsigned char *p, *data;
+	struct jvst_vm_dfa_prefilter *pf = &dfa->pre;
+	size_t j, nentries, tblsize;
+	char *mem;
+
+	p = buf + vf->off[VM_FILE_DENSE] + VM_FILE_DENSEHDR*i;
+	dfa->nclasses = get_u64(p+ 0);
+	dfa->width    = get_u64(p+ 8);
+	dfa->nfa      = (get_u64(p+16) != 0);
+
+	pf->nprefix = get_u64(p+48);
+	pf->nsuffix = get_u64(p+56);
+	pf->nfactor = get_u64(p+64);
+	memcpy(pf->prefix, p+72, JVST_VM_DFA_MAXLIT);
+	memcpy(pf->suffix, p+72 + JVST_VM_DFA_MAXLIT, JVST_VM_DFA_MAXLIT);
+	memcpy(pf->factor, p+72 + 2*JVST_VM_DFA_MAXLIT, JVST_VM_DFA_MAXLIT);
+
+	data = buf + vf->off[VM_FILE_DENSEDATA];
+	nentries = dfa->nfa ? 0 : (dfa->nstates+1) * dfa->nclasses;
+	tblsize = nentries * dfa->width;
+
+	if (inplace) {
+		dfa->ends = (int *)(buf + vf->off[VM_FILE_DENSEENDS]) + get_u64(p+24);
+		dfa->classes = (uint8_t *)(data + get_u64(p+32));
+		dfa->table = dfa->nfa ? NULL : (void *)(data + get_u64(p+40));
+		return;
+	}
+
+	mem = xmalloc(dfa->nstates * sizeof dfa->ends[0] + (UCHAR_MAX+1) + tblsize);
+	dfa->ends = (int *)mem;
+	dfa->classes = (uint8_t *)(mem + dfa->nstates * sizeof dfa->ends[0]);
+	dfa->table = dfa->nfa ? NULL : dfa->classes + (UCHAR_MAX+1);
+
+	get_ints(dfa->ends, buf + vf->off[VM_FILE_DENSEENDS] + 4*get_u64(p+24), dfa->nstates);
+	memcpy(dfa->classes, data + get_u64(p+32), UCHAR_MAX+1);
+
+	data += get_u64(p+40);
+	for (j=0; j < nentries; j++) {
+		switch (dfa->width) {
+		case 1:
+			((uint8_t *)dfa->table)[j] = data[j];
+			break;
+
+		case 2:
+			((uint16_t *)dfa->table)[j] = (uint16_t)(data[2*j] | (data[2*j+1] << 8));
+			break;
+
+		default:
+			((uint32_t *)dfa->table)[j] = get_u32(data + 4*j);
+			break;
+		}
+	}
+}
+
+static int
+vm_file_inimage(const struct jvst_vm_program *prog, const void *p)
+{
+	const unsigned char *img = prog->image;
+
+	return (const unsigned char *)p >= img && (const unsigned char *)p < img + prog->image_len;
+}
+
+/* Verifies a program loaded from a file.  If it fails, the dense forms
+ * of its DFAs that don't check out are dropped, and it's verified again,
+ * which builds them from their sparse forms if those check out.
+ */
+static int
+vm_file_verify(struct jvst_vm_program *prog)
+{
+	static const struct jvst_vm_dfa_prefilter nopre = { 0 };
+	size_t i, ndrop;
+
+	if (jvst_vm_program_verify(prog, NULL, 0) == 0) {
+		return 0;
+	}
+
+	ndrop = 0;
+	for (i=0; i < prog->ndfa; i++) {
+		struct jvst_vm_dfa *dfa = &prog->dfas[i];
+
+		if (dfa->ends == NULL || jvst_vm_dfa_verify(dfa) == 0) {
+			continue;
+		}
+
+		if (!vm_file_inimage(prog, dfa->ends)) {
+			free(dfa->ends);
+		}
+
+		dfa->ends = NULL;
+		dfa->classes = NULL;
+		dfa->table = NULL;
+		dfa->nclasses = 0;
+		dfa->width = 0;
+		dfa->nfa = 0;
+		dfa->pre = nopre;
+		ndrop++;
+	}
+
+	if (ndrop == 0) {
+		return -1;
+	}
+
+	return jvst_vm_program_verify(prog, NULL, 0);
+}
+
+/* Builds a program with its own copy of the arrays in the file */
+static struct jvst_vm_program *
+vm_file_copy(const unsigned char *buf, const struct vm_file *vf)
+{
+	struct jvst_vm_program *prog;
+	const unsigned char *p;
+	size_t i;
+
+	prog = xmalloc(sizeof *prog);
+	memset(prog, 0, sizeof *prog);
+
+	prog->ncode = vf->nelts[VM_FILE_CODE];
+	prog->code = xmalloc((prog->ncode > 0 ? prog->ncode : 1) * sizeof prog->code[0]);
+	p = buf + vf->off[VM_FILE_CODE];
+	for (i=0; i < prog->ncode; i++) {
+		prog->code[i] = get_u32(p + 4*i);
+	}
+
+	if (vf->nelts[VM_FILE_FLOATS] > 0) {
+		prog->nfloat = vf->nelts[VM_FILE_FLOATS];
+		prog->fdata = xmalloc(prog->nfloat * sizeof prog->fdata[0]);
+		p = buf + vf->off[VM_FILE_FLOATS];
+		for (i=0; i < prog->nfloat; i++) {
+			uint64_t bits = get_u64(p + 8*i);
+			memcpy(&prog->fdata[i], &bits, sizeof bits);
+		}
+	}
+
+	if (vf->nelts[VM_FILE_CONSTS] > 0) {
+		prog->nconst = vf->nelts[VM_FILE_CONSTS];
+		prog->cdata = xmalloc(prog->nconst * sizeof prog->cdata[0]);
+		p = buf + vf->off[VM_FILE_CONSTS];
+		for (i=0; i < prog->nconst; i++) {
+			prog->cdata[i] = (int64_t)get_u64(p + 8*i);
+		}
+	}
+
+	if (vf->nsplit > 0) {
+		prog->nsplit = vf->nsplit;
+		prog->sdata = xmalloc(vf->nelts[VM_FILE_SPLITS] * sizeof prog->sdata[0]);
+		p = buf + vf->off[VM_FILE_SPLITS];
+		for (i=0; i < vf->nelts[VM_FILE_SPLITS]; i++) {
+			prog->sdata[i] = get_u32(p + 4*i);
+		}
+	}
+
+	if (vf->nelts[VM_FILE_DFAS] > 0) {
+		prog->ndfa = vf->nelts[VM_FILE_DFAS];
+		prog->dfas = xmalloc(prog->ndfa * sizeof prog->dfas[0]);
+
+		for (i=0; i < prog->ndfa; i++) {
+			struct jvst_vm_dfa *dfa = &prog->dfas[i];
+			size_t nelt;
+
+			p = buf + vf->off[VM_FILE_DFAS] + VM_FILE_DFAHDR*i;
+			nelt = jvst_vm_dfa_init(dfa, get_u64(p+0), get_u64(p+8), get_u64(p+16));
+
+			p = buf + vf->off[VM_FILE_DFADATA] + 4*get_u64(p+24);
+			get_ints(dfa->offs, p, nelt);
+
+			if (vf->nelts[VM_FILE_DENSE] > 0) {
+				vm_file_dense(buf, vf, i, dfa, 0);
+			}
+		}
+	}
+
+	// the decoded stream isn't copied, it's rebuilt as the program
+	// is verified.  Like freshly encoded programs, programs that fail
+	// verification run on the interpreter that checks each
+	// instruction.
+	(void)vm_file_verify(prog);
+
+	return prog;
+}
+
+struct jvst_vm_program *
+jvst_vm_readbuf(const unsigned char *buf, size_t n)
+{
+	struct vm_file vf;
+
+	if (vm_file_check(buf, n, &vf) != 0) {
+		return NULL;
+	}
+
+	return vm_file_copy(buf, &vf);
+}
+
+struct jvst_vm_program *
+jvst_vm_readfile(FILE *f)
+{
+	struct jvst_vm_program *prog;
+	unsigned char *buf;
+	size_t n, max;
+
+	buf = NULL;
+	n = max = 0;
+
+	for (;;) {
+		size_t r;
+
+		if (n + BUFSIZ >= max) {
+			buf = xenlargevec(buf, &max, BUFSIZ, 1);
+		}
+
+		r = fread(buf + n, 1, max - n, f);
+		n += r;
+
+		if (r == 0) {
+			break;
+		}
+	}
+
+	if (ferror(f)) {
+		free(buf);
+		return NULL;
+	}
+
+	prog = jvst_vm_readbuf(buf, n);
+	free(buf);
+
+	return prog;
+}
+
+/* Sections can be used in place if the host's layout matches the file */
+static int
+vm_file_native(void)
+{
+	static const uint32_t one = 1;
+	unsigned char c;
+
+	memcpy(&c, &one, 1);
+
+	return c == 1 && sizeof (int) == 4 &&
+		sizeof (struct jvst_vm_decoded) == VM_FILE_DECSIZE &&
+		offsetof(struct jvst_vm_decoded, a0slot) == 2 &&
+		offsetof(struct jvst_vm_decoded, a1slot) == 3 &&
+		offsetof(struct jvst_vm_decoded, a0) == 4 &&
+		offsetof(struct jvst_vm_decoded, a1) == 8;
+}
+
+struct jvst_vm_program *
+jvst_vm_mapfile(int fd)
+{
+	return jvst_vm_mapfile_at(fd, 0);
+}
+
+struct jvst_vm_program *
+jvst_vm_mapfile_at(int fd, size_t off)
+{
+	struct jvst_vm_program *prog;
+	struct vm_file vf;
+	struct stat st;
+	unsigned char *img;
+	size_t i, n;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		return NULL;
+	}
+
+	n = (size_t)st.st_size;
+	if ((off_t)n != st.st_size || off >= n) {
+		return NULL;
+	}
+	n -= off;
+
+	img = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, (off_t)off);
+	if (img == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (vm_file_check(img, n, &vf) != 0) {
+		munmap(img, n);
+		return NULL;
+	}
+
+	if (!vm_file_native()) {
+		prog = vm_file_copy(img, &vf);
+		munmap(img, n);
+		return prog;
+	}
+
+	prog = xmalloc(sizeof *prog);
+	memset(prog, 0, sizeof *prog);
+
+	prog->image = img;
+	prog->image_len = n;
+
+	prog->ncode = vf.nelts[VM_FILE_CODE];
+	prog->code = (uint32_t *)(img + vf.off[VM_FILE_CODE]);
+
+	prog->nfloat = vf.nelts[VM_FILE_FLOATS];
+	prog->fdata = (double *)(img + vf.off[VM_FILE_FLOATS]);
+
+	prog->nconst = vf.nelts[VM_FILE_CONSTS];
+	prog->cdata = (int64_t *)(img + vf.off[VM_FILE_CONSTS]);
+
+	prog->nsplit = vf.nsplit;
+	prog->sdata = (uint32_t *)(img + vf.off[VM_FILE_SPLITS]);
+
+	// the DFA structs have pointers, so they're the only part of the
+	// program that isn't used in place.  Without dense forms in the
+	// file, they're built when the program is verified.
+	if (vf.nelts[VM_FILE_DFAS] > 0) {
+		prog->ndfa = vf.nelts[VM_FILE_DFAS];
+		prog->dfas = xcalloc(prog->ndfa, sizeof prog->dfas[0]);
+
+		for (i=0; i < prog->ndfa; i++) {
+			struct jvst_vm_dfa *dfa = &prog->dfas[i];
+			const unsigned char *p;
+
+			p = img + vf.off[VM_FILE_DFAS] + VM_FILE_DFAHDR*i;
+			dfa->nstates = get_u64(p+ 0);
+			dfa->nedges  = get_u64(p+ 8);
+			dfa->nends   = get_u64(p+16);
+
+			dfa->offs = (int *)(img + vf.off[VM_FILE_DFADATA]) + get_u64(p+24);
+			dfa->transitions = dfa->offs + (dfa->nstates+1);
+			dfa->endstates = dfa->transitions + 2*dfa->nedges;
+
+			if (vf.nelts[VM_FILE_DENSE] > 0) {
+				vm_file_dense(img, &vf, i, dfa, 1);
+			}
+		}
+	}
+
+	// the file's decoded stream is used if the program verifies with
+	// it.  Otherwise, or without one, verifying decodes the program
+	// into private memory.
+	if (vf.nelts[VM_FILE_DECODED] > 0) {
+		prog->decoded = (struct jvst_vm_decoded *)(img + vf.off[VM_FILE_DECODED]);
+		if (vm_file_verify(prog) == 0) {
+			jvst_vm_program_sizing(prog);
+			return prog;
+		}
+
+		prog->decoded = NULL;
+	}
+
+	(void)vm_file_verify(prog);
+
+	return prog;
+}
+
+void
+jvst_vm_program_unmap(struct jvst_vm_program *prog)
+{
+	size_t i;
+
+	if (prog->image == NULL) {
+		return;
+	}
+
+	if (!vm_file_inimage(prog, prog->decoded)) {
+		free(prog->decoded);
+	}
+
+	// dense forms of the DFAs are allocated if the file didn't have
+	// them
+	for (i=0; i < prog->ndfa; i++) {
+		if (!vm_file_inimage(prog, prog->dfas[i].ends)) {
+			free(prog->dfas[i].ends);
+		}
+	}
+	free(prog->dfas);
+	munmap((void *)prog->image, prog->image_len);
+
+	prog->image = NULL;
+	prog->image_len = 0;
+
+	prog->code = NULL;
+	prog->fdata = NULL;
+	prog->cdata = NULL;
+	prog->sdata = NULL;
+	prog->dfas = NULL;
+	prog->ndfa = 0;
+	prog->decoded = NULL;
+}
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
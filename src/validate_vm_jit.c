@@ -0,0 +1,734 @@
+#define _DEFAULT_SOURCE
+
+#include "validate_vm.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xalloc.h"
+#include "debug.h"
+
+/* Selects the JIT.  It's built on x86-64 hosts with mmap, elsewhere
+ * jvst_vm_program_jit() always fails and programs run on the
+ * interpreter.  Build with -DJVST_VM_JIT=0 to leave it out.
+ */
+#ifndef JVST_VM_JIT
+#  if (defined(__x86_64__) || defined(_M_X64)) && (defined(__unix__) || defined(__APPLE__))
+#    define JVST_VM_JIT 1
+#  else
+#    define JVST_VM_JIT 0
+#  endif
+#endif
+
+#if JVST_VM_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Template JIT.  Each instruction is translated to a fixed sequence of
+ * x86-64 code that does what the unchecked interpreter does, calling
+ * the jvst_vm_rt_* functions for anything more than slot arithmetic and
+ * branches.  The state is kept where the interpreter keeps it: r_pc,
+ * r_fp and r_sp in the context and slots on the VM stack, so native
+ * code and the interpreter are interchangeable.
+ *
+ * Native code is entered with the context, and jumps through a table to
+ * the code for r_pc.  While it runs:
+ *
+ *	rbx	the context
+ *	r12	&ctx->stack[fp]
+ *	r13	the flag register
+ *	r14	the pc to code address table
+ *
+ * It returns with eax set to the result, after storing r_pc and the
+ * flag register.  CALL and RETURN don't use the native stack: RETURN
+ * pops the VM frame and dispatches on the new r_pc.
+ */
+
+struct jvst_vm_jit {
+	void *mem;
+	size_t len;
+
+	int (*entry)(struct jvst_vm_ctx *vm);
+};
+
+enum {
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+struct jit_fixup {
+	size_t at;		// offset of the rel32
+	uint32_t pc;		// target instruction
+};
+
+struct jit_asm {
+	unsigned char *code;
+	size_t len;
+	size_t cap;
+
+	size_t *addr;		// code offset of each instruction, ncode+1 entries
+
+	size_t nfix;
+	size_t maxfix;
+	struct jit_fixup *fix;
+
+	// shared code
+	size_t leave;
+	size_t badpc;
+	size_t entry;
+	size_t redispatch;
+
+	size_t tabref;		// offset of the rel32 that loads r14
+};
+
+static void
+jit_byte(struct jit_asm *a, unsigned b)
+{
+	if (a->len >= a->cap) {
+		a->code = xenlargevec(a->code, &a->cap, 1, 1);
+	}
+
+	a->code[a->len++] = b;
+}
+
+static void
+jit_bytes(struct jit_asm *a, const char *s, size_t n)
+{
+	size_t i;
+
+	for (i=0; i < n; i++) {
+		jit_byte(a, (unsigned char)s[i]);
+	}
+}
+
+#define JIT_BYTES(a, s) jit_bytes((a), (s), sizeof (s) - 1)
+
+static void
+jit_u32(struct jit_asm *a, uint32_t v)
+{
+	jit_byte(a, v & 0xff);
+	jit_byte(a, (v >> 8) & 0xff);
+	jit_byte(a, (v >> 16) & 0xff);
+	jit_byte(a, (v >> 24) & 0xff);
+}
+
+static void
+jit_u64(struct jit_asm *a, uint64_t v)
+{
+	jit_u32(a, (uint32_t)v);
+	jit_u32(a, (uint32_t)(v >> 32));
+}
+
+static void
+jit_patch32(struct jit_asm *a, size_t at, int32_t v)
+{
+	uint32_t u = (uint32_t)v;
+
+	a->code[at+0] = u & 0xff;
+	a->code[at+1] = (u >> 8) & 0xff;
+	a->code[at+2] = (u >> 16) & 0xff;
+	a->code[at+3] = (u >> 24) & 0xff;
+}
+
+// rel32 to a code offset that's already been emitted
+static void
+jit_rel32(struct jit_asm *a, size_t target)
+{
+	jit_u32(a, (uint32_t)(int32_t)((long)target - (long)(a->len + 4)));
+}
+
+// rel32 to the code of an instruction, patched once it's emitted
+static void
+jit_rel32_pc(struct jit_asm *a, uint32_t pc)
+{
+	if (a->nfix >= a->maxfix) {
+		a->fix = xenlargevec(a->fix, &a->maxfix, 1, sizeof a->fix[0]);
+	}
+
+	a->fix[a->nfix].at = a->len;
+	a->fix[a->nfix].pc = pc;
+	a->nfix++;
+
+	jit_u32(a, 0);
+}
+
+/* op r64, [base + disp32] with a 64-bit operand.  base is rbx or r12. */
+static void
+jit_mem(struct jit_asm *a, unsigned rex, unsigned op, int reg, int base, int32_t disp)
+{
+	rex |= 0x40;
+	if (reg >= 8) {
+		rex |= 0x04;
+	}
+	if (base >= 8) {
+		rex |= 0x01;
+	}
+
+	if (rex != 0x40) {
+		jit_byte(a, rex);
+	}
+
+	if (op > 0xff) {
+		jit_byte(a, op >> 8);
+	}
+	jit_byte(a, op & 0xff);
+
+	jit_byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP) {
+		jit_byte(a, 0x24);
+	}
+	jit_u32(a, (uint32_t)disp);
+}
+
+#define REXW 0x08
+
+static int32_t
+jit_slot(int32_t slot)
+{
+	return slot * (int32_t)sizeof (union jvst_vm_stackval);
+}
+
+// mov reg, imm64
+static void
+jit_movabs(struct jit_asm *a, int reg, uint64_t v)
+{
+	jit_byte(a, 0x48 | ((reg >= 8) ? 0x01 : 0));
+	jit_byte(a, 0xb8 + (reg & 7));
+	jit_u64(a, v);
+}
+
+// mov r32, imm32
+static void
+jit_mov32(struct jit_asm *a, int reg, uint32_t v)
+{
+	if (reg >= 8) {
+		jit_byte(a, 0x41);
+	}
+	jit_byte(a, 0xb8 + (reg & 7));
+	jit_u32(a, v);
+}
+
+// mov dword [rbx + off], imm32
+static void
+jit_store_ctx32(struct jit_asm *a, size_t off, uint32_t v)
+{
+	jit_mem(a, 0, 0xc7, 0, RBX, (int32_t)off);
+	jit_u32(a, v);
+}
+
+// mov rdi, rbx ; mov rax, fn ; call rax
+static void
+jit_call(struct jit_asm *a, void (*fn)(void))
+{
+	JIT_BYTES(a, "\x48\x89\xdf");
+	jit_movabs(a, RAX, (uint64_t)(uintptr_t)fn);
+	JIT_BYTES(a, "\xff\xd0");
+}
+
+#define JIT_CALL(a, fn) jit_call((a), (void (*)(void))(fn))
+
+// leaves with eax as the result if it isn't JVST_VALID
+static void
+jit_check(struct jit_asm *a, uint32_t pc)
+{
+	size_t skip;
+
+	JIT_BYTES(a, "\x85\xc0");		// test eax, eax
+	JIT_BYTES(a, "\x74");			// jz skip
+	skip = a->len;
+	jit_byte(a, 0);
+
+	jit_store_ctx32(a, offsetof(struct jvst_vm_ctx, r_pc), pc);
+	jit_byte(a, 0xe9);			// jmp leave
+	jit_rel32(a, a->leave);
+
+	a->code[skip] = (unsigned char)(a->len - (skip+1));
+}
+
+// leaves with result ret at pc
+static void
+jit_leave(struct jit_asm *a, uint32_t pc, int ret)
+{
+	jit_store_ctx32(a, offsetof(struct jvst_vm_ctx, r_pc), pc);
+	jit_mov32(a, RAX, (uint32_t)ret);
+	jit_byte(a, 0xe9);
+	jit_rel32(a, a->leave);
+}
+
+// loads rax with an integer argument
+static void
+jit_ival(struct jit_asm *a, int isslot, int32_t arg)
+{
+	if (isslot) {
+		jit_mem(a, REXW, 0x8b, RAX, R12, jit_slot(arg));	// mov rax, [r12+slot]
+	} else {
+		JIT_BYTES(a, "\x48\xc7\xc0");				// mov rax, imm32
+		jit_u32(a, (uint32_t)arg);
+	}
+}
+
+static int
+jit_fint(double v)
+{
+	return isfinite(v) && (v == ceil(v));
+}
+
+static int
+jit_ins(struct jit_asm *a, const struct jvst_vm_program *prog, uint32_t pc)
+{
+	const struct jvst_vm_decoded *ins = &prog->decoded[pc];
+	const size_t off_pc   = offsetof(struct jvst_vm_ctx, r_pc);
+	const size_t off_err  = offsetof(struct jvst_vm_ctx, error);
+	const size_t off_stk  = offsetof(struct jvst_vm_ctx, stack);
+
+	switch (ins->op) {
+	case JVST_OP_NOP:
+		break;
+
+	case JVST_OP_PROC:
+		jit_mov32(a, RSI, (uint32_t)ins->a0);
+		JIT_CALL(a, jvst_vm_rt_proc);
+		JIT_BYTES(a, "\x89\xc0");				// mov eax, eax (uint32_t return)
+		jit_mem(a, REXW, 0x8b, R12, RBX, (int32_t)off_stk);	// mov r12, [rbx+stack]
+		JIT_BYTES(a, "\x4d\x8d\x24\xc4");			// lea r12, [r12+rax*8]
+		break;
+
+	case JVST_OP_ICMP:
+		jit_ival(a, ins->a0slot, ins->a0);
+		JIT_BYTES(a, "\x31\xc9\x31\xd2");			// xor ecx,ecx ; xor edx,edx
+		if (ins->a1slot) {
+			jit_mem(a, REXW, 0x3b, RAX, R12, jit_slot(ins->a1));	// cmp rax, [r12+slot]
+		} else {
+			JIT_BYTES(a, "\x48\x3d");			// cmp rax, imm32
+			jit_u32(a, (uint32_t)ins->a1);
+		}
+		JIT_BYTES(a, "\x0f\x9f\xc1");				// setg cl
+		JIT_BYTES(a, "\x0f\x9c\xc2");				// setl dl
+		JIT_BYTES(a, "\x48\x29\xd1");				// sub rcx, rdx
+		JIT_BYTES(a, "\x49\x89\xcd");				// mov r13, rcx
+		break;
+
+	case JVST_OP_FCMP:
+		// movsd xmm0, [r12+a0] ; movsd xmm1, [r12+a1]
+		jit_byte(a, 0xf2);
+		jit_mem(a, 0, 0x0f10, 0, R12, jit_slot(ins->a0));
+		jit_byte(a, 0xf2);
+		jit_mem(a, 0, 0x0f10, 1, R12, jit_slot(ins->a1));
+		JIT_BYTES(a, "\x31\xc9\x31\xd2");			// xor ecx,ecx ; xor edx,edx
+		JIT_BYTES(a, "\x66\x0f\x2e\xc1");			// ucomisd xmm0, xmm1
+		JIT_BYTES(a, "\x0f\x97\xc1");				// seta cl
+		JIT_BYTES(a, "\x66\x0f\x2e\xc8");			// ucomisd xmm1, xmm0
+		JIT_BYTES(a, "\x0f\x97\xc2");				// seta dl
+		JIT_BYTES(a, "\x48\x29\xd1");				// sub rcx, rdx
+		JIT_BYTES(a, "\x49\x89\xcd");				// mov r13, rcx
+		break;
+
+	case JVST_OP_FINT:
+		jit_byte(a, 0xf2);
+		jit_mem(a, 0, 0x0f10, 0, R12, jit_slot(ins->a0));	// movsd xmm0, [r12+a0]
+		if (ins->a1slot) {
+			jit_byte(a, 0xf2);
+			jit_mem(a, 0, 0x0f5e, 0, R12, jit_slot(ins->a1));	// divsd xmm0, [r12+a1]
+		} else if (ins->a1 != 0) {
+			jit_mov32(a, RAX, (uint32_t)ins->a1);
+			JIT_BYTES(a, "\xf2\x0f\x2a\xc8");		// cvtsi2sd xmm1, eax
+			JIT_BYTES(a, "\xf2\x0f\x5e\xc1");		// divsd xmm0, xmm1
+		}
+		jit_movabs(a, RAX, (uint64_t)(uintptr_t)jit_fint);
+		JIT_BYTES(a, "\xff\xd0");				// call rax
+		JIT_BYTES(a, "\x4c\x63\xe8");				// movsxd r13, eax
+		break;
+
+	case JVST_OP_JMP:
+		{
+			static const unsigned char jcc[8] = {
+				[JVST_VM_BR_LT] = 0x8c,
+				[JVST_VM_BR_LE] = 0x8e,
+				[JVST_VM_BR_EQ] = 0x84,
+				[JVST_VM_BR_GE] = 0x8d,
+				[JVST_VM_BR_GT] = 0x8f,
+				[JVST_VM_BR_NE] = 0x85,
+			};
+
+			if (ins->cond == JVST_VM_BR_NEVER) {
+				break;
+			}
+
+			if (ins->cond == JVST_VM_BR_ALWAYS) {
+				jit_byte(a, 0xe9);
+			} else {
+				JIT_BYTES(a, "\x4d\x85\xed");		// test r13, r13
+				jit_byte(a, 0x0f);
+				jit_byte(a, jcc[ins->cond]);
+			}
+			jit_rel32_pc(a, ins->a0);
+		}
+		break;
+
+	case JVST_OP_SWITCH:
+		{
+			const int64_t *tbl = &prog->cdata[ins->a1];
+
+			// keys outside the table, including negative ones,
+			// are above it as unsigned values
+			jit_ival(a, ins->a0slot, ins->a0);
+			JIT_BYTES(a, "\x48\x3d");				// cmp rax, ncase
+			jit_u32(a, (uint32_t)tbl[0]);
+			JIT_BYTES(a, "\x0f\x83");				// jae default
+			jit_rel32_pc(a, (uint32_t)tbl[1]);
+			jit_movabs(a, RCX, (uint64_t)(uintptr_t)&tbl[2]);
+			JIT_BYTES(a, "\x48\x8b\x04\xc1");			// mov rax, [rcx+rax*8]
+			JIT_BYTES(a, "\x41\xff\x24\xc6");			// jmp [r14+rax*8]
+		}
+		break;
+
+	case JVST_OP_CALL:
+		jit_mov32(a, RSI, pc);
+		JIT_CALL(a, jvst_vm_rt_call);
+		jit_byte(a, 0xe9);
+		jit_rel32_pc(a, ins->a0);
+		break;
+
+	case JVST_OP_SPLIT:
+	case JVST_OP_SPLITV:
+	case JVST_OP_SPLITANY:
+	case JVST_OP_SPLITALL:
+	case JVST_OP_SPLITONE:
+		if (ins->a0slot) {
+			jit_mem(a, REXW, 0x8b, RSI, R12, jit_slot(ins->a0));	// mov rsi, [r12+a0]
+		} else {
+			jit_mov32(a, RSI, (uint32_t)ins->a0);
+		}
+		jit_mem(a, REXW, 0x8d, RDX, R12, jit_slot(ins->a1));	// lea rdx, [r12+a1]
+		jit_mov32(a, RCX, ins->op);
+		JIT_CALL(a, jvst_vm_rt_split);
+		jit_check(a, pc);
+		break;
+
+	case JVST_OP_TOKEN:
+		if (!ins->a1slot && ins->a1 == -1) {
+			JIT_CALL(a, jvst_vm_rt_unget);
+			break;
+		}
+
+		JIT_CALL(a, jvst_vm_rt_token);
+		jit_check(a, pc);
+		break;
+
+	case JVST_OP_CONSUME:
+		JIT_CALL(a, jvst_vm_rt_consume);
+		jit_check(a, pc);
+		break;
+
+	case JVST_OP_MATCH:
+	case JVST_OP_LMATCH:
+		if (ins->a0slot) {
+			jit_mem(a, REXW, 0x8b, RAX, R12, jit_slot(ins->a0));
+			JIT_BYTES(a, "\x48\x69\xc0");			// imul rax, rax, imm32
+			jit_u32(a, sizeof prog->dfas[0]);
+			jit_movabs(a, RSI, (uint64_t)(uintptr_t)prog->dfas);
+			JIT_BYTES(a, "\x48\x01\xc6");			// add rsi, rax
+		} else {
+			jit_movabs(a, RSI, (uint64_t)(uintptr_t)&prog->dfas[ins->a0]);
+		}
+
+		if (ins->op == JVST_OP_LMATCH) {
+			jit_movabs(a, RDX, (uint64_t)(uintptr_t)&prog->cdata[ins->a1]);
+			JIT_CALL(a, jvst_vm_rt_lmatch);
+		} else {
+			JIT_CALL(a, jvst_vm_rt_match);
+		}
+		jit_check(a, pc);
+		break;
+
+	case JVST_OP_ENUM:
+		jit_movabs(a, RSI, (uint64_t)(uintptr_t)&prog->cdata[prog->cdata[ins->a0]]);
+		JIT_CALL(a, jvst_vm_rt_enum);
+		jit_check(a, pc);
+		break;
+
+	case JVST_OP_DISPATCH:
+		jit_movabs(a, RSI, (uint64_t)(uintptr_t)&prog->cdata[prog->cdata[ins->a0]]);
+		jit_mem(a, REXW, 0x8d, RDX, R12, jit_slot(ins->a1));	// lea rdx, [r12+a1]
+		JIT_CALL(a, jvst_vm_rt_dispatch);
+		jit_check(a, pc);
+		break;
+
+	case JVST_OP_FLOAD:
+		{
+			uint64_t bits;
+
+			memcpy(&bits, &prog->fdata[ins->a1], sizeof bits);
+			jit_movabs(a, RAX, bits);
+			jit_mem(a, REXW, 0x89, RAX, R12, jit_slot(ins->a0));	// mov [r12+a0], rax
+		}
+		break;
+
+	case JVST_OP_ILOAD:
+		jit_movabs(a, RAX, (uint64_t)prog->cdata[ins->a1]);
+		jit_mem(a, REXW, 0x89, RAX, R12, jit_slot(ins->a0));
+		break;
+
+	case JVST_OP_MOVE:
+		if (ins->a1slot) {
+			jit_mem(a, REXW, 0x8b, RAX, R12, jit_slot(ins->a1));
+		} else {
+			jit_ival(a, 0, ins->a1);
+		}
+		jit_mem(a, REXW, 0x89, RAX, R12, jit_slot(ins->a0));
+		break;
+
+	case JVST_OP_INCR:
+		if (ins->a1slot) {
+			jit_mem(a, REXW, 0x63, RAX, R12, jit_slot(ins->a1));	// movsxd rax, dword [r12+a1]
+		} else {
+			jit_ival(a, 0, ins->a1);
+		}
+		jit_mem(a, REXW, 0x01, RAX, R12, jit_slot(ins->a0));	// add [r12+a0], rax
+		break;
+
+	case JVST_OP_BSET:
+		if (ins->a1slot) {
+			jit_mem(a, REXW, 0x8b, RCX, R12, jit_slot(ins->a1));	// mov rcx, [r12+a1]
+			jit_mov32(a, RAX, 1);
+			JIT_BYTES(a, "\x48\xd3\xe0");			// shl rax, cl
+		} else {
+			jit_movabs(a, RAX, (uint64_t)1 << (ins->a1 & 63));
+		}
+		jit_mem(a, REXW, 0x09, RAX, R12, jit_slot(ins->a0));	// or [r12+a0], rax
+		break;
+
+	case JVST_OP_BAND:
+		if (ins->a1slot) {
+			jit_mem(a, REXW, 0x8b, RAX, R12, jit_slot(ins->a1));
+		} else {
+			jit_ival(a, 0, ins->a1);
+		}
+		jit_mem(a, REXW, 0x21, RAX, R12, jit_slot(ins->a0));	// and [r12+a0], rax
+		break;
+
+	case JVST_OP_RETURN:
+		if (ins->a0 != 0) {
+			jit_store_ctx32(a, off_err, (uint32_t)ins->a0);
+			jit_leave(a, pc, JVST_INVALID);
+			break;
+		}
+
+		jit_store_ctx32(a, off_pc, pc);
+		JIT_CALL(a, jvst_vm_rt_return);
+		JIT_BYTES(a, "\x3d");					// cmp eax, CONTINUE
+		jit_u32(a, JVST_VM_RT_CONTINUE);
+		jit_byte(a, 0x0f);					// je redispatch
+		jit_byte(a, 0x84);
+		jit_rel32(a, a->redispatch);
+		jit_byte(a, 0xe9);					// jmp leave
+		jit_rel32(a, a->leave);
+		break;
+
+	case JVST_OP_UNIQUE:
+		jit_mov32(a, RSI, (uint32_t)ins->a0);
+		if (ins->a0 == JVST_VM_UNIQUE_EVAL) {
+			jit_store_ctx32(a, off_pc, pc);
+			JIT_CALL(a, jvst_vm_rt_unique);
+			jit_byte(a, 0xe9);
+			jit_rel32(a, a->leave);
+		} else {
+			JIT_CALL(a, jvst_vm_rt_unique);
+		}
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+jit_prologue(struct jit_asm *a, size_t ncode)
+{
+	const size_t off_pc   = offsetof(struct jvst_vm_ctx, r_pc);
+	const size_t off_fp   = offsetof(struct jvst_vm_ctx, r_fp);
+	const size_t off_flag = offsetof(struct jvst_vm_ctx, r_flag);
+	const size_t off_stk  = offsetof(struct jvst_vm_ctx, stack);
+
+	// leave: store the flag register and return eax
+	a->leave = a->len;
+	jit_mem(a, REXW, 0x89, R13, RBX, (int32_t)off_flag);	// mov [rbx+r_flag], r13
+	JIT_BYTES(a, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b");	// pop r15,r14,r13,r12,rbx
+	jit_byte(a, 0xc3);					// ret
+
+	// pc has left the program
+	a->badpc = a->len;
+	JIT_CALL(a, jvst_vm_rt_badpc);
+	jit_byte(a, 0xe9);
+	jit_rel32(a, a->leave);
+
+	// entry.  Five pushes keep the stack aligned for calls.
+	a->entry = a->len;
+	JIT_BYTES(a, "\x53\x41\x54\x41\x55\x41\x56\x41\x57");	// push rbx,r12,r13,r14,r15
+	JIT_BYTES(a, "\x48\x89\xfb");				// mov rbx, rdi
+	JIT_BYTES(a, "\x4c\x8d\x35");				// lea r14, [rip+table]
+	a->tabref = a->len;
+	jit_u32(a, 0);
+	jit_mem(a, REXW, 0x8b, R13, RBX, (int32_t)off_flag);	// mov r13, [rbx+r_flag]
+
+	// continue at r_pc in frame r_fp
+	a->redispatch = a->len;
+	jit_mem(a, 0, 0x8b, RAX, RBX, (int32_t)off_fp);		// mov eax, [rbx+r_fp]
+	jit_mem(a, REXW, 0x8b, R12, RBX, (int32_t)off_stk);	// mov r12, [rbx+stack]
+	JIT_BYTES(a, "\x4d\x8d\x24\xc4");			// lea r12, [r12+rax*8]
+	jit_mem(a, 0, 0x8b, RAX, RBX, (int32_t)off_pc);		// mov eax, [rbx+r_pc]
+	JIT_BYTES(a, "\x3d");					// cmp eax, ncode
+	jit_u32(a, (uint32_t)ncode);
+	JIT_BYTES(a, "\x0f\x87");				// ja badpc
+	jit_rel32(a, a->badpc);
+	JIT_BYTES(a, "\x41\xff\x24\xc6");			// jmp [r14+rax*8]
+}
+
+static enum jvst_result
+jit_run(struct jvst_vm_ctx *vm, enum SJP_RESULT pret, struct sjp_event *evt)
+{
+	vm->evt = *evt;
+	vm->pret = pret;
+
+	return vm->prog->jit->entry(vm);
+}
+
+int
+jvst_vm_program_jit(struct jvst_vm_program *prog)
+{
+	static const struct jit_asm zero;
+	struct jit_asm a = zero;
+	struct jvst_vm_jit *jit;
+	unsigned char *mem;
+	uint64_t *table;
+	size_t i, n, tab, len, pagesz;
+	char err[128];
+
+	if (prog->jit != NULL) {
+		return 0;
+	}
+
+	// programs compiled to C are already native, and tracing opcodes
+	// needs the interpreter
+	if (prog->native != NULL || (debug & DEBUG_VMOP)) {
+		return -1;
+	}
+
+	// like the unchecked interpreter, native code relies on the
+	// program having been verified
+	if (!prog->verified && jvst_vm_program_verify(prog, err, sizeof err) != 0) {
+		return -1;
+	}
+
+	n = prog->ncode;
+	a.addr = xcalloc(n+1, sizeof a.addr[0]);
+
+	jit_prologue(&a, n);
+
+	for (i=0; i < n; i++) {
+		a.addr[i] = a.len;
+		if (jit_ins(&a, prog, i) != 0) {
+			goto unsupported;
+		}
+	}
+
+	// running off the end of the program
+	a.addr[n] = a.len;
+	jit_store_ctx32(&a, offsetof(struct jvst_vm_ctx, r_pc), (uint32_t)n);
+	jit_byte(&a, 0xe9);
+	jit_rel32(&a, a.badpc);
+
+	for (i=0; i < a.nfix; i++) {
+		size_t at = a.fix[i].at;
+		jit_patch32(&a, at, (int32_t)((long)a.addr[a.fix[i].pc] - (long)(at+4)));
+	}
+
+	// the table of code addresses for dispatch follows the code
+	tab = (a.len + 7) & ~(size_t)7;
+	jit_patch32(&a, a.tabref, (int32_t)((long)tab - (long)(a.tabref+4)));
+
+	pagesz = (size_t)sysconf(_SC_PAGESIZE);
+	len = tab + (n+1) * sizeof table[0];
+	len = (len + pagesz - 1) & ~(pagesz - 1);
+
+	// written while writable, then made executable and read-only
+	mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		goto unsupported;
+	}
+
+	memcpy(mem, a.code, a.len);
+
+	table = (uint64_t *)(mem + tab);
+	for (i=0; i <= n; i++) {
+		table[i] = (uint64_t)(uintptr_t)(mem + a.addr[i]);
+	}
+
+	if (mprotect(mem, len, PROT_READ | PROT_EXEC) != 0) {
+		munmap(mem, len);
+		goto unsupported;
+	}
+
+	jit = xmalloc(sizeof *jit);
+	jit->mem = mem;
+	jit->len = len;
+	jit->entry = (int (*)(struct jvst_vm_ctx *))(void *)(mem + a.entry);
+
+	prog->jit = jit;
+	prog->native = jit_run;
+
+	free(a.code);
+	free(a.addr);
+	free(a.fix);
+	return 0;
+
+unsupported:
+	free(a.code);
+	free(a.addr);
+	free(a.fix);
+	return -1;
+}
+
+void
+jvst_vm_program_unjit(struct jvst_vm_program *prog)
+{
+	if (prog->jit == NULL) {
+		return;
+	}
+
+	munmap(prog->jit->mem, prog->jit->len);
+	free(prog->jit);
+
+	prog->jit = NULL;
+	prog->native = NULL;
+}
+
+#else /* !JVST_VM_JIT */
+
+int
+jvst_vm_program_jit(struct jvst_vm_program *prog)
+{
+	(void)prog;
+	return -1;
+}
+
+void
+jvst_vm_program_unjit(struct jvst_vm_program *prog)
+{
+	(void)prog;
+}
+
+#endif /* JVST_VM_JIT */
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
@@ -0,0 +1,408 @@
+#include "validate_vm.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xalloc.h"
+
+/* Lazy DFAs
+ *
+ * An NFA is determinised as it runs.  Each DFA state is a set of NFA
+ * states, closed over epsilon edges, and its transitions are built the
+ * first time a byte of their class is seen.  The states built so far
+ * are cached, so input that keeps to familiar paths runs from the cache
+ * at nearly the speed of a dense DFA.
+ *
+ * The cache holds at most maxstates states.  When it's full and a
+ * transition needs a new state, it's flushed, keeping only the start
+ * state and the state the match is in, whose set is interned again.
+ * The flush can come partway through a string, so states are renumbered
+ * under a partly matched string, and a cache can only serve one match
+ * at a time.
+ */
+
+enum {
+	LAZY_UNKNOWN = -2,	// transition hasn't been built
+	LAZY_MINSTATES = 3,	// the start state, the kept state and a new one
+};
+
+struct jvst_vm_lazy {
+	const struct jvst_vm_dfa *nfa;
+	size_t maxstates;
+
+	// the lowest byte of each class
+	uint8_t rep[UCHAR_MAX+1];
+
+	// the NFA states of DFA state s are sets[setoff[s]] up to
+	// sets[setoff[s+1]], sorted
+	size_t nstates;
+	size_t cap;
+	int *next;		// nclasses transitions for each state
+	int *ends;
+	size_t *setoff;
+
+	int *sets;
+	size_t nsets;
+	size_t capsets;
+
+	// open addressed index of the states by their sets, holding
+	// state+1 so that zero is an empty slot
+	int *index;
+	size_t nindex;
+
+	// scratch for building a set
+	int *scratch;
+	unsigned char *mark;
+};
+
+static uint64_t
+lazy_sethash(const int *set, size_t n)
+{
+	uint64_t h;
+	size_t i;
+
+	h = UINT64_C(0xcbf29ce484222325);
+	for (i=0; i < n; i++) {
+		h ^= (uint32_t)set[i];
+		h *= UINT64_C(0x100000001b3);
+	}
+
+	return h ^ (h >> 32);
+}
+
+static int
+lazy_intcmp(const void *pa, const void *pb)
+{
+	int a = *(const int *)pa, b = *(const int *)pb;
+	return (a > b) - (a < b);
+}
+
+/* Closes the first n states of the scratch set over epsilon edges and
+ * sorts it.  The states must be marked.  Returns the size of the set,
+ * and leaves no state marked.
+ */
+static size_t
+lazy_closure(struct jvst_vm_lazy *lz, size_t n)
+{
+	const struct jvst_vm_dfa *nfa = lz->nfa;
+	size_t i;
+
+	for (i=0; i < n; i++) {
+		int q = lz->scratch[i];
+		int e;
+
+		// epsilon edges sort last
+		for (e = nfa->offs[q+1]-1; e >= nfa->offs[q]; e--) {
+			int dst = nfa->transitions[2*e+1];
+
+			if (nfa->transitions[2*e+0] != JVST_VM_DFA_EPSILON) {
+				break;
+			}
+
+			if (!lz->mark[dst]) {
+				lz->mark[dst] = 1;
+				lz->scratch[n++] = dst;
+			}
+		}
+	}
+
+	for (i=0; i < n; i++) {
+		lz->mark[lz->scratch[i]] = 0;
+	}
+
+	qsort(lz->scratch, n, sizeof lz->scratch[0], lazy_intcmp);
+	return n;
+}
+
+static void
+lazy_index_put(struct jvst_vm_lazy *lz, size_t st)
+{
+	size_t i, mask;
+	uint64_t h;
+
+	h = lazy_sethash(&lz->sets[lz->setoff[st]], lz->setoff[st+1] - lz->setoff[st]);
+	mask = lz->nindex - 1;
+	for (i = h & mask; lz->index[i] != 0; i = (i+1) & mask) {
+		continue;
+	}
+
+	lz->index[i] = (int)st + 1;
+}
+
+static void
+lazy_index_rebuild(struct jvst_vm_lazy *lz, size_t nindex)
+{
+	size_t st;
+
+	free(lz->index);
+	lz->nindex = nindex;
+	lz->index = xcalloc(nindex, sizeof lz->index[0]);
+
+	for (st=0; st < lz->nstates; st++) {
+		lazy_index_put(lz, st);
+	}
+}
+
+/* Returns the DFA state for the first n states of the scratch set,
+ * adding it to the cache if it's new.
+ */
+static int
+lazy_state(struct jvst_vm_lazy *lz, size_t n)
+{
+	const struct jvst_vm_dfa *nfa = lz->nfa;
+	size_t i, mask, st, nc;
+	uint64_t h;
+
+	h = lazy_sethash(lz->scratch, n);
+	mask = lz->nindex - 1;
+	for (i = h & mask; lz->index[i] != 0; i = (i+1) & mask) {
+		size_t s = lz->index[i] - 1;
+		size_t off = lz->setoff[s];
+
+		if (lz->setoff[s+1] - off == n &&
+			memcmp(&lz->sets[off], lz->scratch, n * sizeof lz->scratch[0]) == 0) {
+			return (int)s;
+		}
+	}
+
+	nc = nfa->nclasses;
+	st = lz->nstates;
+	if (st >= lz->cap) {
+		size_t cap = lz->cap;
+
+		lz->next = xenlargevec(lz->next, &cap, 1, nc * sizeof lz->next[0]);
+		lz->ends = xrealloc(lz->ends, cap * sizeof lz->ends[0]);
+		lz->setoff = xrealloc(lz->setoff, (cap+1) * sizeof lz->setoff[0]);
+		lz->cap = cap;
+	}
+
+	if (lz->capsets - lz->nsets < n) {
+		lz->sets = xenlargevec(lz->sets, &lz->capsets, n - (lz->capsets - lz->nsets), sizeof lz->sets[0]);
+	}
+
+	memcpy(&lz->sets[lz->nsets], lz->scratch, n * sizeof lz->scratch[0]);
+	lz->setoff[st] = lz->nsets;
+	lz->nsets += n;
+	lz->setoff[st+1] = lz->nsets;
+
+	for (i=0; i < nc; i++) {
+		lz->next[st*nc + i] = LAZY_UNKNOWN;
+	}
+
+	// the set is sorted, so this is the case of its lowest end state
+	lz->ends[st] = -1;
+	for (i=0; i < n; i++) {
+		if (nfa->ends[lz->scratch[i]] >= 0) {
+			lz->ends[st] = nfa->ends[lz->scratch[i]];
+			break;
+		}
+	}
+
+	lz->nstates++;
+	if (2*lz->nstates > lz->nindex) {
+		lazy_index_rebuild(lz, 2*lz->nindex);
+	} else {
+		lazy_index_put(lz, st);
+	}
+
+	return (int)st;
+}
+
+/* Builds the transition from DFA state st on byte class c */
+static int
+lazy_step(struct jvst_vm_lazy *lz, size_t st, size_t c)
+{
+	const struct jvst_vm_dfa *nfa = lz->nfa;
+	size_t i, n;
+	int lbl, next;
+
+	lbl = lz->rep[c];
+	n = 0;
+	for (i = lz->setoff[st]; i < lz->setoff[st+1]; i++) {
+		int q = lz->sets[i];
+		int e;
+
+		for (e = nfa->offs[q]; e < nfa->offs[q+1]; e++) {
+			int elbl = nfa->transitions[2*e+0];
+			int dst  = nfa->transitions[2*e+1];
+
+			if (elbl > lbl) {
+				break;
+			}
+
+			if (elbl == lbl && !lz->mark[dst]) {
+				lz->mark[dst] = 1;
+				lz->scratch[n++] = dst;
+			}
+		}
+	}
+
+	next = JVST_VM_DFA_NOMATCH;
+	if (n > 0) {
+		next = lazy_state(lz, lazy_closure(lz, n));
+	}
+
+	lz->next[st*nfa->nclasses + c] = next;
+	return next;
+}
+
+/* Drops every state but the start state */
+static void
+lazy_flush(struct jvst_vm_lazy *lz)
+{
+	size_t i;
+
+	lz->nstates = 1;
+	lz->nsets = lz->setoff[1];
+	for (i=0; i < lz->nfa->nclasses; i++) {
+		lz->next[i] = LAZY_UNKNOWN;
+	}
+
+	memset(lz->index, 0, lz->nindex * sizeof lz->index[0]);
+	lazy_index_put(lz, 0);
+}
+
+/* Flushes the cache but keeps state st.  Returns its new number. */
+static size_t
+lazy_flush_keep(struct jvst_vm_lazy *lz, size_t st)
+{
+	size_t n;
+
+	n = lz->setoff[st+1] - lz->setoff[st];
+	memcpy(lz->scratch, &lz->sets[lz->setoff[st]], n * sizeof lz->scratch[0]);
+
+	lazy_flush(lz);
+	return lazy_state(lz, n);
+}
+
+struct jvst_vm_lazy *
+jvst_vm_lazy_new(const struct jvst_vm_dfa *nfa, size_t maxstates)
+{
+	struct jvst_vm_lazy *lz;
+	int b;
+
+	assert(nfa->nstates > 0);
+	assert(nfa->ends != NULL);
+
+	lz = xcalloc(1, sizeof *lz);
+	lz->nfa = nfa;
+	lz->maxstates = (maxstates < LAZY_MINSTATES) ? LAZY_MINSTATES : maxstates;
+
+	for (b = UCHAR_MAX; b >= 0; b--) {
+		lz->rep[nfa->classes[b]] = (uint8_t)b;
+	}
+
+	lz->scratch = xmalloc(nfa->nstates * sizeof lz->scratch[0]);
+	lz->mark = xcalloc(nfa->nstates, 1);
+
+	lz->nindex = 16;
+	lz->index = xcalloc(lz->nindex, sizeof lz->index[0]);
+
+	lz->scratch[0] = JVST_VM_DFA_START;
+	lz->mark[JVST_VM_DFA_START] = 1;
+	(void)lazy_state(lz, lazy_closure(lz, 1));
+
+	return lz;
+}
+
+void
+jvst_vm_lazy_free(struct jvst_vm_lazy *lz)
+{
+	if (lz == NULL) {
+		return;
+	}
+
+	free(lz->next);
+	free(lz->ends);
+	free(lz->setoff);
+	free(lz->sets);
+	free(lz->index);
+	free(lz->scratch);
+	free(lz->mark);
+	free(lz);
+}
+
+int
+jvst_vm_lazy_run(struct jvst_vm_lazy *lz, int st0, const char *buf, size_t n)
+{
+	const struct jvst_vm_dfa *nfa = lz->nfa;
+	size_t i, st, nc;
+
+	if (st0 < 0) {
+		return st0;
+	}
+
+	if ((size_t)st0 >= lz->nstates) {
+		return JVST_VM_DFA_BADSTATE;
+	}
+
+	st = st0;
+	nc = nfa->nclasses;
+	for (i=0; i < n; i++) {
+		size_t c = nfa->classes[(unsigned char)buf[i]];
+		int next;
+
+		next = lz->next[st*nc + c];
+		if (next == LAZY_UNKNOWN) {
+			// room for the state the step may add
+			if (lz->nstates >= lz->maxstates) {
+				st = lazy_flush_keep(lz, st);
+			}
+
+			next = lazy_step(lz, st, c);
+		}
+
+		if (next < 0) {
+			return JVST_VM_DFA_NOMATCH;
+		}
+
+		st = next;
+	}
+
+	return (int)st;
+}
+
+bool
+jvst_vm_lazy_endstate(const struct jvst_vm_lazy *lz, int st1, int *datap)
+{
+	if (st1 < 0 || (size_t)st1 >= lz->nstates || lz->ends[st1] < 0) {
+		return false;
+	}
+
+	if (datap != NULL) {
+		*datap = lz->ends[st1];
+	}
+
+	return true;
+}
+
+size_t
+jvst_vm_lazy_size(const struct jvst_vm_lazy *lz)
+{
+	return lz->nstates;
+}
+
+size_t
+jvst_vm_lazy_count(const struct jvst_vm_dfa *nfa, size_t limit)
+{
+	struct jvst_vm_lazy *lz;
+	size_t st, c, n;
+
+	lz = jvst_vm_lazy_new(nfa, (size_t)-1);
+	for (st=0; st < lz->nstates && lz->nstates <= limit; st++) {
+		for (c=0; c < nfa->nclasses && lz->nstates <= limit; c++) {
+			if (lz->next[st*nfa->nclasses + c] == LAZY_UNKNOWN) {
+				(void)lazy_step(lz, st, c);
+			}
+		}
+	}
+
+	n = lz->nstates;
+	jvst_vm_lazy_free(lz);
+
+	return n;
+}
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
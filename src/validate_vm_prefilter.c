@@ -0,0 +1,622 @@
+#include "validate_vm.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xalloc.h"
+
+/* DFA prefilters
+ *
+ * Many patterns have literals that every string they match contains:
+ * ^urn:uuid: has a prefix, @example\.com$ a suffix, and [a-z]+foo[0-9]
+ * the factor "foo".  The VM checks them with memcmp() and memchr(),
+ * which is much cheaper than running the DFA over a string that can't
+ * match.
+ *
+ * They're found on the DFA's graph, walking sets of live states (those
+ * on a path from the start to an end state).  The prefix grows while
+ * no state in the set is an end state and every edge out of the set has
+ * the same byte.  The suffix is the same, walking back from the end
+ * states until the set holds the start.  A factor is found around a
+ * state every match passes through, which is a dominator of the end
+ * states: the bytes before the edges that first enter it, and the bytes
+ * after it.
+ */
+
+enum {
+	// edges looked at while finding factors
+	PF_MAXWORK = 1 << 20,
+};
+
+struct pf_builder {
+	const struct jvst_vm_dfa *dfa;
+	size_t n;
+
+	unsigned char *isend;
+	unsigned char *live;
+
+	// edges into each state: redges[2*i] is the source and
+	// redges[2*i+1] the byte of edge i, for roff[st] <= i < roff[st+1]
+	int *roff;
+	int *redges;
+
+	// sets of states, with generation marks to find duplicates
+	int *set;
+	int *next;
+	unsigned *mark;
+	unsigned gen;
+
+	// dominators.  The node n is a sink with an edge from each end
+	// state.
+	int *idom;
+	int *rpo;
+	int *depth;
+
+	size_t work;
+};
+
+// returns the edges of state st, clamped to the edge array
+static void
+pf_edges(const struct jvst_vm_dfa *dfa, size_t st, size_t *e0p, size_t *e1p)
+{
+	int e0, e1;
+
+	e0 = dfa->offs[st];
+	e1 = dfa->offs[st+1];
+
+	if (e0 < 0 || (size_t)e0 > dfa->nedges) {
+		e0 = 0;
+	}
+
+	if (e1 < e0 || (size_t)e1 > dfa->nedges) {
+		e1 = e0;
+	}
+
+	*e0p = e0;
+	*e1p = e1;
+}
+
+static int
+pf_edge(const struct pf_builder *b, size_t e, int *lblp, int *dstp)
+{
+	int lbl = b->dfa->transitions[2*e+0];
+	int dst = b->dfa->transitions[2*e+1];
+
+	if (lbl < 0 || lbl > UCHAR_MAX || dst < 0 || (size_t)dst >= b->n) {
+		return 0;
+	}
+
+	*lblp = lbl;
+	*dstp = dst;
+	return 1;
+}
+
+static void
+pf_init(struct pf_builder *b, const struct jvst_vm_dfa *dfa)
+{
+	size_t n, st, e, e0, e1, i;
+	int *stk, nstk;
+
+	n = dfa->nstates;
+	b->dfa = dfa;
+	b->n = n;
+	b->work = 0;
+	b->gen = 0;
+
+	b->isend = xcalloc(n, 1);
+	b->live = xcalloc(n, 1);
+	b->roff = xcalloc(n+1, sizeof b->roff[0]);
+	b->set = xmalloc((n+1) * sizeof b->set[0]);
+	b->next = xmalloc((n+1) * sizeof b->next[0]);
+	b->mark = xcalloc(n+1, sizeof b->mark[0]);
+	b->idom = xmalloc((n+1) * sizeof b->idom[0]);
+	b->rpo = xmalloc((n+1) * sizeof b->rpo[0]);
+	b->depth = xmalloc((n+1) * sizeof b->depth[0]);
+
+	for (i=0; i < dfa->nends; i++) {
+		int est = dfa->endstates[2*i+0];
+
+		if (est >= 0 && (size_t)est < n && dfa->endstates[2*i+1] >= 0) {
+			b->isend[est] = 1;
+		}
+	}
+
+	// count, then place, the edges into each state
+	for (st=0; st < n; st++) {
+		pf_edges(dfa, st, &e0, &e1);
+		for (e=e0; e < e1; e++) {
+			int lbl, dst;
+			if (pf_edge(b, e, &lbl, &dst)) {
+				b->roff[dst+1]++;
+			}
+		}
+	}
+
+	for (st=0; st < n; st++) {
+		b->roff[st+1] += b->roff[st];
+	}
+
+	b->redges = xmalloc((2*(size_t)b->roff[n] + 1) * sizeof b->redges[0]);
+	stk = b->set;
+	memcpy(stk, b->roff, n * sizeof stk[0]);
+	for (st=0; st < n; st++) {
+		pf_edges(dfa, st, &e0, &e1);
+		for (e=e0; e < e1; e++) {
+			int lbl, dst;
+			if (pf_edge(b, e, &lbl, &dst)) {
+				b->redges[2*stk[dst]+0] = st;
+				b->redges[2*stk[dst]+1] = lbl;
+				stk[dst]++;
+			}
+		}
+	}
+
+	// states that reach an end state...
+	nstk = 0;
+	for (st=0; st < n; st++) {
+		if (b->isend[st]) {
+			b->live[st] = 1;
+			stk[nstk++] = st;
+		}
+	}
+
+	while (nstk > 0) {
+		int q = stk[--nstk];
+		for (i = b->roff[q]; i < (size_t)b->roff[q+1]; i++) {
+			int src = b->redges[2*i];
+			if (!b->live[src]) {
+				b->live[src] = 1;
+				stk[nstk++] = src;
+			}
+		}
+	}
+
+	// ...and are reached from the start
+	if (n == 0 || !b->live[JVST_VM_DFA_START]) {
+		memset(b->live, 0, n);
+		return;
+	}
+
+	b->mark[JVST_VM_DFA_START] = 1;
+	stk[0] = JVST_VM_DFA_START;
+	nstk = 1;
+	while (nstk > 0) {
+		int q = stk[--nstk];
+
+		pf_edges(dfa, q, &e0, &e1);
+		for (e=e0; e < e1; e++) {
+			int lbl, dst;
+			if (pf_edge(b, e, &lbl, &dst) && b->live[dst] && !b->mark[dst]) {
+				b->mark[dst] = 1;
+				stk[nstk++] = dst;
+			}
+		}
+	}
+
+	for (st=0; st < n; st++) {
+		b->live[st] = b->live[st] && b->mark[st];
+		b->mark[st] = 0;
+	}
+}
+
+static void
+pf_finalize(struct pf_builder *b)
+{
+	free(b->isend);
+	free(b->live);
+	free(b->roff);
+	free(b->redges);
+	free(b->set);
+	free(b->next);
+	free(b->mark);
+	free(b->idom);
+	free(b->rpo);
+	free(b->depth);
+}
+
+static void
+pf_swap(struct pf_builder *b)
+{
+	int *tmp = b->set;
+	b->set = b->next;
+	b->next = tmp;
+}
+
+/* Returns the bytes every match has after reaching a state of the
+ * first nset states of the set, up to max of them.  Changes the set.
+ */
+static size_t
+pf_forward(struct pf_builder *b, size_t nset, char *out, size_t max)
+{
+	size_t len, i, e, e0, e1;
+
+	for (len=0; len < max; len++) {
+		size_t nnext = 0;
+		int c = -1;
+
+		b->gen++;
+		for (i=0; i < nset; i++) {
+			int q = b->set[i];
+
+			if (b->isend[q]) {
+				return len;
+			}
+
+			pf_edges(b->dfa, q, &e0, &e1);
+			for (e=e0; e < e1; e++) {
+				int lbl, dst;
+
+				b->work++;
+				if (!pf_edge(b, e, &lbl, &dst) || !b->live[dst]) {
+					continue;
+				}
+
+				if (c >= 0 && lbl != c) {
+					return len;
+				}
+
+				c = lbl;
+				if (b->mark[dst] != b->gen) {
+					b->mark[dst] = b->gen;
+					b->next[nnext++] = dst;
+				}
+			}
+		}
+
+		if (c < 0) {
+			return len;
+		}
+
+		out[len] = (char)c;
+		pf_swap(b);
+		nset = nnext;
+	}
+
+	return len;
+}
+
+/* Returns the bytes every match has before reaching a state of the
+ * first nset states of the set, last byte first, up to max of them.
+ * Changes the set.
+ */
+static size_t
+pf_backward(struct pf_builder *b, size_t nset, char *out, size_t max)
+{
+	size_t len, i, j;
+
+	for (len=0; len < max; len++) {
+		size_t nnext = 0;
+		int c = -1;
+
+		b->gen++;
+		for (i=0; i < nset; i++) {
+			int q = b->set[i];
+
+			if (q == JVST_VM_DFA_START) {
+				return len;
+			}
+
+			for (j = b->roff[q]; j < (size_t)b->roff[q+1]; j++) {
+				int src = b->redges[2*j+0];
+				int lbl = b->redges[2*j+1];
+
+				b->work++;
+				if (!b->live[src]) {
+					continue;
+				}
+
+				if (c >= 0 && lbl != c) {
+					return len;
+				}
+
+				c = lbl;
+				if (b->mark[src] != b->gen) {
+					b->mark[src] = b->gen;
+					b->next[nnext++] = src;
+				}
+			}
+		}
+
+		if (c < 0) {
+			return len;
+		}
+
+		out[len] = (char)c;
+		pf_swap(b);
+		nset = nnext;
+	}
+
+	return len;
+}
+
+static void
+pf_reverse(char *s, size_t n)
+{
+	size_t i;
+
+	for (i=0; i < n/2; i++) {
+		char c = s[i];
+		s[i] = s[n-1-i];
+		s[n-1-i] = c;
+	}
+}
+
+static int
+pf_intersect(const struct pf_builder *b, int x, int y)
+{
+	while (x != y) {
+		while (b->rpo[x] > b->rpo[y]) {
+			x = b->idom[x];
+		}
+		while (b->rpo[y] > b->rpo[x]) {
+			y = b->idom[y];
+		}
+	}
+
+	return x;
+}
+
+/* Finds the dominators of the live states and the sink with the
+ * iterative algorithm of Cooper, Harvey and Kennedy.  Returns 0 if the
+ * sink isn't reached.
+ */
+static int
+pf_dominators(struct pf_builder *b)
+{
+	size_t n = b->n, npost, i, j;
+	int *post, *stk, *stke, nstk;
+	int changed;
+
+	post = xmalloc((n+1) * sizeof post[0]);
+	stk = xmalloc((n+1) * sizeof stk[0]);
+	stke = xmalloc((n+1) * sizeof stke[0]);
+
+	for (i=0; i <= n; i++) {
+		b->rpo[i] = -1;
+		b->idom[i] = -1;
+	}
+
+	// postorder by depth first search.  Edge e1 of an end state is
+	// its edge to the sink.
+	npost = 0;
+	stk[0] = JVST_VM_DFA_START;
+	stke[0] = -1;
+	b->rpo[JVST_VM_DFA_START] = 0;
+	nstk = 1;
+	while (nstk > 0) {
+		int q = stk[nstk-1];
+		size_t e, e0, e1;
+		int succ = -1;
+
+		if ((size_t)q < n) {
+			pf_edges(b->dfa, q, &e0, &e1);
+			e = (stke[nstk-1] < 0) ? e0 : (size_t)stke[nstk-1];
+			for (; e <= e1 && succ < 0; e++) {
+				int lbl, dst;
+
+				if (e == e1) {
+					if (b->isend[q] && b->rpo[n] < 0) {
+						succ = n;
+					}
+				} else if (pf_edge(b, e, &lbl, &dst) && b->live[dst] && b->rpo[dst] < 0) {
+					succ = dst;
+				}
+			}
+			stke[nstk-1] = e;
+		}
+
+		if (succ >= 0) {
+			b->rpo[succ] = 0;
+			stk[nstk] = succ;
+			stke[nstk] = -1;
+			nstk++;
+		} else {
+			post[npost++] = q;
+			nstk--;
+		}
+	}
+
+	free(stk);
+	free(stke);
+
+	if (b->rpo[n] < 0) {
+		free(post);
+		return 0;
+	}
+
+	for (i=0; i < npost; i++) {
+		b->rpo[post[i]] = npost-1 - i;
+	}
+
+	b->idom[JVST_VM_DFA_START] = JVST_VM_DFA_START;
+	do {
+		changed = 0;
+
+		// reverse postorder, skipping the start
+		for (i = npost-1; i-- > 0;) {
+			int q = post[i], nd = -1;
+
+			if ((size_t)q == n) {
+				for (j=0; j < n; j++) {
+					if (b->isend[j] && b->live[j] && b->idom[j] >= 0) {
+						nd = (nd < 0) ? (int)j : pf_intersect(b, j, nd);
+					}
+				}
+			} else {
+				for (j = b->roff[q]; j < (size_t)b->roff[q+1]; j++) {
+					int src = b->redges[2*j];
+					if (b->live[src] && b->idom[src] >= 0) {
+						nd = (nd < 0) ? src : pf_intersect(b, src, nd);
+					}
+				}
+			}
+
+			if (b->idom[q] != nd) {
+				b->idom[q] = nd;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	// the immediate dominator comes first in reverse postorder
+	b->depth[JVST_VM_DFA_START] = 0;
+	for (i = npost-1; i-- > 0;) {
+		int q = post[i];
+		b->depth[q] = b->depth[b->idom[q]] + 1;
+	}
+
+	free(post);
+	return 1;
+}
+
+static int
+pf_dominates(struct pf_builder *b, int d, int q)
+{
+	if (b->rpo[q] < 0) {
+		return 0;
+	}
+
+	while (b->depth[q] > b->depth[d]) {
+		b->work++;
+		q = b->idom[q];
+	}
+
+	return q == d;
+}
+
+/* The factor around dominator d: the bytes before the edges that first
+ * enter d, and the bytes after d.
+ */
+static size_t
+pf_factor(struct pf_builder *b, int d, char *out)
+{
+	size_t nset, nb, j;
+	int c;
+
+	nset = 0;
+	nb = 0;
+	c = -1;
+	b->gen++;
+	for (j = b->roff[d]; j < (size_t)b->roff[d+1]; j++) {
+		int src = b->redges[2*j+0];
+		int lbl = b->redges[2*j+1];
+
+		if (!b->live[src] || pf_dominates(b, d, src)) {
+			continue;
+		}
+
+		if (c >= 0 && lbl != c) {
+			c = -2;
+			break;
+		}
+
+		c = lbl;
+		if (b->mark[src] != b->gen) {
+			b->mark[src] = b->gen;
+			b->set[nset++] = src;
+		}
+	}
+
+	if (c >= 0) {
+		out[0] = (char)c;
+		nb = 1 + pf_backward(b, nset, &out[1], JVST_VM_DFA_MAXLIT-1);
+		pf_reverse(out, nb);
+	}
+
+	b->set[0] = d;
+	return nb + pf_forward(b, 1, &out[nb], JVST_VM_DFA_MAXLIT - nb);
+}
+
+void
+jvst_vm_dfa_prefilter_build(const struct jvst_vm_dfa *dfa, struct jvst_vm_dfa_prefilter *pf)
+{
+	struct pf_builder b;
+	char buf[JVST_VM_DFA_MAXLIT];
+	size_t n, nset, st;
+	int d;
+
+	memset(pf, 0, sizeof *pf);
+	if (dfa->nstates == 0) {
+		return;
+	}
+
+	pf_init(&b, dfa);
+	n = b.n;
+	if (!b.live[JVST_VM_DFA_START]) {
+		goto done;
+	}
+
+	b.set[0] = JVST_VM_DFA_START;
+	pf->nprefix = pf_forward(&b, 1, pf->prefix, sizeof pf->prefix);
+
+	nset = 0;
+	for (st=0; st < n; st++) {
+		if (b.isend[st] && b.live[st]) {
+			b.set[nset++] = st;
+		}
+	}
+	pf->nsuffix = pf_backward(&b, nset, pf->suffix, sizeof pf->suffix);
+	pf_reverse(pf->suffix, pf->nsuffix);
+
+	// a factor only helps if it's longer than the prefix and suffix
+	if (!pf_dominators(&b)) {
+		goto done;
+	}
+
+	for (d = b.idom[n]; d != JVST_VM_DFA_START && b.work < PF_MAXWORK; d = b.idom[d]) {
+		size_t nf = pf_factor(&b, d, buf);
+
+		if (nf > pf->nfactor && nf > pf->nprefix && nf > pf->nsuffix) {
+			memcpy(pf->factor, buf, nf);
+			pf->nfactor = nf;
+		}
+	}
+
+done:
+	pf_finalize(&b);
+}
+
+bool
+jvst_vm_dfa_maymatch(const struct jvst_vm_dfa *dfa, const char *s, size_t n)
+{
+	const struct jvst_vm_dfa_prefilter *pf = &dfa->pre;
+	const char *p, *end;
+	size_t nf;
+
+	if (pf->nprefix > 0 && (n < pf->nprefix || memcmp(s, pf->prefix, pf->nprefix) != 0)) {
+		return false;
+	}
+
+	if (pf->nsuffix > 0 &&
+		(n < pf->nsuffix || memcmp(s + n - pf->nsuffix, pf->suffix, pf->nsuffix) != 0)) {
+		return false;
+	}
+
+	nf = pf->nfactor;
+	if (nf == 0) {
+		return true;
+	}
+
+	if (n < nf) {
+		return false;
+	}
+
+	// memchr() finds where the factor might start
+	end = s + (n - nf) + 1;
+	for (p = s; p < end; p++) {
+		p = memchr(p, (unsigned char)pf->factor[0], end - p);
+		if (p == NULL) {
+			return false;
+		}
+
+		if (memcmp(p+1, &pf->factor[1], nf-1) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
@@ -0,0 +1,557 @@
+/* Interpreter core of the VM.
+ *
+ * This file is included twice by validate_vm.c.  The checked variant
+ * tests slot, pool and index arguments as each instruction executes.
+ * The unchecked variant is only used for programs that have passed
+ * jvst_vm_program_verify(), where those tests can't fail.
+ *
+ * Before including, define:
+ *   VM_RUN_FN   the name of the function to define
+ *   VM_CHECKED  1 to check arguments at runtime, 0 otherwise
+ */
+
+#ifndef VM_RUN_FN
+#  error "VM_RUN_FN must be defined before including validate_vm_run.h"
+#endif
+
+#ifndef VM_CHECKED
+#  error "VM_CHECKED must be defined before including validate_vm_run.h"
+#endif
+
+#define DEBUG_OP(vm,pc) do{ if (DEBUG_OPCODES && (pc) < (vm)->prog->ncode) { \
+	debug_op((vm),(pc),(vm)->prog->code[(pc)]); } } while(0)
+
+#if DEBUG_STEP
+#  define DEBUG_WAIT() do { static char buf[256]; fgets(buf, sizeof buf, stdin); } while(0)
+#else
+#  define DEBUG_WAIT() do {} while(0)
+#endif
+
+/* With threaded dispatch, each instruction handler jumps directly to
+ * the handler of the next instruction through the dispatch table.  The
+ * switch is still used to enter the first instruction.  Without it,
+ * every instruction goes back through the switch.
+ */
+#if JVST_VM_THREADED
+#  define VM_OP(name) case JVST_OP_##name: op_##name
+#  define DISPATCH() do { ins = &dec[pc]; DEBUG_OP(vm,pc); DEBUG_WAIT(); \
+	goto *dispatch[ins->op]; } while(0)
+#else
+#  define VM_OP(name) case JVST_OP_##name
+#  define DISPATCH() goto loop
+#endif
+
+#define NEXT do{ vm->r_pc = ++pc; DISPATCH(); } while(0)
+#define BRANCH(target) do { pc = (target); vm->r_pc = pc; DISPATCH(); } while(0)
+static enum jvst_result
+VM_RUN_FN(struct jvst_vm_ctx *vm, enum SJP_RESULT pret, struct sjp_event *evt)
+{
+#if JVST_VM_THREADED
+	static const void *const dispatch[JVST_OP_NDECODED] = {
+		[JVST_OP_NOP]     = &&op_NOP,
+		[JVST_OP_PROC]    = &&op_PROC,
+		[JVST_OP_ICMP]    = &&op_ICMP,
+		[JVST_OP_FCMP]    = &&op_FCMP,
+		[JVST_OP_FINT]    = &&op_FINT,
+		[JVST_OP_JMP]     = &&op_JMP,
+		[JVST_OP_CALL]    = &&op_CALL,
+		[JVST_OP_SPLIT]   = &&op_SPLIT,
+		[JVST_OP_SPLITV]  = &&op_SPLITV,
+		[JVST_OP_SPLITANY] = &&op_SPLITANY,
+		[JVST_OP_SPLITALL] = &&op_SPLITALL,
+		[JVST_OP_SPLITONE] = &&op_SPLITONE,
+		[JVST_OP_TOKEN]   = &&op_TOKEN,
+		[JVST_OP_CONSUME] = &&op_CONSUME,
+		[JVST_OP_MATCH]   = &&op_MATCH,
+		[JVST_OP_FLOAD]   = &&op_FLOAD,
+		[JVST_OP_ILOAD]   = &&op_ILOAD,
+		[JVST_OP_MOVE]    = &&op_MOVE,
+		[JVST_OP_INCR]    = &&op_INCR,
+		[JVST_OP_BSET]    = &&op_BSET,
+		[JVST_OP_BAND]    = &&op_BAND,
+		[JVST_OP_RETURN]  = &&op_RETURN,
+		[JVST_OP_UNIQUE]  = &&op_UNIQUE,
+		[JVST_OP_SWITCH]  = &&op_SWITCH,
+		[JVST_OP_LMATCH]  = &&op_LMATCH,
+		[JVST_OP_ENUM]    = &&op_ENUM,
+		[JVST_OP_DISPATCH] = &&op_DISPATCH,
+
+		[JVST_OP_BADPC]   = &&op_BADPC,
+		[JVST_OP_BADOP]   = &&op_BADOP,
+	};
+#endif /* JVST_VM_THREADED */
+
+	const struct jvst_vm_decoded *dec, *ins;
+	uint32_t pc, fp, sp;
+	int64_t flag;
+	int ret;
+
+	vm->evt = *evt;
+	vm->pret = pret;
+
+	dec = vm->prog->decoded;
+
+	pc = vm->r_pc;
+	fp = vm->r_fp;
+	sp = vm->r_sp;
+	flag = vm->r_flag;
+
+	ret = JVST_INVALID;
+
+	// bounds check pc.  Once running, pc can only leave the program
+	// by landing on the sentinel at the end of the decoded stream.
+	if (pc > vm->prog->ncode) {
+		vm->error = JVST_INVALID_VM_BAD_PC;
+		ret = JVST_INVALID;
+		goto finish;
+	}
+
+loop:
+	ins = &dec[pc];
+	DEBUG_OP(vm, pc);
+	DEBUG_WAIT();
+
+	switch (ins->op) {
+	VM_OP(NOP):
+		NEXT;
+
+	VM_OP(PROC):
+		{
+			uint32_t fp0;
+			int i,n,nsl;
+
+			assert(!ins->a0slot);
+
+			nsl = ins->a0;
+			if (VM_CHECKED && nsl < 0) {
+				// XXX - better error messages
+				vm->error = JVST_INVALID_VM_INVALID_ARG;
+				ret = JVST_INVALID;
+				goto finish;
+			}
+
+			// allocate extra slots for "registers"
+			n = nsl + JVST_VM_NUMREG;
+
+			// setup frame
+			fp0 = fp;
+			fp = sp;
+
+			// allocate stack slots
+			resize_stack(vm, sp+n);
+			for (i=0; i < n; i++) {
+				vm->stack[sp++].u = 0;
+			}
+
+			if (fp0 != fp) {
+				// copy registers
+				vm->stack[fp+JVST_VM_TT  ].i = vm->stack[fp0+JVST_VM_TT  ].i;
+				vm->stack[fp+JVST_VM_TNUM].f = vm->stack[fp0+JVST_VM_TNUM].f;
+				vm->stack[fp+JVST_VM_TLEN].i = vm->stack[fp0+JVST_VM_TLEN].i;
+				vm->stack[fp+JVST_VM_M   ].i = vm->stack[fp0+JVST_VM_M   ].i;
+			} else {
+				// load TT / TNUM / TLEN from current token
+				load_slots_from_token(vm,fp);
+			}
+
+			vm->r_fp = fp;
+			vm->r_sp = sp;
+		}
+		NEXT;
+
+	/* integer comparisons */
+	VM_OP(ICMP):
+		vm->r_flag = flag = iopcmp(vm, fp, ins, VM_CHECKED);
+		NEXT;
+
+	/* floating point comparisons */
+	VM_OP(FCMP):
+		vm->r_flag = flag = fopcmp(vm, fp, ins, VM_CHECKED);
+		NEXT;
+
+	VM_OP(FINT):
+		{
+			double v;
+
+			assert(ins->a0slot);
+
+			v = vm_fvalptr(vm, fp, ins->a0slot, ins->a0, VM_CHECKED)[0];
+			if (ins->a1slot || ins->a1 != 0) {
+				double div;
+
+				if (ins->a1slot) {
+					div = vm_fvalptr(vm, fp, ins->a1slot, ins->a1, VM_CHECKED)[0];
+				} else {
+					div = ins->a1;
+				}
+
+				v /= div;
+			}
+
+			vm->r_flag = flag = isfinite(v) && (v == ceil(v));
+		}
+		NEXT;
+
+	VM_OP(JMP):
+		if (ins->cond != JVST_VM_BR_ALWAYS) {
+			int mask;
+
+			// XXX - can we simplify / eliminate
+			// branches?
+			mask = (flag<0) | ((flag > 0) << 1) | ((flag == 0) << 2);
+
+			if ((ins->cond & mask) == 0) {
+				NEXT;
+			}
+		}
+
+		BRANCH(ins->a0);
+
+	VM_OP(SWITCH):
+		{
+			const int64_t *tbl;
+			int64_t key, ncase, dest;
+
+			if (VM_CHECKED && (ins->a1slot || ins->a1 < 0 || (size_t)ins->a1 + 2 > vm->prog->nconst)) {
+				PANIC(vm, -1, "SWITCH op with invalid jump table");
+			}
+
+			tbl = &vm->prog->cdata[ins->a1];
+			ncase = tbl[0];
+			if (VM_CHECKED && (ncase < 0 || (uint64_t)ncase > vm->prog->nconst - ins->a1 - 2)) {
+				PANIC(vm, -1, "SWITCH op with invalid jump table");
+			}
+
+			key = vm_ival(vm, fp, ins->a0slot, ins->a0, VM_CHECKED);
+			dest = (key >= 0 && key < ncase) ? tbl[2+key] : tbl[1];
+
+			// like branches, destinations outside of the program
+			// land on the sentinel
+			if (VM_CHECKED && (dest < 0 || (uint64_t)dest >= vm->prog->ncode)) {
+				dest = vm->prog->ncode;
+			}
+
+			BRANCH((uint32_t)dest);
+		}
+
+	VM_OP(TOKEN):
+		// read next token, set the various token values
+		if (!ins->a1slot && ins->a1 == -1) {
+			unget_token(vm);
+			NEXT;
+		}
+
+		if (next_token(vm,fp)) {
+			return JVST_NEXT;
+		}
+		NEXT;
+
+	VM_OP(CONSUME):
+		{
+			int ret;
+
+			ret = consume_current_value(vm);
+			if (ret != JVST_VALID) {
+				return ret;
+			}
+		}
+		NEXT;
+
+	VM_OP(RETURN):
+		assert(!ins->a0slot);
+
+		if (ins->a0 != 0) {
+			vm->error = vm_ival(vm, fp, ins->a0slot, ins->a0, VM_CHECKED);
+			assert(vm->error != 0);
+			ret = JVST_INVALID;
+			goto finish;
+		}
+
+		// otherwise VALID return
+
+		// consume token, then return to previous frame or, if top of
+		// stack, return JVST_VALID
+		ret = consume_current_value(vm);
+		if (ret != JVST_VALID && ret != JVST_NEXT) {
+			return ret;
+		}
+
+		// value consumed... return to previous frame or finish
+		// if we're at the top of the stack
+		if (fp == 0) {
+			vm->r_pc = pc = 0;
+			ret = JVST_VALID;
+			goto finish;
+		}
+
+		vm->r_sp = sp = fp-2;
+		vm->r_pc = pc = vm->stack[fp-2].u;
+		vm->r_fp = fp = vm->stack[fp-1].u;
+		NEXT; // pc points to CALL, continue with next instruction
+
+	VM_OP(MOVE):
+		assert(ins->a0slot);
+
+		if (!ins->a1slot) {
+			vm_slotptr(vm,fp,ins->a0,VM_CHECKED)->i = ins->a1;
+		} else {
+			union jvst_vm_stackval *s0, *s1;
+			s0 = vm_slotptr(vm,fp,ins->a0,VM_CHECKED);
+			s1 = vm_slotptr(vm,fp,ins->a1,VM_CHECKED);
+			memcpy(s0,s1,sizeof(*s0));
+		}
+		NEXT;
+
+	VM_OP(FLOAD):
+		assert(ins->a0slot);
+		assert(!ins->a1slot);
+
+		if (VM_CHECKED && (ins->a1 < 0 || (size_t)ins->a1 >= vm->prog->nfloat)) {
+			PANIC(vm, -1, "invalid float pool index");
+		}
+
+		vm_slotptr(vm, fp, ins->a0, VM_CHECKED)->f = vm->prog->fdata[ins->a1];
+		NEXT;
+
+	VM_OP(ILOAD):
+		assert(ins->a0slot);
+		assert(!ins->a1slot);
+
+		if (VM_CHECKED && (ins->a1 < 0 || (size_t)ins->a1 >= vm->prog->nconst)) {
+			PANIC(vm, -1, "invalid const pool index");
+		}
+
+		vm_slotptr(vm, fp, ins->a0, VM_CHECKED)->i = vm->prog->cdata[ins->a1];
+		NEXT;
+
+	VM_OP(INCR):
+		{
+			union jvst_vm_stackval *slot;
+			int delta;
+
+			assert(ins->a0slot);
+
+			slot = vm_slotptr(vm, fp, ins->a0, VM_CHECKED);
+			delta = vm_ival(vm, fp, ins->a1slot, ins->a1, VM_CHECKED);
+			slot->i += delta;
+		}
+		NEXT;
+
+	VM_OP(MATCH):
+		{
+			int dfa_ind;
+			const struct jvst_vm_dfa *dfa;
+
+			dfa_ind = vm_ival(vm, fp, ins->a0slot, ins->a0, VM_CHECKED);
+
+			if (VM_CHECKED && (dfa_ind < 0 || (size_t)dfa_ind >= vm->prog->ndfa)) {
+				PANIC(vm, -1, "MATCH op with invalid DFA");
+			}
+
+			// a DFA that failed verification isn't compiled
+			if (VM_CHECKED && vm->prog->dfas[dfa_ind].ends == NULL) {
+				PANIC(vm, -1, "MATCH op with unchecked DFA");
+			}
+
+			dfa = &vm->prog->dfas[dfa_ind];
+			assert(dfa != NULL);
+
+			ret = vm_match(vm, dfa);
+			if (ret != JVST_VALID) {
+				goto finish;
+			}
+		}
+		NEXT;
+
+	VM_OP(LMATCH):
+		{
+			int dfa_ind;
+
+			dfa_ind = vm_ival(vm, fp, ins->a0slot, ins->a0, VM_CHECKED);
+
+			if (VM_CHECKED && (dfa_ind < 0 || (size_t)dfa_ind >= vm->prog->ndfa)) {
+				PANIC(vm, -1, "LMATCH op with invalid DFA");
+			}
+
+			// a DFA that failed verification isn't compiled
+			if (VM_CHECKED && vm->prog->dfas[dfa_ind].ends == NULL) {
+				PANIC(vm, -1, "LMATCH op with unchecked DFA");
+			}
+
+			if (VM_CHECKED && !verify_lits(vm->prog, ins->a1slot, ins->a1)) {
+				PANIC(vm, -1, "LMATCH op with invalid literal table");
+			}
+
+			ret = vm_lmatch(vm, &vm->prog->dfas[dfa_ind], &vm->prog->cdata[ins->a1]);
+			if (ret != JVST_VALID) {
+				goto finish;
+			}
+		}
+		NEXT;
+
+	VM_OP(ENUM):
+		if (VM_CHECKED && !verify_vset(vm->prog, ins->a0slot, ins->a0)) {
+			PANIC(vm, -1, "ENUM op with invalid value set");
+		}
+
+		ret = vm_enum(vm, &vm->prog->cdata[vm->prog->cdata[ins->a0]]);
+		if (ret != JVST_VALID) {
+			goto finish;
+		}
+		NEXT;
+
+	VM_OP(CALL):
+		assert(dec[ins->a0].op == JVST_OP_PROC || dec[ins->a0].op == JVST_OP_BADPC);
+
+		resize_stack(vm, sp+2);
+		vm->stack[sp+0].u = pc;
+		vm->stack[sp+1].u = fp;
+
+		sp += 2;
+		vm->r_fp = fp;
+		vm->r_sp = sp;
+
+		BRANCH(ins->a0);
+
+	VM_OP(BSET):
+		{
+			union jvst_vm_stackval *slot;
+			int bit;
+
+			assert(ins->a0slot);
+
+			slot = vm_slotptr(vm, fp, ins->a0, VM_CHECKED);
+			bit = vm_ival(vm, fp, ins->a1slot, ins->a1, VM_CHECKED);
+
+			if (VM_CHECKED && (bit < 0 || bit >= 64)) {
+				PANIC(vm, -1, "BSET op with invalid bit");
+			}
+
+			slot->u |= ((uint64_t)1 << bit);
+		}
+		NEXT;
+
+	VM_OP(BAND):
+		{
+			union jvst_vm_stackval *slot;
+			uint64_t mask;
+
+			assert(ins->a0slot);
+
+			slot = vm_slotptr(vm, fp, ins->a0, VM_CHECKED);
+			mask = vm_uval(vm, fp, ins->a1slot, ins->a1, VM_CHECKED);
+
+			slot->u &= mask;
+		}
+		NEXT;
+
+	VM_OP(SPLITV):
+	VM_OP(SPLIT):
+	VM_OP(SPLITANY):
+	VM_OP(SPLITALL):
+	VM_OP(SPLITONE):
+		{
+			int split;
+			union jvst_vm_stackval *slot;
+
+			if (VM_CHECKED && !ins->a1slot) {
+				PANIC(vm, -1, "SPLIT op with non-slot second argument");
+			}
+
+			split = vm_ival(vm, fp, ins->a0slot, ins->a0, VM_CHECKED);
+			slot = vm_slotptr(vm, fp, ins->a1, VM_CHECKED);
+			if (VM_CHECKED && (split < 0 || (size_t)split >= vm->prog->nsplit)) {
+				PANIC(vm, -1, "SPLIT op with bad split index");
+			}
+
+			ret = vm_split(vm,split,slot,ins->op);
+			if (ret != JVST_VALID) {
+				goto finish;
+			}
+		}
+		NEXT;
+
+	VM_OP(DISPATCH):
+		{
+			union jvst_vm_stackval *slot;
+
+			if (VM_CHECKED && !ins->a1slot) {
+				PANIC(vm, -1, "DISPATCH op with non-slot second argument");
+			}
+
+			if (VM_CHECKED && !verify_disc(vm->prog, ins->a0slot, ins->a0)) {
+				PANIC(vm, -1, "DISPATCH op with invalid table");
+			}
+
+			slot = vm_slotptr(vm, fp, ins->a1, VM_CHECKED);
+			ret = vm_dispatch(vm, &vm->prog->cdata[vm->prog->cdata[ins->a0]], slot);
+			if (ret != JVST_VALID) {
+				goto finish;
+			}
+		}
+		NEXT;
+
+	VM_OP(UNIQUE):
+		switch (ins->a0) {
+		case JVST_VM_UNIQUE_INIT:
+			vm->uniq = vm_uniq_get(vm->owner);
+			break;
+
+		case JVST_VM_UNIQUE_EVAL:
+			{
+				int ret = jvst_vm_uniq_evaluate(vm->uniq, vm->pret, &vm->evt);
+				switch (ret) {
+				case JVST_VALID:
+				case JVST_NEXT:
+				case JVST_MORE:
+					return ret;
+
+				case JVST_INVALID:
+					vm->error = JVST_INVALID_NOT_UNIQUE;
+					ret = JVST_INVALID;
+					goto finish;
+
+				default:
+					PANIC(vm, -1, "unexpected return from jvst_vm_uniq_evaluate");
+				}
+			}
+			break;
+
+		case JVST_VM_UNIQUE_FINAL:
+			vm_uniq_put(vm->owner, vm->uniq);
+			vm->uniq = NULL;
+			break;
+
+		default:
+			PANIC(vm, -1, "invalid arg0 for UNIQUE op");
+		}
+		NEXT;
+
+	VM_OP(BADPC):
+		vm->error = JVST_INVALID_VM_BAD_PC;
+		ret = JVST_INVALID;
+		goto finish;
+
+	VM_OP(BADOP):
+		vm->error = JVST_INVALID_VM_INVALID_OP;
+		return JVST_INVALID;
+	}
+
+	vm->error = JVST_INVALID_VM_INVALID_OP;
+	return JVST_INVALID;
+
+finish:
+	vm->r_pc = pc;
+	vm->r_fp = fp;
+	vm->r_sp = sp;
+	vm->r_flag = flag;
+	return ret;
+}
+#undef NEXT
+#undef BRANCH
+#undef DISPATCH
+#undef VM_OP
+#undef DEBUG_WAIT
+#undef DEBUG_OP
+
+/* vim: set tabstop=8 shiftwidth=8 noexpandtab: */
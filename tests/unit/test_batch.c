@@ -0,0 +1,309 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "validate_testing.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jvst_macros.h"
+
+#include "validate_vm.h"
+#include "validate_batch.h"
+
+struct result_log {
+  size_t n;
+  size_t max;
+  struct jvst_vm_record_result *results;
+  size_t stop_after;  // if non-zero, stop the batch after this many results
+};
+
+static int
+log_result(void *opaque, const struct jvst_vm_record_result *res)
+{
+  struct result_log *log = opaque;
+
+  if (log->n >= log->max) {
+    log->max = log->max ? 2*log->max : 64;
+    log->results = realloc(log->results, log->max * sizeof log->results[0]);
+    assert(log->results != NULL);
+  }
+
+  log->results[log->n++] = *res;
+
+  if (log->stop_after > 0 && log->n >= log->stop_after) {
+    return 5;
+  }
+
+  return 0;
+}
+
+static int
+compare_logs(const char *fname, const char *what, const struct result_log *want, const struct result_log *got)
+{
+  size_t i;
+
+  if (want->n != got->n) {
+    fprintf(stderr, "%s: %s: expected %zu results, found %zu\n", fname, what, want->n, got->n);
+    return 0;
+  }
+
+  for (i=0; i < want->n; i++) {
+    const struct jvst_vm_record_result *w = &want->results[i], *g = &got->results[i];
+
+    if (w->index != g->index || w->offset != g->offset || w->result != g->result || w->error != g->error) {
+      fprintf(stderr, "%s: %s: expected record %zu at %zu to be %d with error %d, "
+          "found record %zu at %zu is %d with error %d\n",
+          fname, what,
+          w->index, w->offset, w->result, w->error,
+          g->index, g->offset, g->result, g->error);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// every JSON text must be an array
+static struct jvst_vm_program *
+array_program(struct arena_info *A)
+{
+  return newvm_program(A,
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_BEG),
+      JVST_OP_JMP, JVST_VM_BR_NE, "invalid",
+      JVST_OP_CONSUME, 0, 0,
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "invalid",
+      JVST_OP_RETURN, VMLIT(7), 0,
+      VM_END);
+}
+
+// A stream of mostly small records with a few large ones, so that
+// chunks take very different amounts of time.
+static char *
+make_stream(size_t nrec, size_t *np)
+{
+  size_t i, j, n, max;
+  char *s;
+
+  max = 4096;
+  s = malloc(max);
+  n = 0;
+
+  for (i=0; i < nrec; i++) {
+    char rec[64];
+    int len;
+
+    switch (i % 7) {
+    case 0:
+      len = snprintf(rec, sizeof rec, "%zu\n", i);
+      break;
+
+    case 3:
+      len = snprintf(rec, sizeof rec, "\n");
+      break;
+
+    case 5:
+      len = snprintf(rec, sizeof rec, "[%zu, {\"a\": [%zu]}] %c\n", i, i, (i % 2) ? 'x' : ' ');
+      break;
+
+    default:
+      len = snprintf(rec, sizeof rec, "[%zu, \"s\"]\n", i);
+      break;
+    }
+
+    if (n + (size_t)len + 8192 >= max) {
+      max *= 2;
+      s = realloc(s, max);
+    }
+
+    memcpy(&s[n], rec, len);
+    n += len;
+
+    if (i % 97 == 0) {
+      s[n++] = '[';
+      for (j=0; j < 1000; j++) {
+        s[n++] = '1';
+        s[n++] = ',';
+      }
+      s[n++] = '1';
+      s[n++] = ']';
+      s[n++] = '\n';
+    }
+  }
+
+  // last record isn't terminated
+  memcpy(&s[n], "[1]", 3);
+  n += 3;
+
+  *np = n;
+  return s;
+}
+
+static void test_batch_records(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  struct jvst_vm_records rs;
+  struct result_log want = { 0 };
+  static const size_t nthreads[] = { 1, 2, 4, 8 };
+  static const size_t chunks[] = { 1, 100, 4096, 0 };
+  size_t i, j, n;
+  char *stream, *copy;
+
+  prog = array_program(&A);
+  stream = make_stream(5000, &n);
+  copy = malloc(n);
+
+  // sequential results to compare against
+  memcpy(copy, stream, n);
+  jvst_vm_records_init(&rs, prog, JVST_VM_RECORD_NDJSON, log_result, &want);
+  jvst_vm_records_more(&rs, copy, n);
+  jvst_vm_records_close(&rs);
+  jvst_vm_records_finalize(&rs);
+
+  for (i=0; i < ARRAYLEN(nthreads); i++) {
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      struct jvst_batch_opts opts = { 0 };
+      struct result_log got = { 0 };
+      char what[64];
+      int ret;
+
+      ntest++;
+
+      opts.nthreads = nthreads[i];
+      opts.chunk = chunks[j];
+      snprintf(what, sizeof what, "%zu threads, %zu byte chunks", opts.nthreads, opts.chunk);
+
+      memcpy(copy, stream, n);
+      ret = jvst_batch_records(prog, &opts, JVST_VM_RECORD_NDJSON, copy, n, log_result, &got);
+      if (ret != 0 || !compare_logs(__func__, what, &want, &got)) {
+        printf("%s: %s: failed\n", __func__, what);
+        nfail++;
+      }
+
+      free(got.results);
+    }
+  }
+
+  // stopping the batch
+  {
+    struct jvst_batch_opts opts = { 0 };
+    struct result_log got = { 0 };
+    int ret;
+
+    ntest++;
+
+    opts.nthreads = 4;
+    opts.chunk = 100;
+    got.stop_after = 10;
+
+    memcpy(copy, stream, n);
+    ret = jvst_batch_records(prog, &opts, JVST_VM_RECORD_NDJSON, copy, n, log_result, &got);
+    if (ret != 5 || got.n != 10 || got.results[9].index != 9) {
+      printf("%s: stop: failed, returned %d after %zu results\n", __func__, ret, got.n);
+      nfail++;
+    }
+
+    free(got.results);
+  }
+
+  free(want.results);
+  free(copy);
+  free(stream);
+}
+
+static void test_batch_files(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  static const char *const docs[] = {
+    "[1,2,3]", "3", "{\"a\":1}", NULL, "[[1],\n[2]]", "[1,",
+  };
+  enum { NDOCS = sizeof docs / sizeof docs[0] };
+  char paths[NDOCS][64];
+  const char *pathv[NDOCS];
+  struct result_log got = { 0 };
+  struct jvst_batch_opts opts = { 0 };
+  size_t i;
+  int ret;
+
+  static const struct {
+    enum jvst_result result;
+    int error;
+  } want[NDOCS] = {
+    { JVST_VALID, 0 },
+    { JVST_INVALID, 7 },
+    { JVST_INVALID, 7 },
+    { JVST_INVALID, JVST_INVALID_IO },
+    { JVST_VALID, 0 },
+    { JVST_INVALID, JVST_INVALID_JSON },
+  };
+
+  prog = array_program(&A);
+
+  for (i=0; i < NDOCS; i++) {
+    FILE *f;
+    int fd;
+
+    pathv[i] = paths[i];
+    strcpy(paths[i], "/tmp/test_batch.XXXXXX");
+
+    fd = mkstemp(paths[i]);
+    assert(fd >= 0);
+
+    if (docs[i] == NULL) {
+      // can't be read
+      close(fd);
+      unlink(paths[i]);
+      continue;
+    }
+
+    f = fdopen(fd, "w");
+    assert(f != NULL);
+    fputs(docs[i], f);
+    fclose(f);
+  }
+
+  ntest++;
+
+  opts.nthreads = 3;
+  ret = jvst_batch_files(prog, &opts, pathv, NDOCS, log_result, &got);
+
+  if (ret != 0 || got.n != NDOCS) {
+    printf("%s: failed, returned %d with %zu results\n", __func__, ret, got.n);
+    nfail++;
+  } else {
+    for (i=0; i < NDOCS; i++) {
+      if (got.results[i].index != i ||
+          got.results[i].result != want[i].result ||
+          got.results[i].error != want[i].error) {
+        printf("%s: file %zu: expected %d with error %d, found file %zu is %d with error %d\n",
+            __func__, i, want[i].result, want[i].error,
+            got.results[i].index, got.results[i].result, got.results[i].error);
+        nfail++;
+        break;
+      }
+    }
+  }
+
+  for (i=0; i < NDOCS; i++) {
+    if (docs[i] != NULL) {
+      unlink(paths[i]);
+    }
+  }
+
+  free(got.results);
+}
+
+int main(void)
+{
+  test_batch_records();
+  test_batch_files();
+
+  return report_tests();
+}
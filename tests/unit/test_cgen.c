@@ -0,0 +1,512 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "validate_testing.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jvst_macros.h"
+
+#include "validate_op.h"
+#include "validate_ir.h"
+#include "validate_vm.h"
+#include "validate_cgen.h"
+
+// how the tests compile generated code, run from the top of the tree
+#ifndef CGEN_CC
+#define CGEN_CC "cc"
+#endif
+
+#ifndef CGEN_CFLAGS
+#define CGEN_CFLAGS "-I share/git/sjp -I src"
+#endif
+
+static char *
+gen(struct jvst_vm_program *prog, const char *prefix, int *retp, char *err, size_t nerr)
+{
+  char *buf = NULL;
+  size_t n = 0;
+  FILE *f;
+
+  f = open_memstream(&buf, &n);
+  assert(f != NULL);
+
+  *retp = jvst_cgen_program(f, prog, prefix, err, nerr);
+  fclose(f);
+
+  return buf;
+}
+
+static int
+has(const char *fname, const char *out, const char *frag)
+{
+  if (strstr(out, frag) == NULL) {
+    fprintf(stderr, "%s: expected generated code to contain:\n%s\n", fname, frag);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void test_cgen_procs(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  char err[256] = { 0 };
+  char *out;
+  int ret;
+
+  static const char *const frags[] = {
+    // one function per proc
+    "static int\nproc0(struct jvst_vm_ctx *vm, uint32_t pc)\n",
+    "static int\nproc1(struct jvst_vm_ctx *vm, uint32_t pc)\n",
+
+    // resume points: proc entry, TOKEN and after the CALL
+    "\tcase 0: goto L0;\n",
+    "\tcase 1: goto L1;\n",
+    "\tcase 8: goto L8;\n",
+
+    // jumps within the proc are gotos
+    "\tif (flag == 0) {\n\t\tgoto L5;\n\t}\n",
+
+    // slots and constants are folded into the code
+    "\tflag = CMP(sl[0].i, 8);\n",
+    "\tsl[4].f = 0x1.8p+0;\n",
+
+    // calls are direct
+    "\tjvst_vm_rt_call(vm, 7);\n",
+    "\tret = proc1(vm, 10);\n",
+
+    "\t[10] = proc1,\n",
+    "struct jvst_vm_program t_program = {\n",
+    "\t.native = run,\n",
+    "void\nt_init(struct jvst_vm *vm)\n",
+    "enum jvst_result\nt_more(struct jvst_vm *vm, char *data, size_t n)\n",
+    "enum jvst_result\nt_close(struct jvst_vm *vm)\n",
+  };
+  size_t i;
+
+  ntest++;
+
+  prog = newvm_program(&A,
+      VM_FLOATS, 1, 1.5,
+      JVST_OP_PROC, VMLIT(1), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_BEG),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "array",
+      JVST_OP_RETURN, VMLIT(7), 0,
+
+      VM_LABEL, "array",
+      JVST_OP_FLOAD, VMSLOT(0), VMLIT(0),
+      JVST_OP_TOKEN, VMLIT(0), VMLIT(-1),
+      JVST_OP_CALL, 2,
+      JVST_OP_CONSUME, 0, 0,
+      JVST_OP_RETURN, 0, 0,
+
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_CONSUME, 0, 0,
+      JVST_OP_RETURN, 0, 0,
+      VM_END);
+
+  out = gen(prog, "t", &ret, err, sizeof err);
+  if (ret != 0) {
+    printf("%s: generating C failed: %s\n", __func__, err);
+    nfail++;
+  } else {
+    for (i=0; i < ARRAYLEN(frags); i++) {
+      if (!has(__func__, out, frags[i])) {
+        nfail++;
+        break;
+      }
+    }
+  }
+
+  free(out);
+}
+
+static void test_cgen_errors(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  char err[256];
+  char *out;
+  int ret;
+
+  // prefix isn't an identifier
+  ntest++;
+
+  prog = newvm_program(&A,
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_CONSUME, 0, 0,
+      JVST_OP_RETURN, 0, 0,
+      VM_END);
+
+  err[0] = '\0';
+  out = gen(prog, "1schema", &ret, err, sizeof err);
+  if (ret == 0 || err[0] == '\0') {
+    printf("%s: expected a bad prefix to fail\n", __func__);
+    nfail++;
+  }
+  free(out);
+
+  // program doesn't verify
+  ntest++;
+
+  prog = newvm_program(&A,
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_MOVE, VMSLOT(3), VMLIT(1),
+      JVST_OP_RETURN, 0, 0,
+      VM_END);
+
+  err[0] = '\0';
+  out = gen(prog, "schema", &ret, err, sizeof err);
+  if (ret == 0 || strstr(err, "does not verify") == NULL) {
+    printf("%s: expected an unverifiable program to fail, error: %s\n", __func__, err);
+    nfail++;
+  }
+  free(out);
+}
+
+static struct jvst_vm_program *
+build(struct jvst_cnode *ctree)
+{
+  struct jvst_ir_stmt *ir;
+  struct jvst_op_program *opprog;
+
+  ir = jvst_ir_translate(jvst_cnode_canonify(jvst_cnode_simplify(ctree)));
+  opprog = jvst_op_optimize(jvst_op_assemble(jvst_ir_flatten(jvst_ir_linearize(ir))));
+
+  return jvst_op_encode(opprog);
+}
+
+// Generates C for prog, compiles it to a shared object in dir and loads
+// it.  Returns the compiled program, or NULL if any step fails.
+static struct jvst_vm_program *
+compile(const char *fname, struct jvst_vm_program *prog, const char *dir,
+    size_t id, void **hp)
+{
+  char src[256], so[256], cmd[1024], err[256] = { 0 };
+  struct jvst_vm_program *cprog;
+  FILE *f;
+  int ret;
+
+  snprintf(src, sizeof src, "%s/p%zu.c", dir, id);
+  snprintf(so, sizeof so, "%s/p%zu.so", dir, id);
+
+  f = fopen(src, "w");
+  assert(f != NULL);
+  ret = jvst_cgen_program(f, prog, "t", err, sizeof err);
+  fclose(f);
+
+  if (ret != 0) {
+    printf("%s[%zu]: generating C failed: %s\n", fname, id, err);
+    unlink(src);
+    return NULL;
+  }
+
+  cprog = NULL;
+
+  snprintf(cmd, sizeof cmd, "%s -std=c99 -fPIC -shared %s -o %s %s -lm",
+      CGEN_CC, CGEN_CFLAGS, so, src);
+  if (system(cmd) != 0) {
+    printf("%s[%zu]: compiling generated C failed\n", fname, id);
+    goto done;
+  }
+
+  *hp = dlopen(so, RTLD_NOW|RTLD_LOCAL);
+  if (*hp == NULL) {
+    printf("%s[%zu]: %s\n", fname, id, dlerror());
+    goto done;
+  }
+
+  cprog = dlsym(*hp, "t_program");
+  if (cprog == NULL) {
+    printf("%s[%zu]: %s\n", fname, id, dlerror());
+  }
+
+done:
+  unlink(so);
+  unlink(src);
+
+  return cprog;
+}
+
+// checks that the generated program carries prog's decoded stream,
+// sizing and dense DFAs, so loading it doesn't build them
+static int
+same_predecode(const struct jvst_vm_program *prog, const struct jvst_vm_program *cprog)
+{
+  size_t i;
+
+  if (cprog->decoded == NULL ||
+      memcmp(cprog->decoded, prog->decoded, (prog->ncode+1) * sizeof prog->decoded[0]) != 0) {
+    return 0;
+  }
+
+  if (cprog->sizing.stack != prog->sizing.stack ||
+      cprog->sizing.split_stack != prog->sizing.split_stack ||
+      cprog->sizing.maxsplit != prog->sizing.maxsplit ||
+      cprog->sizing.nctx != prog->sizing.nctx) {
+    return 0;
+  }
+
+  for (i=0; i < prog->ndfa; i++) {
+    const struct jvst_vm_dfa *a = &prog->dfas[i], *b = &cprog->dfas[i];
+    size_t tblsize = a->nfa ? 0 : (a->nstates+1) * a->nclasses * a->width;
+
+    if (b->ends == NULL || b->nclasses != a->nclasses || b->width != a->width || b->nfa != a->nfa) {
+      return 0;
+    }
+
+    if (memcmp(b->ends, a->ends, a->nstates * sizeof a->ends[0]) != 0 ||
+        memcmp(b->classes, a->classes, 256) != 0 ||
+        (tblsize > 0 && memcmp(b->table, a->table, tblsize) != 0)) {
+      return 0;
+    }
+
+    if (b->pre.nprefix != a->pre.nprefix || b->pre.nsuffix != a->pre.nsuffix ||
+        b->pre.nfactor != a->pre.nfactor ||
+        memcmp(b->pre.prefix, a->pre.prefix, a->pre.nprefix) != 0 ||
+        memcmp(b->pre.suffix, a->pre.suffix, a->pre.nsuffix) != 0 ||
+        memcmp(b->pre.factor, a->pre.factor, a->pre.nfactor) != 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static int
+run_chunked(struct jvst_vm_program *prog, const char *json, size_t chunk, int *errp)
+{
+  struct jvst_vm vm = { 0 };
+  char buf[1024];
+  size_t n, off;
+  int ret;
+
+  n = strlen(json);
+  assert(n < sizeof buf);
+  memcpy(buf, json, n);
+
+  jvst_vm_init_defaults(&vm, prog);
+
+  ret = JVST_MORE;
+  for (off=0; off < n && !JVST_IS_INVALID(ret); off += chunk) {
+    ret = jvst_vm_more(&vm, &buf[off], (n-off < chunk) ? n-off : chunk);
+  }
+  if (!JVST_IS_INVALID(ret)) {
+    ret = jvst_vm_close(&vm);
+  }
+
+  *errp = vm.ctx.error;
+  jvst_vm_finalize(&vm);
+
+  return ret;
+}
+
+static void test_cgen_run(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *progs[4], *cprogs[4] = { NULL };
+  void *handles[4] = { NULL };
+  static const size_t chunks[] = { 1, 1024 };
+  char dir[] = "/tmp/test_cgen.XXXXXX";
+  size_t i, j;
+
+  static const struct {
+    size_t prog;
+    const char *json;
+    int valid;
+  } tests[] = {
+    { 0, "[1,2,3]", 1 },
+    { 0, "[]", 1 },
+    { 0, "[1,2,3,4]", 0 },
+    { 0, "[1,2.5]", 0 },
+    { 0, "[1,\"a\"]", 0 },
+    { 0, "{}", 0 },
+
+    { 1, "[1,2]", 1 },
+    { 1, "[1,\"a\"]", 0 },
+    { 1, "[[1],{\"a\":[2]}]", 1 },
+    { 1, "\"x\"", 1 },
+    { 1, "2", 1 },
+    { 1, "2.5", 0 },
+
+    { 2, "{\"foo\":1,\"bar\":\"x\"}", 1 },
+    { 2, "{\"bar\":\"x\",\"foo\":2.5,\"baz\":[1,{}]}", 1 },
+    { 2, "{\"foo\":\"x\"}", 0 },
+    { 2, "{\"bar\":3}", 0 },
+    { 2, "{\"bar\":\"x\"}", 0 },
+    { 2, "{\"fo\":1,\"foobar\":{},\"foo\":1}", 1 },
+    { 2, "[]", 1 },
+
+    { 3, "[1,2,3]", 1 },
+    { 3, "[1,2,1]", 0 },
+    { 3, "[\"a\",\"b\",{\"a\":1}]", 1 },
+    { 3, "[{\"a\":1,\"b\":2},{\"b\":2,\"a\":1}]", 0 },
+    { 3, "[[1,2],[2,1]]", 1 },
+    { 3, "[[1,2],[1,2]]", 0 },
+    { 3, "3", 0 },
+  };
+
+  // An array of at most three small integers, checked by a proc called
+  // for each item
+  progs[0] = newvm_program(&A,
+      VM_FLOATS, 1, 100.0,
+      JVST_OP_PROC, VMLIT(1), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_BEG),
+      JVST_OP_JMP, JVST_VM_BR_NE, "invalid",
+      VM_LABEL, "loop",
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_END),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "end",
+      JVST_OP_TOKEN, VMLIT(0), VMLIT(-1),
+      JVST_OP_CALL, 2,
+      JVST_OP_INCR, VMSLOT(0), VMLIT(1),
+      JVST_OP_JMP, JVST_VM_BR_ALWAYS, "loop",
+      VM_LABEL, "end",
+      JVST_OP_ICMP, VMSLOT(0), VMLIT(3),
+      JVST_OP_JMP, JVST_VM_BR_GT, "toomany",
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "toomany",
+      JVST_OP_RETURN, VMLIT(9), 0,
+      VM_LABEL, "invalid",
+      JVST_OP_RETURN, VMLIT(7), 0,
+
+      JVST_OP_PROC, VMLIT(1), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_NUMBER),
+      JVST_OP_JMP, JVST_VM_BR_NE, "notnum",
+      JVST_OP_FLOAD, VMSLOT(0), VMLIT(0),
+      JVST_OP_FCMP, VMREG(JVST_VM_TNUM), VMSLOT(0),
+      JVST_OP_JMP, JVST_VM_BR_GE, "big",
+      JVST_OP_FINT, VMREG(JVST_VM_TNUM), VMLIT(0),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "notint",
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "big",
+      JVST_OP_RETURN, VMLIT(10), 0,
+      VM_LABEL, "notint",
+      JVST_OP_RETURN, VMLIT(11), 0,
+      VM_LABEL, "notnum",
+      JVST_OP_RETURN, VMLIT(12), 0,
+      VM_END);
+
+  // anyOf and oneOf, which split the token stream between procs
+  progs[1] = build(newcnode_bool(&A, JVST_CNODE_OR,
+        newcnode_switch(&A, 0,
+          SJP_NUMBER, newcnode(&A, JVST_CNODE_NUM_INTEGER),
+          SJP_STRING, newcnode_valid(),
+          SJP_NONE),
+        newcnode_switch(&A, 0,
+          SJP_ARRAY_BEG, newcnode_bool(&A, JVST_CNODE_XOR,
+            newcnode_items(&A, newcnode_switch(&A, 0,
+                SJP_NUMBER, newcnode(&A, JVST_CNODE_NUM_INTEGER),
+                SJP_NONE), NULL),
+            newcnode_contains(&A, newcnode_switch(&A, 0,
+                SJP_OBJECT_BEG, newcnode_valid(),
+                SJP_NONE)),
+            NULL),
+          SJP_NONE),
+        NULL));
+
+  // properties matched with a DFA, calling a proc for each value
+  progs[2] = build(newcnode_switch(&A, 1,
+        SJP_OBJECT_BEG, newcnode_bool(&A, JVST_CNODE_AND,
+          newcnode_required(&A, stringset(&A, "foo", NULL)),
+          newcnode_propset(&A,
+            newcnode_prop_match(&A, RE_LITERAL, "foo",
+              newcnode_switch(&A, 0, SJP_NUMBER, newcnode_valid(), SJP_NONE)),
+            newcnode_prop_match(&A, RE_LITERAL, "bar",
+              newcnode_switch(&A, 0, SJP_STRING, newcnode_valid(), SJP_NONE)),
+            NULL),
+          NULL),
+        SJP_NONE));
+
+  // uniqueItems
+  progs[3] = build(newcnode_switch(&A, 0,
+        SJP_ARRAY_BEG, newcnode_bool(&A, JVST_CNODE_AND,
+          newcnode(&A, JVST_CNODE_ARR_UNIQUE),
+          newcnode_items(&A, newcnode_switch(&A, 1, SJP_NONE), NULL),
+          NULL),
+        SJP_NONE));
+
+  // skip if there's no compiler to build the generated code with
+  if (system(CGEN_CC " --version >/dev/null 2>&1") != 0) {
+    nskipped++;
+    return;
+  }
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    nskipped++;
+    return;
+  }
+
+  for (i=0; i < ARRAYLEN(progs); i++) {
+    ntest++;
+
+    cprogs[i] = compile(__func__, progs[i], dir, i, &handles[i]);
+    if (cprogs[i] == NULL) {
+      nfail++;
+      continue;
+    }
+
+    ntest++;
+    if (!same_predecode(progs[i], cprogs[i])) {
+      printf("%s[%zu]: generated program doesn't carry its decoded stream and dense DFAs\n",
+          __func__, i);
+      nfail++;
+    }
+  }
+
+  rmdir(dir);
+
+  // the same documents on the interpreter and the generated code
+  for (i=0; i < ARRAYLEN(tests); i++) {
+    struct jvst_vm_program *prog = progs[tests[i].prog];
+    struct jvst_vm_program *cprog = cprogs[tests[i].prog];
+
+    if (cprog == NULL) {
+      continue;
+    }
+
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      int ret[2], err[2];
+
+      ntest++;
+
+      ret[0] = run_chunked(prog, tests[i].json, chunks[j], &err[0]);
+      ret[1] = run_chunked(cprog, tests[i].json, chunks[j], &err[1]);
+
+      if (JVST_IS_INVALID(ret[1]) == tests[i].valid ||
+          ret[0] != ret[1] || err[0] != err[1]) {
+        printf("%s[%zu]: %s: chunk size %zu: expected %s, "
+            "interpreter returned %d with error %d, generated code returned %d with error %d\n",
+            __func__, i+1, tests[i].json, chunks[j],
+            tests[i].valid ? "valid" : "invalid",
+            ret[0], err[0], ret[1], err[1]);
+        nfail++;
+      }
+    }
+  }
+
+  for (i=0; i < ARRAYLEN(handles); i++) {
+    if (handles[i] != NULL) {
+      dlclose(handles[i]);
+    }
+  }
+}
+
+int main(void)
+{
+  test_cgen_procs();
+  test_cgen_errors();
+  test_cgen_run();
+
+  return report_tests();
+}
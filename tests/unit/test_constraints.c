@@ -4224,6 +4224,61 @@ static void test_canonify_patterns(void)
 }
 
 
+static void test_canonify_pattern_cache(void)
+{
+  struct arena_info A = {0};
+  struct jvst_cnode_forest *forest;
+  struct jvst_cnode *expected;
+  size_t i, lookups, hits;
+
+  static const char *const patterns[] = { "a+b.d", "c*", "a+b.d" };
+
+  // the trees of a forest share a cache, so the repeated pattern is
+  // compiled once
+  forest = jvst_cnode_forest_new();
+  for (i=0; i < ARRAYLEN(patterns); i++) {
+    jvst_cnode_forest_add_tree(forest,
+        newcnode_switch(&A, 1,
+          SJP_STRING, newcnode_strmatch(&A, RE_NATIVE, patterns[i]),
+          SJP_NONE));
+  }
+
+  jvst_cnode_simplify_forest(forest);
+  jvst_cnode_canonify_forest(forest);
+
+  ntest++;
+  jvst_cnode_re_cache_stats(&lookups, &hits);
+  if (lookups != 3 || hits != 1) {
+    printf("%s: expected 3 lookups and 1 hit, found %zu and %zu\n",
+        __func__, lookups, hits);
+    nfail++;
+  }
+
+  // each tree has its own copy of the DFA
+  for (i=0; i < ARRAYLEN(patterns); i++) {
+    ntest++;
+
+    expected = newcnode_switch(&A, 1,
+        SJP_STRING, newcnode_mswitch(&A,
+                      newcnode_invalid(),
+
+                      newcnode_mcase(&A,
+                        newmatchset(&A, RE_NATIVE, patterns[i], -1),
+                        newcnode_valid()
+                      ),
+
+                      NULL
+                    ),
+        SJP_NONE);
+
+    if (!cnode_trees_equal(__func__, forest->trees[i], expected)) {
+      printf("%s_%zu: failed\n", __func__, i+1);
+      nfail++;
+    }
+  }
+}
+
+
 static void test_xlate_minmax_items(void)
 {
   struct arena_info A = {0};
@@ -4760,6 +4815,7 @@ int main(void)
   test_canonify_length_constraints();
   test_canonify_required();
   test_canonify_patterns();
+  test_canonify_pattern_cache();
 
   return report_tests();
 }
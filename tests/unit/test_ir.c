@@ -2754,7 +2754,7 @@ void test_ir_dependencies(void)
           newir_if(&A, newir_istok(&A, SJP_OBJECT_BEG),
               newir_if(&A,
                 newir_op(&A, JVST_IR_EXPR_GE, 
-                  newir_split(&A,
+                  newir_splitmode(&A, JVST_IR_SPLIT_ANY, newir_split(&A,
                     newir_frame(&A,
                       newir_matcher(&A, 0, "dfa"),
                       newir_seq(&A,
@@ -2844,7 +2844,7 @@ void test_ir_dependencies(void)
                     ),
 
                     NULL
-                  ),
+                  )),
                   newir_size(&A, 1)
                 ),
                 newir_stmt(&A, JVST_IR_STMT_VALID),
@@ -2920,7 +2920,7 @@ void test_ir_dependencies(void)
           ),
 
           newir_block(&A, 2, "true",
-            newir_move(&A, newir_itemp(&A, 0), newir_split(&A, splitlist, 0)),
+            newir_move(&A, newir_itemp(&A, 0), newir_splitmode(&A, JVST_IR_SPLIT_ANY, newir_split(&A, splitlist, 0))),
             newir_move(&A, newir_itemp(&A, 2), newir_itemp(&A, 0)),
             newir_move(&A, newir_itemp(&A, 1), newir_size(&A, 1)),
 
@@ -3111,7 +3111,7 @@ void test_ir_dependencies(void)
           newir_if(&A, newir_istok(&A, SJP_OBJECT_BEG),
               newir_if(&A,
                 newir_op(&A, JVST_IR_EXPR_GE, 
-                  newir_split(&A,
+                  newir_splitmode(&A, JVST_IR_SPLIT_ANY, newir_split(&A,
                     newir_frame(&A,
                       newir_matcher(&A, 0, "dfa"),
                       newir_seq(&A,
@@ -3211,7 +3211,7 @@ void test_ir_dependencies(void)
                     ),
 
                     NULL
-                  ),
+                  )),
                   newir_size(&A, 1)
                 ),
                 newir_stmt(&A, JVST_IR_STMT_VALID),
@@ -3287,7 +3287,7 @@ void test_ir_dependencies(void)
           ),
 
           newir_block(&A, 2, "true",
-            newir_move(&A, newir_itemp(&A, 0), newir_split(&A, splitlist, 0)),
+            newir_move(&A, newir_itemp(&A, 0), newir_splitmode(&A, JVST_IR_SPLIT_ANY, newir_split(&A, splitlist, 0))),
             newir_move(&A, newir_itemp(&A, 2), newir_itemp(&A, 0)),
             newir_move(&A, newir_itemp(&A, 1), newir_size(&A, 1)),
 
@@ -7252,7 +7252,7 @@ void test_ir_anyof_allof_oneof_1(void)
           newir_if(&A, newir_istok(&A, SJP_STRING),
             newir_if(&A,
               newir_op(&A, JVST_IR_EXPR_GE, 
-                newir_split(&A,
+                newir_splitmode(&A, JVST_IR_SPLIT_ANY, newir_split(&A,
                   newir_frame(&A,
                     newir_seq(&A,
                       newir_stmt(&A, JVST_IR_STMT_CONSUME),
@@ -7284,7 +7284,7 @@ void test_ir_anyof_allof_oneof_1(void)
                     NULL
                   ),
                   NULL
-                ),
+                )),
                 newir_size(&A, 1)
               ),
 
@@ -15,6 +15,7 @@ enum op_test_type {
   NONE =  0,
   ASSEMBLE,
   ENCODE,
+  OPTIMIZE,
 };
 
 struct op_test {
@@ -94,6 +95,18 @@ run_test(const char *fname, const struct op_test *t)
 
     return ret;
 
+  case OPTIMIZE:
+    simplified = jvst_cnode_simplify(t->ctree);
+    canonified = jvst_cnode_canonify(simplified);
+    translated = jvst_ir_translate(canonified);
+    linearized = jvst_ir_linearize(translated);
+    flattened  = jvst_ir_flatten(linearized);
+
+    assembled = jvst_op_assemble(flattened);
+    assembled = jvst_op_optimize(assembled);
+
+    return op_progs_equal(fname, assembled, t->prog);
+
   case STOP:
     break;
   }
@@ -111,6 +124,7 @@ static void report_prog_diff(const char *fname, enum op_test_type type, const ch
 
   switch (type) {
   case ASSEMBLE:
+  case OPTIMIZE:
     pname = "op";
     break;
 
@@ -3246,7 +3260,7 @@ void test_op_dependencies(void)
           newir_if(&A, newir_istok(&A, SJP_OBJECT_BEG),
               newir_if(&A,
                 newir_op(&A, JVST_IR_EXPR_GE, 
-                  newir_split(&A,
+                  newir_splitmode(&A, JVST_IR_SPLIT_ANY, newir_split(&A,
                     newir_frame(&A,
                       newir_matcher(&A, 0, "dfa"),
                       newir_seq(&A,
@@ -3336,7 +3350,7 @@ void test_op_dependencies(void)
                     ),
 
                     NULL
-                  ),
+                  )),
                   newir_size(&A, 1)
                 ),
                 newir_stmt(&A, JVST_IR_STMT_VALID),
@@ -3384,7 +3398,7 @@ void test_op_dependencies(void)
             newop_return(&A, 0),
 
             oplabel, "true_2",
-            newop_instr2(&A, JVST_OP_SPLIT, oparg_lit(0), oparg_slot(3)),
+            newop_instr2(&A, JVST_OP_SPLITANY, oparg_lit(0), oparg_slot(3)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(0), oparg_slot(3)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(2), oparg_slot(0)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(1), oparg_lit(1)),
@@ -3510,7 +3524,7 @@ void test_op_dependencies(void)
           newir_if(&A, newir_istok(&A, SJP_OBJECT_BEG),
               newir_if(&A,
                 newir_op(&A, JVST_IR_EXPR_GE, 
-                  newir_split(&A,
+                  newir_splitmode(&A, JVST_IR_SPLIT_ANY, newir_split(&A,
                     newir_frame(&A,
                       newir_matcher(&A, 0, "dfa"),
                       newir_seq(&A,
@@ -3600,7 +3614,7 @@ void test_op_dependencies(void)
                     ),
 
                     NULL
-                  ),
+                  )),
                   newir_size(&A, 1)
                 ),
                 newir_stmt(&A, JVST_IR_STMT_VALID),
@@ -3641,7 +3655,7 @@ void test_op_dependencies(void)
             newop_return(&A, 0),
 
             oplabel, "true_2",
-            newop_instr2(&A, JVST_OP_SPLIT, oparg_lit(0), oparg_slot(3)),
+            newop_instr2(&A, JVST_OP_SPLITANY, oparg_lit(0), oparg_slot(3)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(0), oparg_slot(3)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(2), oparg_slot(0)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(1), oparg_lit(1)),
@@ -3769,7 +3783,7 @@ void test_op_dependencies(void)
           JVST_OP_RETURN, 0, 0,
 
           VM_LABEL, "true_2",
-          JVST_OP_SPLIT, VMLIT(0), VMSLOT(3),
+          JVST_OP_SPLITANY, VMLIT(0), VMSLOT(3),
           JVST_OP_MOVE, VMSLOT(0), VMSLOT(3),
           JVST_OP_MOVE, VMSLOT(2), VMSLOT(0),
           JVST_OP_MOVE, VMSLOT(1), VMLIT(1),
@@ -3879,7 +3893,7 @@ void test_op_dependencies(void)
           newir_if(&A, newir_istok(&A, SJP_OBJECT_BEG),
               newir_if(&A,
                 newir_op(&A, JVST_IR_EXPR_GE, 
-                  newir_split(&A,
+                  newir_splitmode(&A, JVST_IR_SPLIT_ANY, newir_split(&A,
                     newir_frame(&A,
                       newir_matcher(&A, 0, "dfa"),
                       newir_seq(&A,
@@ -3979,7 +3993,7 @@ void test_op_dependencies(void)
                     ),
 
                     NULL
-                  ),
+                  )),
                   newir_size(&A, 1)
                 ),
                 newir_stmt(&A, JVST_IR_STMT_VALID),
@@ -4001,6 +4015,9 @@ void test_op_dependencies(void)
       ),
 
       newop_program(&A,
+          opconst, (int64_t)4,
+          opconst, (int64_t)0, opconst, (int64_t)0, opconst, (int64_t)0,
+          opconst, (int64_t)0, opconst, (int64_t)0,
           opsplit, 2, 1, 2,
           opdfa, 2,
 
@@ -4027,7 +4044,7 @@ void test_op_dependencies(void)
             newop_return(&A, 0),
 
             oplabel, "true_2",
-            newop_instr2(&A, JVST_OP_SPLIT, oparg_lit(0), oparg_slot(3)),
+            newop_instr2(&A, JVST_OP_SPLITANY, oparg_lit(0), oparg_slot(3)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(0), oparg_slot(3)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(2), oparg_slot(0)),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(1), oparg_lit(1)),
@@ -4088,20 +4105,9 @@ void test_op_dependencies(void)
             oplabel, "false_5",
             newop_match(&A, 1),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(1), oparg_m()),
-            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(1), oparg_lit(0)),
-            newop_br(&A, JVST_VM_BR_EQ, "M_7"),
-
-            oplabel, "M_next_8",
-            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(1), oparg_lit(1)),
-            newop_br(&A, JVST_VM_BR_EQ, "M_9"),
-
-            oplabel, "M_next_10",
-            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(1), oparg_lit(2)),
-            newop_br(&A, JVST_VM_BR_EQ, "M_11"),
-
-            oplabel, "M_next_12",
-            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(1), oparg_lit(3)),
-            newop_br(&A, JVST_VM_BR_EQ, "M_13"),
+            newop_switch(&A, oparg_slot(1), 0, "invalid_9_14",
+              "M_7", "M_9", "M_11", "M_13",
+              NULL),
 
             oplabel, "invalid_9_14",
             newop_return(&A, 9),
@@ -4392,6 +4398,9 @@ void test_op_dependencies(void)
       ),
 
       newop_program(&A,
+          opconst, (int64_t)4,
+          opconst, (int64_t)0, opconst, (int64_t)0, opconst, (int64_t)0,
+          opconst, (int64_t)0, opconst, (int64_t)0,
           opsplit, 4, 1,2,3,4,
           opdfa, 4,
 
@@ -4496,20 +4505,9 @@ void test_op_dependencies(void)
             oplabel, "false_5",
             newop_match(&A, 1),
             newop_load(&A, JVST_OP_MOVE, oparg_slot(1), oparg_m()),
-            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(1), oparg_lit(0)),
-            newop_br(&A, JVST_VM_BR_EQ, "M_7"),
-
-            oplabel, "M_next_8",
-            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(1), oparg_lit(1)),
-            newop_br(&A, JVST_VM_BR_EQ, "M_9"),
-
-            oplabel, "M_next_10",
-            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(1), oparg_lit(2)),
-            newop_br(&A, JVST_VM_BR_EQ, "M_11"),
-
-            oplabel, "M_next_12",
-            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(1), oparg_lit(3)),
-            newop_br(&A, JVST_VM_BR_EQ, "M_13"),
+            newop_switch(&A, oparg_slot(1), 0, "invalid_9_14",
+              "M_7", "M_9", "M_11", "M_13",
+              NULL),
 
             oplabel, "invalid_9_14",
             newop_return(&A, 9),
@@ -4918,6 +4916,736 @@ void test_op_unique_1(void)
   RUNTESTS(tests);
 }
 
+/* Hand-written programs branch to labels, the optimizer wants branches
+ * to instructions like the assembler leaves them
+ */
+static void
+resolve_labels(struct jvst_op_program *prog)
+{
+  struct jvst_op_proc *proc;
+  struct jvst_op_instr *instr, *dest;
+
+  for (proc = prog->procs; proc != NULL; proc = proc->next) {
+    for (instr = proc->ilist; instr != NULL; instr = instr->next) {
+      if (instr->op != JVST_OP_JMP || instr->args[1].type != JVST_VM_ARG_LABEL) {
+        continue;
+      }
+
+      for (dest = proc->ilist; dest != NULL; dest = dest->next) {
+        if (dest->label != NULL && strcmp(dest->label, instr->args[1].u.label) == 0) {
+          break;
+        }
+      }
+
+      assert(dest != NULL);
+      instr->args[1].type = JVST_VM_ARG_INSTR;
+      instr->args[1].u.dest = dest;
+    }
+  }
+}
+
+static void test_op_optimize(void)
+{
+  struct arena_info A = {0};
+
+  const struct op_test tests[] = {
+    {
+      // copy of %TN is propagated into the FCMP, and the MOVE is
+      // removed
+      OPTIMIZE,
+      newcnode_switch(&A, 0,
+          SJP_NUMBER, newcnode_range(&A, JVST_CNODE_RANGE_MIN, 1.1, 0.0),
+          SJP_NONE),
+
+      newir_frame(&A,
+          newir_stmt(&A, JVST_IR_STMT_TOKEN),
+          newir_if(&A, newir_istok(&A, SJP_NUMBER),
+            newir_if(&A,
+              newir_op(&A, JVST_IR_EXPR_GE,
+                newir_expr(&A, JVST_IR_EXPR_TOK_NUM),
+                newir_num(&A, 1.1)),
+              newir_seq(&A,
+                newir_stmt(&A, JVST_IR_STMT_CONSUME),
+                newir_stmt(&A, JVST_IR_STMT_VALID),
+                NULL
+              ),
+              newir_invalid(&A, JVST_INVALID_NUMBER, "number not valid")),
+            newir_invalid(&A, JVST_INVALID_UNEXPECTED_TOKEN, "unexpected token")
+          ),
+          NULL
+      ),
+
+      newop_program(&A,
+          opfloat, 1.1,
+
+          newop_proc(&A,
+            opslots, 2,
+
+            oplabel, "entry_0",
+            newop_instr(&A, JVST_OP_TOKEN),
+            newop_cmp(&A, JVST_OP_ICMP, oparg_tt(), oparg_tok(SJP_NUMBER)),
+            newop_br(&A, JVST_VM_BR_EQ, "true_2"),
+
+            oplabel, "invalid_1_9",
+            newop_return(&A, 1),
+
+            oplabel, "true_2",
+            newop_load(&A, JVST_OP_FLOAD, oparg_slot(0), oparg_lit(0)),
+            newop_cmp(&A, JVST_OP_FCMP, oparg_tnum(), oparg_slot(0)),
+            newop_br(&A, JVST_VM_BR_GE, "true_4"),
+
+            oplabel, "invalid_3_7",
+            newop_return(&A, 3),
+
+            oplabel, "true_4",
+            newop_instr(&A, JVST_OP_CONSUME),
+
+            oplabel, "valid_5",
+            newop_return(&A, 0),
+
+            NULL
+          ),
+
+          NULL
+      ),
+    },
+
+    {
+      // chain of copies into the comparison collapses, and the
+      // temporaries are never read
+      OPTIMIZE,
+      newcnode_switch(&A, 0,
+        SJP_NUMBER, newcnode_bool(&A, JVST_CNODE_XOR,
+          newcnode(&A,JVST_CNODE_NUM_INTEGER),
+          newcnode_range(&A, JVST_CNODE_RANGE_MIN, 2.0, 0.0),
+          NULL),
+        SJP_NONE),
+
+      newir_frame(&A,
+          newir_counter(&A, 0, "xor_num"),
+          newir_stmt(&A, JVST_IR_STMT_TOKEN),
+          newir_if(&A, newir_istok(&A, SJP_NUMBER),
+            newir_seq(&A,
+              newir_if(&A,
+                newir_op(&A, JVST_IR_EXPR_GE,
+                  newir_expr(&A, JVST_IR_EXPR_TOK_NUM),
+                  newir_num(&A, 2.0)
+                ),
+                newir_incr(&A, 0, "xor_num"),
+                newir_stmt(&A, JVST_IR_STMT_NOP)
+              ),
+
+              newir_if(&A,
+                newir_isint(&A, newir_expr(&A, JVST_IR_EXPR_TOK_NUM)),
+                newir_incr(&A, 0, "xor_num"),
+                newir_stmt(&A, JVST_IR_STMT_NOP)
+              ),
+
+              newir_if(&A,
+                newir_op(&A, JVST_IR_EXPR_EQ,
+                  newir_count(&A, 0, "xor_num"),
+                  newir_size(&A, 1)
+                ),
+                newir_stmt(&A, JVST_IR_STMT_VALID),
+                newir_invalid(&A, JVST_INVALID_NUMBER, "number not valid")
+              ),
+
+              NULL
+            ),
+            newir_invalid(&A, JVST_INVALID_UNEXPECTED_TOKEN, "unexpected token")
+          ),
+          NULL
+      ),
+
+      newop_program(&A,
+          opfloat, 2.0,
+
+          newop_proc(&A,
+            opslots, 6,
+
+            oplabel, "entry_0",
+            newop_instr(&A, JVST_OP_TOKEN),
+            newop_cmp(&A, JVST_OP_ICMP, oparg_tt(), oparg_tok(SJP_NUMBER)),
+            newop_br(&A, JVST_VM_BR_EQ, "true_2"),
+
+            oplabel, "invalid_1_15",
+            newop_return(&A, 1),
+
+            oplabel, "true_2",
+            newop_load(&A, JVST_OP_FLOAD, oparg_slot(1), oparg_lit(0)),
+            newop_cmp(&A, JVST_OP_FCMP, oparg_tnum(), oparg_slot(1)),
+            newop_br(&A, JVST_VM_BR_GE, "true_4"),
+
+            oplabel, "join_3",
+            newop_cmp(&A, JVST_OP_FINT, oparg_tnum(), oparg_none()),
+            newop_br(&A, JVST_VM_BR_NE, "true_7"),
+
+            oplabel, "join_6",
+            newop_cmp(&A, JVST_OP_ICMP, oparg_slot(0), oparg_lit(1)),
+            newop_br(&A, JVST_VM_BR_EQ, "valid_11"),
+
+            oplabel, "invalid_3_13",
+            newop_return(&A, 3),
+
+            oplabel, "true_4",
+            newop_incr(&A, 0),
+            newop_br(&A, JVST_VM_BR_ALWAYS, "join_3"),
+
+            oplabel, "true_7",
+            newop_incr(&A, 0),
+            newop_br(&A, JVST_VM_BR_ALWAYS, "join_6"),
+
+            oplabel, "valid_11",
+            newop_return(&A, 0),
+
+            NULL
+          ),
+
+          NULL
+      ),
+    },
+
+    { STOP },
+  };
+
+  RUNTESTS(tests);
+}
+
+static void test_op_optimize_branches(void)
+{
+  struct arena_info A = {0};
+  struct jvst_op_program *prog, *expected;
+  size_t n;
+
+  ntest++;
+
+  prog = newop_program(&A,
+      newop_proc(&A,
+        opslots, 1,
+
+        oplabel, "entry_0",
+        newop_instr(&A, JVST_OP_TOKEN),
+        newop_load(&A, JVST_OP_MOVE, oparg_slot(0), oparg_lit(3)),
+        newop_cmp(&A, JVST_OP_ICMP, oparg_slot(0), oparg_lit(2)),
+        newop_br(&A, JVST_VM_BR_GT, "big"),
+
+        oplabel, "small",
+        newop_return(&A, 1),
+
+        oplabel, "big",
+        newop_cmp(&A, JVST_OP_ICMP, oparg_tt(), oparg_tok(SJP_STRING)),
+        newop_br(&A, JVST_VM_BR_EQ, "str"),
+        newop_br(&A, JVST_VM_BR_ALWAYS, "other"),
+
+        oplabel, "str",
+        newop_instr(&A, JVST_OP_CONSUME),
+        newop_return(&A, 0),
+
+        oplabel, "other",
+        newop_cmp(&A, JVST_OP_ICMP, oparg_tt(), oparg_tok(SJP_NUMBER)),
+        newop_br(&A, JVST_VM_BR_EQ, "str"),
+
+        oplabel, "bad",
+        newop_return(&A, 1),
+
+        NULL
+      ),
+
+      NULL
+  );
+
+  // the comparison with a constant is folded away with the branch
+  // it decides, leaving the first RETURN unreachable, and the branch
+  // around the jump to "other" is inverted
+  expected = newop_program(&A,
+      newop_proc(&A,
+        opslots, 1,
+
+        oplabel, "entry_0",
+        newop_instr(&A, JVST_OP_TOKEN),
+
+        oplabel, "big",
+        newop_cmp(&A, JVST_OP_ICMP, oparg_tt(), oparg_tok(SJP_STRING)),
+        newop_br(&A, JVST_VM_BR_NE, "other"),
+
+        oplabel, "str",
+        newop_instr(&A, JVST_OP_CONSUME),
+        newop_return(&A, 0),
+
+        oplabel, "other",
+        newop_cmp(&A, JVST_OP_ICMP, oparg_tt(), oparg_tok(SJP_NUMBER)),
+        newop_br(&A, JVST_VM_BR_EQ, "str"),
+
+        oplabel, "bad",
+        newop_return(&A, 1),
+
+        NULL
+      ),
+
+      NULL
+  );
+
+  resolve_labels(prog);
+  n = jvst_op_count(prog);
+
+  jvst_op_optimize(prog);
+  if (!op_progs_equal(__func__, prog, expected)) {
+    nfail++;
+    return;
+  }
+
+  if (n != 13 || jvst_op_count(prog) != 8) {
+    printf("%s: expected 13 instructions optimized to 8, found %zu optimized to %zu\n",
+        __func__, n, jvst_op_count(prog));
+    nfail++;
+  }
+}
+
+static void test_op_switch(void)
+{
+  struct arena_info A = {0};
+  struct jvst_cnode *ctree;
+  struct jvst_ir_stmt *ir;
+  struct jvst_op_program *prog, *expected;
+  struct jvst_op_instr *instr;
+  struct jvst_vm_program *vmprog;
+  char err[256] = { 0 };
+
+  ntest++;
+
+  ctree = newcnode_switch(&A, 0,
+      SJP_NULL, newcnode_valid(),
+      SJP_TRUE, newcnode_valid(),
+      SJP_FALSE, newcnode_valid(),
+      SJP_NUMBER, newcnode(&A, JVST_CNODE_NUM_INTEGER),
+      SJP_NONE);
+
+  // the chain of token type tests is a single SWITCH, and the
+  // compares it replaced aren't assembled
+  expected = newop_program(&A,
+      opconst, (int64_t)6,
+      opconst, (int64_t)0, opconst, (int64_t)0, opconst, (int64_t)0,
+      opconst, (int64_t)0, opconst, (int64_t)0, opconst, (int64_t)0,
+      opconst, (int64_t)0,
+
+      newop_proc(&A,
+        oplabel, "entry_0",
+        newop_instr(&A, JVST_OP_TOKEN),
+        newop_switch(&A, oparg_tt(), 0, "invalid_1_18",
+          "invalid_1_18", "true_2", "true_6", "true_9", "invalid_1_18", "true_12",
+          NULL),
+
+        oplabel, "invalid_1_18",
+        newop_return(&A, 1),
+
+        oplabel, "true_2",
+        newop_instr(&A, JVST_OP_CONSUME),
+
+        oplabel, "valid_3",
+        newop_return(&A, 0),
+
+        oplabel, "true_6",
+        newop_instr(&A, JVST_OP_CONSUME),
+        newop_return(&A, 0),
+
+        oplabel, "true_9",
+        newop_instr(&A, JVST_OP_CONSUME),
+        newop_return(&A, 0),
+
+        oplabel, "true_12",
+        newop_cmp(&A, JVST_OP_FINT, oparg_tnum(), oparg_none()),
+        newop_br(&A, JVST_VM_BR_NE, "true_14"),
+
+        oplabel, "invalid_2_16",
+        newop_return(&A, 2),
+
+        oplabel, "true_14",
+        newop_instr(&A, JVST_OP_CONSUME),
+        newop_return(&A, 0),
+
+        NULL
+      ),
+
+      NULL
+  );
+
+  ir = jvst_ir_translate(jvst_cnode_canonify(jvst_cnode_simplify(ctree)));
+  prog = jvst_op_assemble(jvst_ir_flatten(jvst_ir_linearize(ir)));
+
+  // the assembler drops the compares itself, without the optimizer
+  for (instr = prog->procs->ilist; instr != NULL; instr = instr->next) {
+    if (instr->op == JVST_OP_ICMP && instr->args[0].type == JVST_VM_ARG_TT) {
+      printf("%s: compare of %%TT left after the SWITCH\n", __func__);
+      nfail++;
+      return;
+    }
+  }
+
+  prog = jvst_op_optimize(prog);
+  if (!op_progs_equal(__func__, prog, expected)) {
+    nfail++;
+    return;
+  }
+
+  // the encoder fills in the table: the default and the SJP_NONE
+  // case share a destination, the SJP_NULL case has its own
+  vmprog = jvst_op_encode(prog);
+  if (jvst_vm_program_verify(vmprog, err, sizeof err) != 0) {
+    printf("%s: encoded program does not verify: %s\n", __func__, err);
+    nfail++;
+  } else if (vmprog->cdata[0] != 6 || vmprog->cdata[1] != vmprog->cdata[2] ||
+      vmprog->cdata[1] == vmprog->cdata[3]) {
+    printf("%s: jump table was not filled in\n", __func__);
+    nfail++;
+  }
+
+  jvst_vm_program_free(vmprog);
+}
+
+static void test_op_intern(void)
+{
+  struct arena_info A = {0};
+  struct jvst_cnode *ctree;
+  struct jvst_ir_stmt *ir;
+  struct jvst_op_program *prog;
+  struct jvst_op_proc *proc;
+  struct jvst_op_instr *instr;
+  struct jvst_op_pool_sizes sizes;
+  size_t nfload;
+
+  ntest++;
+
+  // both items have the same minimum
+  ctree = newcnode_switch(&A, 0,
+      SJP_ARRAY_BEG, newcnode_items(&A,
+                       NULL,
+                       newcnode_switch(&A, 0,
+                         SJP_NUMBER, newcnode_range(&A, JVST_CNODE_RANGE_MIN, 1.5, 0.0),
+                         SJP_NONE),
+                       newcnode_switch(&A, 0,
+                         SJP_NUMBER, newcnode_range(&A, JVST_CNODE_RANGE_EXCL_MIN, 1.5, 0.0),
+                         SJP_NONE),
+                       NULL),
+      SJP_NONE);
+
+  ir = jvst_ir_translate(jvst_cnode_canonify(jvst_cnode_simplify(ctree)));
+  prog = jvst_op_assemble(jvst_ir_flatten(jvst_ir_linearize(ir)));
+
+  nfload = 0;
+  for (proc = prog->procs; proc != NULL; proc = proc->next) {
+    for (instr = proc->ilist; instr != NULL; instr = instr->next) {
+      if (instr->op != JVST_OP_FLOAD) {
+        continue;
+      }
+
+      nfload++;
+      if (instr->args[1].type != JVST_VM_ARG_CONST || instr->args[1].u.index != 0) {
+        printf("%s: FLOAD does not load the first float\n", __func__);
+        nfail++;
+        return;
+      }
+    }
+  }
+
+  jvst_op_pool_sizes(prog, &sizes);
+  if (nfload != 2 || sizes.nfloat != 1 || prog->uninterned.nfloat != 2 ||
+      prog->fdata[0] != 1.5) {
+    printf("%s: expected 2 FLOADs of one float, found %zu FLOADs of %zu floats (%zu before interning)\n",
+        __func__, nfload, sizes.nfloat, prog->uninterned.nfloat);
+    nfail++;
+  }
+}
+
+static void test_op_enum(void)
+{
+  static const struct ast_string_set zero;
+  struct arena_info A = {0};
+  struct ast_string_set sset;
+  struct ast_schema *schema;
+  struct jvst_ir_stmt *ir;
+  struct jvst_op_program *prog;
+  struct jvst_op_proc *proc;
+  struct jvst_op_instr *instr;
+  struct jvst_vm_program *vmprog;
+  char err[256] = { 0 };
+  size_t i, nenum;
+
+  static const struct {
+    const char *json;
+    int error;
+  } docs[] = {
+    { "\"AO\"", 0 },
+    { "978", 0 },
+    { "978.0", 0 },
+    { "null", 0 },
+    { "{\"n\":[1,2],\"code\":\"X\"}", 0 },
+    { "[\"a\",1]", 0 },
+    { "\"AX\"", JVST_INVALID_NOT_IN_ENUM },
+    { "841", JVST_INVALID_NOT_IN_ENUM },
+    { "{\"code\":\"X\"}", JVST_INVALID_NOT_IN_ENUM },
+    { "[1,\"a\"]", JVST_INVALID_NOT_IN_ENUM },
+    { "true", JVST_INVALID_UNEXPECTED_TOKEN },
+  };
+
+  schema = newschema_p(&A, 0,
+      "enum", newjson_str(&A, "AD"),
+      "enum", newjson_str(&A, "AE"),
+      "enum", newjson_str(&A, "AF"),
+      "enum", newjson_str(&A, "AG"),
+      "enum", newjson_str(&A, "AI"),
+      "enum", newjson_str(&A, "AL"),
+      "enum", newjson_str(&A, "AM"),
+      "enum", newjson_str(&A, "AO"),
+      "enum", newjson_num(&A, 840.0),
+      "enum", newjson_num(&A, 978.0),
+      "enum", newjson_null(&A),
+      "enum", newjson_object(&A,
+                "code", newjson_str(&A, "X"),
+                "n", newjson_array(&A, newjson_num(&A, 1.0), newjson_num(&A, 2.0), NULL),
+                NULL),
+      "enum", newjson_array(&A, newjson_str(&A, "a"), newjson_num(&A, 1.0), NULL),
+      NULL);
+
+  sset = zero;
+  sset.str.s = "http://example.com/root.json";
+  sset.str.len = strlen(sset.str.s);
+  schema->all_ids = &sset;
+
+  // a large enum is one ENUM for each type of member, instead of
+  // a SPLIT over every member
+  ntest++;
+
+  ir = jvst_ir_translate(jvst_cnode_from_ast(schema));
+  prog = jvst_op_assemble(jvst_ir_flatten(jvst_ir_linearize(ir)));
+  prog = jvst_op_optimize(prog);
+
+  nenum = 0;
+  for (proc = prog->procs; proc != NULL; proc = proc->next) {
+    for (instr = proc->ilist; instr != NULL; instr = instr->next) {
+      if (instr->op == JVST_OP_SPLIT || instr->op == JVST_OP_SPLITANY) {
+        printf("%s: enum has a SPLIT\n", __func__);
+        nfail++;
+        return;
+      }
+
+      nenum += (instr->op == JVST_OP_ENUM);
+    }
+  }
+
+  if (nenum != 4) {
+    printf("%s: expected 4 ENUMs, found %zu\n", __func__, nenum);
+    nfail++;
+    return;
+  }
+
+  vmprog = jvst_op_encode(prog);
+  if (jvst_vm_program_verify(vmprog, err, sizeof err) != 0) {
+    printf("%s: encoded program does not verify: %s\n", __func__, err);
+    nfail++;
+    jvst_vm_program_free(vmprog);
+    return;
+  }
+
+  for (i=0; i < ARRAYLEN(docs); i++) {
+    struct jvst_vm vm = { 0 };
+    char buf[256];
+    size_t n;
+    int ret;
+
+    ntest++;
+
+    n = strlen(docs[i].json);
+    assert(n < sizeof buf);
+    memcpy(buf, docs[i].json, n);
+
+    jvst_vm_init_defaults(&vm, vmprog);
+    ret = jvst_vm_more(&vm, buf, n);
+    if (!JVST_IS_INVALID(ret)) {
+      ret = jvst_vm_close(&vm);
+    }
+
+    if (JVST_IS_INVALID(ret) != (docs[i].error != 0) ||
+        (docs[i].error != 0 && vm.ctx.error != docs[i].error)) {
+      printf("%s: %s: expected error %d, but result is %d with error %d\n",
+          __func__, docs[i].json, docs[i].error, ret, vm.ctx.error);
+      nfail++;
+    }
+
+    jvst_vm_finalize(&vm);
+  }
+
+  jvst_vm_program_free(vmprog);
+}
+
+struct dispatch_doc {
+  const char *json;
+  int valid;
+};
+
+static void
+check_dispatch(const char *name, struct ast_schema *schema,
+    const struct dispatch_doc *docs, size_t ndocs)
+{
+  static const struct ast_string_set zero;
+  struct ast_string_set sset;
+  struct jvst_ir_stmt *ir;
+  struct jvst_op_program *prog;
+  struct jvst_op_proc *proc;
+  struct jvst_op_instr *instr;
+  struct jvst_vm_program *vmprog;
+  char err[256] = { 0 };
+  size_t i, ndispatch;
+
+  sset = zero;
+  sset.str.s = "http://example.com/root.json";
+  sset.str.len = strlen(sset.str.s);
+  schema->all_ids = &sset;
+
+  // the union is one DISPATCH instead of a split over every branch
+  ntest++;
+
+  ir = jvst_ir_translate(jvst_cnode_from_ast(schema));
+  prog = jvst_op_assemble(jvst_ir_flatten(jvst_ir_linearize(ir)));
+  prog = jvst_op_optimize(prog);
+
+  ndispatch = 0;
+  for (proc = prog->procs; proc != NULL; proc = proc->next) {
+    for (instr = proc->ilist; instr != NULL; instr = instr->next) {
+      ndispatch += (instr->op == JVST_OP_DISPATCH);
+    }
+  }
+
+  if (ndispatch != 1) {
+    printf("%s: expected 1 DISPATCH, found %zu\n", name, ndispatch);
+    nfail++;
+    return;
+  }
+
+  vmprog = jvst_op_encode(prog);
+  if (jvst_vm_program_verify(vmprog, err, sizeof err) != 0) {
+    printf("%s: encoded program does not verify: %s\n", name, err);
+    nfail++;
+    jvst_vm_program_free(vmprog);
+    return;
+  }
+
+  for (i=0; i < ndocs; i++) {
+    struct jvst_vm vm = { 0 };
+    char buf[256];
+    size_t n;
+    int ret;
+
+    ntest++;
+
+    n = strlen(docs[i].json);
+    assert(n < sizeof buf);
+    memcpy(buf, docs[i].json, n);
+
+    jvst_vm_init_defaults(&vm, vmprog);
+    ret = jvst_vm_more(&vm, buf, n);
+    if (!JVST_IS_INVALID(ret)) {
+      ret = jvst_vm_close(&vm);
+    }
+
+    if (JVST_IS_INVALID(ret) == docs[i].valid) {
+      printf("%s: %s: expected %s, but result is %d with error %d\n",
+          name, docs[i].json, docs[i].valid ? "valid" : "invalid", ret, vm.ctx.error);
+      nfail++;
+    }
+
+    jvst_vm_finalize(&vm);
+  }
+
+  jvst_vm_program_free(vmprog);
+}
+
+static void test_op_dispatch(void)
+{
+  struct arena_info A = {0};
+  struct ast_schema *schema;
+
+  static const struct dispatch_doc oneof_docs[] = {
+    { "{\"kind\":\"circle\",\"r\":1}", 1 },
+    { "{\"r\":1,\"kind\":\"circle\"}", 1 },
+    { "{\"kind\":\"square\",\"side\":2}", 1 },
+    { "{\"kind\":\"tri\",\"base\":3}", 1 },
+    { "{\"a\":{\"kind\":\"circle\"},\"b\":[1,{\"kind\":\"x\"}],\"kind\":\"triangle\",\"base\":3}", 1 },
+    { "{\"kind\":\"circle\",\"r\":\"x\"}", 0 },
+    { "{\"kind\":\"circle\"}", 0 },
+    { "{\"kind\":\"hexagon\",\"r\":1}", 0 },
+    { "{\"kind\":1,\"r\":1}", 0 },
+    { "{\"kind\":{\"kind\":\"circle\"},\"r\":1}", 0 },
+    { "{\"r\":1}", 0 },
+    { "{}", 0 },
+    { "\"circle\"", 0 },
+  };
+
+  static const struct dispatch_doc anyof_docs[] = {
+    { "{\"type\":\"a\",\"x\":1}", 1 },
+    { "{\"x\":\"s\",\"type\":\"b\"}", 1 },
+    { "{\"type\":\"a\",\"x\":\"s\"}", 0 },
+    { "{\"type\":\"c\"}", 0 },
+    { "{\"type\":null}", 0 },
+
+    // without the discriminator, every branch is tried
+    { "{\"x\":1}", 1 },
+    { "{\"x\":\"s\",\"y\":[{}]}", 1 },
+    { "{\"x\":true}", 0 },
+    { "{}", 1 },
+    { "[1]", 1 },
+  };
+
+  schema = newschema_p(&A, 0,
+      "oneOf", schema_set(&A,
+        newschema_p(&A, JSON_VALUE_OBJECT,
+          "properties", newprops(&A,
+            "kind", newschema_p(&A, 0, "const", newjson_str(&A, "circle"), NULL),
+            "r", newschema(&A, JSON_VALUE_NUMBER),
+            NULL),
+          "required", stringset(&A, "kind", "r", NULL),
+          NULL),
+        newschema_p(&A, JSON_VALUE_OBJECT,
+          "properties", newprops(&A,
+            "kind", newschema_p(&A, 0, "const", newjson_str(&A, "square"), NULL),
+            "side", newschema(&A, JSON_VALUE_NUMBER),
+            NULL),
+          "required", stringset(&A, "kind", NULL),
+          NULL),
+        newschema_p(&A, JSON_VALUE_OBJECT,
+          "properties", newprops(&A,
+            "kind", newschema_p(&A, 0,
+              "enum", newjson_str(&A, "triangle"),
+              "enum", newjson_str(&A, "tri"),
+              NULL),
+            "base", newschema(&A, JSON_VALUE_NUMBER),
+            NULL),
+          "required", stringset(&A, "kind", "base", NULL),
+          NULL),
+        NULL),
+      NULL);
+
+  check_dispatch("test_op_dispatch (oneOf)", schema, oneof_docs, ARRAYLEN(oneof_docs));
+
+  schema = newschema_p(&A, 0,
+      "anyOf", schema_set(&A,
+        newschema_p(&A, 0,
+          "properties", newprops(&A,
+            "type", newschema_p(&A, 0, "const", newjson_str(&A, "a"), NULL),
+            "x", newschema(&A, JSON_VALUE_NUMBER),
+            NULL),
+          NULL),
+        newschema_p(&A, 0,
+          "properties", newprops(&A,
+            "type", newschema_p(&A, 0, "const", newjson_str(&A, "b"), NULL),
+            "x", newschema(&A, JSON_VALUE_STRING),
+            NULL),
+          NULL),
+        NULL),
+      NULL);
+
+  check_dispatch("test_op_dispatch (anyOf)", schema, anyof_docs, ARRAYLEN(anyof_docs));
+}
+
 /* incomplete tests... placeholders for conversion from cnode tests */
 static void test_op_minproperties_3(void);
 static void test_op_maxproperties_1(void);
@@ -4939,6 +5667,13 @@ int main(void)
   test_op_minimum();
   test_op_multiple_of();
 
+  test_op_optimize();
+  test_op_optimize_branches();
+  test_op_switch();
+  test_op_intern();
+  test_op_enum();
+  test_op_dispatch();
+
   test_op_properties();
 
   test_op_minmax_properties_1();
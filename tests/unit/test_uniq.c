@@ -389,6 +389,435 @@ static void test_object_uniqueness(void)
 }
 
 
+static enum jvst_result
+uniq_event(struct jvst_vm_unique *uniq, enum SJP_EVENT type, const char *text, double d)
+{
+  struct sjp_event evt = { 0 };
+
+  evt.type = type;
+  if (text != NULL) {
+    evt.text = text;
+    evt.n = strlen(text);
+  }
+  evt.extra.d = d;
+
+  return jvst_vm_uniq_evaluate(uniq, SJP_OK, &evt);
+}
+
+// evaluates an item of depth nested arrays around a string
+static enum jvst_result
+uniq_nested(struct jvst_vm_unique *uniq, size_t depth, const char *str)
+{
+  enum jvst_result ret;
+  size_t i;
+
+  for (i=0; i < depth; i++) {
+    uniq_event(uniq, SJP_ARRAY_BEG, NULL, 0.0);
+  }
+
+  ret = uniq_event(uniq, SJP_STRING, str, 0.0);
+  for (i=0; i < depth; i++) {
+    ret = uniq_event(uniq, SJP_ARRAY_END, NULL, 0.0);
+  }
+
+  return ret;
+}
+
+static void test_uniqueness_storage(void)
+{
+  struct jvst_vm_unique *uniq;
+  enum jvst_result ret;
+  size_t i;
+
+  uniq = jvst_vm_uniq_initialize();
+
+  // nesting deeper than the initial stack grows the stack
+  ntest++;
+
+  if (uniq_nested(uniq, 100, "a") != JVST_VALID ||
+      uniq_nested(uniq, 100, "b") != JVST_VALID ||
+      uniq_nested(uniq, 100, "a") != JVST_INVALID) {
+    printf("%s: nested items are not unique\n", __func__);
+    nfail++;
+  }
+
+  if (uniq->nstack <= 100) {
+    printf("%s: expected the stack to grow past 100 frames, it has %zu\n",
+        __func__, uniq->nstack);
+    nfail++;
+  }
+
+  // more entries than fit in one arena chunk, then a duplicate
+  ntest++;
+
+  jvst_vm_uniq_reset(uniq);
+  ret = JVST_VALID;
+  for (i=0; i < 4096 && ret == JVST_VALID; i++) {
+    ret = uniq_event(uniq, SJP_NUMBER, NULL, (double)i);
+  }
+
+  if (ret != JVST_VALID || uniq_event(uniq, SJP_NUMBER, NULL, 17.0) != JVST_INVALID) {
+    printf("%s: many numbers are not unique\n", __func__);
+    nfail++;
+  }
+
+  // resetting keeps only the first arena chunk and forgets the entries
+  ntest++;
+
+  jvst_vm_uniq_reset(uniq);
+  if (uniq->arena.chunks == NULL || uniq->arena.chunks->next != NULL ||
+      uniq->arena.chunks->len != 0) {
+    printf("%s: expected the reset arena to have one empty chunk\n", __func__);
+    nfail++;
+  }
+
+  if (uniq_event(uniq, SJP_NUMBER, NULL, 17.0) != JVST_VALID) {
+    printf("%s: reset set still has entries\n", __func__);
+    nfail++;
+  }
+
+  jvst_vm_uniq_finalize(uniq);
+}
+
+struct uniq_tok {
+  enum SJP_EVENT type;
+  const char *text;
+  double d;
+};
+
+// evaluates the tokens of one item, returning the final result
+static enum jvst_result
+uniq_item(struct jvst_vm_unique *uniq, const struct uniq_tok *toks)
+{
+  enum jvst_result ret = JVST_INVALID;
+
+  for (; toks->type != SJP_NONE; toks++) {
+    ret = uniq_event(uniq, toks->type, toks->text, toks->d);
+  }
+
+  return ret;
+}
+
+static void test_uniqueness_hashing(void)
+{
+  // {"a":[1,{"x":null,"y":"s"}],"b":true}
+  static const struct uniq_tok obj1[] = {
+    { SJP_OBJECT_BEG }, { SJP_STRING, "a" },
+      { SJP_ARRAY_BEG }, { SJP_NUMBER, NULL, 1.0 },
+        { SJP_OBJECT_BEG },
+          { SJP_STRING, "x" }, { SJP_NULL },
+          { SJP_STRING, "y" }, { SJP_STRING, "s" },
+        { SJP_OBJECT_END },
+      { SJP_ARRAY_END },
+      { SJP_STRING, "b" }, { SJP_TRUE },
+    { SJP_OBJECT_END },
+    { SJP_NONE },
+  };
+
+  // {"b":true,"a":[1,{"y":"s","x":null}]}
+  static const struct uniq_tok obj2[] = {
+    { SJP_OBJECT_BEG }, { SJP_STRING, "b" }, { SJP_TRUE },
+      { SJP_STRING, "a" },
+      { SJP_ARRAY_BEG }, { SJP_NUMBER, NULL, 1.0 },
+        { SJP_OBJECT_BEG },
+          { SJP_STRING, "y" }, { SJP_STRING, "s" },
+          { SJP_STRING, "x" }, { SJP_NULL },
+        { SJP_OBJECT_END },
+      { SJP_ARRAY_END },
+    { SJP_OBJECT_END },
+    { SJP_NONE },
+  };
+
+  // {"b":true,"a":[{"y":"s","x":null},1]}
+  static const struct uniq_tok obj3[] = {
+    { SJP_OBJECT_BEG }, { SJP_STRING, "b" }, { SJP_TRUE },
+      { SJP_STRING, "a" },
+      { SJP_ARRAY_BEG },
+        { SJP_OBJECT_BEG },
+          { SJP_STRING, "y" }, { SJP_STRING, "s" },
+          { SJP_STRING, "x" }, { SJP_NULL },
+        { SJP_OBJECT_END },
+        { SJP_NUMBER, NULL, 1.0 },
+      { SJP_ARRAY_END },
+    { SJP_OBJECT_END },
+    { SJP_NONE },
+  };
+
+  // {"a":"b","b":"a"} and {"a":"a","b":"b"}
+  static const struct uniq_tok swap1[] = {
+    { SJP_OBJECT_BEG },
+      { SJP_STRING, "a" }, { SJP_STRING, "b" },
+      { SJP_STRING, "b" }, { SJP_STRING, "a" },
+    { SJP_OBJECT_END },
+    { SJP_NONE },
+  };
+  static const struct uniq_tok swap2[] = {
+    { SJP_OBJECT_BEG },
+      { SJP_STRING, "a" }, { SJP_STRING, "a" },
+      { SJP_STRING, "b" }, { SJP_STRING, "b" },
+    { SJP_OBJECT_END },
+    { SJP_NONE },
+  };
+
+  struct jvst_vm_unique *uniq;
+
+  uniq = jvst_vm_uniq_initialize();
+
+  // object members match in any order, array items in order only
+  ntest++;
+
+  if (uniq_item(uniq, obj1) != JVST_VALID ||
+      uniq_item(uniq, obj3) != JVST_VALID ||
+      uniq_item(uniq, obj2) != JVST_INVALID) {
+    printf("%s: nested objects are not compared by their members\n", __func__);
+    nfail++;
+  }
+
+  // members are hashed as key/value pairs
+  ntest++;
+
+  jvst_vm_uniq_reset(uniq);
+  if (uniq_item(uniq, swap1) != JVST_VALID ||
+      uniq_item(uniq, swap2) != JVST_VALID ||
+      uniq_item(uniq, swap1) != JVST_INVALID) {
+    printf("%s: object members are not paired\n", __func__);
+    nfail++;
+  }
+
+  jvst_vm_uniq_finalize(uniq);
+}
+
+static void test_uniqueness_sets(void)
+{
+  struct jvst_vm_unique *uniq;
+  enum jvst_result ret;
+  size_t i;
+
+  uniq = jvst_vm_uniq_initialize();
+
+  // arrays of numbers use the number set, where zero is negative zero
+  ntest++;
+
+  ret = JVST_VALID;
+  for (i=0; i < 3000 && ret == JVST_VALID; i++) {
+    ret = uniq_event(uniq, SJP_NUMBER, NULL, (double)i - 1500.0);
+  }
+
+  if (ret != JVST_VALID ||
+      uniq_event(uniq, SJP_NUMBER, NULL, -0.0) != JVST_INVALID ||
+      uniq_event(uniq, SJP_NUMBER, NULL, 0.5) != JVST_VALID ||
+      uniq_event(uniq, SJP_NUMBER, NULL, 0.5) != JVST_INVALID) {
+    printf("%s: numbers are not unique\n", __func__);
+    nfail++;
+  }
+
+  if (uniq->items != JVST_VM_UNIQ_ITEMS_NUMBERS) {
+    printf("%s: expected numbers to use the number set\n", __func__);
+    nfail++;
+  }
+
+  // arrays of strings use the string set
+  ntest++;
+
+  jvst_vm_uniq_reset(uniq);
+  if (uniq_event(uniq, SJP_STRING, "a", 0.0) != JVST_VALID ||
+      uniq_event(uniq, SJP_STRING, "", 0.0) != JVST_VALID ||
+      uniq_event(uniq, SJP_STRING, "ab", 0.0) != JVST_VALID ||
+      uniq_event(uniq, SJP_STRING, "", 0.0) != JVST_INVALID ||
+      uniq_event(uniq, SJP_STRING, "ab", 0.0) != JVST_INVALID) {
+    printf("%s: strings are not unique\n", __func__);
+    nfail++;
+  }
+
+  if (uniq->items != JVST_VM_UNIQ_ITEMS_STRINGS) {
+    printf("%s: expected strings to use the string set\n", __func__);
+    nfail++;
+  }
+
+  // a string after numbers moves them to the generic set
+  ntest++;
+
+  jvst_vm_uniq_reset(uniq);
+  if (uniq_event(uniq, SJP_NUMBER, NULL, 0.0) != JVST_VALID ||
+      uniq_event(uniq, SJP_NUMBER, NULL, 2.0) != JVST_VALID ||
+      uniq_event(uniq, SJP_STRING, "2", 0.0) != JVST_VALID ||
+      uniq_event(uniq, SJP_NUMBER, NULL, 2.0) != JVST_INVALID ||
+      uniq_event(uniq, SJP_NUMBER, NULL, -0.0) != JVST_INVALID ||
+      uniq_event(uniq, SJP_STRING, "2", 0.0) != JVST_INVALID ||
+      uniq_event(uniq, SJP_NULL, NULL, 0.0) != JVST_VALID) {
+    printf("%s: mixed items are not unique\n", __func__);
+    nfail++;
+  }
+
+  if (uniq->items != JVST_VM_UNIQ_ITEMS_MIXED) {
+    printf("%s: expected mixed items to use the generic set\n", __func__);
+    nfail++;
+  }
+
+  // strings before a composite move to the generic set
+  ntest++;
+
+  jvst_vm_uniq_reset(uniq);
+  if (uniq_event(uniq, SJP_STRING, "a", 0.0) != JVST_VALID ||
+      uniq_nested(uniq, 1, "a") != JVST_VALID ||
+      uniq_event(uniq, SJP_STRING, "a", 0.0) != JVST_INVALID ||
+      uniq_nested(uniq, 1, "a") != JVST_INVALID) {
+    printf("%s: strings and arrays are not unique\n", __func__);
+    nfail++;
+  }
+
+  jvst_vm_uniq_finalize(uniq);
+}
+
+// evaluates the tokens of one value against a value set
+static enum jvst_result
+vset_member(struct jvst_vm_unique *uniq, const int64_t *tbl, const struct uniq_tok *toks)
+{
+  struct sjp_event evt = { 0 };
+  enum jvst_result ret = JVST_INVALID;
+
+  jvst_vm_uniq_reset(uniq);
+  for (; toks->type != SJP_NONE; toks++) {
+    evt.type = toks->type;
+    evt.text = toks->text;
+    evt.n = (toks->text != NULL) ? strlen(toks->text) : 0;
+    evt.extra.d = toks->d;
+
+    ret = jvst_vm_uniq_member(uniq, tbl, SJP_OK, &evt);
+  }
+
+  return ret;
+}
+
+static void test_value_sets(void)
+{
+  struct arena_info A = {0};
+  struct ast_value_set vals[9];
+  struct jvst_vm_unique *uniq;
+  struct sjp_event evt = { 0 };
+  int64_t *strs, *nums, *objs, *arrs;
+  size_t i, nmembers, nwords, nstrs;
+
+  // {"b":[1,null],"a":"x"}
+  static const struct uniq_tok obj1[] = {
+    { SJP_OBJECT_BEG },
+      { SJP_STRING, "b" }, { SJP_ARRAY_BEG }, { SJP_NUMBER, NULL, 1.0 }, { SJP_NULL }, { SJP_ARRAY_END },
+      { SJP_STRING, "a" }, { SJP_STRING, "x" },
+    { SJP_OBJECT_END },
+    { SJP_NONE },
+  };
+
+  // {"b":[null,1],"a":"x"}
+  static const struct uniq_tok obj2[] = {
+    { SJP_OBJECT_BEG },
+      { SJP_STRING, "b" }, { SJP_ARRAY_BEG }, { SJP_NULL }, { SJP_NUMBER, NULL, 1.0 }, { SJP_ARRAY_END },
+      { SJP_STRING, "a" }, { SJP_STRING, "x" },
+    { SJP_OBJECT_END },
+    { SJP_NONE },
+  };
+
+  // {"a":"x"}
+  static const struct uniq_tok obj3[] = {
+    { SJP_OBJECT_BEG }, { SJP_STRING, "a" }, { SJP_STRING, "x" }, { SJP_OBJECT_END },
+    { SJP_NONE },
+  };
+
+  // ["x",{}]
+  static const struct uniq_tok arr1[] = {
+    { SJP_ARRAY_BEG }, { SJP_STRING, "x" }, { SJP_OBJECT_BEG }, { SJP_OBJECT_END }, { SJP_ARRAY_END },
+    { SJP_NONE },
+  };
+
+  static const char *const strings[] = { "USD", "EUR", "", "JPY" };
+
+  // "USD", 840, {"a":"x","b":[1,null]}, "EUR", "", null, ["x",{}], -0, "EUR"
+  vals[0].value = *newjson_str(&A, "USD");
+  vals[1].value = *newjson_num(&A, 840.0);
+  vals[2].value = *newjson_object(&A,
+      "a", newjson_str(&A, "x"),
+      "b", newjson_array(&A, newjson_num(&A, 1.0), newjson_null(&A), NULL),
+      NULL);
+  vals[3].value = *newjson_str(&A, "EUR");
+  vals[4].value = *newjson_str(&A, "");
+  vals[5].value = *newjson_null(&A);
+  vals[6].value = *newjson_array(&A, newjson_str(&A, "x"), newjson_object(&A, NULL), NULL);
+  vals[7].value = *newjson_num(&A, -0.0);
+  vals[8].value = *newjson_str(&A, "EUR");
+  for (i=0; i < ARRAYLEN(vals); i++) {
+    vals[i].next = (i+1 < ARRAYLEN(vals)) ? &vals[i+1] : NULL;
+  }
+
+  // each table holds the members of one type, without duplicates
+  ntest++;
+
+  strs = jvst_vm_vset_build(vals, SJP_STRING, &nstrs, &nwords);
+  if (nstrs != 3 || !jvst_vm_vset_verify(strs, nwords)) {
+    printf("%s: expected a table of 3 strings, found %zu\n", __func__, nstrs);
+    nfail++;
+  }
+
+  nums = jvst_vm_vset_build(vals, SJP_NUMBER, &nmembers, &nwords);
+  objs = jvst_vm_vset_build(vals, SJP_OBJECT_BEG, &nmembers, &nwords);
+  arrs = jvst_vm_vset_build(vals, SJP_ARRAY_BEG, &nmembers, &nwords);
+
+  // a table must end every chain with an empty bucket
+  ntest++;
+
+  if (jvst_vm_vset_verify(strs, 3) || jvst_vm_vset_verify(objs, 1)) {
+    printf("%s: truncated tables verify\n", __func__);
+    nfail++;
+  }
+
+  // complete scalars are looked up directly, and zero is negative zero
+  ntest++;
+
+  evt.type = SJP_STRING;
+  for (i=0; i < ARRAYLEN(strings); i++) {
+    evt.text = strings[i];
+    evt.n = strlen(strings[i]);
+    if (jvst_vm_vset_find(strs, &evt) != (i < 3)) {
+      printf("%s: string \"%s\" %s the set\n", __func__, strings[i],
+          (i < 3) ? "is not in" : "is in");
+      nfail++;
+    }
+  }
+
+  evt.type = SJP_NUMBER;
+  evt.text = NULL;
+  evt.n = 0;
+  evt.extra.d = 0.0;
+  if (!jvst_vm_vset_find(nums, &evt)) {
+    printf("%s: 0 is not in the set\n", __func__);
+    nfail++;
+  }
+
+  evt.extra.d = 841.0;
+  if (jvst_vm_vset_find(nums, &evt)) {
+    printf("%s: 841 is in the set\n", __func__);
+    nfail++;
+  }
+
+  // composites are matched a token at a time, objects in any order
+  // of their members and arrays only in order
+  ntest++;
+
+  uniq = jvst_vm_uniq_initialize();
+  if (vset_member(uniq, objs, obj1) != JVST_VALID ||
+      vset_member(uniq, objs, obj2) != JVST_INVALID ||
+      vset_member(uniq, objs, obj3) != JVST_INVALID ||
+      vset_member(uniq, arrs, arr1) != JVST_VALID ||
+      vset_member(uniq, objs, arr1) != JVST_INVALID) {
+    printf("%s: composite members are not matched\n", __func__);
+    nfail++;
+  }
+
+  jvst_vm_uniq_finalize(uniq);
+
+  free(strs);
+  free(nums);
+  free(objs);
+  free(arrs);
+}
 
 int main(void)
 {
@@ -398,5 +827,10 @@ int main(void)
   test_array_uniqueness();
   test_object_uniqueness();
 
+  test_uniqueness_storage();
+  test_uniqueness_hashing();
+  test_uniqueness_sets();
+  test_value_sets();
+
   return report_tests();
 }
@@ -0,0 +1,2282 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "validate_testing.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jvst_macros.h"
+
+#include "validate_vm.h"
+#include "xxhash.h"
+
+struct verify_test {
+  bool verifies;
+  struct jvst_vm_program *prog;
+};
+
+static int
+run_verify_test(const char *fname, const struct verify_test *t)
+{
+  char err[256] = { 0 };
+  int ret;
+
+  ret = jvst_vm_program_verify(t->prog, err, sizeof err);
+  if ((ret == 0) != t->verifies) {
+    fprintf(stderr, "%s: expected program to %s verification, but it %s: %s\n",
+        fname,
+        t->verifies ? "pass" : "fail",
+        (ret == 0) ? "passed" : "failed",
+        err);
+    return 0;
+  }
+
+  if ((t->prog->verified != 0) != t->verifies) {
+    fprintf(stderr, "%s: verified flag is %d\n", fname, t->prog->verified);
+    return 0;
+  }
+
+  return 1;
+}
+
+#define RUNTESTS(testlist) runtests(__func__, (testlist))
+static void runtests(const char *testname, const struct verify_test tests[])
+{
+  int i;
+
+  for (i=0; tests[i].prog != NULL; i++) {
+    ntest++;
+
+    if (!run_verify_test(testname, &tests[i])) {
+      printf("%s[%d]: failed\n", testname, i+1);
+      nfail++;
+    }
+  }
+}
+
+static void test_verify_valid(void)
+{
+  struct arena_info A = {0};
+
+  const struct verify_test tests[] = {
+    {
+      true,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_TOKEN, 0, 0,
+          JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_NUMBER),
+          JVST_OP_JMP, JVST_VM_BR_EQ, "true_2",
+          JVST_OP_RETURN, VMLIT(1), 0,
+
+          VM_LABEL, "true_2",
+          JVST_OP_FINT, VMREG(JVST_VM_TNUM), VMLIT(0),
+          JVST_OP_JMP, JVST_VM_BR_NE, "true_4",
+
+          JVST_OP_RETURN, VMLIT(2), 0,
+
+          VM_LABEL, "true_4",
+          JVST_OP_CONSUME, 0, 0,
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    {
+      true,
+      newvm_program(&A,
+          VM_FLOATS, 1, 1.1,
+          JVST_OP_PROC, VMLIT(2), VMLIT(0),
+          JVST_OP_TOKEN, 0, 0,
+          JVST_OP_FLOAD, VMSLOT(0), VMLIT(0),
+          JVST_OP_FCMP, VMREG(JVST_VM_TNUM), VMSLOT(0),
+          JVST_OP_MOVE, VMSLOT(1), VMLIT(5),
+          JVST_OP_INCR, VMSLOT(1), VMSLOT(1),
+          JVST_OP_BSET, VMSLOT(1), VMLIT(63),
+          JVST_OP_CONSUME, 0, 0,
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    {
+      true,
+      newvm_program(&A,
+          VM_SPLIT, 2, 2, 3,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_SPLITV, VMLIT(0), VMSLOT(0),
+          JVST_OP_CONSUME, 0, 0,
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_RETURN, VMLIT(1), 0,
+          VM_END)
+    },
+
+    { false, NULL },
+  };
+
+  RUNTESTS(tests);
+}
+
+static void test_verify_invalid(void)
+{
+  struct arena_info A = {0};
+
+  const struct verify_test tests[] = {
+    // program must start with a PROC
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_TOKEN, 0, 0,
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // slot outside of the frame
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_MOVE, VMSLOT(1), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // float compare against a literal
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_TOKEN, 0, 0,
+          JVST_OP_FCMP, VMREG(JVST_VM_TNUM), VMLIT(3),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // float pool index out of range
+    {
+      false,
+      newvm_program(&A,
+          VM_FLOATS, 1, 1.1,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_FLOAD, VMSLOT(0), VMLIT(1),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // const pool is empty
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_ILOAD, VMSLOT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // no DFAs
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_TOKEN, 0, 0,
+          JVST_OP_MATCH, VMLIT(0), 0,
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // bit out of range
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_BSET, VMSLOT(0), VMLIT(64),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // split index out of range
+    {
+      false,
+      newvm_program(&A,
+          VM_SPLIT, 1, 2,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_SPLIT, VMLIT(1), VMSLOT(0),
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // SPLITV bitvector doesn't fit in the frame
+    {
+      false,
+      newvm_program(&A,
+          VM_SPLIT, 1, 2,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_SPLITV, VMLIT(0), VMSLOT(1),
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // invalid UNIQUE argument
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_UNIQUE, VMLIT(3), 0,
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // SWITCH jump table isn't in the const pool
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_SWITCH, VMSLOT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // SWITCH destination out of range
+    {
+      false,
+      newvm_program(&A,
+          VM_JTAB, 1, "ret", "end",
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_SWITCH, VMSLOT(0), VMLIT(0),
+          VM_LABEL, "ret",
+          JVST_OP_RETURN, 0, 0,
+          VM_LABEL, "end",
+          VM_END)
+    },
+
+    // SWITCH key isn't a slot
+    {
+      false,
+      newvm_program(&A,
+          VM_JTAB, 0, "ret",
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_SWITCH, VMLIT(0), VMLIT(0),
+          VM_LABEL, "ret",
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // JMP into the body of another proc, whose slots don't fit in
+    // this one's frame
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_JMP, JVST_VM_BR_ALWAYS, "other",
+
+          JVST_OP_PROC, VMLIT(4), VMLIT(0),
+          VM_LABEL, "other",
+          JVST_OP_MOVE, VMSLOT(3), VMLIT(1),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // JMP to another proc's PROC
+    {
+      false,
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_JMP, JVST_VM_BR_ALWAYS, "other",
+
+          VM_LABEL, "other",
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // SWITCH destination in another proc
+    {
+      false,
+      newvm_program(&A,
+          VM_JTAB, 1, "ret", "other",
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_SWITCH, VMSLOT(0), VMLIT(0),
+          VM_LABEL, "ret",
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(4), VMLIT(0),
+          VM_LABEL, "other",
+          JVST_OP_MOVE, VMSLOT(3), VMLIT(1),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    { false, NULL },
+  };
+
+  RUNTESTS(tests);
+}
+
+struct run_test {
+  const char *json;
+  int error;  // expected error code, 0 if the input is valid
+  struct jvst_vm_program *prog;
+};
+
+static int
+run_vm_doc(struct jvst_vm *vm, const char *json)
+{
+  char buf[1024];
+  size_t n;
+  int ret;
+
+  n = strlen(json);
+  assert(n < sizeof buf);
+  memcpy(buf, json, n);
+
+  ret = jvst_vm_more(vm, buf, n);
+  if (!JVST_IS_INVALID(ret)) {
+    ret = jvst_vm_close(vm);
+  }
+
+  return ret;
+}
+
+static int
+run_vm_test(const char *fname, const struct run_test *t)
+{
+  struct jvst_vm vm = { 0 };
+  int ret;
+
+  if (jvst_vm_program_verify(t->prog, NULL, 0) != 0) {
+    fprintf(stderr, "%s: program does not verify\n", fname);
+    return 0;
+  }
+
+  jvst_vm_init_defaults(&vm, t->prog);
+
+  ret = run_vm_doc(&vm, t->json);
+
+  if (JVST_IS_INVALID(ret) != (t->error != 0) ||
+      (t->error != 0 && vm.ctx.error != t->error)) {
+    fprintf(stderr, "%s: %s: expected error %d, but result is %d with error %d\n",
+        fname, t->json, t->error, ret, vm.ctx.error);
+    jvst_vm_finalize(&vm);
+    return 0;
+  }
+
+  jvst_vm_finalize(&vm);
+  return 1;
+}
+
+#define RUNVM(testlist) runvm(__func__, (testlist))
+static void runvm(const char *testname, const struct run_test tests[])
+{
+  int i;
+
+  for (i=0; tests[i].json != NULL; i++) {
+    ntest++;
+
+    if (!run_vm_test(testname, &tests[i])) {
+      printf("%s[%d]: failed\n", testname, i+1);
+      nfail++;
+    }
+  }
+}
+
+// Procs used by the split tests.  proc 2 consumes the whole value and
+// is committed to VALID after the first token.  proc 3 walks an array
+// item by item and is VALID at the end of it.  proc 4 is INVALID.
+//
+// The parent stores the SPLIT count and returns error 8 if the count
+// matches the given value, otherwise error 7.  A short-circuited split
+// doesn't count branches it stopped running, so the count shows
+// whether the split stopped early.
+#define SPLIT_PARENT(splitop, count) \
+          JVST_OP_PROC, VMLIT(1), VMLIT(0), \
+          JVST_OP_TOKEN, 0, 0, \
+          JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_BEG), \
+          JVST_OP_JMP, JVST_VM_BR_NE, "invalid", \
+          (splitop), VMLIT(0), VMSLOT(0), \
+          JVST_OP_ICMP, VMSLOT(0), VMLIT(count), \
+          JVST_OP_JMP, JVST_VM_BR_EQ, "counted", \
+          VM_LABEL, "invalid", \
+          JVST_OP_RETURN, VMLIT(7), 0, \
+          VM_LABEL, "counted", \
+          JVST_OP_RETURN, VMLIT(8), 0
+
+#define SPLIT_PARENT_VALID(splitop, count) \
+          JVST_OP_PROC, VMLIT(1), VMLIT(0), \
+          JVST_OP_TOKEN, 0, 0, \
+          (splitop), VMLIT(0), VMSLOT(0), \
+          JVST_OP_ICMP, VMSLOT(0), VMLIT(count), \
+          JVST_OP_JMP, JVST_VM_BR_EQ, "counted", \
+          JVST_OP_RETURN, VMLIT(7), 0, \
+          VM_LABEL, "counted", \
+          JVST_OP_RETURN, 0, 0
+
+#define SPLIT_PROCS \
+          JVST_OP_PROC, VMLIT(0), VMLIT(0), \
+          JVST_OP_CONSUME, 0, 0, \
+          JVST_OP_RETURN, 0, 0, \
+          \
+          JVST_OP_PROC, VMLIT(0), VMLIT(0), \
+          VM_LABEL, "loop", \
+          JVST_OP_TOKEN, 0, 0, \
+          JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_END), \
+          JVST_OP_JMP, JVST_VM_BR_NE, "loop", \
+          JVST_OP_RETURN, 0, 0, \
+          \
+          JVST_OP_PROC, VMLIT(0), VMLIT(0), \
+          JVST_OP_RETURN, VMLIT(3), 0
+
+static void test_split_modes(void)
+{
+  struct arena_info A = {0};
+
+  const struct run_test tests[] = {
+    // SPLIT runs every branch
+    {
+      "[1,2,3]", 0,
+      newvm_program(&A,
+          VM_SPLIT, 3, 2, 3, 4,
+          SPLIT_PARENT_VALID(JVST_OP_SPLIT, 2),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    // SPLITANY stops the other branches once one is committed, and
+    // the committed branch consumes the rest of the value
+    {
+      "[1,[2,3],{\"a\":4}]", 0,
+      newvm_program(&A,
+          VM_SPLIT, 2, 2, 3,
+          SPLIT_PARENT_VALID(JVST_OP_SPLITANY, 1),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    // SPLITANY with no valid branch
+    {
+      "[1,2]", 8,
+      newvm_program(&A,
+          VM_SPLIT, 2, 4, 4,
+          SPLIT_PARENT(JVST_OP_SPLITANY, 0),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    // SPLITONE fails as soon as two branches are committed
+    {
+      "[1,2,3]", 8,
+      newvm_program(&A,
+          VM_SPLIT, 3, 2, 2, 3,
+          SPLIT_PARENT(JVST_OP_SPLITONE, 2),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    // SPLITONE with one committed branch waits for the others
+    {
+      "[1,2,3]", 8,
+      newvm_program(&A,
+          VM_SPLIT, 3, 2, 3, 4,
+          SPLIT_PARENT(JVST_OP_SPLITONE, 2),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    // SPLITALL fails as soon as one branch fails
+    {
+      "[1,2,3]", 8,
+      newvm_program(&A,
+          VM_SPLIT, 3, 4, 3, 2,
+          SPLIT_PARENT(JVST_OP_SPLITALL, 1),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    // SPLITALL with every branch valid
+    {
+      "[1,2]", 0,
+      newvm_program(&A,
+          VM_SPLIT, 2, 2, 3,
+          SPLIT_PARENT_VALID(JVST_OP_SPLITALL, 2),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    // SPLIT with only committed branches left keeps one to consume
+    // the value, and counts the others as valid
+    {
+      "[1,[2,[3]],4]", 0,
+      newvm_program(&A,
+          VM_SPLIT, 3, 2, 2, 4,
+          SPLIT_PARENT_VALID(JVST_OP_SPLIT, 2),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    { NULL },
+  };
+
+  RUNVM(tests);
+}
+
+static size_t
+count_pool(const struct jvst_vm *vm)
+{
+  const struct jvst_vm_ctx *ctx;
+  size_t n = 0;
+
+  for (ctx = vm->free_ctx; ctx != NULL; ctx = ctx->next_free) {
+    n++;
+  }
+
+  return n;
+}
+
+static void test_reset(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  struct jvst_vm vm = { 0 };
+  union jvst_vm_stackval *stack;
+  size_t npool;
+  int i;
+
+  const struct run_test docs[] = {
+    { "[1,2]",       0, NULL },
+    { "3",           7, NULL },
+    { "[1,[2]",      JVST_INVALID_JSON, NULL },
+    { "[[1],{}]",    0, NULL },
+    { "[}",          SJP_INVALID_CHAR, NULL },
+    { "[]",          0, NULL },
+    { NULL },
+  };
+
+  prog = newvm_program(&A,
+      VM_SPLIT, 2, 3, 2,
+      SPLIT_PARENT(JVST_OP_SPLITANY, 1),
+      SPLIT_PROCS,
+      VM_END);
+
+  jvst_vm_init_defaults(&vm, prog);
+  stack = vm.ctx.stack;
+  npool = count_pool(&vm);
+
+  // the sizing hint preallocates a context for each branch
+  ntest++;
+  if (npool != 2) {
+    printf("%s: failed: expected 2 preallocated split contexts, found %zu\n", __func__, npool);
+    nfail++;
+  }
+
+  for (i=0; docs[i].json != NULL; i++) {
+    int ret, want;
+
+    ntest++;
+
+    // a valid document fails the parent with error 8, see SPLIT_PARENT
+    want = (docs[i].error == 0) ? 8 : docs[i].error;
+
+    jvst_vm_reset(&vm);
+    ret = run_vm_doc(&vm, docs[i].json);
+
+    if (!JVST_IS_INVALID(ret) || vm.ctx.error != want) {
+      printf("%s[%d]: failed: %s: expected error %d, but result is %d with error %d\n",
+          __func__, i+1, docs[i].json, want, ret, vm.ctx.error);
+      nfail++;
+      continue;
+    }
+
+    jvst_vm_reset(&vm);
+    if (vm.ctx.stack != stack || count_pool(&vm) != npool || vm.ctx.error != 0 || vm.ctx.nsplit != 0) {
+      printf("%s[%d]: failed: VM buffers were not kept by reset\n", __func__, i+1);
+      nfail++;
+    }
+  }
+
+  jvst_vm_finalize(&vm);
+}
+
+struct sizing_test {
+  struct jvst_vm_sizing sizing;
+  struct jvst_vm_program *prog;
+};
+
+static void test_sizing(void)
+{
+  struct arena_info A = {0};
+  int i;
+
+  const struct sizing_test tests[] = {
+    {
+      { 1 + JVST_VM_NUMREG, JVST_VM_NUMREG, 2, 2 },
+      newvm_program(&A,
+          VM_SPLIT, 2, 2, 3,
+          SPLIT_PARENT_VALID(JVST_OP_SPLITANY, 1),
+          SPLIT_PROCS,
+          VM_END)
+    },
+
+    // each CALL adds the callee's frame and two linkage slots
+    {
+      { (2+JVST_VM_NUMREG) + 2 + (3+JVST_VM_NUMREG) + 2 + JVST_VM_NUMREG, 0, 0, 0 },
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(2), VMLIT(0),
+          JVST_OP_CALL, 2,
+          JVST_OP_CALL, 3,
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(3), VMLIT(0),
+          JVST_OP_CALL, 3,
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // a split inside a split branch needs contexts for both
+    {
+      { JVST_VM_NUMREG + 1, JVST_VM_NUMREG + 1, 2, 4 },
+      newvm_program(&A,
+          VM_SPLIT, 2, 2, 3,
+          VM_SPLIT, 2, 4, 4,
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_SPLIT, VMLIT(0), VMSLOT(0),
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(1), VMLIT(0),
+          JVST_OP_SPLIT, VMLIT(1), VMSLOT(0),
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    // recursion leaves the stack depth unbounded
+    {
+      { 0, 0, 0, 0 },
+      newvm_program(&A,
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_CALL, 2,
+          JVST_OP_RETURN, 0, 0,
+
+          JVST_OP_PROC, VMLIT(0), VMLIT(0),
+          JVST_OP_CALL, 2,
+          JVST_OP_RETURN, 0, 0,
+          VM_END)
+    },
+
+    { { 0 }, NULL },
+  };
+
+  for (i=0; tests[i].prog != NULL; i++) {
+    const struct jvst_vm_sizing *got, *want;
+
+    ntest++;
+
+    jvst_vm_program_predecode(tests[i].prog);
+    got = &tests[i].prog->sizing;
+    want = &tests[i].sizing;
+
+    if (got->stack != want->stack || got->split_stack != want->split_stack ||
+        got->maxsplit != want->maxsplit || got->nctx != want->nctx) {
+      printf("%s[%d]: failed: expected sizing {%zu,%zu,%zu,%zu}, found {%zu,%zu,%zu,%zu}\n",
+          __func__, i+1,
+          want->stack, want->split_stack, want->maxsplit, want->nctx,
+          got->stack, got->split_stack, got->maxsplit, got->nctx);
+      nfail++;
+    }
+  }
+}
+
+struct record_test {
+  enum jvst_vm_record_format format;
+  const char *stream;
+  struct jvst_vm_record_result results[8];
+  size_t nresults;
+};
+
+struct record_log {
+  struct jvst_vm_record_result results[8];
+  size_t n;
+};
+
+static int
+log_record(void *opaque, const struct jvst_vm_record_result *res)
+{
+  struct record_log *log = opaque;
+
+  assert(log->n < ARRAYLEN(log->results));
+  log->results[log->n++] = *res;
+  return 0;
+}
+
+static int
+run_record_test(const char *fname, const struct record_test *t, struct jvst_vm_program *prog, size_t chunk)
+{
+  struct jvst_vm_records rs;
+  struct record_log log = { 0 };
+  char buf[1024];
+  size_t i, n, off;
+
+  n = strlen(t->stream);
+  assert(n < sizeof buf);
+  memcpy(buf, t->stream, n);
+
+  jvst_vm_records_init(&rs, prog, t->format, log_record, &log);
+  for (off=0; off < n; off += chunk) {
+    jvst_vm_records_more(&rs, &buf[off], (n-off < chunk) ? n-off : chunk);
+  }
+  jvst_vm_records_close(&rs);
+  jvst_vm_records_finalize(&rs);
+
+  if (log.n != t->nresults) {
+    fprintf(stderr, "%s: chunk size %zu: expected %zu records, found %zu\n",
+        fname, chunk, t->nresults, log.n);
+    return 0;
+  }
+
+  for (i=0; i < log.n; i++) {
+    const struct jvst_vm_record_result *want = &t->results[i], *got = &log.results[i];
+
+    if (got->index != want->index || got->offset != want->offset ||
+        got->result != want->result || got->error != want->error) {
+      fprintf(stderr, "%s: chunk size %zu: expected record %zu at %zu to be %d with error %d, "
+          "found record %zu at %zu is %d with error %d\n",
+          fname, chunk,
+          want->index, want->offset, want->result, want->error,
+          got->index, got->offset, got->result, got->error);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void test_records(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  static const size_t chunks[] = { 1, 3, 1024 };
+  size_t i, j;
+
+  // every JSON text must be an array
+  const struct record_test tests[] = {
+    {
+      JVST_VM_RECORD_NDJSON,
+      "[1,2]\n\n  3\n[[1],{\"a\":2}]  \r\n[1,\n{}\n[] x\n[4]",
+      {
+        { 0,  0, JVST_VALID,   0 },
+        { 1,  9, JVST_INVALID, 7 },
+        { 2, 11, JVST_VALID,   0 },
+        { 3, 28, JVST_INVALID, JVST_INVALID_JSON },
+        { 4, 32, JVST_INVALID, 7 },
+        { 5, 35, JVST_INVALID, JVST_INVALID_JSON },
+        { 6, 40, JVST_VALID,   0 },
+      },
+      7,
+    },
+
+    {
+      JVST_VM_RECORD_SEQ,
+      "\x1e[1,\n2]\n\x1e" "3\n\x1e\n\x1e{\"a\":[]}\n",
+      {
+        { 0,  1, JVST_VALID,   0 },
+        { 1,  9, JVST_INVALID, 7 },
+        { 2, 14, JVST_INVALID, 7 },
+      },
+      3,
+    },
+
+    { 0, NULL },
+  };
+
+  prog = newvm_program(&A,
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_BEG),
+      JVST_OP_JMP, JVST_VM_BR_NE, "invalid",
+      JVST_OP_CONSUME, 0, 0,
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "invalid",
+      JVST_OP_RETURN, VMLIT(7), 0,
+      VM_END);
+
+  for (i=0; tests[i].stream != NULL; i++) {
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      ntest++;
+
+      if (!run_record_test(__func__, &tests[i], prog, chunks[j])) {
+        printf("%s[%zu]: failed\n", __func__, i+1);
+        nfail++;
+      }
+    }
+  }
+}
+
+static int
+run_chunked(struct jvst_vm_program *prog, const char *json, size_t chunk, int *errp)
+{
+  struct jvst_vm vm = { 0 };
+  char buf[1024];
+  size_t n, off;
+  int ret;
+
+  n = strlen(json);
+  assert(n < sizeof buf);
+  memcpy(buf, json, n);
+
+  jvst_vm_init_defaults(&vm, prog);
+
+  ret = JVST_MORE;
+  for (off=0; off < n && !JVST_IS_INVALID(ret); off += chunk) {
+    ret = jvst_vm_more(&vm, &buf[off], (n-off < chunk) ? n-off : chunk);
+  }
+  if (!JVST_IS_INVALID(ret)) {
+    ret = jvst_vm_close(&vm);
+  }
+
+  *errp = vm.ctx.error;
+  jvst_vm_finalize(&vm);
+
+  return ret;
+}
+
+static void test_jit(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *progs[2];
+  static const size_t chunks[] = { 1, 1024 };
+  size_t i, j, k;
+
+  static const struct {
+    size_t prog;
+    const char *json;
+    int error;
+  } tests[] = {
+    { 0, "[1,2,3]", 0 },
+    { 0, "[]", 0 },
+    { 0, "[1,2,3,4]", 9 },
+    { 0, "[1,2.5]", 11 },
+    { 0, "[1,200]", 10 },
+    { 0, "[1,\"a\"]", 12 },
+    { 0, "{}", 7 },
+    { 1, "[1,2,3]", 8 },
+    { 1, "3", 7 },
+  };
+
+  // An array of at most three small integers, checked by a proc called
+  // for each item.  Covers calls and returns between frames, float and
+  // integer compares, and the slot ops.
+  progs[0] = newvm_program(&A,
+      VM_FLOATS, 1, 100.0,
+      JVST_OP_PROC, VMLIT(2), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_BEG),
+      JVST_OP_JMP, JVST_VM_BR_NE, "invalid",
+      VM_LABEL, "loop",
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_END),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "end",
+      JVST_OP_TOKEN, VMLIT(0), VMLIT(-1),
+      JVST_OP_CALL, 2,
+      JVST_OP_INCR, VMSLOT(0), VMLIT(1),
+      JVST_OP_JMP, JVST_VM_BR_ALWAYS, "loop",
+      VM_LABEL, "end",
+      JVST_OP_ICMP, VMSLOT(0), VMLIT(3),
+      JVST_OP_JMP, JVST_VM_BR_GT, "toomany",
+      JVST_OP_BSET, VMSLOT(1), VMLIT(2),
+      JVST_OP_BAND, VMSLOT(1), VMLIT(6),
+      JVST_OP_ICMP, VMSLOT(1), VMLIT(4),
+      JVST_OP_JMP, JVST_VM_BR_NE, "invalid",
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "toomany",
+      JVST_OP_RETURN, VMLIT(9), 0,
+      VM_LABEL, "invalid",
+      JVST_OP_RETURN, VMLIT(7), 0,
+
+      JVST_OP_PROC, VMLIT(1), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_NUMBER),
+      JVST_OP_JMP, JVST_VM_BR_NE, "notnum",
+      JVST_OP_FLOAD, VMSLOT(0), VMLIT(0),
+      JVST_OP_FCMP, VMREG(JVST_VM_TNUM), VMSLOT(0),
+      JVST_OP_JMP, JVST_VM_BR_GE, "big",
+      JVST_OP_FINT, VMREG(JVST_VM_TNUM), VMLIT(0),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "notint",
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "big",
+      JVST_OP_RETURN, VMLIT(10), 0,
+      VM_LABEL, "notint",
+      JVST_OP_RETURN, VMLIT(11), 0,
+      VM_LABEL, "notnum",
+      JVST_OP_RETURN, VMLIT(12), 0,
+      VM_END);
+
+  progs[1] = newvm_program(&A,
+      VM_SPLIT, 3, 2, 2, 3,
+      SPLIT_PARENT(JVST_OP_SPLITONE, 2),
+      SPLIT_PROCS,
+      VM_END);
+
+  // the JIT isn't available on every host
+  for (i=0; i < ARRAYLEN(progs); i++) {
+    if (jvst_vm_program_jit(progs[i]) != 0) {
+      return;
+    }
+  }
+
+  for (i=0; i < ARRAYLEN(tests); i++) {
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      struct jvst_vm_program *prog = progs[tests[i].prog];
+      int ret[2], err[2];
+
+      ntest++;
+
+      // the same program on the interpreter and as machine code
+      for (k=0; k < 2; k++) {
+        if (k == 0) {
+          jvst_vm_program_unjit(prog);
+        } else if (jvst_vm_program_jit(prog) != 0) {
+          assert(!"JIT failed after succeeding once");
+        }
+
+        ret[k] = run_chunked(prog, tests[i].json, chunks[j], &err[k]);
+      }
+
+      if (JVST_IS_INVALID(ret[1]) != (tests[i].error != 0) ||
+          (tests[i].error != 0 && err[1] != tests[i].error) ||
+          ret[0] != ret[1] || err[0] != err[1]) {
+        printf("%s[%zu]: %s: chunk size %zu: expected error %d, "
+            "interpreter returned %d with error %d, JIT returned %d with error %d\n",
+            __func__, i+1, tests[i].json, chunks[j], tests[i].error,
+            ret[0], err[0], ret[1], err[1]);
+        nfail++;
+      }
+    }
+  }
+}
+
+static void test_switch(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  static const size_t chunks[] = { 1, 1024 };
+  size_t i, j, k;
+  int jit;
+
+  static const struct {
+    const char *json;
+    int error;
+  } tests[] = {
+    { "[]", 0 },
+    { "[1]", 13 },
+    { "[1,2]", 0 },
+    { "[1,[2],3]", 14 },
+    { "[1,2,3,4]", 15 },
+    { "{}", 7 },
+  };
+
+  // Counts the items of an array and branches on the count through a
+  // jump table.  Counts past the end of the table take the default.
+  prog = newvm_program(&A,
+      VM_JTAB, 4, "many", "ok", "one", "ok", "three",
+      JVST_OP_PROC, VMLIT(1), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_BEG),
+      JVST_OP_JMP, JVST_VM_BR_NE, "invalid",
+      VM_LABEL, "loop",
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_ARRAY_END),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "end",
+      JVST_OP_TOKEN, VMLIT(0), VMLIT(-1),
+      JVST_OP_CALL, 2,
+      JVST_OP_INCR, VMSLOT(0), VMLIT(1),
+      JVST_OP_JMP, JVST_VM_BR_ALWAYS, "loop",
+      VM_LABEL, "end",
+      JVST_OP_SWITCH, VMSLOT(0), VMLIT(0),
+      VM_LABEL, "ok",
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "one",
+      JVST_OP_RETURN, VMLIT(13), 0,
+      VM_LABEL, "three",
+      JVST_OP_RETURN, VMLIT(14), 0,
+      VM_LABEL, "many",
+      JVST_OP_RETURN, VMLIT(15), 0,
+      VM_LABEL, "invalid",
+      JVST_OP_RETURN, VMLIT(7), 0,
+
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_CONSUME, 0, 0,
+      JVST_OP_RETURN, 0, 0,
+      VM_END);
+
+  ntest++;
+  if (jvst_vm_program_verify(prog, NULL, 0) != 0) {
+    printf("%s: program does not verify\n", __func__);
+    nfail++;
+    return;
+  }
+
+  // the JIT isn't available on every host
+  jit = (jvst_vm_program_jit(prog) == 0);
+
+  for (i=0; i < ARRAYLEN(tests); i++) {
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      for (k=0; k < (jit ? 2 : 1); k++) {
+        int ret, err;
+
+        ntest++;
+
+        if (k == 0) {
+          jvst_vm_program_unjit(prog);
+        } else if (jvst_vm_program_jit(prog) != 0) {
+          assert(!"JIT failed after succeeding once");
+        }
+
+        ret = run_chunked(prog, tests[i].json, chunks[j], &err);
+        if (JVST_IS_INVALID(ret) != (tests[i].error != 0) ||
+            (tests[i].error != 0 && err != tests[i].error)) {
+          printf("%s[%zu]: %s: chunk size %zu, %s: expected error %d, "
+              "but result is %d with error %d\n",
+              __func__, i+1, tests[i].json, chunks[j],
+              (k == 0) ? "interpreter" : "JIT",
+              tests[i].error, ret, err);
+          nfail++;
+        }
+      }
+    }
+  }
+}
+
+static int
+dfa_match(const struct jvst_vm_dfa *dfa, const char *s, size_t chunk)
+{
+  size_t off, n;
+  int st, data;
+
+  n = strlen(s);
+  st = JVST_VM_DFA_START;
+  for (off=0; off < n; off += chunk) {
+    st = jvst_vm_dfa_run(dfa, st, &s[off], (n-off < chunk) ? n-off : chunk);
+  }
+
+  if (!jvst_vm_dfa_endstate(dfa, st, &data)) {
+    return -1;
+  }
+
+  return data;
+}
+
+static void test_dfa(void)
+{
+  struct jvst_vm_dfa dfa;
+  size_t i, j;
+  char buf[512];
+
+  static const size_t chunks[] = { 1, 3, 1024 };
+
+  static const struct {
+    const char *s;
+    int data;
+  } tests[] = {
+    { "ab", 1 },
+    { "ac", 1 },
+    { "a0", 2 },
+    { "a5", 2 },
+    { "a",  -1 },
+    { "ad", -1 },
+    { "a:", -1 },
+    { "b",  -1 },
+    { "",   -1 },
+    { "ab\xc3", -1 },
+  };
+
+  // matches a[bc] with data 1 and a[0-9] with data 2
+  ntest++;
+
+  (void)jvst_vm_dfa_init(&dfa, 4, 13, 2);
+  dfa.offs[0] = 0;
+  dfa.offs[1] = 1;
+  dfa.offs[2] = 13;
+  dfa.offs[3] = 13;
+  dfa.offs[4] = 13;
+
+  dfa.transitions[0] = 'a';
+  dfa.transitions[1] = 1;
+  for (i=0; i < 10; i++) {
+    dfa.transitions[2*(i+1)+0] = '0'+i;
+    dfa.transitions[2*(i+1)+1] = 3;
+  }
+  dfa.transitions[22] = 'b';
+  dfa.transitions[23] = 2;
+  dfa.transitions[24] = 'c';
+  dfa.transitions[25] = 2;
+
+  dfa.endstates[0] = 2;
+  dfa.endstates[1] = 1;
+  dfa.endstates[2] = 3;
+  dfa.endstates[3] = 2;
+
+  jvst_vm_dfa_compile(&dfa);
+
+  // the classes are: bytes before '0', the digits, bytes from ':'
+  // to '`', a, b and c, and bytes after c
+  if (dfa.width != 1 || dfa.nclasses != 6 ||
+      dfa.classes['0'] != dfa.classes['9'] || dfa.classes['b'] != dfa.classes['c'] ||
+      dfa.classes['a'] == dfa.classes['b']) {
+    printf("%s: unexpected byte classes: %zu classes, %zu byte entries\n",
+        __func__, dfa.nclasses, dfa.width);
+    nfail++;
+  }
+
+  for (i=0; i < ARRAYLEN(tests); i++) {
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      int data;
+
+      ntest++;
+
+      data = dfa_match(&dfa, tests[i].s, chunks[j]);
+      if (data != tests[i].data) {
+        printf("%s[%zu]: \"%s\" chunk size %zu: expected %d, found %d\n",
+            __func__, i+1, tests[i].s, chunks[j], tests[i].data, data);
+        nfail++;
+      }
+    }
+  }
+
+  jvst_vm_dfa_finalize(&dfa);
+
+  // too many states for one byte entries: matches exactly 299 x's
+  ntest++;
+
+  (void)jvst_vm_dfa_init(&dfa, 300, 299, 1);
+  for (i=0; i < 300; i++) {
+    dfa.offs[i] = i;
+  }
+  dfa.offs[300] = 299;
+  for (i=0; i < 299; i++) {
+    dfa.transitions[2*i+0] = 'x';
+    dfa.transitions[2*i+1] = i+1;
+  }
+  dfa.endstates[0] = 299;
+  dfa.endstates[1] = 4;
+
+  jvst_vm_dfa_compile(&dfa);
+
+  memset(buf, 'x', 300);
+  buf[300] = '\0';
+
+  if (dfa.width != 2 || dfa_match(&dfa, buf, 7) != -1 || dfa_match(&dfa, buf+1, 7) != 4 ||
+      dfa_match(&dfa, buf+2, 7) != -1) {
+    printf("%s: long DFA: %zu byte entries, matched %d %d %d\n",
+        __func__, dfa.width, dfa_match(&dfa, buf, 7), dfa_match(&dfa, buf+1, 7),
+        dfa_match(&dfa, buf+2, 7));
+    nfail++;
+  }
+
+  jvst_vm_dfa_finalize(&dfa);
+}
+
+static void test_lmatch(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  struct jvst_op_lits *lits;
+  struct jvst_vm_dfa dfa, loop;
+  static const size_t chunks[] = { 1, 1024 };
+  size_t i, j, k;
+  int jit;
+
+  static const char *const keys[] = {
+    "foo", "ba", "bar", "baz",
+    "", "f", "fo", "fooo", "b", "bay", "qux", "baza",
+  };
+
+  static const struct {
+    const char *json;
+    int error;
+  } tests[] = {
+    { "{}", 0 },
+    { "{\"foo\":1,\"bar\":[1,2],\"baz\":{\"ba\":1}}", 0 },
+    { "{\"foo\":1,\"fo\":2}", 13 },
+    { "{\"foox\":true}", 13 },
+    { "{\"bar\":1,\"ba\":2}", 14 },
+    { "[]", 7 },
+  };
+
+  // matches foo and baz with data 1, bar with 2 and ba with 3
+  (void)jvst_vm_dfa_init(&dfa, 8, 7, 4);
+  dfa.offs[0] = 0;
+  dfa.offs[1] = 2;
+  dfa.offs[2] = 3;
+  dfa.offs[3] = 4;
+  dfa.offs[4] = 4;
+  dfa.offs[5] = 5;
+  dfa.offs[6] = 7;
+  dfa.offs[7] = 7;
+  dfa.offs[8] = 7;
+
+  dfa.transitions[0]  = 'b'; dfa.transitions[1]  = 4;
+  dfa.transitions[2]  = 'f'; dfa.transitions[3]  = 1;
+  dfa.transitions[4]  = 'o'; dfa.transitions[5]  = 2;
+  dfa.transitions[6]  = 'o'; dfa.transitions[7]  = 3;
+  dfa.transitions[8]  = 'a'; dfa.transitions[9]  = 5;
+  dfa.transitions[10] = 'r'; dfa.transitions[11] = 6;
+  dfa.transitions[12] = 'z'; dfa.transitions[13] = 7;
+
+  dfa.endstates[0] = 3; dfa.endstates[1] = 1;
+  dfa.endstates[2] = 5; dfa.endstates[3] = 3;
+  dfa.endstates[4] = 6; dfa.endstates[5] = 2;
+  dfa.endstates[6] = 7; dfa.endstates[7] = 1;
+
+  jvst_vm_dfa_compile(&dfa);
+
+  ntest++;
+  lits = jvst_op_build_lits(&dfa);
+  if (lits == NULL || lits->nkeys != 4) {
+    printf("%s: expected a table of 4 strings, found %zu\n",
+        __func__, (lits != NULL) ? lits->nkeys : 0);
+    nfail++;
+    jvst_vm_dfa_finalize(&dfa);
+    return;
+  }
+
+  // the table agrees with the DFA
+  for (i=0; i < ARRAYLEN(keys); i++) {
+    int expected, found;
+
+    ntest++;
+
+    expected = dfa_match(&dfa, keys[i], 1024);
+    if (expected < 0) {
+      expected = 0;
+    }
+
+    found = jvst_vm_lits_find(lits->words, keys[i], strlen(keys[i]));
+    if (found != expected) {
+      printf("%s[%zu]: \"%s\": expected case %d, found %d\n",
+          __func__, i+1, keys[i], expected, found);
+      nfail++;
+    }
+  }
+
+  // x* isn't a finite set of strings
+  ntest++;
+
+  (void)jvst_vm_dfa_init(&loop, 1, 1, 1);
+  loop.offs[0] = 0;
+  loop.offs[1] = 1;
+  loop.transitions[0] = 'x';
+  loop.transitions[1] = 0;
+  loop.endstates[0] = 0;
+  loop.endstates[1] = 1;
+  jvst_vm_dfa_compile(&loop);
+
+  if (jvst_op_build_lits(&loop) != NULL) {
+    printf("%s: expected no table for a DFA with a cycle\n", __func__);
+    nfail++;
+  }
+  jvst_vm_dfa_finalize(&loop);
+
+  // Raises 13 for an unknown property name and 14 for "ba"
+  prog = newvm_program(&A,
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_OBJECT_BEG),
+      JVST_OP_JMP, JVST_VM_BR_NE, "invalid",
+      VM_LABEL, "loop",
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_TT), VMLIT(SJP_OBJECT_END),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "ok",
+      JVST_OP_LMATCH, VMLIT(0), VMLIT(0),
+      JVST_OP_ICMP, VMREG(JVST_VM_M), VMLIT(0),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "unknown",
+      JVST_OP_ICMP, VMREG(JVST_VM_M), VMLIT(3),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "ba",
+      JVST_OP_CONSUME, 0, 0,
+      JVST_OP_JMP, JVST_VM_BR_ALWAYS, "loop",
+      VM_LABEL, "ok",
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "unknown",
+      JVST_OP_RETURN, VMLIT(13), 0,
+      VM_LABEL, "ba",
+      JVST_OP_RETURN, VMLIT(14), 0,
+      VM_LABEL, "invalid",
+      JVST_OP_RETURN, VMLIT(7), 0,
+      VM_END);
+
+  prog->ndfa = 1;
+  prog->dfas = &dfa;
+  prog->nconst = lits->nwords;
+  prog->cdata = lits->words;
+
+  // the bucket count must be a power of two
+  ntest++;
+  lits->words[0]--;
+  if (jvst_vm_program_verify(prog, NULL, 0) == 0) {
+    printf("%s: program with a bad literal table verifies\n", __func__);
+    nfail++;
+  }
+  lits->words[0]++;
+
+  ntest++;
+  if (jvst_vm_program_verify(prog, NULL, 0) != 0) {
+    printf("%s: program does not verify\n", __func__);
+    nfail++;
+    goto done;
+  }
+
+  // the JIT isn't available on every host
+  jit = (jvst_vm_program_jit(prog) == 0);
+
+  // one byte chunks split the property names, which are then matched
+  // with the DFA
+  for (i=0; i < ARRAYLEN(tests); i++) {
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      for (k=0; k < (jit ? 2 : 1); k++) {
+        int ret, err;
+
+        ntest++;
+
+        if (k == 0) {
+          jvst_vm_program_unjit(prog);
+        } else if (jvst_vm_program_jit(prog) != 0) {
+          assert(!"JIT failed after succeeding once");
+        }
+
+        ret = run_chunked(prog, tests[i].json, chunks[j], &err);
+        if (JVST_IS_INVALID(ret) != (tests[i].error != 0) ||
+            (tests[i].error != 0 && err != tests[i].error)) {
+          printf("%s[%zu]: %s: chunk size %zu, %s: expected error %d, "
+              "but result is %d with error %d\n",
+              __func__, i+1, tests[i].json, chunks[j],
+              (k == 0) ? "interpreter" : "JIT",
+              tests[i].error, ret, err);
+          nfail++;
+        }
+      }
+    }
+  }
+
+  jvst_vm_program_unjit(prog);
+
+done:
+  free(lits->words);
+  free(lits);
+  jvst_vm_dfa_finalize(&dfa);
+}
+
+static int
+lazy_match(struct jvst_vm_lazy *lz, const char *s, size_t chunk)
+{
+  size_t off, n;
+  int st, data;
+
+  n = strlen(s);
+  st = JVST_VM_DFA_START;
+  for (off=0; off < n; off += chunk) {
+    st = jvst_vm_lazy_run(lz, st, &s[off], (n-off < chunk) ? n-off : chunk);
+  }
+
+  if (!jvst_vm_lazy_endstate(lz, st, &data)) {
+    return -1;
+  }
+
+  return data;
+}
+
+// builds an NFA for (a|b)*a(a|b){width-1} with data 1.  Its DFA
+// remembers the last width bytes, so it has 2^width states.
+static void
+build_wide_nfa(struct jvst_vm_dfa *nfa, int width)
+{
+  int i, e;
+
+  (void)jvst_vm_dfa_init(nfa, width+1, 3 + 2*(width-1), 1);
+
+  nfa->offs[0] = 0;
+  nfa->transitions[0] = 'a'; nfa->transitions[1] = 0;
+  nfa->transitions[2] = 'a'; nfa->transitions[3] = 1;
+  nfa->transitions[4] = 'b'; nfa->transitions[5] = 0;
+
+  e = 3;
+  for (i=1; i < width; i++) {
+    nfa->offs[i] = e;
+    nfa->transitions[2*e+0] = 'a'; nfa->transitions[2*e+1] = i+1; e++;
+    nfa->transitions[2*e+0] = 'b'; nfa->transitions[2*e+1] = i+1; e++;
+  }
+  nfa->offs[width] = e;
+  nfa->offs[width+1] = e;
+
+  nfa->endstates[0] = width;
+  nfa->endstates[1] = 1;
+
+  jvst_vm_dfa_compile(nfa);
+}
+
+// a long string through a cache much smaller than the DFA flushes it
+// partway through, and the cache stays within its bound
+static void test_lazy_bound(void)
+{
+  enum { WIDTH = 13, MAXSTATES = 64, LEN = 5000 };
+  static const size_t chunks[] = { 1, 7, LEN };
+  struct jvst_vm_dfa nfa;
+  struct jvst_vm_lazy *lz;
+  char *s;
+  uint32_t x;
+  size_t i, j, off, n, maxsize;
+  int st, data, want;
+
+  build_wide_nfa(&nfa, WIDTH);
+
+  s = malloc(LEN);
+  assert(s != NULL);
+
+  x = 12345;
+  for (i=0; i < LEN; i++) {
+    x = x*1103515245 + 12345;
+    s[i] = ((x >> 16) & 1) ? 'a' : 'b';
+  }
+
+  lz = jvst_vm_lazy_new(&nfa, MAXSTATES);
+
+  for (j=0; j < ARRAYLEN(chunks); j++) {
+    for (n = LEN-1; n <= LEN; n++) {
+      ntest++;
+
+      maxsize = 0;
+      st = JVST_VM_DFA_START;
+      for (off=0; off < n; off += chunks[j]) {
+        st = jvst_vm_lazy_run(lz, st, &s[off], (n-off < chunks[j]) ? n-off : chunks[j]);
+        if (jvst_vm_lazy_size(lz) > maxsize) {
+          maxsize = jvst_vm_lazy_size(lz);
+        }
+      }
+
+      want = (s[n-WIDTH] == 'a') ? 1 : -1;
+      if (!jvst_vm_lazy_endstate(lz, st, &data)) {
+        data = -1;
+      }
+
+      if (data != want || maxsize > MAXSTATES) {
+        printf("%s: %zu bytes, chunk size %zu: expected %d with at most %d states, "
+            "found %d with %zu states\n",
+            __func__, n, chunks[j], want, MAXSTATES, data, maxsize);
+        nfail++;
+      }
+    }
+  }
+
+  jvst_vm_lazy_free(lz);
+  free(s);
+  jvst_vm_dfa_finalize(&nfa);
+}
+
+static void test_lazy(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  struct jvst_vm_lazy *lz[2];
+  struct jvst_vm_dfa nfa;
+  static const size_t chunks[] = { 1, 3, 1024 };
+  size_t i, j, k;
+  int jit;
+
+  static const struct {
+    const char *s;
+    int data;
+  } tests[] = {
+    { "aa",     1 },
+    { "ab",     1 },
+    { "bab",    1 },
+    { "aaaaab", 1 },
+    { "ba",     -1 },
+    { "abb",    -1 },
+    { "a",      -1 },
+    { "",       -1 },
+    { "aac",    -1 },
+  };
+
+  static const struct {
+    const char *json;
+    int error;
+  } runs[] = {
+    { "\"ab\"", 0 },
+    { "\"babbbaa\"", 0 },
+    { "\"abb\"", 13 },
+    { "\"aac\"", 13 },
+  };
+
+  // matches (a|b)*a(a|b) with data 1.  State 0 has two edges on 'a',
+  // and state 2 reaches the end state over an epsilon edge.  The byte
+  // classes are: bytes before 'a', a, b, and bytes after 'b'.
+  (void)jvst_vm_dfa_init(&nfa, 4, 6, 1);
+  nfa.offs[0] = 0;
+  nfa.offs[1] = 3;
+  nfa.offs[2] = 5;
+  nfa.offs[3] = 6;
+  nfa.offs[4] = 6;
+
+  nfa.transitions[0]  = 'a'; nfa.transitions[1]  = 0;
+  nfa.transitions[2]  = 'a'; nfa.transitions[3]  = 1;
+  nfa.transitions[4]  = 'b'; nfa.transitions[5]  = 0;
+  nfa.transitions[6]  = 'a'; nfa.transitions[7]  = 2;
+  nfa.transitions[8]  = 'b'; nfa.transitions[9]  = 2;
+  nfa.transitions[10] = JVST_VM_DFA_EPSILON; nfa.transitions[11] = 3;
+
+  nfa.endstates[0] = 3;
+  nfa.endstates[1] = 1;
+
+  jvst_vm_dfa_compile(&nfa);
+
+  ntest++;
+  if (!nfa.nfa || nfa.nclasses != 4) {
+    printf("%s: expected an NFA with 4 byte classes, found nfa=%d with %zu classes\n",
+        __func__, nfa.nfa, nfa.nclasses);
+    nfail++;
+    jvst_vm_dfa_finalize(&nfa);
+    return;
+  }
+
+  // the determinised DFA has the states {0}, {0,1}, {0,1,2,3} and
+  // {0,2,3}.  Counting stops once it passes the limit.
+  ntest++;
+  if (jvst_vm_lazy_count(&nfa, 100) != 4 || jvst_vm_lazy_count(&nfa, 2) != 3) {
+    printf("%s: expected 4 DFA states, 3 with a limit of 2; found %zu and %zu\n",
+        __func__, jvst_vm_lazy_count(&nfa, 100), jvst_vm_lazy_count(&nfa, 2));
+    nfail++;
+  }
+
+  // the second cache is as small as it gets, so it's flushed partway
+  // through most strings
+  lz[0] = jvst_vm_lazy_new(&nfa, 100);
+  lz[1] = jvst_vm_lazy_new(&nfa, 1);
+
+  for (i=0; i < ARRAYLEN(tests); i++) {
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      for (k=0; k < ARRAYLEN(lz); k++) {
+        int data;
+
+        ntest++;
+
+        data = lazy_match(lz[k], tests[i].s, chunks[j]);
+        if (data != tests[i].data) {
+          printf("%s[%zu]: \"%s\" chunk size %zu, cache %zu: expected %d, found %d\n",
+              __func__, i+1, tests[i].s, chunks[j], k, tests[i].data, data);
+          nfail++;
+        }
+      }
+    }
+  }
+
+  jvst_vm_lazy_free(lz[0]);
+  jvst_vm_lazy_free(lz[1]);
+
+  // Raises 13 unless the token matches
+  prog = newvm_program(&A,
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_MATCH, VMLIT(0), 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_M), VMLIT(0),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "nomatch",
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "nomatch",
+      JVST_OP_RETURN, VMLIT(13), 0,
+      VM_END);
+
+  prog->ndfa = 1;
+  prog->dfas = &nfa;
+
+  // labels above epsilon are invalid
+  ntest++;
+  nfa.transitions[10]++;
+  if (jvst_vm_program_verify(prog, NULL, 0) == 0) {
+    printf("%s: program with a bad NFA label verifies\n", __func__);
+    nfail++;
+  }
+  nfa.transitions[10]--;
+
+  ntest++;
+  if (jvst_vm_program_verify(prog, NULL, 0) != 0) {
+    printf("%s: program does not verify\n", __func__);
+    nfail++;
+    goto done;
+  }
+
+  // the JIT isn't available on every host
+  jit = (jvst_vm_program_jit(prog) == 0);
+
+  for (i=0; i < ARRAYLEN(runs); i++) {
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      for (k=0; k < (jit ? 2 : 1); k++) {
+        int ret, err;
+
+        ntest++;
+
+        if (k == 0) {
+          jvst_vm_program_unjit(prog);
+        } else if (jvst_vm_program_jit(prog) != 0) {
+          assert(!"JIT failed after succeeding once");
+        }
+
+        ret = run_chunked(prog, runs[i].json, chunks[j], &err);
+        if (JVST_IS_INVALID(ret) != (runs[i].error != 0) ||
+            (runs[i].error != 0 && err != runs[i].error)) {
+          printf("%s[%zu]: %s: chunk size %zu, %s: expected error %d, "
+              "but result is %d with error %d\n",
+              __func__, i+1, runs[i].json, chunks[j],
+              (k == 0) ? "interpreter" : "JIT",
+              runs[i].error, ret, err);
+          nfail++;
+        }
+      }
+    }
+  }
+
+  jvst_vm_program_unjit(prog);
+
+done:
+  jvst_vm_dfa_finalize(&nfa);
+}
+
+struct dfa_edges {
+  int from;
+  int lo, hi;
+  int to;
+};
+
+// builds a DFA from edges on byte ranges, sorted by state and byte, with
+// one end state
+static void
+build_dfa(struct jvst_vm_dfa *dfa, size_t nstates, const struct dfa_edges *edges, size_t n, int end)
+{
+  size_t i, ne, st;
+  int b;
+
+  ne = 0;
+  for (i=0; i < n; i++) {
+    ne += edges[i].hi - edges[i].lo + 1;
+  }
+
+  (void)jvst_vm_dfa_init(dfa, nstates, ne, 1);
+
+  ne = 0;
+  for (st=0, i=0; st < nstates; st++) {
+    dfa->offs[st] = ne;
+    for (; i < n && edges[i].from == (int)st; i++) {
+      for (b = edges[i].lo; b <= edges[i].hi; b++) {
+        dfa->transitions[2*ne+0] = b;
+        dfa->transitions[2*ne+1] = edges[i].to;
+        ne++;
+      }
+    }
+  }
+  dfa->offs[nstates] = ne;
+
+  dfa->endstates[0] = end;
+  dfa->endstates[1] = 1;
+
+  jvst_vm_dfa_compile(dfa);
+}
+
+static void test_prefilter(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog;
+  struct jvst_vm_dfa dfas[2];
+  static const size_t chunks[] = { 1, 1024 };
+  size_t i, j;
+
+  // x*foo[0-9]
+  static const struct dfa_edges factor[] = {
+    { 0, 'f', 'f', 1 }, { 0, 'x', 'x', 0 },
+    { 1, 'o', 'o', 2 },
+    { 2, 'o', 'o', 3 },
+    { 3, '0', '9', 4 },
+  };
+
+  // urn:[a-z]*\.com
+  static const struct dfa_edges ends[] = {
+    { 0, 'u', 'u', 1 },
+    { 1, 'r', 'r', 2 },
+    { 2, 'n', 'n', 3 },
+    { 3, ':', ':', 4 },
+    { 4, '.', '.', 5 }, { 4, 'a', 'z', 4 },
+    { 5, 'c', 'c', 6 },
+    { 6, 'o', 'o', 7 },
+    { 7, 'm', 'm', 8 },
+  };
+
+  static const struct {
+    const char *prefix, *suffix, *factor;
+  } expected[] = {
+    { "", "", "foo" },
+    { "urn:", ".com", "" },
+  };
+
+  static const struct {
+    int dfa;
+    const char *s;
+    bool maymatch;
+    bool matches;
+  } tests[] = {
+    { 0, "foo1",        true,  true  },
+    { 0, "xxxfoo9",     true,  true  },
+    { 0, "xxfo",        false, false },
+    { 0, "fofoo1",      true,  false },
+    { 0, "barfoo",      true,  false },
+    { 0, "",            false, false },
+    { 1, "urn:ab.com",  true,  true  },
+    { 1, "urn:.com",    true,  true  },
+    { 1, "urn:ab.org",  false, false },
+    { 1, "uri:ab.com",  false, false },
+    { 1, "urn:.co",     false, false },
+    { 1, "urn:A.com",   true,  false },
+  };
+
+  build_dfa(&dfas[0], 5, factor, ARRAYLEN(factor), 4);
+  build_dfa(&dfas[1], 9, ends, ARRAYLEN(ends), 8);
+
+  for (i=0; i < ARRAYLEN(expected); i++) {
+    const struct jvst_vm_dfa_prefilter *pf = &dfas[i].pre;
+
+    ntest++;
+    if (pf->nprefix != strlen(expected[i].prefix) ||
+        memcmp(pf->prefix, expected[i].prefix, pf->nprefix) != 0 ||
+        pf->nsuffix != strlen(expected[i].suffix) ||
+        memcmp(pf->suffix, expected[i].suffix, pf->nsuffix) != 0 ||
+        pf->nfactor != strlen(expected[i].factor) ||
+        memcmp(pf->factor, expected[i].factor, pf->nfactor) != 0) {
+      printf("%s[%zu]: expected prefix \"%s\", suffix \"%s\" and factor \"%s\", "
+          "found \"%.*s\", \"%.*s\" and \"%.*s\"\n",
+          __func__, i+1, expected[i].prefix, expected[i].suffix, expected[i].factor,
+          (int)pf->nprefix, pf->prefix, (int)pf->nsuffix, pf->suffix,
+          (int)pf->nfactor, pf->factor);
+      nfail++;
+    }
+  }
+
+  for (i=0; i < ARRAYLEN(tests); i++) {
+    const struct jvst_vm_dfa *dfa = &dfas[tests[i].dfa];
+    bool maymatch, matches;
+
+    ntest++;
+
+    maymatch = jvst_vm_dfa_maymatch(dfa, tests[i].s, strlen(tests[i].s));
+    matches = (dfa_match(dfa, tests[i].s, 1024) >= 0);
+    if (maymatch != tests[i].maymatch || matches != tests[i].matches) {
+      printf("%s[%zu]: \"%s\": expected maymatch=%d and matches=%d, found %d and %d\n",
+          __func__, i+1, tests[i].s, tests[i].maymatch, tests[i].matches,
+          maymatch, matches);
+      nfail++;
+    }
+  }
+
+  // Raises 13 unless the token matches.  One byte chunks split the
+  // strings, so they skip the prefilter.
+  prog = newvm_program(&A,
+      JVST_OP_PROC, VMLIT(0), VMLIT(0),
+      JVST_OP_TOKEN, 0, 0,
+      JVST_OP_MATCH, VMLIT(1), 0,
+      JVST_OP_ICMP, VMREG(JVST_VM_M), VMLIT(0),
+      JVST_OP_JMP, JVST_VM_BR_EQ, "nomatch",
+      JVST_OP_RETURN, 0, 0,
+      VM_LABEL, "nomatch",
+      JVST_OP_RETURN, VMLIT(13), 0,
+      VM_END);
+
+  prog->ndfa = 2;
+  prog->dfas = dfas;
+
+  for (i=0; i < ARRAYLEN(tests); i++) {
+    char json[64];
+
+    if (tests[i].dfa != 1) {
+      continue;
+    }
+
+    snprintf(json, sizeof json, "\"%s\"", tests[i].s);
+    for (j=0; j < ARRAYLEN(chunks); j++) {
+      int ret, err;
+
+      ntest++;
+
+      ret = run_chunked(prog, json, chunks[j], &err);
+      if (JVST_IS_INVALID(ret) == tests[i].matches ||
+          (!tests[i].matches && err != 13)) {
+        printf("%s[%zu]: %s: chunk size %zu: expected %s, "
+            "but result is %d with error %d\n",
+            __func__, i+1, json, chunks[j],
+            tests[i].matches ? "a match" : "error 13", ret, err);
+        nfail++;
+      }
+    }
+  }
+
+  jvst_vm_dfa_finalize(&dfas[0]);
+  jvst_vm_dfa_finalize(&dfas[1]);
+}
+
+static char *
+write_program(const struct jvst_vm_program *prog, size_t *np)
+{
+  struct sbuf b = { 0 };
+  int ret;
+
+  // sizing pass
+  ret = jvst_vm_program_writebuf(&b, prog);
+  assert(ret == -1 && b.len == 0);
+
+  b.cap = b.np;
+  b.np = 0;
+  b.buf = malloc(b.cap);
+  assert(b.buf != NULL);
+
+  ret = jvst_vm_program_writebuf(&b, prog);
+  assert(ret == 0 && b.len == b.cap && b.np == b.cap);
+
+  *np = b.len;
+  return b.buf;
+}
+
+static int
+same_dump(const struct jvst_vm_program *p1, const struct jvst_vm_program *p2)
+{
+  static char d1[16384], d2[16384];
+
+  if (jvst_vm_program_dump(p1, d1, sizeof d1) != 0 ||
+      jvst_vm_program_dump(p2, d2, sizeof d2) != 0) {
+    return 0;
+  }
+
+  return strcmp(d1, d2) == 0;
+}
+
+static uint64_t
+get_le64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  int k;
+
+  for (k=7; k >= 0; k--) {
+    v = (v << 8) | p[k];
+  }
+
+  return v;
+}
+
+// true if p points into the program's mapped file
+static int
+in_image(const struct jvst_vm_program *prog, const void *p)
+{
+  const unsigned char *img = prog->image;
+
+  return (const unsigned char *)p >= img && (const unsigned char *)p < img + prog->image_len;
+}
+
+static void test_file(void)
+{
+  struct arena_info A = {0};
+  struct jvst_vm_program *prog, *copy;
+  struct jvst_vm_dfa dfa;
+  char *enc, *enc2, *bad;
+  size_t i, n, n2;
+  FILE *f;
+
+  static const char *const docs[] = {
+    "[1,2,3]", "[\"a\"]", "3", "[1,", NULL,
+  };
+
+  prog = newvm_program(&A,
+      VM_FLOATS, 2, 1.5, -0.0,
+      VM_SPLIT, 3, 2, 2, 3,
+      SPLIT_PARENT(JVST_OP_SPLITONE, 2),
+      SPLIT_PROCS,
+      VM_END);
+
+  // a DFA matching "a"
+  (void)jvst_vm_dfa_init(&dfa, 2, 1, 1);
+  dfa.offs[0] = 0;
+  dfa.offs[1] = 1;
+  dfa.offs[2] = 1;
+  dfa.transitions[0] = 'a';
+  dfa.transitions[1] = 1;
+  dfa.endstates[0] = 1;
+  dfa.endstates[1] = 5;
+  prog->dfas = &dfa;
+  prog->ndfa = 1;
+
+  assert(jvst_vm_program_verify(prog, NULL, 0) == 0);
+
+  enc = write_program(prog, &n);
+
+  // round trip
+  ntest++;
+  copy = jvst_vm_readbuf((unsigned char *)enc, n);
+  if (copy == NULL) {
+    printf("%s: reading a written program failed\n", __func__);
+    nfail++;
+    return;
+  }
+
+  enc2 = write_program(copy, &n2);
+  if (!copy->verified || !same_dump(prog, copy) ||
+      n != n2 || memcmp(enc, enc2, n) != 0 ||
+      copy->ndfa != 1 || copy->dfas[0].nends != 1 || copy->dfas[0].endstates[1] != 5 ||
+      signbit(copy->fdata[1]) == 0) {
+    printf("%s: program read back differs from the program written\n", __func__);
+    nfail++;
+  }
+  free(enc2);
+
+  // the dense form is read back, not built again
+  ntest++;
+  if (copy->dfas[0].ends == NULL || copy->dfas[0].nclasses != dfa.nclasses ||
+      copy->dfas[0].width != dfa.width || copy->dfas[0].nfa != dfa.nfa ||
+      memcmp(copy->dfas[0].ends, dfa.ends, dfa.nstates * sizeof dfa.ends[0]) != 0 ||
+      memcmp(copy->dfas[0].classes, dfa.classes, 256) != 0 ||
+      memcmp(copy->dfas[0].table, dfa.table, (dfa.nstates+1) * dfa.nclasses * dfa.width) != 0) {
+    printf("%s: dense DFA read back differs from the DFA written\n", __func__);
+    nfail++;
+  }
+
+  for (i=0; docs[i] != NULL; i++) {
+    int ret[2], err[2];
+
+    ntest++;
+
+    ret[0] = run_chunked(prog, docs[i], 1024, &err[0]);
+    ret[1] = run_chunked(copy, docs[i], 1024, &err[1]);
+    if (ret[0] != ret[1] || err[0] != err[1]) {
+      printf("%s: %s: program returned %d with error %d, program read back returned %d with error %d\n",
+          __func__, docs[i], ret[0], err[0], ret[1], err[1]);
+      nfail++;
+    }
+  }
+
+  jvst_vm_program_free(copy);
+
+  // FILE interface
+  ntest++;
+  f = tmpfile();
+  assert(f != NULL);
+  if (jvst_vm_writefile(f, prog) != 0) {
+    printf("%s: writing a program failed\n", __func__);
+    nfail++;
+  } else {
+    rewind(f);
+    copy = jvst_vm_readfile(f);
+    if (copy == NULL || !same_dump(prog, copy)) {
+      printf("%s: program read from a file differs from the program written\n", __func__);
+      nfail++;
+    }
+    if (copy != NULL) {
+      jvst_vm_program_free(copy);
+    }
+  }
+  fclose(f);
+
+  // mapped files
+  ntest++;
+  f = tmpfile();
+  assert(f != NULL);
+  if (jvst_vm_writefile(f, prog) != 0 || fflush(f) != 0) {
+    printf("%s: writing a program failed\n", __func__);
+    nfail++;
+  } else {
+    copy = jvst_vm_mapfile(fileno(f));
+    if (copy == NULL || !copy->verified || !same_dump(prog, copy)) {
+      printf("%s: program mapped from a file differs from the program written\n", __func__);
+      nfail++;
+    } else if (!in_image(copy, copy->decoded)) {
+      printf("%s: mapped program doesn't run from the file's decoded stream\n", __func__);
+      nfail++;
+    } else if (!in_image(copy, copy->dfas[0].ends) || !in_image(copy, copy->dfas[0].classes) ||
+        !in_image(copy, copy->dfas[0].table)) {
+      printf("%s: mapped program doesn't run from the file's dense DFA\n", __func__);
+      nfail++;
+    } else {
+      for (i=0; docs[i] != NULL; i++) {
+        int ret[2], err[2];
+
+        ret[0] = run_chunked(prog, docs[i], 1, &err[0]);
+        ret[1] = run_chunked(copy, docs[i], 1, &err[1]);
+        if (ret[0] != ret[1] || err[0] != err[1]) {
+          printf("%s: %s: program returned %d with error %d, mapped program returned %d with error %d\n",
+              __func__, docs[i], ret[0], err[0], ret[1], err[1]);
+          nfail++;
+          break;
+        }
+      }
+    }
+
+    if (copy != NULL) {
+      jvst_vm_program_free(copy);
+    }
+  }
+  fclose(f);
+
+  // a program after a header of the caller's, on a page boundary
+  ntest++;
+  f = tmpfile();
+  assert(f != NULL);
+  {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    long k;
+
+    assert(pagesize > 0);
+    for (k=0; k < pagesize; k++) {
+      putc('h', f);
+    }
+
+    if (jvst_vm_writefile(f, prog) != 0 || fflush(f) != 0) {
+      printf("%s: writing a program failed\n", __func__);
+      nfail++;
+    } else {
+      copy = jvst_vm_mapfile_at(fileno(f), (size_t)pagesize);
+      if (copy == NULL || !copy->verified || !same_dump(prog, copy)) {
+        printf("%s: program mapped after a header differs from the program written\n", __func__);
+        nfail++;
+      }
+      if (copy != NULL) {
+        jvst_vm_program_free(copy);
+      }
+
+      ntest++;
+      if (jvst_vm_mapfile(fileno(f)) != NULL) {
+        printf("%s: mapping a file with a header from the start succeeded\n", __func__);
+        nfail++;
+      }
+    }
+  }
+  fclose(f);
+
+  // the decoded stream has to be well formed, since it can come from
+  // a file
+  {
+    struct jvst_vm_decoded *dec = prog->decoded;
+    struct jvst_vm_decoded saved;
+    size_t jmp = 3;
+
+    assert(dec[jmp].op == JVST_OP_JMP);
+
+    ntest++;
+    saved = dec[prog->ncode];
+    dec[prog->ncode].op = JVST_OP_RETURN;
+    if (jvst_vm_program_verify(prog, NULL, 0) == 0) {
+      printf("%s: program without a BADPC sentinel verifies\n", __func__);
+      nfail++;
+    }
+    dec[prog->ncode] = saved;
+
+    ntest++;
+    saved = dec[jmp];
+    dec[jmp].cond = 9;
+    if (jvst_vm_program_verify(prog, NULL, 0) == 0) {
+      printf("%s: JMP with an invalid condition verifies\n", __func__);
+      nfail++;
+    }
+    dec[jmp] = saved;
+
+    ntest++;
+    dec[jmp].a1slot = 1;
+    if (jvst_vm_program_verify(prog, NULL, 0) == 0) {
+      printf("%s: decoded JMP with a slot argument verifies\n", __func__);
+      nfail++;
+    }
+    dec[jmp] = saved;
+
+    ntest++;
+    saved = dec[0];
+    dec[0].a0 = JVST_VM_MAXLIT+1;
+    if (jvst_vm_program_verify(prog, NULL, 0) == 0) {
+      printf("%s: decoded PROC with a literal too wide to encode verifies\n", __func__);
+      nfail++;
+    }
+    dec[0] = saved;
+
+    assert(jvst_vm_program_verify(prog, NULL, 0) == 0);
+  }
+
+  // truncated or corrupt files
+  bad = malloc(n);
+  assert(bad != NULL);
+
+  // a mapped file with a malformed decoded stream, but a good
+  // checksum, runs from a decoding of its code
+  ntest++;
+  f = tmpfile();
+  assert(f != NULL);
+  {
+    unsigned char *b = (unsigned char *)bad;
+    uint64_t off, nelts, sum;
+    int k;
+
+    memcpy(bad, enc, n);
+
+    // the decoded stream is section 6
+    off   = get_le64(b + 40 + 16*6);
+    nelts = get_le64(b + 40 + 16*6 + 8);
+    assert(nelts == prog->ncode+1 && off + 12*nelts <= n);
+
+    b[off + 12*(nelts-1)] = JVST_OP_RETURN;
+
+    sum = XXH64(b + 32, n - 32, 0);
+    for (k=0; k < 8; k++) {
+      b[24+k] = (sum >> (8*k)) & 0xff;
+    }
+  }
+
+  if (fwrite(bad, 1, n, f) != n || fflush(f) != 0) {
+    printf("%s: writing a program failed\n", __func__);
+    nfail++;
+  } else {
+    copy = jvst_vm_mapfile(fileno(f));
+    if (copy == NULL || !copy->verified || in_image(copy, copy->decoded)) {
+      printf("%s: mapped program with a bad decoded stream isn't decoded again\n", __func__);
+      nfail++;
+    } else {
+      for (i=0; docs[i] != NULL; i++) {
+        int ret[2], err[2];
+
+        ret[0] = run_chunked(prog, docs[i], 1, &err[0]);
+        ret[1] = run_chunked(copy, docs[i], 1, &err[1]);
+        if (ret[0] != ret[1] || err[0] != err[1]) {
+          printf("%s: %s: program returned %d with error %d, mapped program returned %d with error %d\n",
+              __func__, docs[i], ret[0], err[0], ret[1], err[1]);
+          nfail++;
+          break;
+        }
+      }
+    }
+
+    if (copy != NULL) {
+      jvst_vm_program_free(copy);
+    }
+  }
+  fclose(f);
+
+  // likewise, a dense DFA table with an entry past the dead state is
+  // built again from the sparse form
+  ntest++;
+  f = tmpfile();
+  assert(f != NULL);
+  {
+    unsigned char *b = (unsigned char *)bad;
+    uint64_t hdr, data, sum;
+    int k;
+
+    memcpy(bad, enc, n);
+
+    // dense headers are section 7, the byte pool section 9
+    hdr  = get_le64(b + 40 + 16*7);
+    data = get_le64(b + 40 + 16*9);
+    assert(get_le64(b + 40 + 16*7 + 8) == 1 && get_le64(b + hdr + 8) == 1);
+
+    b[data + get_le64(b + hdr + 40)] = 0xff;
+
+    sum = XXH64(b + 32, n - 32, 0);
+    for (k=0; k < 8; k++) {
+      b[24+k] = (sum >> (8*k)) & 0xff;
+    }
+  }
+
+  if (fwrite(bad, 1, n, f) != n || fflush(f) != 0) {
+    printf("%s: writing a program failed\n", __func__);
+    nfail++;
+  } else {
+    copy = jvst_vm_mapfile(fileno(f));
+    if (copy == NULL || !copy->verified || copy->dfas[0].ends == NULL ||
+        in_image(copy, copy->dfas[0].ends) || !in_image(copy, copy->decoded)) {
+      printf("%s: mapped program with a bad dense DFA isn't compiled again\n", __func__);
+      nfail++;
+    } else {
+      for (i=0; docs[i] != NULL; i++) {
+        int ret[2], err[2];
+
+        ret[0] = run_chunked(prog, docs[i], 1, &err[0]);
+        ret[1] = run_chunked(copy, docs[i], 1, &err[1]);
+        if (ret[0] != ret[1] || err[0] != err[1]) {
+          printf("%s: %s: program returned %d with error %d, mapped program returned %d with error %d\n",
+              __func__, docs[i], ret[0], err[0], ret[1], err[1]);
+          nfail++;
+          break;
+        }
+      }
+    }
+
+    if (copy != NULL) {
+      jvst_vm_program_free(copy);
+    }
+  }
+  fclose(f);
+
+  {
+    static const size_t lens[] = { 0, 7, 40, 100 };
+
+    for (i=0; i < ARRAYLEN(lens); i++) {
+      ntest++;
+      if (jvst_vm_readbuf((unsigned char *)enc, lens[i]) != NULL) {
+        printf("%s: reading a program truncated to %zu bytes succeeded\n", __func__, lens[i]);
+        nfail++;
+      }
+    }
+
+    ntest++;
+    if (jvst_vm_readbuf((unsigned char *)enc, n-1) != NULL) {
+      printf("%s: reading a program missing its last byte succeeded\n", __func__);
+      nfail++;
+    }
+  }
+
+  for (i=0; i < n; i += 13) {
+    ntest++;
+
+    memcpy(bad, enc, n);
+    bad[i] ^= 0x20;
+    if (jvst_vm_readbuf((unsigned char *)bad, n) != NULL) {
+      printf("%s: reading a program with byte %zu changed succeeded\n", __func__, i);
+      nfail++;
+    }
+  }
+
+  free(bad);
+  free(enc);
+}
+
+int main(void)
+{
+  test_verify_valid();
+  test_verify_invalid();
+  test_split_modes();
+  test_reset();
+  test_sizing();
+  test_records();
+  test_jit();
+  test_switch();
+  test_dfa();
+  test_lmatch();
+  test_lazy();
+  test_lazy_bound();
+  test_prefilter();
+  test_file();
+
+  return report_tests();
+}
@@ -63,6 +63,8 @@ static double ar_op_float[NUM_TEST_THINGS];
 static int64_t ar_op_iconst[NUM_TEST_THINGS];
 static struct jvst_op_proc *ar_op_splits[NUM_TEST_THINGS];
 static size_t ar_op_splitoff[NUM_TEST_THINGS];
+static struct jvst_op_jtab ar_op_jtabs[NUM_TEST_THINGS];
+static struct jvst_op_arg ar_op_jtab_dests[NUM_TEST_THINGS];
 
 enum { NUM_VM_PROGRAMS = 64 };
 static struct jvst_vm_program ar_vm_progs[NUM_VM_PROGRAMS];
@@ -1855,6 +1857,17 @@ end:
 	return expr;
 }
 
+struct jvst_ir_expr *
+newir_splitmode(struct arena_info *A, enum jvst_ir_split_mode mode, struct jvst_ir_expr *split)
+{
+	(void)A;
+
+	assert(split->type == JVST_IR_EXPR_SPLIT);
+	split->u.split.mode = mode;
+
+	return split;
+}
+
 struct jvst_ir_expr *
 newir_itemp(struct arena_info *A, size_t ind)
 {
@@ -1961,6 +1974,7 @@ newir_op(struct arena_info *A, enum jvst_ir_expr_type op,
 	case JVST_IR_EXPR_FTEMP:
 	case JVST_IR_EXPR_SEQ:
 	case JVST_IR_EXPR_MATCH:
+	case JVST_IR_EXPR_ENUM:
 		fprintf(stderr, "invalid OP type: %s\n", jvst_ir_expr_type_name(op));
 		abort();
 	}
@@ -2389,6 +2403,9 @@ newop_cmp(struct arena_info *A, enum jvst_vm_op op,
 	case JVST_OP_CALL:
 	case JVST_OP_SPLIT:
 	case JVST_OP_SPLITV:
+	case JVST_OP_SPLITANY:
+	case JVST_OP_SPLITALL:
+	case JVST_OP_SPLITONE:
 	case JVST_OP_TOKEN:
 	case JVST_OP_CONSUME:
 	case JVST_OP_MATCH:
@@ -2400,6 +2417,9 @@ newop_cmp(struct arena_info *A, enum jvst_vm_op op,
 	case JVST_OP_RETURN:
 	case JVST_OP_MOVE:
 	case JVST_OP_UNIQUE:
+	case JVST_OP_SWITCH:
+	case JVST_OP_LMATCH:
+	case JVST_OP_ENUM:
 		fprintf(stderr, "%s:%d (%s) OP %s is not a comparison\n",
 			__FILE__, __LINE__, __func__, jvst_op_name(op));
 		abort();
@@ -2512,6 +2532,9 @@ newop_load(struct arena_info *A, enum jvst_vm_op op,
 	case JVST_OP_CALL:
 	case JVST_OP_SPLIT:
 	case JVST_OP_SPLITV:
+	case JVST_OP_SPLITANY:
+	case JVST_OP_SPLITALL:
+	case JVST_OP_SPLITONE:
 	case JVST_OP_TOKEN:
 	case JVST_OP_CONSUME:
 	case JVST_OP_MATCH:
@@ -2520,6 +2543,9 @@ newop_load(struct arena_info *A, enum jvst_vm_op op,
 	case JVST_OP_BAND:
 	case JVST_OP_RETURN:
 	case JVST_OP_UNIQUE:
+	case JVST_OP_SWITCH:
+	case JVST_OP_LMATCH:
+	case JVST_OP_ENUM:
 		fprintf(stderr, "OP %s is not a load\n",
 			jvst_op_name(op));
 		abort();
@@ -2550,6 +2576,49 @@ newop_br(struct arena_info *A, enum jvst_vm_br_cond brc, const char *label)
 	return instr;
 }
 
+struct jvst_op_instr *
+newop_switch(struct arena_info *A, struct jvst_op_arg key, size_t cind, const char *dflt, ...)
+{
+	struct jvst_op_instr *instr;
+	struct jvst_op_jtab *jtab;
+	const char *lbl;
+	va_list args;
+	size_t max, n;
+
+	max = ARRAYLEN(ar_op_jtabs);
+	if (A->njtab >= max) {
+		fprintf(stderr, "too many jump tables: %zu max\n", max);
+		abort();
+	}
+
+	jtab = &ar_op_jtabs[A->njtab++];
+	jtab->cind = cind;
+	jtab->dests = &ar_op_jtab_dests[A->njtabdest];
+
+	max = ARRAYLEN(ar_op_jtab_dests);
+	va_start(args, dflt);
+	for (n=0, lbl=dflt; lbl != NULL; n++, lbl = va_arg(args, const char *)) {
+		if (A->njtabdest >= max) {
+			fprintf(stderr, "too many jump table entries: %zu max\n", max);
+			abort();
+		}
+
+		A->njtabdest++;
+		jtab->dests[n].type = JVST_VM_ARG_LABEL;
+		jtab->dests[n].u.label = lbl;
+	}
+	va_end(args);
+
+	assert(n > 0);
+	jtab->ncase = n-1;
+
+	instr = newop_instr(A, JVST_OP_SWITCH);
+	instr->args[0] = key;
+	instr->args[1].type = JVST_VM_ARG_JTAB;
+	instr->args[1].u.jtab = jtab;
+	return instr;
+}
+
 struct jvst_op_instr *
 newop_match(struct arena_info *A, int64_t dfa)
 {
@@ -2615,13 +2684,14 @@ newvm_program(struct arena_info *A, ...)
 {
 	struct jvst_vm_program *prog;
 	va_list args;
-	size_t ind,max,nlbl,nproc,off,nsplit;
+	size_t ind,max,nlbl,nproc,off,nsplit,nconst;
 	uint32_t pc;
 
 	struct label labels[64];
 	uint32_t soff[16]  = { 0 };
 	uint32_t procs[16] = { 0 };
 	uint32_t code[256] = { 0 };
+	int64_t consts[64] = { 0 };
 
 	memset(labels, 0, sizeof labels);
 
@@ -2707,6 +2777,18 @@ newvm_program(struct arena_info *A, ...)
 			}
 			break;
 
+		case VM_JTAB:
+			{
+				int i,n;
+
+				// skip default and case labels for now...
+				n = va_arg(args, int);
+				for (i=0; i <= n; i++) {
+					(void) va_arg(args, const char *);
+				}
+			}
+			break;
+
 		default:
 			if (op == JVST_OP_PROC) {
 				assert(nproc < ARRAYLEN(procs));
@@ -2774,6 +2856,7 @@ end_label_scan:
 	va_start(args, A);
 	pc = 0;
 	nsplit = 0;
+	nconst = 0;
 	for (;;) {
 		int op = va_arg(args, int);
 
@@ -2799,7 +2882,7 @@ end_label_scan:
 
 				n = va_arg(args, int);
 				assert(prog->sdata[ind+1] == prog->sdata[ind] + n);
-				off = prog->sdata[prog->nsplit] + prog->sdata[ind];
+				off = prog->nsplit + 1 + prog->sdata[ind];
 
 				for (i=0; i < n; i++) {
 					int proc_ind;
@@ -2816,6 +2899,31 @@ end_label_scan:
 			(void)va_arg(args, int);
 			continue;
 
+		case VM_JTAB:
+			{
+				int i,n;
+
+				n = va_arg(args, int);
+				assert(n >= 0 && nconst + n + 2 <= ARRAYLEN(consts));
+
+				consts[nconst++] = n;
+				for (i=0; i <= n; i++) {
+					const char *lbl;
+					int li;
+
+					lbl = va_arg(args, const char *);
+					li = findlbl(labels, nlbl, lbl);
+					if (li < 0) {
+						fprintf(stderr, "%s:%d (%s) could not find label %s\n",
+							__FILE__, __LINE__, __func__, lbl);
+						abort();
+					}
+
+					consts[nconst++] = labels[li].off;
+				}
+			}
+			continue;
+
 		case VM_LABEL:
 			// eat label argument
 			(void)va_arg(args, const char *);
@@ -2891,6 +2999,11 @@ end_instructions:
 	prog->code = &ar_vm_code[off];
 	memcpy(prog->code, code, pc * sizeof code[0]);
 
+	if (nconst > 0) {
+		prog->cdata = newconsts(A, consts, nconst);
+		prog->nconst = nconst;
+	}
+
 	return prog;
 }
 
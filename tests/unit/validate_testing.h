@@ -50,6 +50,8 @@ struct arena_info {
 	size_t nconst;
 	size_t nsplit;
 	size_t nsplitoff;
+	size_t njtab;
+	size_t njtabdest;
 
 	size_t nvmprog;
 	size_t nvmcode;
@@ -332,6 +334,10 @@ newir_btestany(struct arena_info *A, size_t ind, const char *label, size_t b0, s
 struct jvst_ir_expr *
 newir_split(struct arena_info *A, ...);
 
+// sets the mode of a SPLIT expression
+struct jvst_ir_expr *
+newir_splitmode(struct arena_info *A, enum jvst_ir_split_mode mode, struct jvst_ir_expr *split);
+
 struct jvst_ir_expr *
 newir_ftemp(struct arena_info *A, size_t ind);
 
@@ -370,6 +376,12 @@ newop_load(struct arena_info *A, enum jvst_vm_op op,
 struct jvst_op_instr *
 newop_br(struct arena_info *A, enum jvst_vm_br_cond brc, const char *label);
 
+// Creates a SWITCH on key with the jump table at cind in the constant
+// pool.  The default label is followed by a NULL terminated list of
+// case labels.
+struct jvst_op_instr *
+newop_switch(struct arena_info *A, struct jvst_op_arg key, size_t cind, const char *dflt, ...);
+
 struct jvst_op_instr *
 newop_match(struct arena_info *A, int64_t dfa);
 
@@ -434,6 +446,7 @@ enum {
 	VM_FLOATS = -3,
 	VM_DFA    = -4,
 	VM_SPLIT  = -5,
+	VM_JTAB   = -6,
 };
 
 struct jvst_vm_program *